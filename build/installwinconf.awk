@@ -123,6 +123,7 @@ BEGIN {
           print "#LoadModule cache_module modules/mod_cache.so" > dstfl;
           print "#LoadModule cache_disk_module modules/mod_cache_disk.so" > dstfl;
           print "#LoadModule cache_socache_module modules/mod_cache_socache.so" > dstfl;
+          print "#LoadModule cache_tiered_module modules/mod_cache_tiered.so" > dstfl;
           print "#LoadModule cern_meta_module modules/mod_cern_meta.so" > dstfl;
           print "LoadModule cgi_module modules/mod_cgi.so" > dstfl;
           print "#LoadModule charset_lite_module modules/mod_charset_lite.so" > dstfl;
@@ -148,6 +149,8 @@ BEGIN {
           print "#LoadModule info_module modules/mod_info.so" > dstfl;
           print "LoadModule isapi_module modules/mod_isapi.so" > dstfl;
           print "#LoadModule lbmethod_bybusyness_module modules/mod_lbmethod_bybusyness.so" > dstfl;
+          print "#LoadModule lbmethod_bylatency_module modules/mod_lbmethod_bylatency.so" > dstfl;
+          print "#LoadModule lbmethod_byhash_module modules/mod_lbmethod_byhash.so" > dstfl;
           print "#LoadModule lbmethod_byrequests_module modules/mod_lbmethod_byrequests.so" > dstfl;
           print "#LoadModule lbmethod_bytraffic_module modules/mod_lbmethod_bytraffic.so" > dstfl;
           print "#LoadModule lbmethod_heartbeat_module modules/mod_lbmethod_heartbeat.so" > dstfl;
@@ -168,6 +171,7 @@ BEGIN {
           print "#LoadModule proxy_express_module modules/mod_proxy_express.so" > dstfl;
           print "#LoadModule proxy_fcgi_module modules/mod_proxy_fcgi.so" > dstfl;
           print "#LoadModule proxy_ftp_module modules/mod_proxy_ftp.so" > dstfl;
+          print "#LoadModule proxy_hcheck_module modules/mod_proxy_hcheck.so" > dstfl;
           print "#LoadModule proxy_html_module modules/mod_proxy_html.so" > dstfl;
           print "#LoadModule proxy_http_module modules/mod_proxy_http.so" > dstfl;
           print "#LoadModule proxy_scgi_module modules/mod_proxy_scgi.so" > dstfl;
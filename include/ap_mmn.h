@@ -482,6 +482,23 @@
  * 20150222.0 (2.5.0-dev)  ssl pre_handshake hook now indicates proxy|client
  * 20150222.1 (2.5.0-dev)  Add keep_alive_timeout_set to server_rec
  * 20150222.2 (2.5.0-dev)  Add response code 418 as per RFC2324/RFC7168
+ * 20150222.3 (2.5.0-dev)  Add latency and latency_updated to
+ *                         proxy_worker_shared
+ * 20150222.4 (2.5.0-dev)  Add proxy_hcheck_t and PROXY_WORKER_HC_FAIL to
+ *                         mod_proxy.h, hc to proxy_worker_shared and
+ *                         set_worker_hc_param optional function
+ * 20150222.5 (2.5.0-dev)  Add proxy_splice_t, ap_proxy_splice_create() and
+ *                         ap_proxy_splice_transfer() to mod_proxy.h
+ * 20150222.6 (2.5.0-dev)  Add retry_body_limit and retry_body_limit_set to
+ *                         proxy_dir_conf
+ * 20150222.7 (2.5.0-dev)  Add AP_SOCACHE_FLAG_REFERENCE, ap_socache_pin_t,
+ *                         retrieve_ref and release to ap_socache_provider_t
+ * 20150222.8 (2.5.0-dev)  Add ap_cache_vary_headers(),
+ *                         ap_cache_vary_index_get() and
+ *                         ap_cache_vary_index_set() to mod_cache.h
+ * 20150222.9 (2.5.0-dev)  Add PROXY_RETRY_NOTE and PROXY_WORKER_IS_RETRIED()
+ *                         to mod_proxy.h
+ * 20150222.10 (2.5.0-dev) Add lbmethod_last to struct proxy_balancer
  */
 
 #define MODULE_MAGIC_COOKIE 0x41503235UL /* "AP25" */
@@ -489,7 +506,7 @@
 #ifndef MODULE_MAGIC_NUMBER_MAJOR
 #define MODULE_MAGIC_NUMBER_MAJOR 20150222
 #endif
-#define MODULE_MAGIC_NUMBER_MINOR 2                 /* 0...n */
+#define MODULE_MAGIC_NUMBER_MINOR 10                /* 0...n */
 
 /**
  * Determine if the server's current MODULE_MAGIC_NUMBER is at least a
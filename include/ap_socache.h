@@ -45,9 +45,17 @@ extern "C" {
  */
 #define AP_SOCACHE_FLAG_NOTMPSAFE (0x0001)
 
+/** If this flag is set, the provider implements the retrieve_ref()
+ * and release() interfaces.
+ */
+#define AP_SOCACHE_FLAG_REFERENCE (0x0002)
+
 /** A cache instance. */
 typedef struct ap_socache_instance_t ap_socache_instance_t;
 
+/** An object pinned in a cache instance by retrieve_ref(). */
+typedef struct ap_socache_pin_t ap_socache_pin_t;
+
 /** Hints which may be passed to the init function; providers may
  * ignore some or all of these hints. */
 struct ap_socache_hints {
@@ -212,6 +220,45 @@ typedef struct ap_socache_provider_t {
                             void *userctx, ap_socache_iterator_t *iterator,
                             apr_pool_t *pool);
 
+    /**
+     * Retrieve a cached object by reference.  Instead of being copied
+     * out, the object is pinned where it is stored, and the provider
+     * won't reuse its storage until the pin is released with release(),
+     * even if the object is removed, replaced or expired meanwhile (a
+     * provider may however stop honouring a pin held for too long).
+     * Only implemented by providers having the AP_SOCACHE_FLAG_REFERENCE
+     * flag; the same locking rules as for retrieve() apply to both calls.
+     *
+     * @param instance The cache instance
+     * @param s Associated server structure (for logging purposes)
+     * @param id Unique ID for the object; binary blob
+     * @param idlen Length of id blob
+     * @param data On exit, points to the object (binary blob), which
+     * is valid until the pin is released and must not be modified
+     * @param datalen On exit, the length of the object
+     * @param pin On exit, the pin to pass to release()
+     * @param pool Pool for the pin and temporary allocations.
+     * @return APR status value; APR_NOTFOUND if the object was not
+     * found, APR_ENOTIMPL if this object can't be referenced, in which
+     * case retrieve() can be used instead
+     */
+    apr_status_t (*retrieve_ref)(ap_socache_instance_t *instance,
+                                 server_rec *s,
+                                 const unsigned char *id, unsigned int idlen,
+                                 const unsigned char **data,
+                                 unsigned int *datalen,
+                                 ap_socache_pin_t **pin, apr_pool_t *pool);
+
+    /**
+     * Release an object pinned by retrieve_ref().
+     *
+     * @param instance The cache instance
+     * @param s Associated server structure (for logging purposes)
+     * @param pin The pin returned by retrieve_ref()
+     */
+    void (*release)(ap_socache_instance_t *instance, server_rec *s,
+                    ap_socache_pin_t *pin);
+
 } ap_socache_provider_t;
 
 /** The provider group used to register socache providers. */
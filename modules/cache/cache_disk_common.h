@@ -28,6 +28,10 @@
 
 #define VARY_FORMAT_VERSION 5
 #define DISK_FORMAT_VERSION 6
+#define ENTITY_FORMAT_VERSION 7
+
+/* The body of a single file entity starts at a multiple of this */
+#define CACHE_ENTITY_ALIGN 4096
 
 #define CACHE_HEADER_SUFFIX ".header"
 #define CACHE_DATA_SUFFIX   ".data"
@@ -64,5 +68,16 @@ typedef struct {
     cache_control_t control;
 } disk_cache_info_t;
 
+typedef struct {
+    /* The entity header, info.format is ENTITY_FORMAT_VERSION. */
+    disk_cache_info_t info;
+    /* The size of the entity name and headers that follow. */
+    apr_size_t header_len;
+    /* Where the body starts, a multiple of CACHE_ENTITY_ALIGN. */
+    apr_off_t body_offset;
+    /* The size of the body. */
+    apr_off_t body_len;
+} disk_cache_entity_info_t;
+
 #endif /* CACHE_DIST_COMMON_H */
 /** @} */
@@ -286,7 +286,7 @@ int cache_select(cache_request_rec *cache, request_rec *r)
                  * is this header in the request and the header in the cached
                  * request identical? If not, we give up and do a straight get
                  */
-                h1 = cache_table_getm(r->pool, r->headers_in, vary);
+                h1 = cache_table_getm(r->pool, ap_cache_vary_headers(r), vary);
                 h2 = cache_table_getm(r->pool, h->req_hdrs, vary);
                 if (h1 == h2) {
                     /* both headers NULL, so a match - do nothing */
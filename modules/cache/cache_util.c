@@ -18,6 +18,15 @@
 
 #include "cache_util.h"
 #include <ap_provider.h>
+#include "ap_mpm.h"
+
+#include "apr_atomic.h"
+#include "apr_shm.h"
+
+#if APR_HAS_THREADS
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#endif
 
 APLOG_USE_MODULE(cache);
 
@@ -256,6 +265,10 @@ CACHE_DECLARE(apr_int64_t) ap_cache_current_age(cache_info *info,
  * or when a request arrives containing a Cache-Control: no-cache. At
  * no point is it possible for this lock to permanently deny access to
  * the backend.
+ *
+ * The subrequest refreshing a stale entity in the background runs
+ * under the lock its main request obtained or was handed (see
+ * cache_move_lock()).
  */
 apr_status_t cache_try_lock(cache_server_conf *conf, cache_request_rec *cache,
         request_rec *r)
@@ -271,6 +284,9 @@ apr_status_t cache_try_lock(cache_server_conf *conf, cache_request_rec *cache,
 
     finfo.mtime = 0;
 
+    if (r->main && apr_table_get(r->main->notes, CACHE_REFRESH_NOTE)) {
+        return APR_SUCCESS;
+    }
     if (!conf || !conf->lock || !conf->lockpath) {
         /* no locks configured, leave */
         return APR_SUCCESS;
@@ -366,7 +382,8 @@ apr_status_t cache_try_lock(cache_server_conf *conf, cache_request_rec *cache,
  * lock name first before trying to delete the file.
  *
  * If an optional bucket brigade is passed, the lock will only be
- * removed if the bucket brigade contains an EOS bucket.
+ * removed if the bucket brigade contains an EOS bucket. Otherwise we
+ * won't cache the response, so release the requests collapsed on us.
  */
 apr_status_t cache_remove_lock(cache_server_conf *conf,
         cache_request_rec *cache, request_rec *r, apr_bucket_brigade *bb)
@@ -374,6 +391,9 @@ apr_status_t cache_remove_lock(cache_server_conf *conf,
     void *dummy;
     const char *lockname;
 
+    if (!bb) {
+        cache_collapse_abort(cache, r);
+    }
     if (!conf || !conf->lock || !conf->lockpath) {
         /* no locks configured, leave */
         return APR_SUCCESS;
@@ -428,6 +448,582 @@ apr_status_t cache_remove_lock(cache_server_conf *conf,
     return apr_file_remove(lockname, r->pool);
 }
 
+/**
+ * Hand the cache lock obtained by the request over to the pool p, which
+ * holds it until it is destroyed.
+ *
+ * The lock file is removed and created again from p, so another request
+ * may take the lock in between, in which case APR_EEXIST is returned and
+ * p does not hold it. If the request holds no lock (locks are disabled
+ * or could not be obtained), there is nothing to hand over.
+ */
+apr_status_t cache_move_lock(cache_server_conf *conf,
+        cache_request_rec *cache, request_rec *r, apr_pool_t *p)
+{
+    void *dummy;
+    const char *lockname;
+    apr_file_t *lockfile;
+    apr_status_t status;
+
+    apr_pool_userdata_get(&dummy, CACHE_LOCKFILE_KEY, r->pool);
+    if (!dummy) {
+        return APR_SUCCESS;
+    }
+    apr_pool_userdata_get(&dummy, CACHE_LOCKNAME_KEY, r->pool);
+    lockname = apr_pstrdup(p, (const char *)dummy);
+
+    cache_remove_lock(conf, cache, r, NULL);
+
+    status = apr_file_open(&lockfile, lockname,
+            APR_WRITE | APR_CREATE | APR_EXCL | APR_DELONCLOSE,
+            APR_UREAD | APR_UWRITE, p);
+    if (status == APR_SUCCESS) {
+        apr_pool_userdata_setn(lockname, CACHE_LOCKNAME_KEY, NULL, p);
+        apr_pool_userdata_setn(lockfile, CACHE_LOCKFILE_KEY, NULL, p);
+    }
+    return status;
+}
+
+#if APR_HAS_THREADS
+
+/*
+ * Request collapsing (CacheCollapse).
+ *
+ * The responses in flight are registered per child by key, until the
+ * leader is done with them. Each one has its own pool, so that it can
+ * outlive the leader's request as long as followers are still serving it,
+ * the last one out destroys it. Only the leader allocates from this pool,
+ * and followers look at what it allocated once published under the mutex.
+ *
+ * The collapsing is per child only, requests missing in other children
+ * go to the backend on their own, unless the CacheLock serializes them
+ * (for stale entries).
+ */
+#define COLLAPSE_WAITING   0   /* leader waiting for the response */
+#define COLLAPSE_STREAMING 1   /* headers published, body coming */
+#define COLLAPSE_DONE      2   /* whole body received */
+#define COLLAPSE_FAILED    3   /* leader gave up, nothing more comes */
+
+struct cache_collapse_chunk_t {
+    cache_collapse_chunk_t *next;
+    apr_size_t len;
+    char data[1];
+};
+
+struct cache_collapse_t {
+    apr_pool_t *pool;
+    const char *key;
+    apr_thread_cond_t *cond;
+    int refcount;
+    int registered;
+    int state;
+    int status;
+    const char *status_line;
+    apr_table_t *headers;
+    apr_table_t *vary;          /* leader's request headers in Vary */
+    cache_collapse_chunk_t *first;
+    cache_collapse_chunk_t *last;
+    apr_off_t size;
+};
+
+static apr_thread_mutex_t *collapse_mutex = NULL;
+static apr_hash_t *collapse_entries = NULL;
+
+void cache_collapse_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t rv;
+    int threaded = 0;
+
+    for (; s; s = s->next) {
+        cache_server_conf *conf = ap_get_module_config(s->module_config,
+                                                       &cache_module);
+        if (conf->collapse) {
+            break;
+        }
+    }
+    if (!s) {
+        return;
+    }
+
+    /* Nothing to collapse without concurrent requests */
+    if (ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) != APR_SUCCESS
+        || threaded == AP_MPMQ_NOT_SUPPORTED) {
+        return;
+    }
+
+    rv = apr_thread_mutex_create(&collapse_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02869)
+                     "could not create the CacheCollapse mutex, "
+                     "requests won't be collapsed");
+        collapse_mutex = NULL;
+        return;
+    }
+    collapse_entries = apr_hash_make(p);
+}
+
+/* Must be called with the mutex held */
+static void collapse_unregister(cache_collapse_t *c)
+{
+    if (c->registered) {
+        apr_hash_set(collapse_entries, c->key, APR_HASH_KEY_STRING, NULL);
+        c->registered = 0;
+    }
+}
+
+static apr_status_t collapse_release(void *data)
+{
+    cache_request_rec *cache = data;
+    cache_collapse_t *c = cache->collapse;
+    int last;
+
+    apr_thread_mutex_lock(collapse_mutex);
+    if (cache->collapse_leader && c->state < COLLAPSE_DONE) {
+        c->state = COLLAPSE_FAILED;
+        collapse_unregister(c);
+        apr_thread_cond_broadcast(c->cond);
+    }
+    last = (--c->refcount == 0);
+    apr_thread_mutex_unlock(collapse_mutex);
+
+    cache->collapse = NULL;
+    cache->collapse_leader = 0;
+    if (last) {
+        apr_pool_destroy(c->pool);
+    }
+    return APR_SUCCESS;
+}
+
+static cache_collapse_t *collapse_create(const char *key)
+{
+    apr_allocator_t *allocator;
+    apr_pool_t *pool;
+    cache_collapse_t *c;
+
+    if (apr_allocator_create(&allocator) != APR_SUCCESS) {
+        return NULL;
+    }
+    if (apr_pool_create_ex(&pool, NULL, NULL, allocator) != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return NULL;
+    }
+    apr_allocator_owner_set(allocator, pool);
+    apr_pool_tag(pool, "cache_collapse");
+
+    c = apr_pcalloc(pool, sizeof(*c));
+    c->pool = pool;
+    c->key = apr_pstrdup(pool, key);
+    if (apr_thread_cond_create(&c->cond, pool) != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+    return c;
+}
+
+static int collapse_copy_header(void *rec, const char *key, const char *value)
+{
+    apr_table_add((apr_table_t *)rec, key, value);
+    return 1;
+}
+
+/* A deep copy, the strings must live in the table's pool */
+static apr_table_t *collapse_copy_headers(apr_pool_t *p, apr_table_t *t)
+{
+    apr_table_t *copy = apr_table_make(p, apr_table_elts(t)->nelts);
+    apr_table_do(collapse_copy_header, copy, t, NULL);
+    return copy;
+}
+
+/* Does the leader's response vary on the request's headers? */
+static int collapse_vary_match(cache_collapse_t *c, request_rec *r)
+{
+    char *vary, *token, *last;
+    const char *mine, *theirs;
+
+    theirs = cache_table_getm(r->pool, c->headers, "Vary");
+    if (!theirs) {
+        return 1;
+    }
+    vary = apr_pstrdup(r->pool, theirs);
+    for (token = apr_strtok(vary, ", \t", &last); token;
+         token = apr_strtok(NULL, ", \t", &last)) {
+        if (!strcmp(token, "*")) {
+            return 0;
+        }
+        mine = apr_table_get(ap_cache_vary_headers(r), token);
+        theirs = apr_table_get(c->vary, token);
+        if (mine ? !theirs || strcmp(mine, theirs) : theirs != NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+apr_status_t cache_collapse_join(cache_server_conf *conf,
+        cache_request_rec *cache, request_rec *r)
+{
+    static const char *const conditionals[] = {
+        "If-Match", "If-None-Match", "If-Modified-Since",
+        "If-Unmodified-Since", "If-Range", "Range", NULL
+    };
+    const char *const *h;
+    const char *type;
+    cache_collapse_t *c;
+    apr_time_t deadline;
+    apr_status_t rv = APR_SUCCESS;
+
+    if (!conf->collapse || !collapse_mutex || r->main
+        || r->method_number != M_GET || cache->stale_handle
+        || cache->control_in.no_cache) {
+        return APR_ENOTIMPL;
+    }
+    /* The response to these is not the one to share */
+    for (h = conditionals; *h; h++) {
+        if (apr_table_get(r->headers_in, *h)) {
+            return APR_ENOTIMPL;
+        }
+    }
+
+    if (!cache->key) {
+        cache_generate_key(r, r->pool, &cache->key);
+    }
+
+    apr_thread_mutex_lock(collapse_mutex);
+    c = apr_hash_get(collapse_entries, cache->key, APR_HASH_KEY_STRING);
+    if (!c) {
+        /* A HEAD response has no body to share */
+        if (r->header_only || !(c = collapse_create(cache->key))) {
+            apr_thread_mutex_unlock(collapse_mutex);
+            return APR_ENOTIMPL;
+        }
+        c->refcount = 1;
+        c->registered = 1;
+        apr_hash_set(collapse_entries, c->key, APR_HASH_KEY_STRING, c);
+        apr_thread_mutex_unlock(collapse_mutex);
+
+        cache->collapse = c;
+        cache->collapse_leader = 1;
+        apr_pool_cleanup_register(r->pool, cache, collapse_release,
+                                  apr_pool_cleanup_null);
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                      "cache: leading collapsed requests for %s", cache->key);
+        return APR_SUCCESS;
+    }
+
+    c->refcount++;
+    cache->collapse = c;
+    apr_pool_cleanup_register(r->pool, cache, collapse_release,
+                              apr_pool_cleanup_null);
+
+    deadline = apr_time_now() + conf->collapse_maxwait;
+    while (c->state == COLLAPSE_WAITING) {
+        apr_interval_time_t left = deadline - apr_time_now();
+        if (left <= 0) {
+            break;
+        }
+        apr_thread_cond_timedwait(c->cond, collapse_mutex, left);
+    }
+    if (c->state == COLLAPSE_WAITING) {
+        rv = APR_TIMEUP;
+    }
+    else if (c->state == COLLAPSE_FAILED) {
+        rv = APR_EGENERAL;
+    }
+    else if (!collapse_vary_match(c, r)) {
+        rv = APR_EMISMATCH;
+    }
+    apr_thread_mutex_unlock(collapse_mutex);
+
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, APLOGNO(02870)
+                      "cache: could not collapse onto the request in flight "
+                      "for %s, going to the backend", cache->key);
+        apr_pool_cleanup_run(r->pool, cache, collapse_release);
+        return rv;
+    }
+
+    /* The headers are final once published, serve them */
+    r->status = c->status;
+    r->status_line = apr_pstrdup(r->pool, c->status_line);
+    r->headers_out = collapse_copy_headers(r->pool, c->headers);
+    type = apr_table_get(r->headers_out, "Content-Type");
+    if (type) {
+        ap_set_content_type(r, type);
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02871)
+                  "cache: collapsed onto the request in flight for %s",
+                  cache->key);
+    return APR_EEXISTS;
+}
+
+void cache_collapse_prepare(cache_request_rec *cache, request_rec *r)
+{
+    cache_collapse_t *c = cache->collapse;
+    apr_table_t *headers, *err_headers_out;
+    char *vary, *token, *last;
+    const char *value;
+
+    if (!c || !cache->collapse_leader || c->state != COLLAPSE_WAITING) {
+        return;
+    }
+
+    /* Followers serve what is stored, which merges err_headers_out
+     * (and clears it, so keep them for the leader's response).
+     */
+    err_headers_out = apr_table_copy(r->pool, r->err_headers_out);
+    headers = ap_cache_cacheable_headers_out(r);
+    r->err_headers_out = err_headers_out;
+    c->headers = collapse_copy_headers(c->pool, headers);
+    c->status = r->status;
+    c->status_line = r->status_line ? apr_pstrdup(c->pool, r->status_line)
+                                    : NULL;
+
+    c->vary = apr_table_make(c->pool, 2);
+    value = cache_table_getm(r->pool, headers, "Vary");
+    if (value) {
+        vary = apr_pstrdup(r->pool, value);
+        for (token = apr_strtok(vary, ", \t", &last); token;
+             token = apr_strtok(NULL, ", \t", &last)) {
+            value = apr_table_get(ap_cache_vary_headers(r), token);
+            if (value) {
+                apr_table_setn(c->vary, apr_pstrdup(c->pool, token),
+                               apr_pstrdup(c->pool, value));
+            }
+        }
+    }
+}
+
+void cache_collapse_ready(cache_request_rec *cache, request_rec *r)
+{
+    cache_collapse_t *c = cache->collapse;
+    cache_server_conf *conf;
+
+    if (!c || !cache->collapse_leader || c->state != COLLAPSE_WAITING
+        || !c->headers) {
+        return;
+    }
+
+    conf = ap_get_module_config(r->server->module_config, &cache_module);
+    if (cache->size > conf->collapse_maxsize) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02872)
+                      "cache: response for %s too large to be shared by "
+                      "collapsed requests (%" APR_OFF_T_FMT " bytes)",
+                      cache->key, cache->size);
+        cache_collapse_abort(cache, r);
+        return;
+    }
+
+    apr_thread_mutex_lock(collapse_mutex);
+    c->state = COLLAPSE_STREAMING;
+    apr_thread_cond_broadcast(c->cond);
+    apr_thread_mutex_unlock(collapse_mutex);
+}
+
+void cache_collapse_feed(cache_request_rec *cache, request_rec *r,
+        apr_bucket_brigade *bb)
+{
+    cache_collapse_t *c = cache->collapse;
+    cache_collapse_chunk_t *first = NULL, *last = NULL, *chunk;
+    cache_server_conf *conf;
+    apr_bucket *e;
+    apr_off_t size = 0;
+    int done = 0;
+
+    /* Only the leader changes the state from STREAMING */
+    if (!c || !cache->collapse_leader || c->state != COLLAPSE_STREAMING) {
+        return;
+    }
+
+    conf = ap_get_module_config(r->server->module_config, &cache_module);
+    for (e = APR_BRIGADE_FIRST(bb);
+         e != APR_BRIGADE_SENTINEL(bb);
+         e = APR_BUCKET_NEXT(e))
+    {
+        const char *data;
+        apr_size_t len;
+
+        if (APR_BUCKET_IS_EOS(e)) {
+            done = 1;
+            break;
+        }
+        if (APR_BUCKET_IS_METADATA(e)) {
+            continue;
+        }
+        if (apr_bucket_read(e, &data, &len, APR_BLOCK_READ) != APR_SUCCESS) {
+            cache_collapse_abort(cache, r);
+            return;
+        }
+        if (!len) {
+            continue;
+        }
+        if (c->size + size + len > conf->collapse_maxsize) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02873)
+                          "cache: response for %s exceeds "
+                          "CacheCollapseMaxSize, collapsed requests "
+                          "are released", cache->key);
+            cache_collapse_abort(cache, r);
+            return;
+        }
+        chunk = apr_palloc(c->pool,
+                           APR_OFFSETOF(cache_collapse_chunk_t, data) + len);
+        chunk->next = NULL;
+        chunk->len = len;
+        memcpy(chunk->data, data, len);
+        if (last) {
+            last->next = chunk;
+        }
+        else {
+            first = chunk;
+        }
+        last = chunk;
+        size += len;
+    }
+
+    if (!first && !done) {
+        return;
+    }
+
+    apr_thread_mutex_lock(collapse_mutex);
+    if (first) {
+        if (c->last) {
+            c->last->next = first;
+        }
+        else {
+            c->first = first;
+        }
+        c->last = last;
+        c->size += size;
+    }
+    if (done) {
+        c->state = COLLAPSE_DONE;
+        collapse_unregister(c);
+    }
+    apr_thread_cond_broadcast(c->cond);
+    apr_thread_mutex_unlock(collapse_mutex);
+}
+
+void cache_collapse_abort(cache_request_rec *cache, request_rec *r)
+{
+    cache_collapse_t *c = cache->collapse;
+
+    if (!c || !cache->collapse_leader) {
+        return;
+    }
+
+    apr_thread_mutex_lock(collapse_mutex);
+    if (c->state < COLLAPSE_DONE) {
+        c->state = COLLAPSE_FAILED;
+        collapse_unregister(c);
+        apr_thread_cond_broadcast(c->cond);
+    }
+    apr_thread_mutex_unlock(collapse_mutex);
+}
+
+apr_status_t cache_collapse_pass(cache_request_rec *cache, request_rec *r,
+        ap_filter_t *next)
+{
+    cache_collapse_t *c = cache->collapse;
+    cache_collapse_chunk_t *chunk = NULL, *first, *last, *ch;
+    apr_bucket_alloc_t *ba = r->connection->bucket_alloc;
+    apr_bucket_brigade *bb;
+    apr_status_t rv;
+    int state;
+
+    bb = apr_brigade_create(r->pool, ba);
+    if (r->header_only) {
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(ba));
+        return ap_pass_brigade(next, bb);
+    }
+
+    for (;;) {
+        /* CacheCollapseMaxWait only bounds the wait for the headers, the
+         * body is as slow as the leader's backend.  The leader always ends
+         * the stream, with DONE or FAILED (be it from its pool cleanup).
+         */
+        apr_thread_mutex_lock(collapse_mutex);
+        while ((chunk ? !chunk->next : !c->first)
+               && c->state == COLLAPSE_STREAMING) {
+            apr_thread_cond_wait(c->cond, collapse_mutex);
+        }
+        first = chunk ? chunk->next : c->first;
+        last = c->last;
+        state = c->state;
+        apr_thread_mutex_unlock(collapse_mutex);
+
+        /* The chunks up to the last one seen are immutable */
+        for (ch = first; ch; ch = ch->next) {
+            APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_transient_create(ch->data,
+                                                                    ch->len,
+                                                                    ba));
+            chunk = ch;
+            if (ch == last) {
+                break;
+            }
+        }
+
+        if (state == COLLAPSE_DONE) {
+            APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(ba));
+            return ap_pass_brigade(next, bb);
+        }
+        if (state == COLLAPSE_FAILED) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02874)
+                          "cache: the response collapsed requests "
+                          "follow for %s broke", cache->key);
+            r->connection->keepalive = AP_CONN_CLOSE;
+            APR_BRIGADE_INSERT_TAIL(bb, ap_bucket_error_create(
+                    HTTP_BAD_GATEWAY, NULL, r->pool, ba));
+            APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(ba));
+            ap_pass_brigade(next, bb);
+            return APR_EGENERAL;
+        }
+
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_flush_create(ba));
+        rv = ap_pass_brigade(next, bb);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        apr_brigade_cleanup(bb);
+    }
+}
+
+#else /* APR_HAS_THREADS */
+
+void cache_collapse_child_init(apr_pool_t *p, server_rec *s)
+{
+}
+
+apr_status_t cache_collapse_join(cache_server_conf *conf,
+        cache_request_rec *cache, request_rec *r)
+{
+    return APR_ENOTIMPL;
+}
+
+void cache_collapse_prepare(cache_request_rec *cache, request_rec *r)
+{
+}
+
+void cache_collapse_ready(cache_request_rec *cache, request_rec *r)
+{
+}
+
+void cache_collapse_feed(cache_request_rec *cache, request_rec *r,
+        apr_bucket_brigade *bb)
+{
+}
+
+void cache_collapse_abort(cache_request_rec *cache, request_rec *r)
+{
+}
+
+apr_status_t cache_collapse_pass(cache_request_rec *cache, request_rec *r,
+        ap_filter_t *next)
+{
+    return APR_ENOTIMPL;
+}
+
+#endif /* APR_HAS_THREADS */
+
 int ap_cache_check_no_cache(cache_request_rec *cache, request_rec *r)
 {
 
@@ -511,6 +1107,48 @@ int ap_cache_check_no_store(cache_request_rec *cache, request_rec *r)
     return 1;
 }
 
+/* The stale-while-revalidate window of the cached response (RFC 5861),
+ * or -1 if it may not be served stale while being revalidated.
+ */
+static apr_int64_t cache_stale_while_revalidate(cache_handle_t *h,
+        request_rec *r)
+{
+    cache_control_t *control = &h->cache_obj->info.control;
+    const char *cc_cresp;
+    char *header, *token, *last;
+
+    if (control->must_revalidate || control->proxy_revalidate) {
+        return -1;
+    }
+
+    /* We are a shared cache, for which s-maxage also implies the semantics
+     * of proxy-revalidate (RFC 7234 section 5.2.2.9): once stale, the entity
+     * must be revalidated before it is served, whatever the window.
+     */
+    if (control->s_maxage) {
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE2, 0, r,
+                "cache: s-maxage present, not serving %s stale while "
+                "revalidating", r->unparsed_uri);
+        return -1;
+    }
+
+    cc_cresp = cache_table_getm(r->pool, h->resp_hdrs, "Cache-Control");
+    if (!cc_cresp) {
+        return -1;
+    }
+
+    header = apr_pstrdup(r->pool, cc_cresp);
+    token = cache_strqtok(header, CACHE_SEPARATOR, &last);
+    while (token) {
+        if (!strncasecmp(token, "stale-while-revalidate", 22)
+                && token[22] == '=') {
+            return apr_atoi64(token + 23);
+        }
+        token = cache_strqtok(NULL, CACHE_SEPARATOR, &last);
+    }
+    return -1;
+}
+
 int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
         request_rec *r)
 {
@@ -526,6 +1164,8 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
     cache_server_conf *conf =
       (cache_server_conf *)ap_get_module_config(r->server->module_config,
                                                 &cache_module);
+    cache_dir_conf *dconf = ap_get_module_config(r->per_dir_config,
+                                                 &cache_module);
 
     /*
      * We now want to check if our cached data is still fresh. This depends
@@ -714,6 +1354,52 @@ int cache_check_freshness(cache_handle_t *h, cache_request_rec *cache,
         return 1;    /* Cache object is fresh (enough) */
     }
 
+    /*
+     * At this point we are stale, but the origin server may allow us to
+     * serve the stale entity for a while, as long as it is revalidated
+     * in the background (RFC 5861 stale-while-revalidate). The request
+     * obtaining the lock refreshes the entity once it has served it, the
+     * others just serve it.
+     */
+    if (dconf->stale_while_revalidate && !r->main
+            && r->method_number == M_GET
+            && r->proxyreq != PROXYREQ_PROXY && r->unparsed_uri[0] == '/') {
+        apr_int64_t lifetime = -1, swr = cache_stale_while_revalidate(h, r);
+
+        if (maxage_cresp != -1) {
+            lifetime = maxage_cresp;
+        }
+        else if (info->expire != APR_DATE_BAD) {
+            lifetime = apr_time_sec(info->expire - info->date);
+        }
+
+        if (swr > 0 && lifetime != -1 && age < lifetime + swr) {
+            status = cache_try_lock(conf, cache, r);
+            if (APR_SUCCESS == status || APR_STATUS_IS_EEXIST(status)) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, status, r,
+                        APLOGNO(02876) "Serving stale cached URL while "
+                        "revalidating%s: %s",
+                        APR_SUCCESS == status ? "" : " elsewhere",
+                        r->unparsed_uri);
+
+                cache->stale_refresh = (APR_SUCCESS == status);
+
+                apr_table_set(h->resp_hdrs, "Age",
+                              apr_psprintf(r->pool, "%lu", (unsigned long)age));
+
+                /* make sure we don't stomp on a previous warning */
+                warn_head = apr_table_get(h->resp_hdrs, "Warning");
+                if ((warn_head == NULL) ||
+                    ((warn_head != NULL) && (ap_strstr_c(warn_head, "110") == NULL))) {
+                    apr_table_mergen(h->resp_hdrs, "Warning",
+                                     "110 Response is stale");
+                }
+
+                return 1;
+            }
+        }
+    }
+
     /*
      * At this point we are stale, but: if we are under load, we may let
      * a significant number of stale requests through before the first
@@ -1243,7 +1929,8 @@ CACHE_DECLARE(apr_table_t *)ap_cache_cacheable_headers(apr_pool_t *pool,
  */
 CACHE_DECLARE(apr_table_t *)ap_cache_cacheable_headers_in(request_rec *r)
 {
-    return ap_cache_cacheable_headers(r->pool, r->headers_in, r->server);
+    return ap_cache_cacheable_headers(r->pool, ap_cache_vary_headers(r),
+                                      r->server);
 }
 
 /*
@@ -1266,6 +1953,323 @@ CACHE_DECLARE(apr_table_t *)ap_cache_cacheable_headers_out(request_rec *r)
     return headers_out;
 }
 
+/* The coding we would end up serving for an Accept-Encoding header:
+ * br, gzip or identity.
+ */
+static const char *vary_accept_encoding(apr_pool_t *p, const char *value)
+{
+    char *list, *token, *last;
+    int br = 0, gzip = 0;
+
+    if (!value) {
+        return "identity";
+    }
+
+    list = apr_pstrdup(p, value);
+    for (token = apr_strtok(list, ",", &last); token;
+         token = apr_strtok(NULL, ",", &last)) {
+        char *params = strchr(token, ';');
+        char *end;
+
+        if (params) {
+            const char *q;
+
+            *params++ = '\0';
+
+            /* a zero quality value refuses the coding */
+            q = ap_strcasestr(params, "q=");
+            if (q) {
+                for (q += 2; *q == '0' || *q == '.'; q++);
+                if (!*q || *q == ';' || apr_isspace(*q)) {
+                    continue;
+                }
+            }
+        }
+
+        while (apr_isspace(*token)) {
+            token++;
+        }
+        end = token + strlen(token);
+        while (end > token && apr_isspace(end[-1])) {
+            *--end = '\0';
+        }
+
+        if (!strcasecmp(token, "br")) {
+            br = 1;
+        }
+        else if (!strcasecmp(token, "gzip") || !strcasecmp(token, "x-gzip")
+                 || !strcmp(token, "*")) {
+            gzip = 1;
+        }
+    }
+
+    return br ? "br" : gzip ? "gzip" : "identity";
+}
+
+typedef struct {
+    apr_table_t *from;
+    apr_table_t *headers;
+} cache_vary_headers_t;
+
+CACHE_DECLARE(apr_table_t *)ap_cache_vary_headers(request_rec *r)
+{
+    cache_server_conf *conf = ap_get_module_config(r->server->module_config,
+                                                   &cache_module);
+    cache_vary_normalize_t *rules;
+    cache_vary_headers_t *vh;
+    void *data;
+    int i;
+
+    if (!conf->vary_normalize || !conf->vary_normalize->nelts) {
+        return r->headers_in;
+    }
+
+    /* normalise once per request, unless the headers were replaced */
+    apr_pool_userdata_get(&data, CACHE_VARY_HEADERS_KEY, r->pool);
+    vh = data;
+    if (vh && vh->from == r->headers_in) {
+        return vh->headers;
+    }
+    if (!vh) {
+        vh = apr_palloc(r->pool, sizeof(cache_vary_headers_t));
+        apr_pool_userdata_setn(vh, CACHE_VARY_HEADERS_KEY, NULL, r->pool);
+    }
+    vh->from = r->headers_in;
+    vh->headers = apr_table_copy(r->pool, r->headers_in);
+
+    rules = (cache_vary_normalize_t *)conf->vary_normalize->elts;
+    for (i = 0; i < conf->vary_normalize->nelts; i++) {
+        const char *value;
+
+        if (rules[i].expr) {
+            const char *err = NULL;
+
+            value = ap_expr_str_exec(r, rules[i].expr, &err);
+            if (err) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02908)
+                        "Failure while evaluating the CacheVaryNormalize "
+                        "expression for %s, not normalised: %s",
+                        rules[i].header, err);
+                continue;
+            }
+        }
+        else {
+            value = vary_accept_encoding(r->pool,
+                    cache_table_getm(r->pool, r->headers_in, rules[i].header));
+        }
+        apr_table_setn(vh->headers, rules[i].header, value);
+    }
+
+    return vh->headers;
+}
+
+int cache_vary_encoding_mismatch(request_rec *r)
+{
+    cache_server_conf *conf = ap_get_module_config(r->server->module_config,
+                                                   &cache_module);
+    cache_vary_normalize_t *rules;
+    const char *vary, *coding;
+    int i;
+
+    if (!conf->vary_normalize || !conf->vary_normalize->nelts) {
+        return 0;
+    }
+    vary = cache_table_getm(r->pool, r->headers_out, "Vary");
+    if (!vary) {
+        return 0;
+    }
+
+    coding = r->content_encoding;
+    if (!coding) {
+        coding = cache_table_getm(r->pool, r->headers_out,
+                                  "Content-Encoding");
+    }
+    if (!coding || !strcasecmp(coding, "identity")) {
+        return 0;
+    }
+    if (!strcasecmp(coding, "x-gzip")) {
+        coding = "gzip";
+    }
+
+    rules = (cache_vary_normalize_t *)conf->vary_normalize->elts;
+    for (i = 0; i < conf->vary_normalize->nelts; i++) {
+        if (!rules[i].expr && ap_find_token(r->pool, vary, rules[i].header)
+            && strcasecmp(coding, apr_table_get(ap_cache_vary_headers(r),
+                                                rules[i].header))) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+cache_stats_t *cache_stats = NULL;
+
+apr_status_t cache_stats_init(apr_pool_t *p, server_rec *s)
+{
+    apr_shm_t *shm;
+    apr_status_t rv;
+
+    rv = apr_shm_create(&shm, sizeof(cache_stats_t), NULL, p);
+    if (rv == APR_SUCCESS) {
+        cache_stats = apr_shm_baseaddr_get(shm);
+        memset(cache_stats, 0, sizeof(cache_stats_t));
+    }
+    else {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, rv, s, APLOGNO(02909)
+                     "cache statistics not shared between processes");
+        cache_stats = apr_pcalloc(p, sizeof(cache_stats_t));
+    }
+
+    return APR_SUCCESS;
+}
+
+/* The per child Vary index: the names of the headers in the Vary record
+ * stored under a key, separated by commas, until the record expires.
+ * Recycled as a whole once it has allocated too many entries.
+ */
+#define CACHE_VARY_INDEX_MAX 4096
+
+typedef struct {
+    apr_time_t expire;
+    const char *names;
+} cache_vary_index_entry_t;
+
+static apr_pool_t *vary_index_pool = NULL;
+static apr_hash_t *vary_index = NULL;
+static unsigned int vary_index_allocs = 0;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *vary_index_mutex = NULL;
+#endif
+
+static void vary_index_lock(void)
+{
+#if APR_HAS_THREADS
+    if (vary_index_mutex) {
+        apr_thread_mutex_lock(vary_index_mutex);
+    }
+#endif
+}
+
+static void vary_index_unlock(void)
+{
+#if APR_HAS_THREADS
+    if (vary_index_mutex) {
+        apr_thread_mutex_unlock(vary_index_mutex);
+    }
+#endif
+}
+
+void cache_vary_index_child_init(apr_pool_t *p, server_rec *s)
+{
+#if APR_HAS_THREADS
+    int threaded = 0;
+
+    if (ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) == APR_SUCCESS
+        && threaded != AP_MPMQ_NOT_SUPPORTED) {
+        apr_status_t rv = apr_thread_mutex_create(&vary_index_mutex,
+                                                  APR_THREAD_MUTEX_DEFAULT, p);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02910)
+                         "could not create the Vary index mutex, "
+                         "the index is disabled");
+            return;
+        }
+    }
+#endif
+
+    apr_pool_create(&vary_index_pool, p);
+    apr_pool_tag(vary_index_pool, "mod_cache (vary index)");
+    vary_index = apr_hash_make(vary_index_pool);
+}
+
+unsigned int cache_vary_index_count(void)
+{
+    unsigned int count = 0;
+
+    if (vary_index) {
+        vary_index_lock();
+        count = apr_hash_count(vary_index);
+        vary_index_unlock();
+    }
+
+    return count;
+}
+
+CACHE_DECLARE(apr_array_header_t *)ap_cache_vary_index_get(request_rec *r,
+                                                          const char *key)
+{
+    cache_vary_index_entry_t *e;
+    apr_array_header_t *varray;
+    char *names = NULL, *name, *last;
+
+    if (!vary_index) {
+        return NULL;
+    }
+
+    vary_index_lock();
+    e = apr_hash_get(vary_index, key, APR_HASH_KEY_STRING);
+    if (e && e->expire > r->request_time) {
+        names = apr_pstrdup(r->pool, e->names);
+    }
+    vary_index_unlock();
+
+    if (!names) {
+        if (cache_stats) {
+            apr_atomic_inc32(&cache_stats->vary_index_misses);
+        }
+        return NULL;
+    }
+    if (cache_stats) {
+        apr_atomic_inc32(&cache_stats->vary_index_hits);
+    }
+
+    varray = apr_array_make(r->pool, 5, sizeof(char *));
+    for (name = apr_strtok(names, ",", &last); name;
+         name = apr_strtok(NULL, ",", &last)) {
+        APR_ARRAY_PUSH(varray, const char *) = name;
+    }
+
+    return varray;
+}
+
+CACHE_DECLARE(void)ap_cache_vary_index_set(request_rec *r, const char *key,
+                                           apr_array_header_t *varray,
+                                           apr_time_t expire)
+{
+    cache_vary_index_entry_t *e;
+    const char *names;
+
+    if (!vary_index) {
+        return;
+    }
+
+    names = varray ? apr_array_pstrcat(r->pool, varray, ',') : NULL;
+
+    vary_index_lock();
+    e = apr_hash_get(vary_index, key, APR_HASH_KEY_STRING);
+    if (!names) {
+        apr_hash_set(vary_index, key, APR_HASH_KEY_STRING, NULL);
+    }
+    else if (e && !strcmp(e->names, names)) {
+        e->expire = expire;
+    }
+    else {
+        if (++vary_index_allocs > CACHE_VARY_INDEX_MAX) {
+            /* start over */
+            apr_pool_clear(vary_index_pool);
+            vary_index = apr_hash_make(vary_index_pool);
+            vary_index_allocs = 1;
+        }
+        e = apr_palloc(vary_index_pool, sizeof(cache_vary_index_entry_t));
+        e->expire = expire;
+        e->names = apr_pstrdup(vary_index_pool, names);
+        apr_hash_set(vary_index, apr_pstrdup(vary_index_pool, key),
+                     APR_HASH_KEY_STRING, e);
+    }
+    vary_index_unlock();
+}
+
 apr_table_t *cache_merge_headers_out(request_rec *r)
 {
     apr_table_t *headers_out;
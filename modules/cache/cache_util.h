@@ -55,6 +55,7 @@ extern "C" {
 #include "http_log.h"
 #include "http_connection.h"
 #include "util_filter.h"
+#include "ap_expr.h"
 #include "apr_uri.h"
 
 #ifdef HAVE_NETDB_H
@@ -95,10 +96,15 @@ extern "C" {
 #define DEFAULT_X_CACHE         0
 #define DEFAULT_X_CACHE_DETAIL  0
 #define DEFAULT_CACHE_STALE_ON_ERROR 1
+#define DEFAULT_CACHE_STALE_WHILE_REVALIDATE 0
 #define DEFAULT_CACHE_LOCKPATH "mod_cache-lock"
 #define CACHE_LOCKNAME_KEY "mod_cache-lockname"
 #define CACHE_LOCKFILE_KEY "mod_cache-lockfile"
+#define DEFAULT_CACHE_COLLAPSE_MAXWAIT 5
+#define DEFAULT_CACHE_COLLAPSE_MAXSIZE (1024 * 1024)
 #define CACHE_CTX_KEY "mod_cache-ctx"
+#define CACHE_VARY_HEADERS_KEY "mod_cache-vary-headers"
+#define CACHE_REFRESH_NOTE "mod_cache-refresh"
 #define CACHE_SEPARATOR ",   "
 
 /**
@@ -116,6 +122,13 @@ struct cache_disable {
     apr_size_t pathlen;
 };
 
+/* a CacheVaryNormalize rule */
+typedef struct {
+    const char *header;
+    /* the normalised value, or NULL for the Accept-Encoding normaliser */
+    ap_expr_info_t *expr;
+} cache_vary_normalize_t;
+
 /* static information about the local cache */
 typedef struct {
     apr_array_header_t *cacheenable;    /* URLs to cache */
@@ -124,8 +137,14 @@ typedef struct {
     apr_array_header_t *ignore_headers;
     /** store the identifiers that should not be used for key calculation */
     apr_array_header_t *ignore_session_id;
+    /** request headers normalised before selecting a variant */
+    apr_array_header_t *vary_normalize;
     const char *lockpath;
     apr_time_t lockmaxage;
+    /** how long collapsed requests wait for the response they follow */
+    apr_interval_time_t collapse_maxwait;
+    /** max size of a response shared by collapsed requests */
+    apr_off_t collapse_maxsize;
     apr_uri_t *base_uri;
     /** ignore client's requests for uncached responses */
     unsigned int ignorecachecontrol:1;
@@ -135,6 +154,8 @@ typedef struct {
     unsigned int quick:1;
     /* thundering herd lock */
     unsigned int lock:1;
+    /* collapse concurrent misses onto one backend request */
+    unsigned int collapse:1;
     unsigned int x_cache:1;
     unsigned int x_cache_detail:1;
     /* flag if CacheIgnoreHeader has been set */
@@ -152,6 +173,9 @@ typedef struct {
     unsigned int lock_set:1;
     unsigned int lockpath_set:1;
     unsigned int lockmaxage_set:1;
+    unsigned int collapse_set:1;
+    unsigned int collapse_maxwait_set:1;
+    unsigned int collapse_maxsize_set:1;
     unsigned int x_cache_set:1;
     unsigned int x_cache_detail_set:1;
 } cache_server_conf;
@@ -174,6 +198,8 @@ typedef struct {
     unsigned int x_cache_detail:1;
     /* serve stale on error */
     unsigned int stale_on_error:1;
+    /* serve stale while revalidating in the background (RFC 5861) */
+    unsigned int stale_while_revalidate:1;
     /** ignore the last-modified header when deciding to cache this request */
     unsigned int no_last_mod_ignore:1;
     /** ignore expiration date from server */
@@ -189,6 +215,7 @@ typedef struct {
     unsigned int x_cache_set:1;
     unsigned int x_cache_detail_set:1;
     unsigned int stale_on_error_set:1;
+    unsigned int stale_while_revalidate_set:1;
     unsigned int no_last_mod_ignore_set:1;
     unsigned int store_expired_set:1;
     unsigned int store_private_set:1;
@@ -206,6 +233,10 @@ struct cache_provider_list {
     cache_provider_list *next;
 };
 
+/* A response in flight shared by collapsed requests, and a piece of it */
+typedef struct cache_collapse_t cache_collapse_t;
+typedef struct cache_collapse_chunk_t cache_collapse_chunk_t;
+
 /* per request cache information */
 typedef struct {
     cache_provider_list *providers;     /* possible cache providers */
@@ -217,6 +248,7 @@ typedef struct {
     apr_table_t *stale_headers;         /* original request headers. */
     int in_checked;                     /* CACHE_SAVE must cache the entity */
     int block_response;                 /* CACHE_SAVE must block response. */
+    int stale_refresh;                  /* refresh the stale entity served */
     apr_bucket_brigade *saved_brigade;  /* copy of partial response */
     apr_off_t saved_size;               /* length of saved_brigade */
     apr_time_t exp;                     /* expiration */
@@ -230,6 +262,8 @@ typedef struct {
     apr_off_t size;                     /* the content length from the headers, or -1 */
     apr_bucket_brigade *out;            /* brigade to reuse for upstream responses */
     cache_control_t control_in;         /* cache control incoming */
+    cache_collapse_t *collapse;         /* response we lead or follow */
+    int collapse_leader;                /* we fetch it for the others */
 } cache_request_rec;
 
 /**
@@ -294,11 +328,106 @@ apr_status_t cache_try_lock(cache_server_conf *conf, cache_request_rec *cache,
  * lock name first before trying to delete the file.
  *
  * If an optional bucket brigade is passed, the lock will only be
- * removed if the bucket brigade contains an EOS bucket.
+ * removed if the bucket brigade contains an EOS bucket. Otherwise the
+ * requests collapsed on this one, if any, are released.
  */
 apr_status_t cache_remove_lock(cache_server_conf *conf,
         cache_request_rec *cache, request_rec *r, apr_bucket_brigade *bb);
 
+/**
+ * Hand the cache lock held by the request over to the pool p, for the
+ * entity to be refreshed after the request is done. Returns APR_EEXIST
+ * if another request took the lock meanwhile.
+ */
+apr_status_t cache_move_lock(cache_server_conf *conf,
+        cache_request_rec *cache, request_rec *r, apr_pool_t *p);
+
+/**
+ * Collapse a cache miss onto an identical request in flight (CacheCollapse).
+ *
+ * The first request missing the cache for a key in a child becomes the
+ * leader: it goes to the backend as usual, and the response it stores is
+ * shared with the requests missing the cache for the same key meanwhile
+ * (the followers). Followers wait up to CacheCollapseMaxWait for the
+ * leader to find its response cacheable, and then serve it as it streams
+ * through the CACHE_SAVE filter, until the leader is done with it.
+ *
+ * Only GET and HEAD requests collapse. Conditional and range requests
+ * neither lead nor follow, HEAD requests may follow but never lead. A
+ * follower also goes to the backend if the response varies on request
+ * headers it does not share with the leader.
+ *
+ * If we return APR_SUCCESS, we are the leader. If we return APR_EEXISTS,
+ * we are a follower and the status and headers of the response have been
+ * set, the body is served by cache_collapse_pass(). If we return anything
+ * else, the request goes to the backend on its own.
+ */
+apr_status_t cache_collapse_join(cache_server_conf *conf,
+        cache_request_rec *cache, request_rec *r);
+
+/**
+ * Capture the status and headers of the leader's response, before they
+ * are stored (and err_headers_out merged away).
+ */
+void cache_collapse_prepare(cache_request_rec *cache, request_rec *r);
+
+/**
+ * The leader's response will be cached, let the followers serve it.
+ */
+void cache_collapse_ready(cache_request_rec *cache, request_rec *r);
+
+/**
+ * Share the body in the brigade with the followers, up to an EOS bucket.
+ */
+void cache_collapse_feed(cache_request_rec *cache, request_rec *r,
+        apr_bucket_brigade *bb);
+
+/**
+ * The leader gives up caching, the followers which are still waiting go
+ * to the backend, the others are served a broken response.
+ */
+void cache_collapse_abort(cache_request_rec *cache, request_rec *r);
+
+/**
+ * Serve the body of the leader's response, as it comes, down to next.
+ */
+apr_status_t cache_collapse_pass(cache_request_rec *cache, request_rec *r,
+        ap_filter_t *next);
+
+/**
+ * Set up the per child registry of the responses in flight.
+ */
+void cache_collapse_child_init(apr_pool_t *p, server_rec *s);
+
+/* statistics of all the children, for mod_status */
+typedef struct {
+    apr_uint32_t hits;
+    apr_uint32_t revalidates;
+    apr_uint32_t misses;
+    apr_uint32_t invalidates;
+    apr_uint32_t stores;
+    apr_uint32_t variant_stores;
+    apr_uint32_t vary_index_hits;
+    apr_uint32_t vary_index_misses;
+} cache_stats_t;
+
+extern cache_stats_t *cache_stats;
+
+/**
+ * Allocate the statistics, shared by the children if possible.
+ */
+apr_status_t cache_stats_init(apr_pool_t *p, server_rec *s);
+
+/**
+ * Set up the per child index of the Vary header names of the entities.
+ */
+void cache_vary_index_child_init(apr_pool_t *p, server_rec *s);
+
+/**
+ * Number of entities in the per child Vary index.
+ */
+unsigned int cache_vary_index_count(void);
+
 cache_provider_list *cache_get_providers(request_rec *r,
         cache_server_conf *conf, apr_uri_t uri);
 
@@ -327,6 +456,15 @@ char *cache_strqtok(char *str, const char *sep, char **last);
  */
 apr_table_t *cache_merge_headers_out(request_rec *r);
 
+/**
+ * Check whether the response varies on a header normalised with the
+ * accept-encoding normaliser of CacheVaryNormalize, but its
+ * Content-Encoding is neither identity nor the normalised value. Such a
+ * response can't be served to all the requests sharing its key, since
+ * the backend saw the original header.
+ */
+int cache_vary_encoding_mismatch(request_rec *r);
+
 #ifdef __cplusplus
 }
 #endif
@@ -14,6 +14,7 @@ cache_util.lo dnl
 "
 cache_disk_objs="mod_cache_disk.lo"
 cache_socache_objs="mod_cache_socache.lo"
+cache_tiered_objs="mod_cache_tiered.lo"
 
 case "$host" in
   *os2*)
@@ -21,12 +22,14 @@ case "$host" in
     # and we need some from main cache module
     cache_disk_objs="$cache_disk_objs mod_cache.la"
     cache_socache_objs="$cache_socache_objs mod_cache.la"
+    cache_tiered_objs="$cache_tiered_objs mod_cache.la"
     ;;
 esac
 
 APACHE_MODULE(cache, dynamic file caching.  At least one storage management module (e.g. mod_cache_disk) is also necessary., $cache_objs, , most)
 APACHE_MODULE(cache_disk, disk caching module, $cache_disk_objs, , most, , cache)
 APACHE_MODULE(cache_socache, shared object caching module, $cache_socache_objs, , most)
+APACHE_MODULE(cache_tiered, tiered memory and disk caching module, $cache_tiered_objs, , most, , cache)
 
 dnl
 dnl APACHE_CHECK_DISTCACHE
@@ -19,6 +19,11 @@
 #include "cache_storage.h"
 #include "cache_util.h"
 
+#include "apr_atomic.h"
+#include "ap_mpm.h"
+#include "mod_status.h"
+#include "mod_watchdog.h"
+
 module AP_MODULE_DECLARE_DATA cache_module;
 APR_OPTIONAL_FN_TYPE(ap_cache_generate_key) *cache_generate_key;
 
@@ -35,6 +40,7 @@ static ap_filter_rec_t *cache_out_filter_handle;
 static ap_filter_rec_t *cache_out_subreq_filter_handle;
 static ap_filter_rec_t *cache_remove_url_filter_handle;
 static ap_filter_rec_t *cache_invalidate_filter_handle;
+static ap_filter_rec_t *cache_refresh_filter_handle;
 
 /**
  * Entity headers' names
@@ -52,6 +58,392 @@ static const char *MOD_CACHE_ENTITY_HEADERS[] = {
     NULL
 };
 
+/*
+ * CACHE_REFRESH filter
+ * --------------------
+ *
+ * Terminates the filter stack of the subrequest refreshing a stale entity
+ * in the background: the response is cached by CACHE_SAVE_SUBREQ, and
+ * must not reach the client which has already been served.
+ */
+static apr_status_t cache_refresh_filter(ap_filter_t *f, apr_bucket_brigade *in)
+{
+    apr_brigade_cleanup(in);
+    return APR_SUCCESS;
+}
+
+/*
+ * Refresh of the stale entities served (stale-while-revalidate)
+ * -------------------------------------------------------------
+ *
+ * The request which obtained the cache lock for the stale entity it served
+ * hands the lock and a copy of its request headers over to a per child
+ * watchdog thread. The thread makes up a request on a connection of its
+ * own, and refreshes the entity with a conditional subrequest of it, so
+ * that neither the client nor the next request on its connection wait for
+ * the backend.
+ *
+ * Without mod_watchdog, or with a non threaded MPM (whose modules don't
+ * expect a second thread to run requests), the request refreshes the
+ * entity itself once its response is flushed, holding its worker and
+ * connection until the backend answers.
+ */
+
+#define CACHE_REFRESH_WATCHDOG_NAME "_cache_refresh_"
+
+/* Refreshes waiting for the watchdog thread, per child */
+#define CACHE_REFRESH_MAX_QUEUED 64
+
+typedef struct cache_refresh_job_t cache_refresh_job_t;
+struct cache_refresh_job_t {
+    cache_refresh_job_t *next;
+    apr_pool_t *pool;           /* own allocator, holds the cache lock */
+    server_rec *server;
+    const char *uri;
+    const char *hostname;
+    const char *useragent_ip;
+    apr_table_t *headers_in;
+};
+
+/* CacheStaleWhileRevalidate is on somewhere (until post_config) */
+static int cache_refresh_configured = 0;
+
+#if APR_HAS_THREADS
+static ap_watchdog_t *cache_refresh_watchdog = NULL;
+static apr_thread_mutex_t *cache_refresh_mutex = NULL;
+static cache_refresh_job_t *cache_refresh_first = NULL;
+static cache_refresh_job_t *cache_refresh_last = NULL;
+static int cache_refresh_queued = 0;
+#endif
+
+/* revalidate the entity, not whatever the client asked for */
+static void cache_refresh_strip_headers(apr_table_t *headers)
+{
+    apr_table_unset(headers, "Range");
+    apr_table_unset(headers, "If-Range");
+    apr_table_unset(headers, "If-Match");
+    apr_table_unset(headers, "If-None-Match");
+    apr_table_unset(headers, "If-Modified-Since");
+    apr_table_unset(headers, "If-Unmodified-Since");
+}
+
+/*
+ * Revalidate the URL with a subrequest of r, whose response only goes to
+ * the cache. The cache lock of the entity is held by r (or its pool).
+ */
+static void cache_refresh_run(request_rec *r, const char *uri)
+{
+    ap_filter_t *sink;
+    request_rec *rr;
+    int status;
+
+    sink = apr_pcalloc(r->pool, sizeof(ap_filter_t));
+    sink->frec = cache_refresh_filter_handle;
+    sink->r = r;
+    sink->c = r->connection;
+
+    cache_refresh_strip_headers(r->headers_in);
+
+    /* lets the subrequest, lookup included, go to the backend under the
+     * lock held by r, see cache_try_lock() */
+    apr_table_setn(r->notes, CACHE_REFRESH_NOTE, "1");
+
+    rr = ap_sub_req_method_uri("GET", uri, r, sink);
+    if (rr->status == HTTP_OK) {
+        status = ap_run_sub_req(rr);
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02877)
+                "cache: background refresh of %s returned %d (%d)",
+                uri, status, rr->status);
+    }
+    else {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02878)
+                "cache: could not refresh %s in the background (%d)",
+                uri, rr->status);
+    }
+    ap_destroy_sub_req(rr);
+}
+
+/*
+ * Refresh the stale entity just served from the request itself, after
+ * flushing its response.
+ */
+static void cache_refresh_now(cache_request_rec *cache, request_rec *r)
+{
+    cache_server_conf *conf = ap_get_module_config(r->server->module_config,
+                                                   &cache_module);
+    apr_bucket_brigade *bb;
+
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_flush_create(bb->bucket_alloc));
+    if (ap_pass_brigade(r->connection->output_filters, bb) == APR_SUCCESS
+            && !r->connection->aborted) {
+        cache_refresh_run(r, r->unparsed_uri);
+    }
+
+    cache_remove_lock(conf, cache, r, NULL);
+}
+
+#if APR_HAS_THREADS
+
+static int cache_refresh_copy_header(void *rec, const char *key,
+                                     const char *val)
+{
+    apr_table_add((apr_table_t *)rec, key, val);
+    return 1;
+}
+
+/*
+ * Queue the refresh of the stale entity just served for the watchdog
+ * thread, along with the cache lock.
+ */
+static void cache_refresh_queue(cache_request_rec *cache, request_rec *r)
+{
+    cache_server_conf *conf = ap_get_module_config(r->server->module_config,
+                                                   &cache_module);
+    cache_refresh_job_t *job;
+    apr_allocator_t *allocator;
+    apr_pool_t *p;
+
+    /* outlives the request, and is used then freed by the watchdog
+     * thread: created from the global pool, safe from any thread */
+    apr_allocator_create(&allocator);
+    apr_pool_create_ex(&p, NULL, NULL, allocator);
+    apr_allocator_owner_set(allocator, p);
+    apr_pool_tag(p, "cache_refresh");
+
+    if (cache_move_lock(conf, cache, r, p) != APR_SUCCESS) {
+        /* another request took the lock, it refreshes the entity */
+        apr_pool_destroy(p);
+        return;
+    }
+
+    job = apr_pcalloc(p, sizeof(cache_refresh_job_t));
+    job->pool = p;
+    job->server = r->server;
+    job->uri = apr_pstrdup(p, r->unparsed_uri);
+    job->hostname = apr_pstrdup(p, r->hostname);
+    job->useragent_ip = apr_pstrdup(p, r->useragent_ip);
+    job->headers_in = apr_table_make(p, apr_table_elts(r->headers_in)->nelts);
+    apr_table_do(cache_refresh_copy_header, job->headers_in, r->headers_in,
+                 NULL);
+
+    apr_thread_mutex_lock(cache_refresh_mutex);
+    if (cache_refresh_queued < CACHE_REFRESH_MAX_QUEUED) {
+        if (cache_refresh_last) {
+            cache_refresh_last->next = job;
+        }
+        else {
+            cache_refresh_first = job;
+        }
+        cache_refresh_last = job;
+        cache_refresh_queued++;
+        job = NULL;
+    }
+    apr_thread_mutex_unlock(cache_refresh_mutex);
+
+    if (job) {
+        /* releases the lock, a later request will try again */
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02952)
+                "cache: too many background refreshes queued, not "
+                "refreshing %s", r->unparsed_uri);
+        apr_pool_destroy(p);
+    }
+}
+
+/*
+ * Run a queued refresh, from a request made up on a connection to nowhere
+ * (nothing is written to it, the subrequest's output ends in the
+ * CACHE_REFRESH filter).
+ */
+static void cache_refresh_job(cache_refresh_job_t *job)
+{
+    apr_pool_t *p = job->pool;
+    apr_socket_t *csd;
+    apr_sockaddr_t *sa;
+    apr_status_t rv;
+    conn_rec *c = NULL;
+    request_rec *r;
+
+    rv = apr_socket_create(&csd, APR_INET, SOCK_STREAM, APR_PROTO_TCP, p);
+    if (rv == APR_SUCCESS) {
+        c = ap_run_create_connection(p, job->server, csd, 0, NULL,
+                                     apr_bucket_alloc_create(p));
+    }
+    if (rv != APR_SUCCESS || !c) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, job->server, APLOGNO(02953)
+                     "cache: could not set up the background refresh of %s",
+                     job->uri);
+        return;
+    }
+
+    /* for the access checks of the subrequest */
+    if (job->useragent_ip
+        && apr_sockaddr_info_get(&sa, job->useragent_ip, APR_UNSPEC, 0, 0,
+                                 p) == APR_SUCCESS) {
+        c->client_addr = sa;
+        c->client_ip = job->useragent_ip;
+    }
+
+    /* as ap_read_request() would */
+    r = apr_pcalloc(p, sizeof(request_rec));
+    r->pool = p;
+    r->connection = c;
+    r->server = job->server;
+
+    r->allowed_methods = ap_make_method_list(p, 2);
+
+    r->headers_in = job->headers_in;
+    r->trailers_in = apr_table_make(p, 1);
+    r->subprocess_env = apr_table_make(p, 5);
+    r->headers_out = apr_table_make(p, 1);
+    r->err_headers_out = apr_table_make(p, 1);
+    r->trailers_out = apr_table_make(p, 1);
+    r->notes = apr_table_make(p, 5);
+
+    r->request_config = ap_create_request_config(p);
+
+    r->proto_output_filters = c->output_filters;
+    r->output_filters = r->proto_output_filters;
+    r->proto_input_filters = c->input_filters;
+    r->input_filters = r->proto_input_filters;
+    ap_run_create_request(r);
+    r->per_dir_config = r->server->lookup_defaults;
+
+    r->read_body = REQUEST_NO_BODY;
+    r->status = HTTP_OK;
+    r->used_path_info = AP_REQ_DEFAULT_PATH_INFO;
+
+    r->useragent_addr = c->client_addr;
+    r->useragent_ip = c->client_ip;
+
+    r->request_time = apr_time_now();
+    r->the_request = apr_pstrcat(p, "GET ", job->uri, " HTTP/1.1", NULL);
+    r->method = "GET";
+    r->method_number = M_GET;
+    r->protocol = "HTTP/1.1";
+    r->proto_num = HTTP_VERSION(1, 1);
+    r->hostname = job->hostname;
+    ap_parse_uri(r, job->uri);
+
+    cache_refresh_run(r, job->uri);
+}
+
+static apr_status_t cache_refresh_watchdog_callback(int state, void *data,
+                                                    apr_pool_t *pool)
+{
+    cache_refresh_job_t *job;
+
+    if (!cache_refresh_mutex) {
+        return APR_SUCCESS;
+    }
+
+    for (;;) {
+        apr_thread_mutex_lock(cache_refresh_mutex);
+        job = cache_refresh_first;
+        if (job) {
+            cache_refresh_first = job->next;
+            if (!cache_refresh_first) {
+                cache_refresh_last = NULL;
+            }
+            cache_refresh_queued--;
+        }
+        apr_thread_mutex_unlock(cache_refresh_mutex);
+
+        if (!job) {
+            break;
+        }
+        /* when stopping, just release the locks */
+        if (state != AP_WATCHDOG_STATE_STOPPING) {
+            cache_refresh_job(job);
+        }
+        apr_pool_destroy(job->pool);
+    }
+
+    return APR_SUCCESS;
+}
+
+static void cache_refresh_post_config(apr_pool_t *p, server_rec *s)
+{
+    APR_OPTIONAL_FN_TYPE(ap_watchdog_get_instance) *wd_get_instance;
+    APR_OPTIONAL_FN_TYPE(ap_watchdog_register_callback) *wd_register_callback;
+    apr_status_t rv;
+    int threaded = 0;
+
+    cache_refresh_watchdog = NULL;
+
+    wd_get_instance = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_get_instance);
+    wd_register_callback = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_register_callback);
+    if (!wd_get_instance || !wd_register_callback
+        || ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) != APR_SUCCESS
+        || threaded == AP_MPMQ_NOT_SUPPORTED) {
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(02954)
+                     "CacheStaleWhileRevalidate: mod_watchdog and a threaded "
+                     "MPM are required to refresh stale entities in the "
+                     "background, the requests serving them will refresh "
+                     "them after their response");
+        return;
+    }
+
+    rv = wd_get_instance(&cache_refresh_watchdog, CACHE_REFRESH_WATCHDOG_NAME,
+                         0, 0, p);
+    if (rv == APR_SUCCESS) {
+        rv = wd_register_callback(cache_refresh_watchdog, AP_WD_TM_SLICE,
+                                  NULL, cache_refresh_watchdog_callback);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(02955)
+                     "CacheStaleWhileRevalidate: could not set up the "
+                     "background refresh watchdog, the requests serving "
+                     "stale entities will refresh them after their response");
+        cache_refresh_watchdog = NULL;
+    }
+}
+
+static void cache_refresh_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t rv;
+
+    if (!cache_refresh_watchdog) {
+        return;
+    }
+    rv = apr_thread_mutex_create(&cache_refresh_mutex,
+                                 APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02956)
+                     "could not create the background refresh mutex, "
+                     "stale entities will be refreshed by the requests "
+                     "serving them");
+        cache_refresh_mutex = NULL;
+    }
+}
+
+#endif /* APR_HAS_THREADS */
+
+/*
+ * Refresh the stale entity just served, under the cache lock obtained by
+ * cache_check_freshness(), unless serving it failed.
+ */
+static void cache_refresh(cache_request_rec *cache, request_rec *r, int rv)
+{
+    cache->stale_refresh = 0;
+
+    if (rv != OK) {
+        cache_server_conf *conf;
+
+        conf = ap_get_module_config(r->server->module_config, &cache_module);
+        cache_remove_lock(conf, cache, r, NULL);
+        return;
+    }
+
+#if APR_HAS_THREADS
+    if (cache_refresh_mutex) {
+        cache_refresh_queue(cache, r);
+        return;
+    }
+#endif
+    cache_refresh_now(cache, r);
+}
+
 /*
  * CACHE handler
  * -------------
@@ -177,6 +569,11 @@ static int cache_quick_handler(request_rec *r, int lookup)
      *   return OK
      */
     rv = cache_select(cache, r);
+    if (rv == DECLINED && !lookup
+        && cache_collapse_join(conf, cache, r) == APR_EEXISTS) {
+        /* served by the identical request in flight */
+        rv = OK;
+    }
     if (rv != OK) {
         if (rv == DECLINED) {
             if (!lookup) {
@@ -234,6 +631,7 @@ static int cache_quick_handler(request_rec *r, int lookup)
                     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv,
                             r, APLOGNO(00752) "Cache locked for url, not caching "
                             "response: %s", r->uri);
+                    cache_collapse_abort(cache, r);
                     /* cache_select() may have added conditional headers */
                     if (cache->stale_headers) {
                         r->headers_in = cache->stale_headers;
@@ -260,7 +658,8 @@ static int cache_quick_handler(request_rec *r, int lookup)
 
     /* we've got a cache hit! tell everyone who cares */
     cache_run_cache_status(cache->handle, r, r->headers_out, AP_CACHE_HIT,
-            "cache hit");
+            cache->collapse ? "cache hit: collapsed onto request in flight"
+                            : "cache hit");
 
     /* if we are a lookup, we are exiting soon one way or another; Restore
      * the headers. */
@@ -333,9 +732,16 @@ static int cache_quick_handler(request_rec *r, int lookup)
     e = apr_bucket_eos_create(out->bucket_alloc);
     APR_BRIGADE_INSERT_TAIL(out, e);
 
-    return ap_pass_brigade_fchk(r, out,
-                                "cache_quick_handler(%s): ap_pass_brigade returned",
-                                cache->provider_name);
+    rv = ap_pass_brigade_fchk(r, out,
+                              "cache_quick_handler(%s): ap_pass_brigade returned",
+                              cache->provider_name);
+
+    /* served stale, now bring the entity up to date */
+    if (cache->stale_refresh) {
+        cache_refresh(cache, r, rv);
+    }
+
+    return rv;
 }
 
 /**
@@ -477,6 +883,11 @@ static int cache_handler(request_rec *r)
      *   return OK
      */
     rv = cache_select(cache, r);
+    if (rv == DECLINED
+        && cache_collapse_join(conf, cache, r) == APR_EEXISTS) {
+        /* served by the identical request in flight */
+        rv = OK;
+    }
     if (rv != OK) {
         if (rv == DECLINED) {
 
@@ -556,6 +967,7 @@ static int cache_handler(request_rec *r)
                 ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv,
                         r, APLOGNO(00760) "Cache locked for url, not caching "
                         "response: %s", r->uri);
+                cache_collapse_abort(cache, r);
             }
         }
         else {
@@ -567,7 +979,8 @@ static int cache_handler(request_rec *r)
 
     /* we've got a cache hit! tell everyone who cares */
     cache_run_cache_status(cache->handle, r, r->headers_out, AP_CACHE_HIT,
-            "cache hit");
+            cache->collapse ? "cache hit: collapsed onto request in flight"
+                            : "cache hit");
 
     rv = ap_meets_conditions(r);
     if (rv != OK) {
@@ -628,8 +1041,15 @@ static int cache_handler(request_rec *r)
     out = apr_brigade_create(r->pool, r->connection->bucket_alloc);
     e = apr_bucket_eos_create(out->bucket_alloc);
     APR_BRIGADE_INSERT_TAIL(out, e);
-    return ap_pass_brigade_fchk(r, out, "cache(%s): ap_pass_brigade returned",
-                                cache->provider_name);
+    rv = ap_pass_brigade_fchk(r, out, "cache(%s): ap_pass_brigade returned",
+                              cache->provider_name);
+
+    /* served stale, now bring the entity up to date */
+    if (cache->stale_refresh) {
+        cache_refresh(cache, r, rv);
+    }
+
+    return rv;
 }
 
 /*
@@ -659,8 +1079,17 @@ static apr_status_t cache_out_filter(ap_filter_t *f, apr_bucket_brigade *in)
     while (!APR_BRIGADE_EMPTY(in)) {
         apr_bucket *e = APR_BRIGADE_FIRST(in);
         if (APR_BUCKET_IS_EOS(e)) {
-            apr_bucket_brigade *bb = apr_brigade_create(r->pool,
-                    r->connection->bucket_alloc);
+            apr_bucket_brigade *bb;
+
+            /* collapsed onto a request in flight, follow its response */
+            if (cache->collapse && !cache->collapse_leader) {
+                ap_remove_output_filter(f);
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r, APLOGNO(02875)
+                        "cache: serving %s from the request in flight", r->uri);
+                return cache_collapse_pass(cache, r, f->next);
+            }
+
+            bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
 
             /* restore content type of cached response if available */
             /* Needed especially when stale content gets served. */
@@ -738,6 +1167,9 @@ static int cache_save_store(ap_filter_t *f, apr_bucket_brigade *in,
             }
         }
 
+        /* share what we got with the requests collapsed on us */
+        cache_collapse_feed(cache, f->r, cache->out);
+
         /* conditionally remove the lock as soon as we see the eos bucket */
         cache_remove_lock(conf, cache, f->r, cache->out);
 
@@ -1109,6 +1541,10 @@ static apr_status_t cache_save_filter(ap_filter_t *f, apr_bucket_brigade *in)
     else if (ap_find_token(NULL, apr_table_get(r->headers_out, "Vary"), "*")) {
         reason = "Vary header contains '*'";
     }
+    else if (cache_vary_encoding_mismatch(r)) {
+        reason = "Content-Encoding does not match the normalised "
+                 "Accept-Encoding";
+    }
     else if (apr_table_get(r->subprocess_env, "no-cache") != NULL) {
         reason = "environment variable 'no-cache' is set";
     }
@@ -1476,6 +1912,7 @@ static apr_status_t cache_save_filter(ap_filter_t *f, apr_bucket_brigade *in)
      * permissions problems or a read-only (re)mount. This must be handled
      * later.
      */
+    cache_collapse_prepare(cache, r);
     rv = cache->provider->store_headers(cache->handle, r, info);
 
     /* Did we just update the cached headers on a revalidated response?
@@ -1583,10 +2020,20 @@ static apr_status_t cache_save_filter(ap_filter_t *f, apr_bucket_brigade *in)
         return ap_pass_brigade(f->next, in);
     }
 
+    if (cache_stats) {
+        apr_atomic_inc32(&cache_stats->stores);
+        if (apr_table_get(r->headers_out, "Vary")) {
+            apr_atomic_inc32(&cache_stats->variant_stores);
+        }
+    }
+
     /* we've got a cache miss! tell anyone who cares */
     cache_run_cache_status(cache->handle, r, r->headers_out, AP_CACHE_MISS,
             "cache miss: attempting entity save");
 
+    /* the requests collapsed on us can now follow the response */
+    cache_collapse_ready(cache, r);
+
     return cache_save_store(f, in, conf, cache);
 }
 
@@ -1776,18 +2223,30 @@ static int cache_status(cache_handle_t *h, request_rec *r,
     switch (status) {
     case AP_CACHE_HIT: {
         apr_table_setn(r->subprocess_env, AP_CACHE_HIT_ENV, reason);
+        if (cache_stats) {
+            apr_atomic_inc32(&cache_stats->hits);
+        }
         break;
     }
     case AP_CACHE_REVALIDATE: {
         apr_table_setn(r->subprocess_env, AP_CACHE_REVALIDATE_ENV, reason);
+        if (cache_stats) {
+            apr_atomic_inc32(&cache_stats->revalidates);
+        }
         break;
     }
     case AP_CACHE_MISS: {
         apr_table_setn(r->subprocess_env, AP_CACHE_MISS_ENV, reason);
+        if (cache_stats) {
+            apr_atomic_inc32(&cache_stats->misses);
+        }
         break;
     }
     case AP_CACHE_INVALIDATE: {
         apr_table_setn(r->subprocess_env, AP_CACHE_INVALIDATE_ENV, reason);
+        if (cache_stats) {
+            apr_atomic_inc32(&cache_stats->invalidates);
+        }
         break;
     }
     }
@@ -1938,6 +2397,8 @@ static void *create_dir_config(apr_pool_t *p, char *dummy)
 
     dconf->stale_on_error = DEFAULT_CACHE_STALE_ON_ERROR;
 
+    dconf->stale_while_revalidate = DEFAULT_CACHE_STALE_WHILE_REVALIDATE;
+
     /* array of providers for this URL space */
     dconf->cacheenable = apr_array_make(p, 10, sizeof(struct cache_enable));
 
@@ -1985,6 +2446,11 @@ static void *merge_dir_config(apr_pool_t *p, void *basev, void *addv) {
     new->stale_on_error_set = add->stale_on_error_set
             || base->stale_on_error_set;
 
+    new->stale_while_revalidate = (add->stale_while_revalidate_set == 0)
+            ? base->stale_while_revalidate : add->stale_while_revalidate;
+    new->stale_while_revalidate_set = add->stale_while_revalidate_set
+            || base->stale_while_revalidate_set;
+
     new->cacheenable = add->enable_set ? apr_array_append(p, base->cacheenable,
             add->cacheenable) : base->cacheenable;
     new->enable_set = add->enable_set || base->enable_set;
@@ -2016,10 +2482,16 @@ static void * create_cache_config(apr_pool_t *p, server_rec *s)
     /* array of identifiers that should not be used for key calculation */
     ps->ignore_session_id = apr_array_make(p, 10, sizeof(char *));
     ps->ignore_session_id_set = CACHE_IGNORE_SESSION_ID_UNSET;
+    /* array of request headers to normalise before selecting a variant */
+    ps->vary_normalize = apr_array_make(p, 2, sizeof(cache_vary_normalize_t));
     ps->lock = 0; /* thundering herd lock defaults to off */
     ps->lock_set = 0;
     ps->lockpath = ap_runtime_dir_relative(p, DEFAULT_CACHE_LOCKPATH);
     ps->lockmaxage = apr_time_from_sec(DEFAULT_CACHE_MAXAGE);
+    ps->collapse = 0; /* request collapsing defaults to off */
+    ps->collapse_set = 0;
+    ps->collapse_maxwait = apr_time_from_sec(DEFAULT_CACHE_COLLAPSE_MAXWAIT);
+    ps->collapse_maxsize = DEFAULT_CACHE_COLLAPSE_MAXSIZE;
     ps->x_cache = DEFAULT_X_CACHE;
     ps->x_cache_detail = DEFAULT_X_CACHE_DETAIL;
     return ps;
@@ -2056,6 +2528,8 @@ static void * merge_cache_config(apr_pool_t *p, void *basev, void *overridesv)
         (overrides->ignore_session_id_set == CACHE_IGNORE_SESSION_ID_UNSET)
         ? base->ignore_session_id
         : overrides->ignore_session_id;
+    ps->vary_normalize = apr_array_append(p, base->vary_normalize,
+                                          overrides->vary_normalize);
     ps->lock =
         (overrides->lock_set == 0)
         ? base->lock
@@ -2068,6 +2542,18 @@ static void * merge_cache_config(apr_pool_t *p, void *basev, void *overridesv)
         (overrides->lockmaxage_set == 0)
         ? base->lockmaxage
         : overrides->lockmaxage;
+    ps->collapse =
+        (overrides->collapse_set == 0)
+        ? base->collapse
+        : overrides->collapse;
+    ps->collapse_maxwait =
+        (overrides->collapse_maxwait_set == 0)
+        ? base->collapse_maxwait
+        : overrides->collapse_maxwait;
+    ps->collapse_maxsize =
+        (overrides->collapse_maxsize_set == 0)
+        ? base->collapse_maxsize
+        : overrides->collapse_maxsize;
     ps->quick =
         (overrides->quick_set == 0)
         ? base->quick
@@ -2183,6 +2669,40 @@ static const char *add_ignore_header(cmd_parms *parms, void *dummy,
     return NULL;
 }
 
+static const char *add_vary_normalize(cmd_parms *parms, void *dummy,
+                                      const char *header,
+                                      const char *normalizer)
+{
+    cache_server_conf *conf;
+    cache_vary_normalize_t *rule;
+
+    conf =
+        (cache_server_conf *)ap_get_module_config(parms->server->module_config,
+                                                  &cache_module);
+    rule = apr_array_push(conf->vary_normalize);
+    rule->header = header;
+    rule->expr = NULL;
+
+    if (!strncasecmp(normalizer, "expr=", 5)) {
+        const char *err = NULL;
+
+        rule->expr = ap_expr_parse_cmd(parms, normalizer + 5,
+                                       AP_EXPR_FLAG_STRING_RESULT, &err, NULL);
+        if (err) {
+            return apr_psprintf(parms->pool,
+                                "CacheVaryNormalize: cannot parse expression "
+                                "'%s': %s", normalizer + 5, err);
+        }
+    }
+    else if (strcasecmp(normalizer, "accept-encoding")) {
+        return apr_psprintf(parms->pool, "CacheVaryNormalize: unknown "
+                            "normaliser '%s', must be 'accept-encoding' or "
+                            "'expr=<expression>'", normalizer);
+    }
+
+    return NULL;
+}
+
 static const char *add_ignore_session_id(cmd_parms *parms, void *dummy,
                                          const char *identifier)
 {
@@ -2419,6 +2939,56 @@ static const char *set_cache_lock_maxage(cmd_parms *parms, void *dummy,
     return NULL;
 }
 
+static const char *set_cache_collapse(cmd_parms *parms, void *dummy,
+                                      int flag)
+{
+    cache_server_conf *conf;
+
+    conf =
+        (cache_server_conf *)ap_get_module_config(parms->server->module_config,
+                                                  &cache_module);
+    conf->collapse = flag;
+    conf->collapse_set = 1;
+    return NULL;
+}
+
+static const char *set_cache_collapse_maxwait(cmd_parms *parms, void *dummy,
+                                              const char *arg)
+{
+    cache_server_conf *conf;
+    apr_int64_t seconds;
+
+    conf =
+        (cache_server_conf *)ap_get_module_config(parms->server->module_config,
+                                                  &cache_module);
+    seconds = apr_atoi64(arg);
+    if (seconds <= 0) {
+        return "CacheCollapseMaxWait value must be a non-zero positive integer";
+    }
+    conf->collapse_maxwait = apr_time_from_sec(seconds);
+    conf->collapse_maxwait_set = 1;
+    return NULL;
+}
+
+static const char *set_cache_collapse_maxsize(cmd_parms *parms, void *dummy,
+                                              const char *arg)
+{
+    cache_server_conf *conf;
+    apr_off_t size;
+
+    conf =
+        (cache_server_conf *)ap_get_module_config(parms->server->module_config,
+                                                  &cache_module);
+    if (apr_strtoff(&size, arg, NULL, 10) != APR_SUCCESS || size <= 0) {
+        return "CacheCollapseMaxSize argument must be a non-zero positive "
+               "integer representing the max size of a collapsed response "
+               "in bytes";
+    }
+    conf->collapse_maxsize = size;
+    conf->collapse_maxsize_set = 1;
+    return NULL;
+}
+
 static const char *set_cache_x_cache(cmd_parms *parms, void *dummy, int flag)
 {
 
@@ -2497,6 +3067,19 @@ static const char *set_cache_stale_on_error(cmd_parms *parms, void *dummy,
     return NULL;
 }
 
+static const char *set_cache_stale_while_revalidate(cmd_parms *parms,
+        void *dummy, int flag)
+{
+    cache_dir_conf *dconf = (cache_dir_conf *)dummy;
+
+    dconf->stale_while_revalidate = flag;
+    dconf->stale_while_revalidate_set = 1;
+    if (flag) {
+        cache_refresh_configured = 1;
+    }
+    return NULL;
+}
+
 static int cache_post_config(apr_pool_t *p, apr_pool_t *plog,
                              apr_pool_t *ptemp, server_rec *s)
 {
@@ -2507,9 +3090,96 @@ static int cache_post_config(apr_pool_t *p, apr_pool_t *plog,
     if (!cache_generate_key) {
         cache_generate_key = cache_generate_key_default;
     }
+
+    cache_stats_init(p, s);
+
+#if APR_HAS_THREADS
+    if (cache_refresh_configured) {
+        cache_refresh_post_config(p, s);
+    }
+    else {
+        cache_refresh_watchdog = NULL;
+    }
+#endif
+    cache_refresh_configured = 0;
+
     return OK;
 }
 
+static int cache_status_hook(request_rec *r, int flags)
+{
+    apr_uint32_t hits, revalidates, misses, lookups;
+
+    if (!cache_stats) {
+        return DECLINED;
+    }
+
+    hits = apr_atomic_read32(&cache_stats->hits);
+    revalidates = apr_atomic_read32(&cache_stats->revalidates);
+    misses = apr_atomic_read32(&cache_stats->misses);
+    lookups = hits + revalidates + misses;
+
+    if (!(flags & AP_STATUS_SHORT)) {
+        ap_rputs("<hr>\n"
+                 "<table cellspacing=0 cellpadding=0>\n"
+                 "<tr><td bgcolor=\"#000000\">\n"
+                 "<b><font color=\"#ffffff\" face=\"Arial,Helvetica\">"
+                 "mod_cache Status:</font></b>\n"
+                 "</td></tr>\n"
+                 "<tr><td bgcolor=\"#ffffff\">\n", r);
+        ap_rprintf(r, "hits: <b>%u</b>, revalidated: <b>%u</b>, "
+                   "misses: <b>%u</b>, invalidated: <b>%u</b><br>",
+                   hits, revalidates, misses,
+                   apr_atomic_read32(&cache_stats->invalidates));
+        ap_rprintf(r, "hit rate: <b>%u%%</b><br>",
+                   lookups ? (unsigned int)((100.0 * hits) / lookups) : 0);
+        ap_rprintf(r, "entities stored: <b>%u</b>, variants (Vary) "
+                   "among them: <b>%u</b><br>",
+                   apr_atomic_read32(&cache_stats->stores),
+                   apr_atomic_read32(&cache_stats->variant_stores));
+        ap_rprintf(r, "Vary index: <b>%u</b> hits, <b>%u</b> misses, "
+                   "<b>%u</b> entries in this child<br>",
+                   apr_atomic_read32(&cache_stats->vary_index_hits),
+                   apr_atomic_read32(&cache_stats->vary_index_misses),
+                   cache_vary_index_count());
+        ap_rputs("</td></tr>\n</table>\n", r);
+    }
+    else {
+        ap_rputs("ModCacheStatus\n", r);
+        ap_rprintf(r, "CacheHits: %u\n", hits);
+        ap_rprintf(r, "CacheRevalidates: %u\n", revalidates);
+        ap_rprintf(r, "CacheMisses: %u\n", misses);
+        ap_rprintf(r, "CacheInvalidates: %u\n",
+                   apr_atomic_read32(&cache_stats->invalidates));
+        ap_rprintf(r, "CacheHitRate: %u%%\n",
+                   lookups ? (unsigned int)((100.0 * hits) / lookups) : 0);
+        ap_rprintf(r, "CacheStores: %u\n",
+                   apr_atomic_read32(&cache_stats->stores));
+        ap_rprintf(r, "CacheVariantStores: %u\n",
+                   apr_atomic_read32(&cache_stats->variant_stores));
+        ap_rprintf(r, "CacheVaryIndexHits: %u\n",
+                   apr_atomic_read32(&cache_stats->vary_index_hits));
+        ap_rprintf(r, "CacheVaryIndexMisses: %u\n",
+                   apr_atomic_read32(&cache_stats->vary_index_misses));
+        ap_rprintf(r, "CacheVaryIndexEntries: %u\n",
+                   cache_vary_index_count());
+    }
+
+    return OK;
+}
+
+static void cache_child_init(apr_pool_t *p, server_rec *s)
+{
+    /* request collapsing registry */
+    cache_collapse_child_init(p, s);
+    /* variants lookup shortcut */
+    cache_vary_index_child_init(p, s);
+#if APR_HAS_THREADS
+    /* background refreshes queue */
+    cache_refresh_child_init(p, s);
+#endif
+}
+
 
 static const command_rec cache_cmds[] =
 {
@@ -2555,6 +3225,10 @@ static const command_rec cache_cmds[] =
     AP_INIT_ITERATE("CacheIgnoreHeaders", add_ignore_header, NULL, RSRC_CONF,
                     "A space separated list of headers that should not be "
                     "stored by the cache"),
+    AP_INIT_TAKE2("CacheVaryNormalize", add_vary_normalize, NULL, RSRC_CONF,
+                  "A request header and how to normalise it before selecting "
+                  "a variant of a cached entity: 'accept-encoding' or "
+                  "'expr=<expression>'"),
     AP_INIT_FLAG("CacheIgnoreQueryString", set_cache_ignore_querystring,
                  NULL, RSRC_CONF,
                  "Ignore query-string when caching"),
@@ -2574,6 +3248,18 @@ static const command_rec cache_cmds[] =
                   "DefaultRuntimeDir setting."),
     AP_INIT_TAKE1("CacheLockMaxAge", set_cache_lock_maxage, NULL, RSRC_CONF,
                   "Maximum age of any thundering herd lock."),
+    AP_INIT_FLAG("CacheCollapse", set_cache_collapse, NULL, RSRC_CONF,
+                 "Enable or disable collapsing concurrent cache misses onto "
+                 "a single backend request."),
+    AP_INIT_TAKE1("CacheCollapseMaxWait", set_cache_collapse_maxwait, NULL,
+                  RSRC_CONF,
+                  "Maximum time in seconds a collapsed request waits for "
+                  "the response it follows, defaults to "
+                  APR_STRINGIFY(DEFAULT_CACHE_COLLAPSE_MAXWAIT) "."),
+    AP_INIT_TAKE1("CacheCollapseMaxSize", set_cache_collapse_maxsize, NULL,
+                  RSRC_CONF,
+                  "Maximum size in bytes of a response shared by collapsed "
+                  "requests."),
     AP_INIT_FLAG("CacheHeader", set_cache_x_cache, NULL, RSRC_CONF | ACCESS_CONF,
                  "Add a X-Cache header to responses. Default is off."),
     AP_INIT_FLAG("CacheDetailHeader", set_cache_x_cache_detail, NULL,
@@ -2584,6 +3270,10 @@ static const command_rec cache_cmds[] =
     AP_INIT_FLAG("CacheStaleOnError", set_cache_stale_on_error,
                  NULL, RSRC_CONF|ACCESS_CONF,
                  "Serve stale content on 5xx errors if present. Defaults to on."),
+    AP_INIT_FLAG("CacheStaleWhileRevalidate", set_cache_stale_while_revalidate,
+                 NULL, RSRC_CONF|ACCESS_CONF,
+                 "Serve stale content within its stale-while-revalidate "
+                 "window and refresh it in the background. Defaults to off."),
     {NULL}
 };
 
@@ -2596,6 +3286,11 @@ static void register_hooks(apr_pool_t *p)
     ap_hook_handler(cache_handler, NULL, NULL, APR_HOOK_REALLY_FIRST);
     /* cache status */
     cache_hook_cache_status(cache_status, NULL, NULL, APR_HOOK_MIDDLE);
+    /* request collapsing registry and Vary index */
+    ap_hook_child_init(cache_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    /* statistics */
+    APR_OPTIONAL_HOOK(ap, status_hook, cache_status_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
     /* cache error handler */
     ap_hook_insert_error_filter(cache_insert_error_filter, NULL, NULL, APR_HOOK_MIDDLE);
     /* cache filters
@@ -2677,6 +3372,11 @@ static void register_hooks(apr_pool_t *p)
                                   cache_invalidate_filter,
                                   NULL,
                                   AP_FTYPE_PROTOCOL);
+    cache_refresh_filter_handle =
+        ap_register_output_filter("CACHE_REFRESH",
+                                  cache_refresh_filter,
+                                  NULL,
+                                  AP_FTYPE_CONTENT_SET);
     ap_hook_post_config(cache_post_config, NULL, NULL, APR_HOOK_REALLY_FIRST);
 }
 
@@ -156,6 +156,35 @@ CACHE_DECLARE(apr_table_t *)ap_cache_cacheable_headers_in(request_rec *r);
  */
 CACHE_DECLARE(apr_table_t *)ap_cache_cacheable_headers_out(request_rec *r);
 
+/**
+ * Return the request headers as used to select among the variants of
+ * an entity: r->headers_in with the values of the headers configured
+ * with CacheVaryNormalize replaced by their normalised value. Entities
+ * are stored with these headers by ap_cache_cacheable_headers_in(), and
+ * providers should build the key of a variant from them.
+ */
+CACHE_DECLARE(apr_table_t *)ap_cache_vary_headers(request_rec *r);
+
+/**
+ * Look up the names of the headers the entity stored under the given key
+ * varies on, as last recorded with ap_cache_vary_index_set() by this
+ * process, saving the provider from reading its Vary record. The variant
+ * found must still be checked against the request, a stale answer being
+ * possible.
+ * @return an array of header names allocated from r->pool, or NULL if
+ * unknown
+ */
+CACHE_DECLARE(apr_array_header_t *)ap_cache_vary_index_get(request_rec *r,
+                                                          const char *key);
+
+/**
+ * Record the names of the headers the entity stored under the given key
+ * varies on, until expire, or forget them if varray is NULL.
+ */
+CACHE_DECLARE(void)ap_cache_vary_index_set(request_rec *r, const char *key,
+                                           apr_array_header_t *varray,
+                                           apr_time_t expire);
+
 /**
  * Parse the Cache-Control and Pragma headers in one go, marking
  * which tokens appear within the header. Populate the structure
@@ -53,6 +53,19 @@
  *   CRLF
  *   r->headers_in (delimited by CRLF)
  *   CRLF
+ *
+ * With CacheSingleFile on, the header file holds the body as well, and
+ * there is no .data file:
+ *
+ * Format #3:
+ *   disk_cache_entity_info_t (first sizeof(apr_uint32_t) bytes is the format)
+ *   entity name, r->headers_out and r->headers_in as in Format #2
+ *   [length is in disk_cache_entity_info_t->header_len]
+ *   padding up to disk_cache_entity_info_t->body_offset
+ *   body [length is in disk_cache_entity_info_t->body_len]
+ *
+ *   A hit then costs one open and one read of the first CACHE_ENTITY_ALIGN
+ *   bytes, the body is sent straight from the file (sendfile permitting).
  */
 
 module AP_MODULE_DECLARE_DATA cache_disk_module;
@@ -66,6 +79,10 @@ static apr_status_t recall_headers(cache_handle_t *h, request_rec *r);
 static apr_status_t recall_body(cache_handle_t *h, apr_pool_t *p, apr_bucket_brigade *bb);
 static apr_status_t read_array(request_rec *r, apr_array_header_t* arr,
                                apr_file_t *file);
+static apr_status_t parse_array(request_rec *r, apr_array_header_t *arr,
+                                const char **buf, const char *end);
+static apr_status_t parse_table(request_rec *r, apr_table_t *table,
+                                const char **buf, const char *end);
 
 /*
  * Local static functions
@@ -214,6 +231,19 @@ static apr_status_t file_cache_create(disk_cache_conf *conf, disk_cache_file_t *
  * file for an ap_cache_el, this state information will be read
  * and written transparent to clients of this module
  */
+static void file_cache_recall_info(cache_info *info,
+                                   disk_cache_object_t *dobj)
+{
+    /* Store it away so we can get it later. */
+    info->status = dobj->disk_info.status;
+    info->date = dobj->disk_info.date;
+    info->expire = dobj->disk_info.expire;
+    info->request_time = dobj->disk_info.request_time;
+    info->response_time = dobj->disk_info.response_time;
+
+    memcpy(&info->control, &dobj->disk_info.control, sizeof(cache_control_t));
+}
+
 static int file_cache_recall_mydata(apr_file_t *fd, cache_info *info,
                                     disk_cache_object_t *dobj, request_rec *r)
 {
@@ -228,14 +258,7 @@ static int file_cache_recall_mydata(apr_file_t *fd, cache_info *info,
         return rv;
     }
 
-    /* Store it away so we can get it later. */
-    info->status = dobj->disk_info.status;
-    info->date = dobj->disk_info.date;
-    info->expire = dobj->disk_info.expire;
-    info->request_time = dobj->disk_info.request_time;
-    info->response_time = dobj->disk_info.response_time;
-
-    memcpy(&info->control, &dobj->disk_info.control, sizeof(cache_control_t));
+    file_cache_recall_info(info, dobj);
 
     /* Note that we could optimize this by conditionally doing the palloc
      * depending upon the size. */
@@ -396,12 +419,215 @@ static int create_entity(cache_handle_t *h, request_rec *r, const char *key, apr
     dobj->vary.file = header_file(r->pool, conf, dobj, key);
 
     dobj->disk_info.header_only = r->header_only;
+    dobj->single = conf->single_file;
+
+    return OK;
+}
+
+/* Open a single file entity, and read its first page */
+static apr_status_t read_entity_page(request_rec *r, const char *file,
+                                     int flags, apr_file_t **fd,
+                                     char **buf, apr_size_t *len)
+{
+    apr_status_t rv;
+
+    rv = apr_file_open(fd, file, flags, 0, r->pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    *buf = apr_palloc(r->pool, CACHE_ENTITY_ALIGN);
+    *len = CACHE_ENTITY_ALIGN;
+    rv = apr_file_read(*fd, *buf, len);
+    if (rv == APR_SUCCESS && *len < sizeof(apr_uint32_t)) {
+        rv = APR_EOF;
+    }
+    if (rv != APR_SUCCESS) {
+        apr_file_close(*fd);
+        *fd = NULL;
+    }
+
+    return rv;
+}
+
+/*
+ * open_entity() for CacheSingleFile: one open and one read of the
+ * entity's first page, which holds the info and the headers.
+ */
+static int open_entity_single(cache_handle_t *h, request_rec *r,
+                              const char *key, disk_cache_conf *conf,
+                              cache_object_t *obj, disk_cache_object_t *dobj,
+                              int flags)
+{
+    disk_cache_entity_info_t einfo;
+    apr_array_header_t *varray;
+    apr_uint32_t format;
+    apr_size_t len;
+    const char *nkey;
+    char *buf;
+    apr_file_t *fd;
+    apr_pool_t *pool;
+    apr_status_t rc;
+
+    /* a Vary index hit names the variant without reading the Vary record */
+    varray = ap_cache_vary_index_get(r, key);
+    if (varray) {
+        nkey = regen_key(r->pool, ap_cache_vary_headers(r), varray, key);
+
+        dobj->hashfile = NULL;
+        dobj->prefix = dobj->vary.file;
+        dobj->hdrs.file = header_file(r->pool, conf, dobj, nkey);
+
+        rc = read_entity_page(r, dobj->hdrs.file, flags, &fd, &buf, &len);
+        if (rc == APR_SUCCESS) {
+            memcpy(&format, buf, sizeof(format));
+        }
+        else {
+            dobj->hashfile = NULL;
+            dobj->prefix = NULL;
+            varray = NULL;
+        }
+    }
+
+    if (!varray) {
+        rc = read_entity_page(r, dobj->vary.file, flags, &fd, &buf, &len);
+        if (rc != APR_SUCCESS) {
+            return DECLINED;
+        }
+        memcpy(&format, buf, sizeof(format));
+
+        if (format == VARY_FORMAT_VERSION) {
+            apr_time_t expire;
+            const char *p = buf + sizeof(format) + sizeof(apr_time_t);
+
+            apr_file_close(fd);
+
+            varray = apr_array_make(r->pool, 5, sizeof(char*));
+            rc = APR_EGENERAL;
+            if (p <= buf + len) {
+                memcpy(&expire, buf + sizeof(format), sizeof(expire));
+                rc = parse_array(r, varray, &p, buf + len);
+            }
+            if (rc != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(02885)
+                        "Cannot parse vary header file: %s",
+                        dobj->vary.file);
+                return DECLINED;
+            }
+
+            ap_cache_vary_index_set(r, key, varray, expire);
+            nkey = regen_key(r->pool, ap_cache_vary_headers(r), varray, key);
+
+            dobj->hashfile = NULL;
+            dobj->prefix = dobj->vary.file;
+            dobj->hdrs.file = header_file(r->pool, conf, dobj, nkey);
+
+            rc = read_entity_page(r, dobj->hdrs.file, flags, &fd, &buf, &len);
+            if (rc != APR_SUCCESS) {
+                return DECLINED;
+            }
+            memcpy(&format, buf, sizeof(format));
+        }
+        else {
+            dobj->hdrs.file = dobj->vary.file;
+            nkey = key;
+        }
+    }
+
+    if (format != ENTITY_FORMAT_VERSION) {
+        /* most likely left behind by the two file layout, it will be
+         * replaced when the entity is cached again.
+         */
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02886)
+                "File '%s' is not a single file entity. File had version: %d.",
+                dobj->hdrs.file, format);
+        apr_file_close(fd);
+        return DECLINED;
+    }
+    if (len < sizeof(einfo)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02887)
+                "Cannot read header file %s", dobj->hdrs.file);
+        apr_file_close(fd);
+        return DECLINED;
+    }
+    memcpy(&einfo, buf, sizeof(einfo));
+
+    /* the headers didn't fit in the first page, read the rest of them */
+    if (sizeof(einfo) + einfo.header_len > len) {
+        apr_size_t total = sizeof(einfo) + einfo.header_len;
+        char *more = apr_palloc(r->pool, total);
+
+        memcpy(more, buf, len);
+        rc = apr_file_read_full(fd, more + len, total - len, NULL);
+        if (rc != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(02888)
+                    "Cannot read header file %s", dobj->hdrs.file);
+            apr_file_close(fd);
+            return DECLINED;
+        }
+        buf = more;
+    }
+
+    memcpy(&dobj->disk_info, &einfo.info, sizeof(disk_cache_info_t));
+    dobj->entity_hdrs = buf + sizeof(einfo);
+    dobj->entity_hdrs_len = einfo.header_len;
+
+    /* check that we have the same URL */
+    if (dobj->disk_info.name_len > dobj->entity_hdrs_len
+            || strlen(key) != dobj->disk_info.name_len
+            || memcmp(dobj->entity_hdrs, key, dobj->disk_info.name_len)) {
+        apr_file_close(fd);
+        return DECLINED;
+    }
+
+    /* Is this a cached HEAD request? */
+    if (dobj->disk_info.header_only && !r->header_only) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r, APLOGNO(02889)
+                "HEAD request cached, non-HEAD requested, ignoring: %s",
+                dobj->hdrs.file);
+        apr_file_close(fd);
+        return DECLINED;
+    }
+
+    obj->key = nkey;
+    dobj->key = nkey;
+    dobj->name = key;
+    dobj->single = 1;
+
+    apr_pool_create(&pool, r->pool);
+    apr_pool_tag(pool, "mod_cache (open_entity)");
+
+    file_cache_create(conf, &dobj->hdrs, pool);
+    file_cache_create(conf, &dobj->vary, pool);
+    file_cache_create(conf, &dobj->data, pool);
+
+    /* a .data file from the two file layout is removed when committing */
+    dobj->data.file = data_file(r->pool, conf, dobj, nkey);
+
+    if (dobj->disk_info.has_body) {
+        dobj->data.fd = fd;
+        dobj->body_offset = einfo.body_offset;
+        dobj->file_size = einfo.body_len;
+    }
+    else {
+        apr_file_close(fd);
+    }
+
+    file_cache_recall_info(&obj->info, dobj);
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02890)
+            "Recalled cached URL info header %s", dobj->name);
+
+    /* make the configuration stick */
+    h->cache_obj = obj;
+    obj->vobj = dobj;
 
     return OK;
 }
 
 static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
 {
+    apr_array_header_t *varray;
     apr_uint32_t format;
     apr_size_t len;
     const char *nkey;
@@ -445,66 +671,94 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
     dobj->root_len = conf->cache_root_len;
 
     dobj->vary.file = header_file(r->pool, conf, dobj, key);
-    flags = APR_READ|APR_BINARY|APR_BUFFERED;
-    rc = apr_file_open(&dobj->vary.fd, dobj->vary.file, flags, 0, r->pool);
-    if (rc != APR_SUCCESS) {
-        return DECLINED;
+
+    if (conf->single_file) {
+        flags = APR_READ | APR_BINARY;
+#ifdef APR_SENDFILE_ENABLED
+        flags |= AP_SENDFILE_ENABLED(coreconf->enable_sendfile);
+#endif
+        return open_entity_single(h, r, key, conf, obj, dobj, flags);
     }
 
-    /* read the format from the cache file */
-    len = sizeof(format);
-    apr_file_read_full(dobj->vary.fd, &format, len, &len);
+    flags = APR_READ|APR_BINARY|APR_BUFFERED;
 
-    if (format == VARY_FORMAT_VERSION) {
-        apr_array_header_t* varray;
-        apr_time_t expire;
+    /* a Vary index hit names the variant without reading the Vary record */
+    varray = ap_cache_vary_index_get(r, key);
+    if (varray) {
+        nkey = regen_key(r->pool, ap_cache_vary_headers(r), varray, key);
 
-        len = sizeof(expire);
-        apr_file_read_full(dobj->vary.fd, &expire, len, &len);
+        dobj->hashfile = NULL;
+        dobj->prefix = dobj->vary.file;
+        dobj->hdrs.file = header_file(r->pool, conf, dobj, nkey);
 
-        varray = apr_array_make(r->pool, 5, sizeof(char*));
-        rc = read_array(r, varray, dobj->vary.fd);
+        rc = apr_file_open(&dobj->hdrs.fd, dobj->hdrs.file, flags, 0, r->pool);
+        if (rc != APR_SUCCESS) {
+            dobj->hashfile = NULL;
+            dobj->prefix = NULL;
+            varray = NULL;
+        }
+    }
+
+    if (!varray) {
+        rc = apr_file_open(&dobj->vary.fd, dobj->vary.file, flags, 0, r->pool);
         if (rc != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(00704)
-                    "Cannot parse vary header file: %s",
-                    dobj->vary.file);
-            apr_file_close(dobj->vary.fd);
             return DECLINED;
         }
-        apr_file_close(dobj->vary.fd);
 
-        nkey = regen_key(r->pool, r->headers_in, varray, key);
+        /* read the format from the cache file */
+        len = sizeof(format);
+        apr_file_read_full(dobj->vary.fd, &format, len, &len);
 
-        dobj->hashfile = NULL;
-        dobj->prefix = dobj->vary.file;
-        dobj->hdrs.file = header_file(r->pool, conf, dobj, nkey);
+        if (format == VARY_FORMAT_VERSION) {
+            apr_time_t expire;
 
-        flags = APR_READ|APR_BINARY|APR_BUFFERED;
-        rc = apr_file_open(&dobj->hdrs.fd, dobj->hdrs.file, flags, 0, r->pool);
-        if (rc != APR_SUCCESS) {
+            len = sizeof(expire);
+            apr_file_read_full(dobj->vary.fd, &expire, len, &len);
+
+            varray = apr_array_make(r->pool, 5, sizeof(char*));
+            rc = read_array(r, varray, dobj->vary.fd);
+            if (rc != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(00704)
+                        "Cannot parse vary header file: %s",
+                        dobj->vary.file);
+                apr_file_close(dobj->vary.fd);
+                return DECLINED;
+            }
+            apr_file_close(dobj->vary.fd);
+
+            ap_cache_vary_index_set(r, key, varray, expire);
+            nkey = regen_key(r->pool, ap_cache_vary_headers(r), varray, key);
+
+            dobj->hashfile = NULL;
+            dobj->prefix = dobj->vary.file;
+            dobj->hdrs.file = header_file(r->pool, conf, dobj, nkey);
+
+            rc = apr_file_open(&dobj->hdrs.fd, dobj->hdrs.file, flags, 0, r->pool);
+            if (rc != APR_SUCCESS) {
+                return DECLINED;
+            }
+        }
+        else if (format != DISK_FORMAT_VERSION) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(00705)
+                    "File '%s' has a version mismatch. File had version: %d.",
+                    dobj->vary.file, format);
+            apr_file_close(dobj->vary.fd);
             return DECLINED;
         }
-    }
-    else if (format != DISK_FORMAT_VERSION) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(00705)
-                "File '%s' has a version mismatch. File had version: %d.",
-                dobj->vary.file, format);
-        apr_file_close(dobj->vary.fd);
-        return DECLINED;
-    }
-    else {
-        apr_off_t offset = 0;
+        else {
+            apr_off_t offset = 0;
 
-        /* oops, not vary as it turns out */
-        dobj->hdrs.fd = dobj->vary.fd;
-        dobj->vary.fd = NULL;
-        dobj->hdrs.file = dobj->vary.file;
+            /* oops, not vary as it turns out */
+            dobj->hdrs.fd = dobj->vary.fd;
+            dobj->vary.fd = NULL;
+            dobj->hdrs.file = dobj->vary.file;
 
-        /* This wasn't a Vary Format file, so we must seek to the
-         * start of the file again, so that later reads work.
-         */
-        apr_file_seek(dobj->hdrs.fd, APR_SET, &offset);
-        nkey = key;
+            /* This wasn't a Vary Format file, so we must seek to the
+             * start of the file again, so that later reads work.
+             */
+            apr_file_seek(dobj->hdrs.fd, APR_SET, &offset);
+            nkey = key;
+        }
     }
 
     obj->key = nkey;
@@ -633,6 +887,10 @@ static int remove_url(cache_handle_t *h, request_rec *r)
         return DECLINED;
     }
 
+    if (dobj->name) {
+        ap_cache_vary_index_set(r, dobj->name, NULL, 0);
+    }
+
     /* Delete headers file */
     if (dobj->hdrs.file) {
         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(00711)
@@ -854,6 +1112,75 @@ static apr_status_t read_table(cache_handle_t *handle, request_rec *r,
     return APR_SUCCESS;
 }
 
+/* Get the next CRLF delimited line of a single file entity's headers */
+static char *parse_line(request_rec *r, const char **buf, const char *end)
+{
+    const char *lf = memchr(*buf, '\n', end - *buf);
+    apr_size_t len;
+    char *line;
+
+    if (!lf) {
+        return NULL;
+    }
+
+    len = lf - *buf;
+    if (len > 0 && (*buf)[len - 1] == CR) {
+        len--;
+    }
+    line = apr_pstrmemdup(r->pool, *buf, len);
+    *buf = lf + 1;
+
+    return line;
+}
+
+static apr_status_t parse_array(request_rec *r, apr_array_header_t *arr,
+                                const char **buf, const char *end)
+{
+    char *w;
+
+    while ((w = parse_line(r, buf, end)) != NULL) {
+        /* If we've finished reading the array, we are done. */
+        if (w[0] == '\0') {
+            return APR_SUCCESS;
+        }
+
+        *((const char **) apr_array_push(arr)) = w;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02891)
+                  "Premature end of vary array.");
+    return APR_EGENERAL;
+}
+
+static apr_status_t parse_table(request_rec *r, apr_table_t *table,
+                                const char **buf, const char *end)
+{
+    char *w, *l;
+
+    while ((w = parse_line(r, buf, end)) != NULL) {
+        /* If we've finished reading the headers, we are done. */
+        if (w[0] == '\0') {
+            return APR_SUCCESS;
+        }
+
+        /* if we see a bogus header don't ignore it. Shout and scream */
+        if (!(l = strchr(w, ':'))) {
+            return APR_EGENERAL;
+        }
+
+        *l++ = '\0';
+        while (apr_isspace(*l)) {
+            ++l;
+        }
+
+        apr_table_addn(table, w, l);
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02892)
+                  "Premature end of cache headers.");
+    return APR_EGENERAL;
+}
+
 /*
  * Reads headers from a buffer and returns an array of headers.
  * Returns NULL on file error
@@ -865,6 +1192,26 @@ static apr_status_t recall_headers(cache_handle_t *h, request_rec *r)
 {
     disk_cache_object_t *dobj = (disk_cache_object_t *) h->cache_obj->vobj;
 
+    /* The headers of a single file entity were read with its info */
+    if (dobj->single && dobj->entity_hdrs) {
+        const char *buf = dobj->entity_hdrs + dobj->disk_info.name_len;
+        const char *end = dobj->entity_hdrs + dobj->entity_hdrs_len;
+
+        h->req_hdrs = apr_table_make(r->pool, 20);
+        h->resp_hdrs = apr_table_make(r->pool, 20);
+
+        if (parse_table(r, h->resp_hdrs, &buf, end) != APR_SUCCESS
+                || parse_table(r, h->req_hdrs, &buf, end) != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02893)
+                    "Cannot parse cached headers for URL %s", dobj->name);
+            return APR_EGENERAL;
+        }
+
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02894)
+                "Recalled headers for URL %s", dobj->name);
+        return APR_SUCCESS;
+    }
+
     /* This case should not happen... */
     if (!dobj->hdrs.fd) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(00719)
@@ -891,7 +1238,8 @@ static apr_status_t recall_body(cache_handle_t *h, apr_pool_t *p, apr_bucket_bri
     disk_cache_object_t *dobj = (disk_cache_object_t*) h->cache_obj->vobj;
 
     if (dobj->data.fd) {
-        apr_brigade_insert_file(bb, dobj->data.fd, 0, dobj->file_size, p);
+        apr_brigade_insert_file(bb, dobj->data.fd, dobj->body_offset,
+                                dobj->file_size, p);
     }
 
     return APR_SUCCESS;
@@ -929,6 +1277,62 @@ static apr_status_t store_table(apr_file_t *fd, apr_table_t *table)
     return rv;
 }
 
+static apr_size_t table_iovec(apr_table_t *table, struct iovec *iov)
+{
+    int i;
+    apr_size_t k = 0;
+    apr_table_entry_t *elts;
+
+    elts = (apr_table_entry_t *) apr_table_elts(table)->elts;
+    for (i = 0; i < apr_table_elts(table)->nelts; ++i) {
+        if (elts[i].key != NULL) {
+            iov[k].iov_base = elts[i].key;
+            iov[k++].iov_len = strlen(elts[i].key);
+            iov[k].iov_base = ": ";
+            iov[k++].iov_len = sizeof(": ") - 1;
+            iov[k].iov_base = elts[i].val;
+            iov[k++].iov_len = strlen(elts[i].val);
+            iov[k].iov_base = CRLF;
+            iov[k++].iov_len = sizeof(CRLF) - 1;
+        }
+    }
+    iov[k].iov_base = CRLF;
+    iov[k++].iov_len = sizeof(CRLF) - 1;
+
+    return k;
+}
+
+/*
+ * Serialize the name and headers of a single file entity once, so that
+ * the body can be written after them straight away.
+ */
+static void serialize_headers(request_rec *r, disk_cache_object_t *dobj)
+{
+    apr_table_t *out = dobj->headers_out, *in = dobj->headers_in;
+    struct iovec *iov;
+    apr_size_t nvec = 0, len;
+
+    if (!out) {
+        out = apr_table_make(r->pool, 1);
+    }
+    if (!in) {
+        in = apr_table_make(r->pool, 1);
+    }
+
+    iov = apr_palloc(r->pool, sizeof(struct iovec) *
+                     ((apr_table_elts(out)->nelts +
+                       apr_table_elts(in)->nelts) * 4 + 3));
+    iov[nvec].iov_base = (char *) dobj->name;
+    iov[nvec++].iov_len = strlen(dobj->name);
+    nvec += table_iovec(out, iov + nvec);
+    nvec += table_iovec(in, iov + nvec);
+
+    dobj->entity_hdrs = apr_pstrcatv(r->pool, iov, nvec, &len);
+    dobj->entity_hdrs_len = len;
+    dobj->store_offset = APR_ALIGN(sizeof(disk_cache_entity_info_t) + len,
+                                   CACHE_ENTITY_ALIGN);
+}
+
 static apr_status_t store_headers(cache_handle_t *h, request_rec *r, cache_info *info)
 {
     disk_cache_object_t *dobj = (disk_cache_object_t*) h->cache_obj->vobj;
@@ -947,10 +1351,15 @@ static apr_status_t store_headers(cache_handle_t *h, request_rec *r, cache_info
         dobj->disk_info.header_only = 1;
     }
 
+    if (dobj->single) {
+        serialize_headers(r, dobj);
+    }
+
     return APR_SUCCESS;
 }
 
-static apr_status_t write_headers(cache_handle_t *h, request_rec *r)
+/* Write the vary file of the entity, if its response varies */
+static apr_status_t write_vary(cache_handle_t *h, request_rec *r)
 {
     disk_cache_conf *conf = ap_get_module_config(r->server->module_config,
                                                  &cache_disk_module);
@@ -958,11 +1367,6 @@ static apr_status_t write_headers(cache_handle_t *h, request_rec *r)
     apr_size_t amt;
     disk_cache_object_t *dobj = (disk_cache_object_t*) h->cache_obj->vobj;
 
-    disk_cache_info_t disk_info;
-    struct iovec iov[2];
-
-    memset(&disk_info, 0, sizeof(disk_cache_info_t));
-
     if (dobj->headers_out) {
         const char *tmp;
 
@@ -1031,14 +1435,58 @@ static apr_status_t write_headers(cache_handle_t *h, request_rec *r)
                 return rv;
             }
 
+            ap_cache_vary_index_set(r, dobj->name, varray,
+                                    h->cache_obj->info.expire);
+
             tmp = regen_key(r->pool, dobj->headers_in, varray, dobj->name);
             dobj->prefix = dobj->hdrs.file;
             dobj->hashfile = NULL;
             dobj->data.file = data_file(r->pool, conf, dobj, tmp);
             dobj->hdrs.file = header_file(r->pool, conf, dobj, tmp);
         }
+        else {
+            ap_cache_vary_index_set(r, dobj->name, NULL, 0);
+        }
     }
 
+    return APR_SUCCESS;
+}
+
+static void write_disk_info(cache_handle_t *h, disk_cache_object_t *dobj,
+                            disk_cache_info_t *disk_info)
+{
+    disk_info->format = DISK_FORMAT_VERSION;
+    disk_info->date = h->cache_obj->info.date;
+    disk_info->expire = h->cache_obj->info.expire;
+    disk_info->entity_version = dobj->disk_info.entity_version++;
+    disk_info->request_time = h->cache_obj->info.request_time;
+    disk_info->response_time = h->cache_obj->info.response_time;
+    disk_info->status = h->cache_obj->info.status;
+    disk_info->inode = dobj->disk_info.inode;
+    disk_info->device = dobj->disk_info.device;
+    disk_info->has_body = dobj->disk_info.has_body;
+    disk_info->header_only = dobj->disk_info.header_only;
+
+    disk_info->name_len = strlen(dobj->name);
+
+    memcpy(&disk_info->control, &h->cache_obj->info.control, sizeof(cache_control_t));
+}
+
+static apr_status_t write_headers(cache_handle_t *h, request_rec *r)
+{
+    apr_status_t rv;
+    apr_size_t amt;
+    disk_cache_object_t *dobj = (disk_cache_object_t*) h->cache_obj->vobj;
+
+    disk_cache_info_t disk_info;
+    struct iovec iov[2];
+
+    memset(&disk_info, 0, sizeof(disk_cache_info_t));
+
+    rv = write_vary(h, r);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
 
     rv = apr_file_mktemp(&dobj->hdrs.tempfd, dobj->hdrs.tempfile,
                          APR_CREATE | APR_WRITE | APR_BINARY |
@@ -1051,21 +1499,7 @@ static apr_status_t write_headers(cache_handle_t *h, request_rec *r)
         return rv;
     }
 
-    disk_info.format = DISK_FORMAT_VERSION;
-    disk_info.date = h->cache_obj->info.date;
-    disk_info.expire = h->cache_obj->info.expire;
-    disk_info.entity_version = dobj->disk_info.entity_version++;
-    disk_info.request_time = h->cache_obj->info.request_time;
-    disk_info.response_time = h->cache_obj->info.response_time;
-    disk_info.status = h->cache_obj->info.status;
-    disk_info.inode = dobj->disk_info.inode;
-    disk_info.device = dobj->disk_info.device;
-    disk_info.has_body = dobj->disk_info.has_body;
-    disk_info.header_only = dobj->disk_info.header_only;
-
-    disk_info.name_len = strlen(dobj->name);
-
-    memcpy(&disk_info.control, &h->cache_obj->info.control, sizeof(cache_control_t));
+    write_disk_info(h, dobj, &disk_info);
 
     iov[0].iov_base = (void*)&disk_info;
     iov[0].iov_len = sizeof(disk_cache_info_t);
@@ -1121,6 +1555,128 @@ static apr_status_t write_headers(cache_handle_t *h, request_rec *r)
     return APR_SUCCESS;
 }
 
+/* Carry the body of an entity over to the new version of its file */
+static apr_status_t copy_body(disk_cache_object_t *dobj)
+{
+    char buf[HUGE_STRING_LEN];
+    apr_off_t offset, left = dobj->file_size;
+    apr_size_t len;
+    apr_status_t rv;
+
+    offset = dobj->body_offset;
+    rv = apr_file_seek(dobj->data.fd, APR_SET, &offset);
+    if (rv == APR_SUCCESS) {
+        offset = dobj->store_offset;
+        rv = apr_file_seek(dobj->hdrs.tempfd, APR_SET, &offset);
+    }
+
+    while (rv == APR_SUCCESS && left > 0) {
+        len = left < (apr_off_t)sizeof(buf) ? (apr_size_t)left : sizeof(buf);
+        rv = apr_file_read_full(dobj->data.fd, buf, len, &len);
+        if (rv == APR_SUCCESS) {
+            rv = apr_file_write_full(dobj->hdrs.tempfd, buf, len, NULL);
+            left -= len;
+        }
+    }
+
+    return rv;
+}
+
+/*
+ * Write a single file entity: the info and headers go in front of the
+ * body written by store_body(), or when only the headers are updated
+ * (revalidation, invalidation), in front of a copy of the current body.
+ */
+static apr_status_t write_entity(cache_handle_t *h, request_rec *r)
+{
+    apr_status_t rv;
+    apr_size_t amt;
+    apr_off_t offset = 0;
+    disk_cache_object_t *dobj = (disk_cache_object_t*) h->cache_obj->vobj;
+
+    disk_cache_entity_info_t einfo;
+    struct iovec iov[2];
+
+    memset(&einfo, 0, sizeof(disk_cache_entity_info_t));
+
+    rv = write_vary(h, r);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    if (!dobj->entity_hdrs) {
+        serialize_headers(r, dobj);
+    }
+
+    if (dobj->data.tempfd) {
+        /* the body's tempfile becomes the entity's */
+        char *tempfile = dobj->hdrs.tempfile;
+
+        dobj->hdrs.tempfd = dobj->data.tempfd;
+        dobj->hdrs.tempfile = dobj->data.tempfile;
+        dobj->data.tempfd = NULL;
+        dobj->data.tempfile = tempfile;
+    }
+    else {
+        dobj->store_offset = APR_ALIGN(sizeof(disk_cache_entity_info_t) +
+                                       dobj->entity_hdrs_len,
+                                       CACHE_ENTITY_ALIGN);
+
+        rv = apr_file_mktemp(&dobj->hdrs.tempfd, dobj->hdrs.tempfile,
+                             APR_CREATE | APR_WRITE | APR_BINARY |
+                             APR_BUFFERED | APR_EXCL, dobj->hdrs.pool);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(02895)
+                    "could not create entity file %s",
+                    dobj->hdrs.tempfile);
+            return rv;
+        }
+
+        if (dobj->disk_info.has_body && dobj->data.fd) {
+            rv = copy_body(dobj);
+            if (rv != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(02896)
+                        "could not copy body to entity file %s",
+                        dobj->hdrs.tempfile);
+                return rv;
+            }
+        }
+    }
+
+    write_disk_info(h, dobj, &einfo.info);
+    einfo.info.format = ENTITY_FORMAT_VERSION;
+    einfo.header_len = dobj->entity_hdrs_len;
+    einfo.body_offset = dobj->store_offset;
+    einfo.body_len = einfo.info.has_body ? dobj->file_size : 0;
+
+    iov[0].iov_base = (void*)&einfo;
+    iov[0].iov_len = sizeof(disk_cache_entity_info_t);
+    iov[1].iov_base = (void*)dobj->entity_hdrs;
+    iov[1].iov_len = dobj->entity_hdrs_len;
+
+    rv = apr_file_seek(dobj->hdrs.tempfd, APR_SET, &offset);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_writev_full(dobj->hdrs.tempfd,
+                                  (const struct iovec *) &iov, 2, &amt);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(02897)
+                "could not write info to entity file %s",
+                dobj->hdrs.tempfile);
+        return rv;
+    }
+
+    rv = apr_file_close(dobj->hdrs.tempfd); /* flush and close */
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(02898)
+                "could not close entity file %s",
+                dobj->hdrs.tempfile);
+        return rv;
+    }
+
+    return APR_SUCCESS;
+}
+
 static apr_status_t store_body(cache_handle_t *h, request_rec *r,
                                apr_bucket_brigade *in, apr_bucket_brigade *out)
 {
@@ -1219,6 +1775,16 @@ static apr_status_t store_body(cache_handle_t *h, request_rec *r,
                 dobj->disk_info.device = finfo.device;
                 dobj->disk_info.inode = finfo.inode;
                 dobj->disk_info.has_body = 1;
+
+                /* leave room for the headers of a single file entity */
+                if (dobj->single) {
+                    apr_off_t offset = dobj->store_offset;
+                    rv = apr_file_seek(dobj->data.tempfd, APR_SET, &offset);
+                    if (rv != APR_SUCCESS) {
+                        apr_pool_destroy(dobj->data.pool);
+                        return rv;
+                    }
+                }
             }
 
             /* write to the cache, leave if we fail */
@@ -1268,7 +1834,13 @@ static apr_status_t store_body(cache_handle_t *h, request_rec *r,
         if (!dobj->disk_info.header_only) {
 
             if (dobj->data.tempfd) {
-                rv = apr_file_close(dobj->data.tempfd);
+                /* a single file entity gets its headers when committed */
+                if (dobj->single) {
+                    rv = apr_file_flush(dobj->data.tempfd);
+                }
+                else {
+                    rv = apr_file_close(dobj->data.tempfd);
+                }
                 if (rv != APR_SUCCESS) {
                     /* Buffered write failed, abandon attempt to write */
                     apr_pool_destroy(dobj->data.pool);
@@ -1319,7 +1891,12 @@ static apr_status_t commit_entity(cache_handle_t *h, request_rec *r)
     apr_status_t rv;
 
     /* write the headers to disk at the last possible moment */
-    rv = write_headers(h, r);
+    if (dobj->single) {
+        rv = write_entity(h, r);
+    }
+    else {
+        rv = write_headers(h, r);
+    }
 
     /* move header and data tempfiles to the final destination */
     if (APR_SUCCESS == rv) {
@@ -1329,7 +1906,13 @@ static apr_status_t commit_entity(cache_handle_t *h, request_rec *r)
         rv = file_cache_el_final(conf, &dobj->vary, r);
     }
     if (APR_SUCCESS == rv) {
-        if (!dobj->disk_info.header_only) {
+        if (dobj->single) {
+            /* drop any body left behind by the two file layout */
+            if (dobj->data.file) {
+                apr_file_remove(dobj->data.file, dobj->data.pool);
+            }
+        }
+        else if (!dobj->disk_info.header_only) {
             rv = file_cache_el_final(conf, &dobj->data, r);
         }
         else if (dobj->data.file){
@@ -1406,6 +1989,7 @@ static void *create_config(apr_pool_t *p, server_rec *s)
     /* XXX: Set default values */
     conf->dirlevels = DEFAULT_DIRLEVELS;
     conf->dirlength = DEFAULT_DIRLENGTH;
+    conf->single_file = DEFAULT_SINGLE_FILE;
 
     conf->cache_root = NULL;
     conf->cache_root_len = 0;
@@ -1520,6 +2104,15 @@ static const char
     return NULL;
 }
 
+static const char
+*set_cache_single_file(cmd_parms *parms, void *in_struct_ptr, int flag)
+{
+    disk_cache_conf *conf = ap_get_module_config(parms->server->module_config,
+                                                 &cache_disk_module);
+    conf->single_file = flag;
+    return NULL;
+}
+
 static const command_rec disk_cache_cmds[] =
 {
     AP_INIT_TAKE1("CacheRoot", set_cache_root, NULL, RSRC_CONF,
@@ -1536,6 +2129,8 @@ static const command_rec disk_cache_cmds[] =
                   "The maximum quantity of data to attempt to read and cache in one go"),
     AP_INIT_TAKE1("CacheReadTime", set_cache_readtime, NULL, RSRC_CONF | ACCESS_CONF,
                   "The maximum time taken to attempt to read and cache in go"),
+    AP_INIT_FLAG("CacheSingleFile", set_cache_single_file, NULL, RSRC_CONF,
+                 "Store the headers and the body of an entity in a single file"),
     {NULL}
 };
 
@@ -53,7 +53,12 @@ typedef struct disk_cache_object {
     apr_table_t *headers_out;    /* Output headers to save */
     apr_off_t offset;            /* Max size to set aside */
     apr_time_t timeout;          /* Max time to set aside */
+    const char *entity_hdrs;     /* Serialized name and headers (single file) */
+    apr_size_t entity_hdrs_len;
+    apr_off_t body_offset;       /* Offset of the body in the entity read */
+    apr_off_t store_offset;      /* Offset of the body in the entity written */
     unsigned int done:1;         /* Is the attempt to cache complete? */
+    unsigned int single:1;       /* Single file layout? */
 } disk_cache_object_t;
 
 
@@ -68,12 +73,14 @@ typedef struct disk_cache_object {
 #define DEFAULT_MAX_FILE_SIZE 1000000
 #define DEFAULT_READSIZE 0
 #define DEFAULT_READTIME 0
+#define DEFAULT_SINGLE_FILE 0
 
 typedef struct {
     const char* cache_root;
     apr_size_t cache_root_len;
     int dirlevels;               /* Number of levels of subdirectories */
     int dirlength;               /* Length of subdirectory names */
+    int single_file;             /* Store entities in a single file */
 } disk_cache_conf;
 
 typedef struct {
@@ -62,6 +62,18 @@
 
 module AP_MODULE_DECLARE_DATA cache_socache_module;
 
+/*
+ * cache_socache_pin_t
+ * An entry referenced in place in the socache, released on cleanup
+ */
+typedef struct cache_socache_pin_t
+{
+    ap_socache_provider_t *provider;
+    ap_socache_instance_t *instance;
+    server_rec *s;
+    ap_socache_pin_t *pin;
+} cache_socache_pin_t;
+
 /*
  * cache_socache_object_t
  * Pointed to by cache_object_t::vobj
@@ -71,6 +83,7 @@ typedef struct cache_socache_object_t
     apr_pool_t *pool; /* pool */
     unsigned char *buffer; /* the cache buffer */
     apr_size_t buffer_len; /* size of the buffer */
+    cache_socache_pin_t *pin; /* entry referenced in the socache, if any */
     apr_bucket_brigade *body; /* brigade containing the body, if any */
     apr_table_t *headers_in; /* Input headers to save */
     apr_table_t *headers_out; /* Output headers to save */
@@ -347,6 +360,99 @@ static void tokens_to_array(apr_pool_t *p, const char *data,
 /*
  * Hook and mod_cache callback functions
  */
+static apr_status_t socache_release(void *data)
+{
+    cache_socache_pin_t *pin = data;
+
+    if (socache_mutex) {
+        apr_status_t status = apr_global_mutex_lock(socache_mutex);
+        if (status != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, status, pin->s, APLOGNO(02901)
+                    "could not acquire lock, cache entry left referenced");
+            return status;
+        }
+    }
+    pin->provider->release(pin->instance, pin->s, pin->pin);
+    if (socache_mutex) {
+        apr_status_t status = apr_global_mutex_unlock(socache_mutex);
+        if (status != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, status, pin->s, APLOGNO(02902)
+                    "could not release lock");
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Retrieve the entry for the given key. If the provider can, the entry is
+ * referenced in place in the cache until sobj->pool is cleaned up, saving
+ * the copy; otherwise it is copied into sobj->buffer.
+ */
+static apr_status_t socache_retrieve(request_rec *r,
+        cache_socache_object_t *sobj, const char *key,
+        unsigned char **buffer, unsigned int *buffer_len)
+{
+    cache_socache_conf *conf = ap_get_module_config(r->server->module_config,
+            &cache_socache_module);
+    ap_socache_provider_t *provider = conf->provider->socache_provider;
+    ap_socache_instance_t *instance = conf->provider->socache_instance;
+    ap_socache_pin_t *pin = NULL;
+    apr_status_t rc = APR_ENOTIMPL;
+
+    if (socache_mutex) {
+        apr_status_t status = apr_global_mutex_lock(socache_mutex);
+        if (status != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(02350)
+                    "could not acquire lock, ignoring: %s", key);
+            return status;
+        }
+    }
+    if (provider->flags & AP_SOCACHE_FLAG_REFERENCE) {
+        const unsigned char *data;
+
+        rc = provider->retrieve_ref(instance, r->server,
+                (unsigned char *) key, strlen(key), &data, buffer_len, &pin,
+                sobj->pool);
+        if (rc == APR_SUCCESS) {
+            /* only ever read from */
+            *buffer = (unsigned char *) data;
+        }
+    }
+    if (rc == APR_ENOTIMPL) {
+        if (!sobj->buffer) {
+            sobj->buffer = apr_palloc(sobj->pool, sobj->buffer_len);
+        }
+        *buffer = sobj->buffer;
+        *buffer_len = sobj->buffer_len;
+        rc = provider->retrieve(instance, r->server, (unsigned char *) key,
+                strlen(key), sobj->buffer, buffer_len, r->pool);
+    }
+    if (socache_mutex) {
+        apr_status_t status = apr_global_mutex_unlock(socache_mutex);
+        if (status != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(02351)
+                    "could not release lock, ignoring: %s", key);
+            if (pin) {
+                provider->release(instance, r->server, pin);
+            }
+            return status;
+        }
+    }
+
+    if (pin) {
+        sobj->pin = apr_palloc(sobj->pool, sizeof(cache_socache_pin_t));
+        sobj->pin->provider = provider;
+        sobj->pin->instance = instance;
+        sobj->pin->s = r->server;
+        sobj->pin->pin = pin;
+        apr_pool_cleanup_register(sobj->pool, sobj->pin, socache_release,
+                apr_pool_cleanup_null);
+    }
+
+    return rc;
+}
+
 static int create_entity(cache_handle_t *h, request_rec *r, const char *key,
         apr_off_t len, apr_bucket_brigade *bb)
 {
@@ -434,8 +540,10 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
             ap_get_module_config(r->per_dir_config, &cache_socache_module);
     cache_socache_conf *conf = ap_get_module_config(r->server->module_config,
             &cache_socache_module);
+    apr_array_header_t *varray;
     apr_uint32_t format;
     apr_size_t slider;
+    unsigned char *buffer;
     unsigned int buffer_len;
     const char *nkey;
     apr_status_t rc;
@@ -463,120 +571,99 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
      */
     apr_pool_create(&sobj->pool, r->pool);
 
-    sobj->buffer = apr_palloc(sobj->pool, dconf->max + 1);
+    /* the buffer itself is only allocated if the entry has to be copied */
     sobj->buffer_len = dconf->max + 1;
 
-    /* attempt to retrieve the cached entry */
-    if (socache_mutex) {
-        apr_status_t status = apr_global_mutex_lock(socache_mutex);
-        if (status != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(02350)
-                    "could not acquire lock, ignoring: %s", obj->key);
-            apr_pool_destroy(sobj->pool);
-            sobj->pool = NULL;
-            return DECLINED;
+    /* a Vary index hit names the variant without fetching the Vary entry */
+    varray = ap_cache_vary_index_get(r, key);
+    if (varray) {
+        nkey = regen_key(r->pool, ap_cache_vary_headers(r), varray, key);
+
+        rc = socache_retrieve(r, sobj, nkey, &buffer, &buffer_len);
+        if (rc == APR_SUCCESS && buffer_len >= sobj->buffer_len) {
+            if (sobj->pin) {
+                apr_pool_cleanup_run(sobj->pool, sobj->pin, socache_release);
+                sobj->pin = NULL;
+            }
+            rc = APR_EGENERAL;
+        }
+        if (rc != APR_SUCCESS) {
+            nkey = NULL;
         }
     }
-    buffer_len = sobj->buffer_len;
-    rc = conf->provider->socache_provider->retrieve(
-            conf->provider->socache_instance, r->server, (unsigned char *) key,
-            strlen(key), sobj->buffer, &buffer_len, r->pool);
-    if (socache_mutex) {
-        apr_status_t status = apr_global_mutex_unlock(socache_mutex);
-        if (status != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(02351)
-                    "could not release lock, ignoring: %s", obj->key);
+
+    if (!nkey) {
+        /* attempt to retrieve the cached entry */
+        rc = socache_retrieve(r, sobj, key, &buffer, &buffer_len);
+        if (rc != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(02352)
+                    "Key not found in cache: %s", key);
             apr_pool_destroy(sobj->pool);
             sobj->pool = NULL;
             return DECLINED;
         }
-    }
-    if (rc != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(02352)
-                "Key not found in cache: %s", key);
-        apr_pool_destroy(sobj->pool);
-        sobj->pool = NULL;
-        return DECLINED;
-    }
-    if (buffer_len >= sobj->buffer_len) {
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(02353)
-                "Key found in cache but too big, ignoring: %s", key);
-        apr_pool_destroy(sobj->pool);
-        sobj->pool = NULL;
-        return DECLINED;
-    }
-
-    /* read the format from the cache file */
-    memcpy(&format, sobj->buffer, sizeof(format));
-    slider = sizeof(format);
-
-    if (format == CACHE_SOCACHE_VARY_FORMAT_VERSION) {
-        apr_array_header_t* varray;
-        apr_time_t expire;
-
-        memcpy(&expire, sobj->buffer + slider, sizeof(expire));
-        slider += sizeof(expire);
-
-        varray = apr_array_make(r->pool, 5, sizeof(char*));
-        rc = read_array(r, varray, sobj->buffer, buffer_len, &slider);
-        if (rc != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(02354)
-                    "Cannot parse vary entry for key: %s", key);
+        if (buffer_len >= sobj->buffer_len) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(02353)
+                    "Key found in cache but too big, ignoring: %s", key);
             apr_pool_destroy(sobj->pool);
             sobj->pool = NULL;
             return DECLINED;
         }
 
-        nkey = regen_key(r->pool, r->headers_in, varray, key);
+        /* read the format from the cache file */
+        memcpy(&format, buffer, sizeof(format));
+        slider = sizeof(format);
 
-        /* attempt to retrieve the cached entry */
-        if (socache_mutex) {
-            apr_status_t status = apr_global_mutex_lock(socache_mutex);
-            if (status != APR_SUCCESS) {
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(02355)
-                        "could not acquire lock, ignoring: %s", obj->key);
+        if (format == CACHE_SOCACHE_VARY_FORMAT_VERSION) {
+            apr_time_t expire;
+
+            memcpy(&expire, buffer + slider, sizeof(expire));
+            slider += sizeof(expire);
+
+            varray = apr_array_make(r->pool, 5, sizeof(char*));
+            rc = read_array(r, varray, buffer, buffer_len, &slider);
+            if (rc != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(02354)
+                        "Cannot parse vary entry for key: %s", key);
                 apr_pool_destroy(sobj->pool);
                 sobj->pool = NULL;
                 return DECLINED;
             }
-        }
-        buffer_len = sobj->buffer_len;
-        rc = conf->provider->socache_provider->retrieve(
-                conf->provider->socache_instance, r->server,
-                (unsigned char *) nkey, strlen(nkey), sobj->buffer,
-                &buffer_len, r->pool);
-        if (socache_mutex) {
-            apr_status_t status = apr_global_mutex_unlock(socache_mutex);
-            if (status != APR_SUCCESS) {
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(02356)
-                        "could not release lock, ignoring: %s", obj->key);
+
+            ap_cache_vary_index_set(r, key, varray, expire);
+            nkey = regen_key(r->pool, ap_cache_vary_headers(r), varray, key);
+
+            /* done with the vary entry */
+            if (sobj->pin) {
+                apr_pool_cleanup_run(sobj->pool, sobj->pin, socache_release);
+                sobj->pin = NULL;
+            }
+
+            /* attempt to retrieve the cached entry */
+            rc = socache_retrieve(r, sobj, nkey, &buffer, &buffer_len);
+            if (rc != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(02357)
+                        "Key not found in cache: %s", key);
                 apr_pool_destroy(sobj->pool);
                 sobj->pool = NULL;
                 return DECLINED;
             }
+            if (buffer_len >= sobj->buffer_len) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(02358)
+                        "Key found in cache but too big, ignoring: %s", key);
+                goto fail;
+            }
+
         }
-        if (rc != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(02357)
-                    "Key not found in cache: %s", key);
-            apr_pool_destroy(sobj->pool);
-            sobj->pool = NULL;
-            return DECLINED;
-        }
-        if (buffer_len >= sobj->buffer_len) {
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rc, r, APLOGNO(02358)
-                    "Key found in cache but too big, ignoring: %s", key);
+        else if (format != CACHE_SOCACHE_DISK_FORMAT_VERSION) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02359)
+                    "Key '%s' found in cache has version %d, expected %d, ignoring",
+                    key, format, CACHE_SOCACHE_DISK_FORMAT_VERSION);
             goto fail;
         }
-
-    }
-    else if (format != CACHE_SOCACHE_DISK_FORMAT_VERSION) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02359)
-                "Key '%s' found in cache has version %d, expected %d, ignoring",
-                key, format, CACHE_SOCACHE_DISK_FORMAT_VERSION);
-        goto fail;
-    }
-    else {
-        nkey = key;
+        else {
+            nkey = key;
+        }
     }
 
     obj->key = nkey;
@@ -584,7 +671,7 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
     sobj->name = key;
 
     if (buffer_len >= sizeof(cache_socache_info_t)) {
-        memcpy(&sobj->socache_info, sobj->buffer, sizeof(cache_socache_info_t));
+        memcpy(&sobj->socache_info, buffer, sizeof(cache_socache_info_t));
     }
     else {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(02360)
@@ -603,7 +690,7 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
     memcpy(&info->control, &sobj->socache_info.control, sizeof(cache_control_t));
 
     if (sobj->socache_info.name_len <= buffer_len - slider) {
-        if (strncmp((const char *) sobj->buffer + slider, sobj->name,
+        if (strncmp((const char *) buffer + slider, sobj->name,
                 sobj->socache_info.name_len)) {
             ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(02361)
                     "Cache entry for key '%s' URL mismatch, ignoring", nkey);
@@ -633,13 +720,13 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
     h->resp_hdrs = apr_table_make(r->pool, 20);
 
     /* Call routine to read the header lines/status line */
-    if (APR_SUCCESS != read_table(h, r, h->resp_hdrs, sobj->buffer, buffer_len,
+    if (APR_SUCCESS != read_table(h, r, h->resp_hdrs, buffer, buffer_len,
             &slider)) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(02364)
                 "Cache entry for key '%s' response headers unreadable, removing", nkey);
         goto fail;
     }
-    if (APR_SUCCESS != read_table(h, r, h->req_hdrs, sobj->buffer, buffer_len,
+    if (APR_SUCCESS != read_table(h, r, h->req_hdrs, buffer, buffer_len,
             &slider)) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, rc, r, APLOGNO(02365)
                 "Cache entry for key '%s' request headers unreadable, removing", nkey);
@@ -657,25 +744,38 @@ static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
      *  to the end of the response. In contrast, if the body is
      *  large, we would rather leave the body where it is in the
      *  temporary pool, and save ourselves the copy.
+     *
+     *  If the entry is referenced in place in the socache, a
+     *  large body is served straight from there, the reference
+     *  being held until the temporary pool goes away. The bucket
+     *  is transient so that anything setting it aside past the
+     *  request takes a copy.
      */
     if (len * 2 > dconf->max) {
         apr_bucket *e;
 
         /* large - use the brigade as is, we're done */
-        e = apr_bucket_immortal_create((const char *) sobj->buffer + slider,
-                len, r->connection->bucket_alloc);
+        if (sobj->pin) {
+            e = apr_bucket_transient_create((const char *) buffer + slider,
+                    len, r->connection->bucket_alloc);
+        }
+        else {
+            e = apr_bucket_immortal_create((const char *) buffer + slider,
+                    len, r->connection->bucket_alloc);
+        }
 
         APR_BRIGADE_INSERT_TAIL(sobj->body, e);
     }
     else {
 
         /* small - make a copy of the data... */
-        apr_brigade_write(sobj->body, NULL, NULL, (const char *) sobj->buffer
+        apr_brigade_write(sobj->body, NULL, NULL, (const char *) buffer
                 + slider, len);
 
-        /* ...and get rid of the large memory buffer */
+        /* ...and get rid of the large memory buffer or reference */
         apr_pool_destroy(sobj->pool);
         sobj->pool = NULL;
+        sobj->pin = NULL;
     }
 
     /* make the configuration stick */
@@ -728,6 +828,10 @@ static int remove_url(cache_handle_t *h, request_rec *r)
         return DECLINED;
     }
 
+    if (sobj->name) {
+        ap_cache_vary_index_set(r, sobj->name, NULL, 0);
+    }
+
     /* Remove the key from the cache */
     if (socache_mutex) {
         apr_status_t status = apr_global_mutex_lock(socache_mutex);
@@ -869,9 +973,14 @@ static apr_status_t store_headers(cache_handle_t *h, request_rec *r,
                 return rv;
             }
 
+            ap_cache_vary_index_set(r, sobj->name, varray, sobj->expire);
+
             obj->key = sobj->key = regen_key(r->pool, sobj->headers_in, varray,
                     sobj->name);
         }
+        else {
+            ap_cache_vary_index_set(r, sobj->name, NULL, 0);
+        }
     }
 
     socache_info->format = CACHE_SOCACHE_DISK_FORMAT_VERSION;
@@ -0,0 +1,680 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apr_strings.h"
+#include "apr_buckets.h"
+#include "apr_hash.h"
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_core.h"
+#include "http_protocol.h"
+#include "ap_provider.h"
+#include "ap_mpm.h"
+#include "util_filter.h"
+
+#if APR_HAS_THREADS
+#include "apr_thread_mutex.h"
+#endif
+
+#include "mod_cache.h"
+
+/*
+ * mod_cache_tiered: Tiered HTTP 1.1 Cache.
+ *
+ * The "tiered" cache provider stacks two cache providers sharing one key
+ * space: a memory tier (by default "socache", mod_cache_socache) in front
+ * of a disk tier (by default "disk", mod_cache_disk).
+ *
+ * Flow:
+ *   New entities are stored in the disk tier, which holds the whole cache
+ *   (the memory tier is only used if the disk tier declines the entity).
+ *
+ *   Lookups try the memory tier first, then the disk tier. An entity
+ *   served from the disk tier CacheTieredPromoteHits times in a child is
+ *   copied to the memory tier as it is served (promotion), and served
+ *   from memory from then on, by every child.
+ *
+ *   When the memory tier evicts an entity, lookups fall back to the disk
+ *   tier again (demotion), where the entity has been all along.
+ *
+ *   Updates of an entity (revalidation, invalidation, removal) are applied
+ *   to both tiers, so that they share one freshness record.
+ */
+
+module AP_MODULE_DECLARE_DATA cache_tiered_module;
+
+#define DEFAULT_MEMORY_PROVIDER "socache"
+#define DEFAULT_DISK_PROVIDER "disk"
+#define DEFAULT_PROMOTE_HITS 2
+
+/* Max number of entities whose hits are counted in a child at a time */
+#define TIERED_MAX_COUNTERS 4096
+
+typedef struct cache_tiered_conf
+{
+    const char *mem_name;
+    const char *disk_name;
+    const cache_provider *mem;
+    const cache_provider *disk;
+    int promote_hits;
+    unsigned int mem_name_set :1;
+    unsigned int disk_name_set :1;
+    unsigned int promote_hits_set :1;
+} cache_tiered_conf;
+
+/*
+ * cache_tiered_object_t
+ * Pointed to by cache_object_t::vobj
+ */
+typedef struct cache_tiered_object_t
+{
+    request_rec *r; /* the request the entity was opened for */
+    const char *key; /* the key the entity was opened or created with */
+    const cache_provider *mem;
+    const cache_provider *disk;
+    cache_handle_t hmem; /* the entity in the memory tier */
+    cache_handle_t hdisk; /* the entity in the disk tier */
+    unsigned int in_mem :1; /* hmem holds the entity */
+    unsigned int in_disk :1; /* hdisk holds the entity */
+    unsigned int disk_tried :1; /* the disk tier was looked up */
+    unsigned int from_mem :1; /* the entity is served from memory */
+    unsigned int promote :1; /* copy to memory when served */
+} cache_tiered_object_t;
+
+/* Per child hit counters of the entities served from disk */
+static apr_pool_t *hits_pool = NULL;
+static apr_hash_t *hits = NULL;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *hits_mutex = NULL;
+#endif
+
+/*
+ * Local static functions
+ */
+
+/* Count a hit in the disk tier, returns whether to promote the entity */
+static int tiered_hit(cache_tiered_conf *conf, const char *key)
+{
+    int *count, promote = 0;
+
+    if (!hits) {
+        return 0;
+    }
+
+#if APR_HAS_THREADS
+    if (hits_mutex) {
+        apr_thread_mutex_lock(hits_mutex);
+    }
+#endif
+
+    count = apr_hash_get(hits, key, APR_HASH_KEY_STRING);
+    if (!count) {
+        /* too many candidates, start over rather than growing forever */
+        if (apr_hash_count(hits) >= TIERED_MAX_COUNTERS) {
+            apr_pool_clear(hits_pool);
+            hits = apr_hash_make(hits_pool);
+        }
+        count = apr_pcalloc(hits_pool, sizeof(*count));
+        apr_hash_set(hits, apr_pstrdup(hits_pool, key), APR_HASH_KEY_STRING,
+                count);
+    }
+    if (++*count >= conf->promote_hits) {
+        apr_hash_set(hits, key, APR_HASH_KEY_STRING, NULL);
+        promote = 1;
+    }
+
+#if APR_HAS_THREADS
+    if (hits_mutex) {
+        apr_thread_mutex_unlock(hits_mutex);
+    }
+#endif
+
+    return promote;
+}
+
+/* Expose the tier serving the entity through the mod_cache handle */
+static void tiered_sync(cache_handle_t *h)
+{
+    cache_tiered_object_t *tobj = (cache_tiered_object_t *) h->cache_obj->vobj;
+    cache_handle_t *from = tobj->from_mem ? &tobj->hmem : &tobj->hdisk;
+
+    if (from->cache_obj) {
+        memcpy(&h->cache_obj->info, &from->cache_obj->info,
+                sizeof(cache_info));
+    }
+    h->req_hdrs = from->req_hdrs;
+    h->resp_hdrs = from->resp_hdrs;
+}
+
+/* Find the disk copy of an entity served from memory, to update it too */
+static int tiered_open_disk(cache_tiered_object_t *tobj, request_rec *r)
+{
+    if (tobj->in_disk || tobj->disk_tried || !tobj->disk) {
+        return tobj->in_disk;
+    }
+    tobj->disk_tried = 1;
+
+    if (tobj->disk->open_entity(&tobj->hdisk, r, tobj->key) == OK) {
+        if (tobj->disk->recall_headers(&tobj->hdisk, r) == APR_SUCCESS) {
+            tobj->in_disk = 1;
+        }
+        else {
+            tobj->disk->remove_entity(&tobj->hdisk);
+        }
+    }
+    return tobj->in_disk;
+}
+
+/*
+ * Copy an entity served from the disk tier to the memory tier. The
+ * memory provider stores what it finds in the request, so the cached
+ * headers are swapped in while it does.
+ */
+static void tiered_promote(cache_tiered_object_t *tobj,
+        apr_bucket_brigade *bb)
+{
+    request_rec *r = tobj->r;
+    apr_table_t *headers_in = r->headers_in;
+    apr_table_t *headers_out = r->headers_out;
+    apr_table_t *err_headers_out = r->err_headers_out;
+    int status = r->status;
+    apr_bucket_brigade *in, *out;
+    apr_bucket *e;
+    apr_off_t len;
+    apr_status_t rv;
+
+    tobj->promote = 0;
+
+    /* a HEAD response would only be good for HEAD requests */
+    if (r->header_only || !tobj->hdisk.cache_obj) {
+        return;
+    }
+    if (apr_brigade_length(bb, 1, &len) != APR_SUCCESS) {
+        return;
+    }
+    if (tobj->mem->create_entity(&tobj->hmem, r, tobj->key, len, NULL) != OK) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02879)
+                "cache_tiered: memory tier declined %s, not promoted",
+                tobj->key);
+        return;
+    }
+
+    r->headers_in = tobj->hdisk.req_hdrs;
+    r->headers_out = tobj->hdisk.resp_hdrs;
+    r->err_headers_out = apr_table_make(r->pool, 1);
+    r->status = tobj->hdisk.cache_obj->info.status;
+
+    rv = tobj->mem->store_headers(&tobj->hmem, r,
+            &tobj->hdisk.cache_obj->info);
+    if (rv == APR_SUCCESS) {
+        in = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+        out = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+
+        /* store copies, the buckets in bb are served to the client */
+        for (e = APR_BRIGADE_FIRST(bb);
+             e != APR_BRIGADE_SENTINEL(bb) && rv == APR_SUCCESS;
+             e = APR_BUCKET_NEXT(e)) {
+            apr_bucket *copy;
+
+            if (APR_BUCKET_IS_METADATA(e)) {
+                continue;
+            }
+            rv = apr_bucket_copy(e, &copy);
+            if (rv == APR_SUCCESS) {
+                APR_BRIGADE_INSERT_TAIL(in, copy);
+            }
+        }
+        APR_BRIGADE_INSERT_TAIL(in,
+                apr_bucket_eos_create(r->connection->bucket_alloc));
+
+        while (rv == APR_SUCCESS && !APR_BRIGADE_EMPTY(in)) {
+            rv = tobj->mem->store_body(&tobj->hmem, r, in, out);
+            if (rv == APR_SUCCESS && APR_BRIGADE_EMPTY(out)) {
+                /* no progress, don't spin */
+                rv = APR_EGENERAL;
+            }
+            apr_brigade_cleanup(out);
+        }
+        apr_brigade_cleanup(in);
+
+        if (rv == APR_SUCCESS) {
+            rv = tobj->mem->commit_entity(&tobj->hmem, r);
+        }
+    }
+
+    r->headers_in = headers_in;
+    r->headers_out = headers_out;
+    r->err_headers_out = err_headers_out;
+    r->status = status;
+
+    if (rv == APR_SUCCESS) {
+        tobj->in_mem = 1;
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02880)
+                "cache_tiered: promoted %s to the memory tier", tobj->key);
+    }
+    else {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, APLOGNO(02881)
+                "cache_tiered: could not promote %s to the memory tier",
+                tobj->key);
+        tobj->mem->remove_entity(&tobj->hmem);
+    }
+}
+
+static int create_entity(cache_handle_t *h, request_rec *r, const char *key,
+        apr_off_t len, apr_bucket_brigade *bb)
+{
+    cache_tiered_conf *conf = ap_get_module_config(r->server->module_config,
+            &cache_tiered_module);
+    cache_tiered_object_t *tobj;
+    cache_object_t *obj;
+
+    if (!conf->mem && !conf->disk) {
+        return DECLINED;
+    }
+
+    tobj = apr_pcalloc(r->pool, sizeof(*tobj));
+    tobj->r = r;
+    tobj->key = apr_pstrdup(r->pool, key);
+    tobj->mem = conf->mem;
+    tobj->disk = conf->disk;
+
+    /* the disk tier holds everything, the memory tier what it can't */
+    if (tobj->disk
+            && tobj->disk->create_entity(&tobj->hdisk, r, key, len, bb) == OK) {
+        tobj->in_disk = tobj->disk_tried = 1;
+    }
+    else if (tobj->mem
+            && tobj->mem->create_entity(&tobj->hmem, r, key, len, bb) == OK) {
+        tobj->in_mem = tobj->from_mem = 1;
+    }
+    else {
+        return DECLINED;
+    }
+
+    h->cache_obj = obj = apr_pcalloc(r->pool, sizeof(*obj));
+    obj->key = tobj->key;
+    obj->vobj = tobj;
+    h->req_hdrs = NULL;
+    h->resp_hdrs = NULL;
+
+    return OK;
+}
+
+static int open_entity(cache_handle_t *h, request_rec *r, const char *key)
+{
+    cache_tiered_conf *conf = ap_get_module_config(r->server->module_config,
+            &cache_tiered_module);
+    cache_tiered_object_t *tobj;
+    cache_object_t *obj;
+
+    h->cache_obj = NULL;
+
+    if (!conf->mem && !conf->disk) {
+        return DECLINED;
+    }
+
+    tobj = apr_pcalloc(r->pool, sizeof(*tobj));
+    tobj->r = r;
+    tobj->key = apr_pstrdup(r->pool, key);
+    tobj->mem = conf->mem;
+    tobj->disk = conf->disk;
+
+    if (tobj->mem && tobj->mem->open_entity(&tobj->hmem, r, key) == OK) {
+        tobj->in_mem = tobj->from_mem = 1;
+    }
+    else if (tobj->disk
+            && tobj->disk->open_entity(&tobj->hdisk, r, key) == OK) {
+        tobj->in_disk = tobj->disk_tried = 1;
+        tobj->promote = tobj->mem && tiered_hit(conf, key);
+    }
+    else {
+        return DECLINED;
+    }
+
+    h->cache_obj = obj = apr_pcalloc(r->pool, sizeof(*obj));
+    obj->key = tobj->key;
+    obj->vobj = tobj;
+    tiered_sync(h);
+
+    return OK;
+}
+
+static int remove_entity(cache_handle_t *h)
+{
+    cache_tiered_object_t *tobj = (cache_tiered_object_t *) h->cache_obj->vobj;
+
+    if (tobj->in_mem) {
+        tobj->mem->remove_entity(&tobj->hmem);
+    }
+    if (tobj->in_disk) {
+        tobj->disk->remove_entity(&tobj->hdisk);
+    }
+
+    /* Null out the cache object pointer so next time we start from scratch  */
+    h->cache_obj = NULL;
+    return OK;
+}
+
+static int remove_url(cache_handle_t *h, request_rec *r)
+{
+    cache_tiered_object_t *tobj = (cache_tiered_object_t *) h->cache_obj->vobj;
+
+    if (tobj->in_mem) {
+        tobj->mem->remove_url(&tobj->hmem, r);
+    }
+    if (tiered_open_disk(tobj, r)) {
+        tobj->disk->remove_url(&tobj->hdisk, r);
+    }
+
+    return OK;
+}
+
+static apr_status_t recall_headers(cache_handle_t *h, request_rec *r)
+{
+    cache_tiered_object_t *tobj = (cache_tiered_object_t *) h->cache_obj->vobj;
+    apr_status_t rv;
+
+    if (tobj->from_mem) {
+        rv = tobj->mem->recall_headers(&tobj->hmem, r);
+    }
+    else {
+        rv = tobj->disk->recall_headers(&tobj->hdisk, r);
+    }
+    if (rv == APR_SUCCESS) {
+        tiered_sync(h);
+    }
+    return rv;
+}
+
+static apr_status_t recall_body(cache_handle_t *h, apr_pool_t *p,
+        apr_bucket_brigade *bb)
+{
+    cache_tiered_object_t *tobj = (cache_tiered_object_t *) h->cache_obj->vobj;
+    apr_status_t rv;
+
+    if (tobj->from_mem) {
+        return tobj->mem->recall_body(&tobj->hmem, p, bb);
+    }
+
+    rv = tobj->disk->recall_body(&tobj->hdisk, p, bb);
+    if (rv == APR_SUCCESS && tobj->promote) {
+        tiered_promote(tobj, bb);
+    }
+    return rv;
+}
+
+static apr_status_t store_headers(cache_handle_t *h, request_rec *r,
+        cache_info *info)
+{
+    cache_tiered_object_t *tobj = (cache_tiered_object_t *) h->cache_obj->vobj;
+    apr_status_t rv = APR_EGENERAL;
+
+    /* updating an entity served from memory, update the disk copy too */
+    if (tobj->in_mem) {
+        tiered_open_disk(tobj, r);
+    }
+
+    if (tobj->in_disk) {
+        rv = tobj->disk->store_headers(&tobj->hdisk, r, info);
+        if (rv != APR_SUCCESS) {
+            tobj->in_disk = 0;
+        }
+    }
+    if (tobj->in_mem) {
+        apr_status_t mrv = tobj->mem->store_headers(&tobj->hmem, r, info);
+        if (mrv != APR_SUCCESS) {
+            /* don't leave a copy with a stale freshness record behind */
+            tobj->mem->remove_url(&tobj->hmem, r);
+            tobj->in_mem = 0;
+        }
+        else if (!tobj->in_disk) {
+            rv = mrv;
+        }
+    }
+
+    memcpy(&h->cache_obj->info, info, sizeof(cache_info));
+
+    return (tobj->in_disk || tobj->in_mem) ? APR_SUCCESS : rv;
+}
+
+static apr_status_t store_body(cache_handle_t *h, request_rec *r,
+        apr_bucket_brigade *in, apr_bucket_brigade *out)
+{
+    cache_tiered_object_t *tobj = (cache_tiered_object_t *) h->cache_obj->vobj;
+
+    /* a new body goes to one tier only, drop any other copy */
+    if (tobj->in_disk) {
+        if (tobj->in_mem) {
+            tobj->mem->remove_url(&tobj->hmem, r);
+            tobj->in_mem = 0;
+        }
+        return tobj->disk->store_body(&tobj->hdisk, r, in, out);
+    }
+    if (tobj->in_mem) {
+        return tobj->mem->store_body(&tobj->hmem, r, in, out);
+    }
+    return APR_EGENERAL;
+}
+
+static apr_status_t commit_entity(cache_handle_t *h, request_rec *r)
+{
+    cache_tiered_object_t *tobj = (cache_tiered_object_t *) h->cache_obj->vobj;
+    apr_status_t rv = APR_EGENERAL;
+
+    if (tobj->in_mem) {
+        rv = tobj->mem->commit_entity(&tobj->hmem, r);
+        if (rv != APR_SUCCESS) {
+            tobj->in_mem = 0;
+        }
+    }
+    if (tobj->in_disk) {
+        rv = tobj->disk->commit_entity(&tobj->hdisk, r);
+    }
+
+    return rv;
+}
+
+static apr_status_t invalidate_entity(cache_handle_t *h, request_rec *r)
+{
+    cache_tiered_object_t *tobj = (cache_tiered_object_t *) h->cache_obj->vobj;
+    apr_status_t rv = APR_EGENERAL;
+
+    /* mark the entity as invalidated */
+    h->cache_obj->info.control.invalidated = 1;
+
+    if (tobj->in_mem) {
+        rv = tobj->mem->invalidate_entity(&tobj->hmem, r);
+    }
+    if (tiered_open_disk(tobj, r)) {
+        rv = tobj->disk->invalidate_entity(&tobj->hdisk, r);
+    }
+
+    return rv;
+}
+
+static void *create_config(apr_pool_t *p, server_rec *s)
+{
+    cache_tiered_conf *conf = apr_pcalloc(p, sizeof(cache_tiered_conf));
+
+    conf->mem_name = DEFAULT_MEMORY_PROVIDER;
+    conf->disk_name = DEFAULT_DISK_PROVIDER;
+    conf->promote_hits = DEFAULT_PROMOTE_HITS;
+
+    return conf;
+}
+
+static void *merge_config(apr_pool_t *p, void *basev, void *overridesv)
+{
+    cache_tiered_conf *ps = apr_pcalloc(p, sizeof(cache_tiered_conf));
+    cache_tiered_conf *base = (cache_tiered_conf *) basev;
+    cache_tiered_conf *overrides = (cache_tiered_conf *) overridesv;
+
+    ps->mem_name = (overrides->mem_name_set == 0) ? base->mem_name
+            : overrides->mem_name;
+    ps->mem_name_set = overrides->mem_name_set || base->mem_name_set;
+    ps->disk_name = (overrides->disk_name_set == 0) ? base->disk_name
+            : overrides->disk_name;
+    ps->disk_name_set = overrides->disk_name_set || base->disk_name_set;
+    ps->promote_hits = (overrides->promote_hits_set == 0) ? base->promote_hits
+            : overrides->promote_hits;
+    ps->promote_hits_set = overrides->promote_hits_set
+            || base->promote_hits_set;
+
+    return ps;
+}
+
+/*
+ * mod_cache_tiered configuration directives handlers.
+ */
+static const char *set_cache_tier(cmd_parms *cmd, void *in_struct_ptr,
+        const char *arg)
+{
+    cache_tiered_conf *conf = ap_get_module_config(cmd->server->module_config,
+            &cache_tiered_module);
+
+    if (!strcasecmp(arg, "tiered")) {
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                " cannot be the tiered provider itself", NULL);
+    }
+    if (!strcasecmp(arg, "none")) {
+        arg = NULL;
+    }
+
+    if (cmd->info) {
+        conf->disk_name = arg;
+        conf->disk_name_set = 1;
+    }
+    else {
+        conf->mem_name = arg;
+        conf->mem_name_set = 1;
+    }
+    return NULL;
+}
+
+static const char *set_cache_promote_hits(cmd_parms *cmd, void *in_struct_ptr,
+        const char *arg)
+{
+    cache_tiered_conf *conf = ap_get_module_config(cmd->server->module_config,
+            &cache_tiered_module);
+
+    conf->promote_hits = atoi(arg);
+    if (conf->promote_hits < 1) {
+        return "CacheTieredPromoteHits must be a positive integer";
+    }
+    conf->promote_hits_set = 1;
+    return NULL;
+}
+
+static int tiered_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptmp, server_rec *base_server)
+{
+    server_rec *s;
+
+    for (s = base_server; s; s = s->next) {
+        cache_tiered_conf *conf =
+                ap_get_module_config(s->module_config, &cache_tiered_module);
+
+        conf->mem = NULL;
+        if (conf->mem_name) {
+            conf->mem = ap_lookup_provider(CACHE_PROVIDER_GROUP,
+                    conf->mem_name, "0");
+            if (!conf->mem) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(02882)
+                        "cache_tiered: memory tier provider '%s' not found, "
+                        "maybe you need to load mod_cache_%s",
+                        conf->mem_name, conf->mem_name);
+            }
+        }
+        conf->disk = NULL;
+        if (conf->disk_name) {
+            conf->disk = ap_lookup_provider(CACHE_PROVIDER_GROUP,
+                    conf->disk_name, "0");
+            if (!conf->disk) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(02883)
+                        "cache_tiered: disk tier provider '%s' not found, "
+                        "maybe you need to load mod_cache_%s",
+                        conf->disk_name, conf->disk_name);
+            }
+        }
+    }
+
+    return OK;
+}
+
+static void tiered_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_pool_create(&hits_pool, p);
+    apr_pool_tag(hits_pool, "cache_tiered_hits");
+    hits = apr_hash_make(hits_pool);
+
+#if APR_HAS_THREADS
+    {
+        int threaded = 0;
+        ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded);
+        if (threaded != AP_MPMQ_NOT_SUPPORTED) {
+            apr_status_t rv = apr_thread_mutex_create(&hits_mutex,
+                    APR_THREAD_MUTEX_DEFAULT, p);
+            if (rv != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02884)
+                        "cache_tiered: could not create the hits mutex, "
+                        "entities won't be promoted");
+                hits = NULL;
+            }
+        }
+    }
+#endif
+}
+
+static const command_rec cache_tiered_cmds[] =
+{
+    AP_INIT_TAKE1("CacheTieredMemory", set_cache_tier, NULL, RSRC_CONF,
+            "The cache provider of the memory tier, 'none' to disable. "
+            "Defaults to '" DEFAULT_MEMORY_PROVIDER "'"),
+    AP_INIT_TAKE1("CacheTieredDisk", set_cache_tier, (void *)1, RSRC_CONF,
+            "The cache provider of the disk tier, 'none' to disable. "
+            "Defaults to '" DEFAULT_DISK_PROVIDER "'"),
+    AP_INIT_TAKE1("CacheTieredPromoteHits", set_cache_promote_hits, NULL,
+            RSRC_CONF,
+            "The number of hits in the disk tier after which an entity is "
+            "promoted to the memory tier"),
+    { NULL }
+};
+
+static const cache_provider cache_tiered_provider =
+{
+    &remove_entity, &store_headers, &store_body, &recall_headers, &recall_body,
+    &create_entity, &open_entity, &remove_url, &commit_entity,
+    &invalidate_entity
+};
+
+static void cache_tiered_register_hook(apr_pool_t *p)
+{
+    /* cache initializer */
+    ap_register_provider(p, CACHE_PROVIDER_GROUP, "tiered", "0",
+            &cache_tiered_provider);
+    ap_hook_post_config(tiered_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(tiered_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+}
+
+AP_DECLARE_MODULE(cache_tiered) = { STANDARD20_MODULE_STUFF,
+    NULL, /* create per-directory config structure */
+    NULL, /* merge per-directory config structures */
+    create_config, /* create per-server config structure */
+    merge_config, /* merge per-server config structures */
+    cache_tiered_cmds, /* command apr_table_t */
+    cache_tiered_register_hook /* register hooks */
+};
@@ -20,6 +20,7 @@
 #include "http_protocol.h"
 #include "http_config.h"
 #include "mod_status.h"
+#include "util_mutex.h"
 
 #include "apr.h"
 #include "apr_strings.h"
@@ -44,6 +45,13 @@
 
 #define DEFAULT_SHMCB_SUFFIX ".cache"
 
+#define SHMCB_MUTEX_TYPE "socache-shmcb"
+
+/* Maximum number of locks per cache, each protecting the subcaches whose
+ * number modulo the number of locks is the lock's.
+ */
+#define SHMCB_MAX_LOCKS 16
+
 #define ALIGNED_HEADER_SIZE APR_ALIGN_DEFAULT(sizeof(SHMCBHeader))
 #define ALIGNED_SUBCACHE_SIZE APR_ALIGN_DEFAULT(sizeof(SHMCBSubcache))
 #define ALIGNED_INDEX_SIZE APR_ALIGN_DEFAULT(sizeof(SHMCBIndex))
@@ -52,15 +60,6 @@
  * Header structure - the start of the shared-mem segment
  */
 typedef struct {
-    /* Stats for cache operations */
-    unsigned long stat_stores;
-    unsigned long stat_replaced;
-    unsigned long stat_expiries;
-    unsigned long stat_scrolled;
-    unsigned long stat_retrieves_hit;
-    unsigned long stat_retrieves_miss;
-    unsigned long stat_removes_hit;
-    unsigned long stat_removes_miss;
     /* Number of subcaches */
     unsigned int subcache_num;
     /* How many indexes each subcache's queue has */
@@ -82,6 +81,16 @@ typedef struct {
     unsigned int idx_pos, idx_used;
     /* Same for the data area */
     unsigned int data_pos, data_used;
+    /* Stats for cache operations, kept per subcache so that they are
+     * updated under the subcache's lock */
+    unsigned long stat_stores;
+    unsigned long stat_replaced;
+    unsigned long stat_expiries;
+    unsigned long stat_scrolled;
+    unsigned long stat_retrieves_hit;
+    unsigned long stat_retrieves_miss;
+    unsigned long stat_removes_hit;
+    unsigned long stat_removes_miss;
 } SHMCBSubcache;
 
 /*
@@ -98,6 +107,12 @@ typedef struct {
     unsigned int id_len;
     /* Used to mark explicitly-removed socache entries */
     unsigned char removed;
+    /* number of retrieve_ref() pins held, and when the first was taken */
+    unsigned int pinned;
+    apr_time_t pinned_at;
+    /* changed whenever the pins held so far are invalidated, so that a
+     * late release can't unpin the entry (or its successor) again */
+    unsigned int pin_gen;
 } SHMCBIndex;
 
 struct ap_socache_instance_t {
@@ -105,8 +120,27 @@ struct ap_socache_instance_t {
     apr_size_t shm_size;
     apr_shm_t *shm;
     SHMCBHeader *header;
+    /* Locks of the subcaches, see SHMCB_LOCK() */
+    apr_global_mutex_t **locks;
+    unsigned int lock_num;
 };
 
+struct ap_socache_pin_t {
+    SHMCBSubcache *subcache;
+    SHMCBIndex *idx;
+    unsigned int data_pos;
+    unsigned int pin_gen;
+};
+
+/* The data of a pinned entry is not reclaimed, unless the first pin is
+ * older than this, so that a child dying with pins held can't block a
+ * subcache for good.
+ */
+#define SHMCB_PIN_TIMEOUT apr_time_from_sec(300)
+
+#define SHMCB_PINNED(pIdx, now) \
+                ((pIdx)->pinned && (pIdx)->pinned_at + SHMCB_PIN_TIMEOUT > (now))
+
 /* The SHM data segment is of fixed size and stores data as follows.
  *
  *   [ SHMCBHeader | Subcaches ]
@@ -147,6 +181,12 @@ struct ap_socache_instance_t {
  * idx1 = { data_pos = 0, data_used = 3, id_len = 1, ...}
  * idx2 = { data_pos = 3, data_used = 3, id_len = 1, ...}
  * ...
+ *
+ * Data is only ever reclaimed from the beginning of the cyclic buffer,
+ * by moving subcache->data_pos past the oldest entries; an entry pinned
+ * by retrieve_ref() stops this until it is released, so that the data
+ * can be used in place meanwhile.  A store which needs room while the
+ * oldest entry is pinned drops the newest entries instead.
  */
 
 /* This macro takes a pointer to the header and a zero-based index and returns
@@ -161,8 +201,16 @@ struct ap_socache_instance_t {
 #define SHMCB_MASK(pHeader, id) \
                 SHMCB_SUBCACHE((pHeader), *(id) & ((pHeader)->subcache_num - 1))
 
-/* This macro takes the same params as the last, generating two outputs for use
- * in ap_log_error(...). */
+/* This macro takes a pointer to the instance and a subcache and returns
+ * the lock protecting the subcache. */
+#define SHMCB_LOCK(pCtx, pSubcache) \
+                (pCtx)->locks[(((unsigned char *)(pSubcache) - \
+                        (unsigned char *)(pCtx)->header - \
+                        ALIGNED_HEADER_SIZE) / \
+                        (pCtx)->header->subcache_size) % (pCtx)->lock_num]
+
+/* This macro takes the same params as SHMCB_MASK, generating two outputs
+ * for use in ap_log_error(...). */
 #define SHMCB_MASK_DBG(pHeader, id) \
                 *(id), (*(id) & ((pHeader)->subcache_num - 1))
 
@@ -257,6 +305,11 @@ static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
                                 unsigned char *data, unsigned int data_len,
                                 const unsigned char *id, unsigned int id_len,
                                 apr_time_t expiry);
+/* Returns the index of the entry, NULL if not found. */
+static SHMCBIndex *shmcb_subcache_find(server_rec *, SHMCBHeader *,
+                                       SHMCBSubcache *,
+                                       const unsigned char *id,
+                                       unsigned int idlen);
 /* Returns zero on success, non-zero on failure. */
 static int shmcb_subcache_retrieve(server_rec *, SHMCBHeader *, SHMCBSubcache *,
                                    const unsigned char *id, unsigned int idlen,
@@ -277,9 +330,36 @@ static apr_status_t shmcb_subcache_iterate(ap_socache_instance_t *instance,
                                            apr_pool_t *pool,
                                            apr_time_t now);
 
+/* The instances initialised in this generation, for child_init */
+static apr_array_header_t *shmcb_instances = NULL;
+
+static apr_status_t shmcb_lock(ap_socache_instance_t *ctx, server_rec *s,
+                               SHMCBSubcache *subcache)
+{
+    apr_status_t rv = apr_global_mutex_lock(SHMCB_LOCK(ctx, subcache));
+
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02904)
+                     "could not acquire %s lock", SHMCB_MUTEX_TYPE);
+    }
+    return rv;
+}
+
+static void shmcb_unlock(ap_socache_instance_t *ctx, server_rec *s,
+                         SHMCBSubcache *subcache)
+{
+    apr_status_t rv = apr_global_mutex_unlock(SHMCB_LOCK(ctx, subcache));
+
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02905)
+                     "could not release %s lock", SHMCB_MUTEX_TYPE);
+    }
+}
+
 /*
  * High-Level "handlers" as per ssl_scache.c
- * subcache internals are deferred to shmcb_subcache_*** functions lower down
+ * subcache internals are deferred to shmcb_subcache_*** functions lower down,
+ * which are called with the subcache's lock held
  */
 
 static const char *socache_shmcb_create(ap_socache_instance_t **context,
@@ -419,14 +499,6 @@ static apr_status_t socache_shmcb_init(ap_socache_instance_t *ctx,
     }
     /* OK, we're sorted */
     ctx->header = header = shm_segment;
-    header->stat_stores = 0;
-    header->stat_replaced = 0;
-    header->stat_expiries = 0;
-    header->stat_scrolled = 0;
-    header->stat_retrieves_hit = 0;
-    header->stat_retrieves_miss = 0;
-    header->stat_removes_hit = 0;
-    header->stat_removes_miss = 0;
     header->subcache_num = num_subcache;
     /* Convert the subcache size (in bytes) to a value that is suitable for
      * structure alignment on the host platform, by rounding down if necessary. */
@@ -457,9 +529,28 @@ static apr_status_t socache_shmcb_init(ap_socache_instance_t *ctx,
     /* The header is done, make the caches empty */
     for (loop = 0; loop < header->subcache_num; loop++) {
         SHMCBSubcache *subcache = SHMCB_SUBCACHE(header, loop);
-        subcache->idx_pos = subcache->idx_used = 0;
-        subcache->data_pos = subcache->data_used = 0;
+        memset(subcache, 0, sizeof(*subcache));
+    }
+
+    /* Create the locks, the subcaches being spread over them */
+    ctx->lock_num = header->subcache_num < SHMCB_MAX_LOCKS
+                    ? header->subcache_num : SHMCB_MAX_LOCKS;
+    ctx->locks = apr_pcalloc(p, ctx->lock_num * sizeof(*ctx->locks));
+    for (loop = 0; loop < ctx->lock_num; loop++) {
+        rv = ap_global_mutex_create(&ctx->locks[loop], NULL,
+                                    SHMCB_MUTEX_TYPE,
+                                    apr_psprintf(p, "%d-%u",
+                                                 shmcb_instances->nelts,
+                                                 loop),
+                                    s, p, 0);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02903)
+                         "could not create %s mutex", SHMCB_MUTEX_TYPE);
+            return rv;
+        }
     }
+    APR_ARRAY_PUSH(shmcb_instances, ap_socache_instance_t *) = ctx;
+
     ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(00830)
                  "Shared memory socache initialised");
     /* Success ... */
@@ -485,6 +576,7 @@ static apr_status_t socache_shmcb_store(ap_socache_instance_t *ctx,
     SHMCBHeader *header = ctx->header;
     SHMCBSubcache *subcache = SHMCB_MASK(header, id);
     int tryreplace;
+    apr_status_t rv;
 
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00831)
                  "socache_shmcb_store (0x%02x -> subcache %d)",
@@ -495,19 +587,24 @@ static apr_status_t socache_shmcb_store(ap_socache_instance_t *ctx,
                 "(%u bytes)", idlen);
         return APR_EINVAL;
     }
+    if ((rv = shmcb_lock(ctx, s, subcache)) != APR_SUCCESS) {
+        return rv;
+    }
     tryreplace = shmcb_subcache_remove(s, header, subcache, id, idlen);
     if (shmcb_subcache_store(s, header, subcache, encoded,
                              len_encoded, id, idlen, expiry)) {
+        shmcb_unlock(ctx, s, subcache);
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(00833)
                      "can't store an socache entry!");
         return APR_ENOSPC;
     }
     if (tryreplace == 0) {
-        header->stat_replaced++;
+        subcache->stat_replaced++;
     }
     else {
-        header->stat_stores++;
+        subcache->stat_stores++;
     }
+    shmcb_unlock(ctx, s, subcache);
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00834)
                  "leaving socache_shmcb_store successfully");
     return APR_SUCCESS;
@@ -521,25 +618,112 @@ static apr_status_t socache_shmcb_retrieve(ap_socache_instance_t *ctx,
 {
     SHMCBHeader *header = ctx->header;
     SHMCBSubcache *subcache = SHMCB_MASK(header, id);
+    apr_status_t status;
     int rv;
 
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00835)
                  "socache_shmcb_retrieve (0x%02x -> subcache %d)",
                  SHMCB_MASK_DBG(header, id));
 
+    if ((status = shmcb_lock(ctx, s, subcache)) != APR_SUCCESS) {
+        return status;
+    }
     /* Get the entry corresponding to the id, if it exists. */
     rv = shmcb_subcache_retrieve(s, header, subcache, id, idlen,
                                  dest, destlen);
     if (rv == 0)
-        header->stat_retrieves_hit++;
+        subcache->stat_retrieves_hit++;
     else
-        header->stat_retrieves_miss++;
+        subcache->stat_retrieves_miss++;
+    shmcb_unlock(ctx, s, subcache);
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00836)
                  "leaving socache_shmcb_retrieve successfully");
 
     return rv == 0 ? APR_SUCCESS : APR_NOTFOUND;
 }
 
+static apr_status_t socache_shmcb_retrieve_ref(ap_socache_instance_t *ctx,
+                                               server_rec *s,
+                                               const unsigned char *id,
+                                               unsigned int idlen,
+                                               const unsigned char **data,
+                                               unsigned int *datalen,
+                                               ap_socache_pin_t **pin,
+                                               apr_pool_t *p)
+{
+    SHMCBHeader *header = ctx->header;
+    SHMCBSubcache *subcache = SHMCB_MASK(header, id);
+    SHMCBIndex *idx;
+    unsigned int data_offset;
+    apr_status_t rv;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(02899)
+                 "socache_shmcb_retrieve_ref (0x%02x -> subcache %d)",
+                 SHMCB_MASK_DBG(header, id));
+
+    if ((rv = shmcb_lock(ctx, s, subcache)) != APR_SUCCESS) {
+        return rv;
+    }
+    idx = shmcb_subcache_find(s, header, subcache, id, idlen);
+    if (!idx) {
+        subcache->stat_retrieves_miss++;
+        shmcb_unlock(ctx, s, subcache);
+        return APR_NOTFOUND;
+    }
+
+    /* Find the offset of the data segment, after the id */
+    data_offset = SHMCB_CYCLIC_INCREMENT(idx->data_pos, idx->id_len,
+                                         header->subcache_data_size);
+
+    /* The data wraps around the end of the cyclic buffer, it has to be
+     * copied out with retrieve().
+     */
+    if (data_offset + (idx->data_used - idx->id_len)
+            > header->subcache_data_size) {
+        shmcb_unlock(ctx, s, subcache);
+        return APR_ENOTIMPL;
+    }
+
+    subcache->stat_retrieves_hit++;
+
+    if (idx->pinned && !SHMCB_PINNED(idx, apr_time_now())) {
+        /* Pins left over by a dead child, forget them */
+        idx->pinned = 0;
+        idx->pin_gen++;
+    }
+    if (!idx->pinned++) {
+        idx->pinned_at = apr_time_now();
+    }
+
+    *pin = apr_palloc(p, sizeof(**pin));
+    (*pin)->subcache = subcache;
+    (*pin)->idx = idx;
+    (*pin)->data_pos = idx->data_pos;
+    (*pin)->pin_gen = idx->pin_gen;
+
+    *data = SHMCB_DATA(header, subcache) + data_offset;
+    *datalen = idx->data_used - idx->id_len;
+
+    shmcb_unlock(ctx, s, subcache);
+
+    return APR_SUCCESS;
+}
+
+static void socache_shmcb_release(ap_socache_instance_t *ctx, server_rec *s,
+                                  ap_socache_pin_t *pin)
+{
+    if (shmcb_lock(ctx, s, pin->subcache) != APR_SUCCESS) {
+        return;
+    }
+    /* The pin may have timed out, and the index been reused since */
+    if (pin->idx->pinned
+        && pin->idx->pin_gen == pin->pin_gen
+        && pin->idx->data_pos == pin->data_pos) {
+        pin->idx->pinned--;
+    }
+    shmcb_unlock(ctx, s, pin->subcache);
+}
+
 static apr_status_t socache_shmcb_remove(ap_socache_instance_t *ctx,
                                          server_rec *s, const unsigned char *id,
                                          unsigned int idlen, apr_pool_t *p)
@@ -556,13 +740,17 @@ static apr_status_t socache_shmcb_remove(ap_socache_instance_t *ctx,
                 "(%u bytes)", idlen);
         return APR_EINVAL;
     }
+    if ((rv = shmcb_lock(ctx, s, subcache)) != APR_SUCCESS) {
+        return rv;
+    }
     if (shmcb_subcache_remove(s, header, subcache, id, idlen) == 0) {
-        header->stat_removes_hit++;
+        subcache->stat_removes_hit++;
         rv = APR_SUCCESS;
     } else {
-        header->stat_removes_miss++;
+        subcache->stat_removes_miss++;
         rv = APR_NOTFOUND;
     }
+    shmcb_unlock(ctx, s, subcache);
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00839)
                  "leaving socache_shmcb_remove successfully");
 
@@ -579,16 +767,29 @@ static void socache_shmcb_status(ap_socache_instance_t *ctx,
     apr_time_t now = apr_time_now();
     double expiry_total = 0;
     int index_pct, cache_pct;
+    SHMCBSubcache totals;
 
     AP_DEBUG_ASSERT(header->subcache_num > 0);
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(00840) "inside shmcb_status");
-    /* Perform the iteration inside the mutex to avoid corruption or invalid
-     * pointer arithmetic. The rest of our logic uses read-only header data so
-     * doesn't need the lock. */
+    memset(&totals, 0, sizeof(totals));
+    /* Perform the iteration of each subcache inside its lock to avoid
+     * corruption or invalid pointer arithmetic. The rest of our logic uses
+     * read-only header data so doesn't need the lock. */
     /* Iterate over the subcaches */
     for (loop = 0; loop < header->subcache_num; loop++) {
         SHMCBSubcache *subcache = SHMCB_SUBCACHE(header, loop);
+        if (shmcb_lock(ctx, s, subcache) != APR_SUCCESS) {
+            continue;
+        }
         shmcb_subcache_expire(s, header, subcache, now);
+        totals.stat_stores += subcache->stat_stores;
+        totals.stat_replaced += subcache->stat_replaced;
+        totals.stat_expiries += subcache->stat_expiries;
+        totals.stat_scrolled += subcache->stat_scrolled;
+        totals.stat_retrieves_hit += subcache->stat_retrieves_hit;
+        totals.stat_retrieves_miss += subcache->stat_retrieves_miss;
+        totals.stat_removes_hit += subcache->stat_removes_hit;
+        totals.stat_removes_miss += subcache->stat_removes_miss;
         total += subcache->idx_used;
         cache_total += subcache->data_used;
         if (subcache->idx_used) {
@@ -602,6 +803,7 @@ static void socache_shmcb_status(ap_socache_instance_t *ctx,
             else
                 min_expiry = ((idx_expiry < min_expiry) ? idx_expiry : min_expiry);
         }
+        shmcb_unlock(ctx, s, subcache);
     }
     index_pct = (100 * total) / (header->index_num *
                                  header->subcache_num);
@@ -629,19 +831,19 @@ static void socache_shmcb_status(ap_socache_instance_t *ctx,
         ap_rprintf(r, "index usage: <b>%d%%</b>, cache usage: <b>%d%%</b><br>",
                    index_pct, cache_pct);
         ap_rprintf(r, "total entries stored since starting: <b>%lu</b><br>",
-                   header->stat_stores);
+                   totals.stat_stores);
         ap_rprintf(r, "total entries replaced since starting: <b>%lu</b><br>",
-                   header->stat_replaced);
+                   totals.stat_replaced);
         ap_rprintf(r, "total entries expired since starting: <b>%lu</b><br>",
-                   header->stat_expiries);
+                   totals.stat_expiries);
         ap_rprintf(r, "total (pre-expiry) entries scrolled out of the cache: "
-                   "<b>%lu</b><br>", header->stat_scrolled);
+                   "<b>%lu</b><br>", totals.stat_scrolled);
         ap_rprintf(r, "total retrieves since starting: <b>%lu</b> hit, "
-                   "<b>%lu</b> miss<br>", header->stat_retrieves_hit,
-                   header->stat_retrieves_miss);
+                   "<b>%lu</b> miss<br>", totals.stat_retrieves_hit,
+                   totals.stat_retrieves_miss);
         ap_rprintf(r, "total removes since starting: <b>%lu</b> hit, "
-                   "<b>%lu</b> miss<br>", header->stat_removes_hit,
-                   header->stat_removes_miss);
+                   "<b>%lu</b> miss<br>", totals.stat_removes_hit,
+                   totals.stat_removes_miss);
     }
     else {
         ap_rputs("CacheType: SHMCB\n", r);
@@ -661,14 +863,14 @@ static void socache_shmcb_status(ap_socache_instance_t *ctx,
 
         ap_rprintf(r, "CacheIndexUsage: %d%%\n", index_pct);
         ap_rprintf(r, "CacheUsage: %d%%\n", cache_pct);
-        ap_rprintf(r, "CacheStoreCount: %lu\n", header->stat_stores);
-        ap_rprintf(r, "CacheReplaceCount: %lu\n", header->stat_replaced);
-        ap_rprintf(r, "CacheExpireCount: %lu\n", header->stat_expiries);
-        ap_rprintf(r, "CacheDiscardCount: %lu\n", header->stat_scrolled);
-        ap_rprintf(r, "CacheRetrieveHitCount: %lu\n", header->stat_retrieves_hit);
-        ap_rprintf(r, "CacheRetrieveMissCount: %lu\n", header->stat_retrieves_miss);
-        ap_rprintf(r, "CacheRemoveHitCount: %lu\n", header->stat_removes_hit);
-        ap_rprintf(r, "CacheRemoveMissCount: %lu\n", header->stat_removes_miss);
+        ap_rprintf(r, "CacheStoreCount: %lu\n", totals.stat_stores);
+        ap_rprintf(r, "CacheReplaceCount: %lu\n", totals.stat_replaced);
+        ap_rprintf(r, "CacheExpireCount: %lu\n", totals.stat_expiries);
+        ap_rprintf(r, "CacheDiscardCount: %lu\n", totals.stat_scrolled);
+        ap_rprintf(r, "CacheRetrieveHitCount: %lu\n", totals.stat_retrieves_hit);
+        ap_rprintf(r, "CacheRetrieveMissCount: %lu\n", totals.stat_retrieves_miss);
+        ap_rprintf(r, "CacheRemoveHitCount: %lu\n", totals.stat_removes_hit);
+        ap_rprintf(r, "CacheRemoveMissCount: %lu\n", totals.stat_removes_miss);
     }
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(00841) "leaving shmcb_status");
 }
@@ -685,14 +887,19 @@ static apr_status_t socache_shmcb_iterate(ap_socache_instance_t *instance,
     apr_size_t buflen = 0;
     unsigned char *buf = NULL;
 
-    /* Perform the iteration inside the mutex to avoid corruption or invalid
-     * pointer arithmetic. The rest of our logic uses read-only header data so
-     * doesn't need the lock. */
+    /* Perform the iteration of each subcache inside its lock to avoid
+     * corruption or invalid pointer arithmetic. The rest of our logic uses
+     * read-only header data so doesn't need the lock. The iterator is thus
+     * called with the lock held, and must not use the cache itself. */
     /* Iterate over the subcaches */
     for (loop = 0; loop < header->subcache_num && rv == APR_SUCCESS; loop++) {
         SHMCBSubcache *subcache = SHMCB_SUBCACHE(header, loop);
+        if ((rv = shmcb_lock(instance, s, subcache)) != APR_SUCCESS) {
+            break;
+        }
         rv = shmcb_subcache_iterate(instance, s, userctx, header, subcache,
                                     iterator, &buf, &buflen, pool, now);
+        shmcb_unlock(instance, s, subcache);
     }
     return rv;
 }
@@ -710,7 +917,10 @@ static void shmcb_subcache_expire(server_rec *s, SHMCBHeader *header,
 
     while (loop < subcache->idx_used) {
         idx = SHMCB_INDEX(subcache, new_idx_pos);
-        if (idx->removed)
+        if (SHMCB_PINNED(idx, now))
+            /* in use, neither it nor anything after can be reclaimed */
+            break;
+        else if (idx->removed)
             freed++;
         else if (idx->expires <= now)
             expired++;
@@ -742,11 +952,48 @@ static void shmcb_subcache_expire(server_rec *s, SHMCBHeader *header,
         subcache->data_used -= diff;
         subcache->data_pos = idx->data_pos;
     }
-    header->stat_expiries += expired;
+    subcache->stat_expiries += expired;
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00843)
                  "we now have %u socache entries", subcache->idx_used);
 }
 
+/* Make room for total_len bytes (and an index) by dropping the newest
+ * entries, used when the oldest one can't be reclaimed because it is
+ * pinned.  Returns non-zero if a pinned entry is in the way.
+ */
+static int shmcb_subcache_drop_newest(server_rec *s, SHMCBHeader *header,
+                                      SHMCBSubcache *subcache,
+                                      unsigned int total_len, apr_time_t now)
+{
+    unsigned int dropped = 0;
+
+    while (header->subcache_data_size - subcache->data_used < total_len
+           || subcache->idx_used == header->index_num) {
+        SHMCBIndex *idx = SHMCB_INDEX(subcache,
+                                      SHMCB_CYCLIC_INCREMENT(subcache->idx_pos,
+                                                    subcache->idx_used - 1,
+                                                    header->index_num));
+        /* The oldest entry is pinned, so there is at least that one */
+        if (subcache->idx_used == 1 || SHMCB_PINNED(idx, now)) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(02900)
+                         "entries in use, can't make room in "
+                         "subcache: idx_used=%d, data_used=%d",
+                         subcache->idx_used, subcache->data_used);
+            return -1;
+        }
+        subcache->data_used = SHMCB_CYCLIC_SPACE(subcache->data_pos,
+                                                 idx->data_pos,
+                                                 header->subcache_data_size);
+        subcache->idx_used--;
+        subcache->stat_scrolled++;
+        dropped++;
+    }
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(02945)
+                 "oldest entry in use, dropped the %u newest entries",
+                 dropped);
+    return 0;
+}
+
 static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
                                 SHMCBSubcache *subcache,
                                 unsigned char *data, unsigned int data_len,
@@ -756,6 +1003,7 @@ static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
     unsigned int data_offset, new_idx, id_offset;
     SHMCBIndex *idx;
     unsigned int total_len = id_len + data_len;
+    apr_time_t now = apr_time_now();
 
     /* Sanity check the input */
     if (total_len > header->subcache_data_size) {
@@ -766,7 +1014,7 @@ static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
     }
 
     /* First reclaim space from removed and expired records. */
-    shmcb_subcache_expire(s, header, subcache, apr_time_now());
+    shmcb_subcache_expire(s, header, subcache, now);
 
     /* Loop until there is enough space to insert
      * XXX: This should first compress out-of-order expiries and
@@ -783,6 +1031,15 @@ static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
         do {
             SHMCBIndex *idx2;
 
+            if (SHMCB_PINNED(idx, now)) {
+                /* The oldest entry is in use, make room at the other end */
+                if (shmcb_subcache_drop_newest(s, header, subcache,
+                                               total_len, now)) {
+                    return -1;
+                }
+                break;
+            }
+
             /* Adjust the indexes by one */
             subcache->idx_pos = SHMCB_CYCLIC_INCREMENT(subcache->idx_pos, 1,
                                                        header->index_num);
@@ -798,7 +1055,7 @@ static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
                                                       header->subcache_data_size);
             subcache->data_pos = idx2->data_pos;
             /* Stats */
-            header->stat_scrolled++;
+            subcache->stat_scrolled++;
             /* Loop admin */
             idx = idx2;
             loop++;
@@ -839,6 +1096,8 @@ static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
     idx->data_used = total_len;
     idx->id_len = id_len;
     idx->removed = 0;
+    idx->pinned = 0;
+    idx->pin_gen++;
     subcache->idx_used++;
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00847)
                  "insert happened at idx=%d, data=(%u:%u)", new_idx,
@@ -851,10 +1110,10 @@ static int shmcb_subcache_store(server_rec *s, SHMCBHeader *header,
     return 0;
 }
 
-static int shmcb_subcache_retrieve(server_rec *s, SHMCBHeader *header,
-                                   SHMCBSubcache *subcache,
-                                   const unsigned char *id, unsigned int idlen,
-                                   unsigned char *dest, unsigned int *destlen)
+static SHMCBIndex *shmcb_subcache_find(server_rec *s, SHMCBHeader *header,
+                                       SHMCBSubcache *subcache,
+                                       const unsigned char *id,
+                                       unsigned int idlen)
 {
     unsigned int pos;
     unsigned int loop = 0;
@@ -866,42 +1125,24 @@ static int shmcb_subcache_retrieve(server_rec *s, SHMCBHeader *header,
         SHMCBIndex *idx = SHMCB_INDEX(subcache, pos);
 
         /* Only consider 'idx' if the id matches, and the "removed"
-         * flag isn't set, and the record is not expired.
-         * Check the data length too to avoid a buffer overflow
-         * in case of corruption, which should be impossible,
-         * but it's cheap to be safe. */
+         * flag isn't set, and the record is not expired. */
         if (!idx->removed
             && idx->id_len == idlen
-            && (idx->data_used - idx->id_len) <= *destlen
             && shmcb_cyclic_memcmp(header->subcache_data_size,
                                    SHMCB_DATA(header, subcache),
                                    idx->data_pos, id, idx->id_len) == 0) {
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00849)
                          "match at idx=%d, data=%d", pos, idx->data_pos);
             if (idx->expires > now) {
-                unsigned int data_offset;
-
-                /* Find the offset of the data segment, after the id */
-                data_offset = SHMCB_CYCLIC_INCREMENT(idx->data_pos,
-                                                     idx->id_len,
-                                                     header->subcache_data_size);
-
-                *destlen = idx->data_used - idx->id_len;
-
-                /* Copy out the data */
-                shmcb_cyclic_cton_memcpy(header->subcache_data_size,
-                                         dest, SHMCB_DATA(header, subcache),
-                                         data_offset, *destlen);
-
-                return 0;
+                return idx;
             }
             else {
                 /* Already stale, quietly remove and treat as not-found */
                 idx->removed = 1;
-                header->stat_expiries++;
+                subcache->stat_expiries++;
                 ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00850)
                              "shmcb_subcache_retrieve discarding expired entry");
-                return -1;
+                return NULL;
             }
         }
         /* Increment */
@@ -911,7 +1152,39 @@ static int shmcb_subcache_retrieve(server_rec *s, SHMCBHeader *header,
 
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00851)
                  "shmcb_subcache_retrieve found no match");
-    return -1;
+    return NULL;
+}
+
+static int shmcb_subcache_retrieve(server_rec *s, SHMCBHeader *header,
+                                   SHMCBSubcache *subcache,
+                                   const unsigned char *id, unsigned int idlen,
+                                   unsigned char *dest, unsigned int *destlen)
+{
+    SHMCBIndex *idx;
+    unsigned int data_offset;
+
+    idx = shmcb_subcache_find(s, header, subcache, id, idlen);
+
+    /* Check the data length too to avoid a buffer overflow
+     * in case of corruption, which should be impossible,
+     * but it's cheap to be safe. */
+    if (!idx || (idx->data_used - idx->id_len) > *destlen) {
+        return -1;
+    }
+
+    /* Find the offset of the data segment, after the id */
+    data_offset = SHMCB_CYCLIC_INCREMENT(idx->data_pos,
+                                         idx->id_len,
+                                         header->subcache_data_size);
+
+    *destlen = idx->data_used - idx->id_len;
+
+    /* Copy out the data */
+    shmcb_cyclic_cton_memcpy(header->subcache_data_size,
+                             dest, SHMCB_DATA(header, subcache),
+                             data_offset, *destlen);
+
+    return 0;
 }
 
 static int shmcb_subcache_remove(server_rec *s, SHMCBHeader *header,
@@ -1022,7 +1295,7 @@ static apr_status_t shmcb_subcache_iterate(ap_socache_instance_t *instance,
             else {
                 /* Already stale, quietly remove and treat as not-found */
                 idx->removed = 1;
-                header->stat_expiries++;
+                subcache->stat_expiries++;
                 ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(00856)
                              "shmcb_subcache_iterate discarding expired entry");
             }
@@ -1037,7 +1310,7 @@ static apr_status_t shmcb_subcache_iterate(ap_socache_instance_t *instance,
 
 static const ap_socache_provider_t socache_shmcb = {
     "shmcb",
-    AP_SOCACHE_FLAG_NOTMPSAFE,
+    AP_SOCACHE_FLAG_REFERENCE,
     socache_shmcb_create,
     socache_shmcb_init,
     socache_shmcb_destroy,
@@ -1045,11 +1318,58 @@ static const ap_socache_provider_t socache_shmcb = {
     socache_shmcb_retrieve,
     socache_shmcb_remove,
     socache_shmcb_status,
-    socache_shmcb_iterate
+    socache_shmcb_iterate,
+    socache_shmcb_retrieve_ref,
+    socache_shmcb_release
 };
 
+static int socache_shmcb_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                    apr_pool_t *ptemp)
+{
+    apr_status_t rv = ap_mutex_register(pconf, SHMCB_MUTEX_TYPE, NULL,
+                                        APR_LOCK_DEFAULT, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog, APLOGNO(02906)
+                      "failed to register %s mutex", SHMCB_MUTEX_TYPE);
+        return 500; /* An HTTP status would be a misnomer! */
+    }
+
+    shmcb_instances = apr_array_make(pconf, 4,
+                                     sizeof(ap_socache_instance_t *));
+
+    return OK;
+}
+
+static void socache_shmcb_child_init(apr_pool_t *p, server_rec *s)
+{
+    int i;
+    unsigned int loop;
+
+    for (i = 0; i < shmcb_instances->nelts; i++) {
+        ap_socache_instance_t *ctx = APR_ARRAY_IDX(shmcb_instances, i,
+                                                   ap_socache_instance_t *);
+        if (!ctx->shm) {
+            /* destroyed */
+            continue;
+        }
+        for (loop = 0; loop < ctx->lock_num; loop++) {
+            const char *lock = apr_global_mutex_lockfile(ctx->locks[loop]);
+            apr_status_t rv = apr_global_mutex_child_init(&ctx->locks[loop],
+                                                          lock, p);
+            if (rv != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02907)
+                             "failed to initialise %s mutex in child_init",
+                             SHMCB_MUTEX_TYPE);
+            }
+        }
+    }
+}
+
 static void register_hooks(apr_pool_t *p)
 {
+    ap_hook_pre_config(socache_shmcb_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(socache_shmcb_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+
     ap_register_provider(p, AP_SOCACHE_PROVIDER_GROUP, "shmcb",
                          AP_SOCACHE_PROVIDER_VERSION,
                          &socache_shmcb);
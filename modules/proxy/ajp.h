@@ -123,6 +123,31 @@ struct ajp_msg
     apr_size_t max_size;
 };
 
+/** A structure holding the AJP state of a backend connection */
+typedef struct ajp_conn_data ajp_conn_data_t;
+
+/**
+ * A structure holding the AJP state of a backend connection, kept in
+ * proxy_conn_rec->data for the lifetime of the connection
+ */
+struct ajp_conn_data
+{
+    /** The message sent to the backend (request headers, then body) */
+    ajp_msg_t   *smsg;
+    /** The size of the buffer of smsg */
+    apr_size_t  smsg_size;
+    /** The message received from the backend, pointing into rbuf */
+    ajp_msg_t   *rmsg;
+    /** The read ahead buffer */
+    apr_byte_t  *rbuf;
+    /** The size of the read ahead buffer */
+    apr_size_t  rbuf_size;
+    /** The position of the first byte not consumed yet in rbuf */
+    apr_size_t  rbuf_pos;
+    /** The length of the data in rbuf */
+    apr_size_t  rbuf_len;
+};
+
 /**
  * Signature for the messages sent from Apache to tomcat
  */
@@ -134,6 +159,8 @@ struct ajp_msg
 #define AJP_MAX_BUFFER_SZ           65536
 #define AJP13_MAX_SEND_BODY_SZ      (AJP_MAX_BUFFER_SZ - AJP_HEADER_SZ)
 #define AJP_PING_PONG_SZ            128
+/** Size of the read ahead buffer, holding at least one message */
+#define AJP_READ_BUFFER_SZ          (AJP_MAX_BUFFER_SZ + AJP_HEADER_LEN)
 
 /** Send a request from web server to container*/
 #define CMD_AJP13_FORWARD_REQUEST   (unsigned char)2
@@ -406,16 +433,53 @@ apr_status_t ajp_ilink_send(apr_socket_t *sock, ajp_msg_t *msg);
  */
 apr_status_t ajp_ilink_receive(apr_socket_t *sock, ajp_msg_t *msg);
 
+/**
+ * Get the AJP state of a backend connection, creating it if needed
+ * @param conn      backend connection
+ * @param buffsize  max size of the AJP packet.
+ * @param data      returned AJP state
+ * @return          APR_SUCCESS or error
+ * @note The state is allocated from the connection's scpool, and goes
+ *       away with the socket.
+ */
+apr_status_t ajp_ilink_data_get(proxy_conn_rec *conn, apr_size_t buffsize,
+                                ajp_conn_data_t **data);
+
+/**
+ * Receive the next AJP message from backend in data->rmsg, reading ahead
+ * as much as available when the buffer does not hold it already
+ *
+ * @param sock      backend socket
+ * @param data      AJP state of the connection
+ * @param buffsize  max size of the AJP packet.
+ * @return          APR_SUCCESS or error
+ * @note The message points into the read ahead buffer, and stays valid
+ *       until a call to this function finds no complete message buffered.
+ */
+apr_status_t ajp_ilink_receive_ahead(apr_socket_t *sock,
+                                     ajp_conn_data_t *data,
+                                     apr_size_t buffsize);
+
+/**
+ * Check whether the read ahead buffer holds a complete AJP message, so
+ * that ajp_ilink_receive_ahead() will return it without reading
+ *
+ * @param data      AJP state of the connection
+ * @param type      returned type of the buffered message
+ * @return          non-zero if a message is buffered
+ */
+int ajp_ilink_pending(ajp_conn_data_t *data, apr_byte_t *type);
+
 /**
  * Build the ajp header message and send it
  * @param sock      backend socket
  * @param r         current request
- * @param buffsize  max size of the AJP packet.
+ * @param msg       AJP message to build the header in
  * @param uri       requested uri
  * @return          APR_SUCCESS or error
  */
 apr_status_t ajp_send_header(apr_socket_t *sock, request_rec *r,
-                             apr_size_t buffsize,
+                             ajp_msg_t *msg,
                              apr_uri_t *uri);
 
 /**
@@ -423,24 +487,25 @@ apr_status_t ajp_send_header(apr_socket_t *sock, request_rec *r,
  * @param sock      backend socket
  * @param r         current request
  * @param buffsize  size of the buffer.
- * @param msg       returned AJP message
+ * @param data      AJP state of the connection, the message is
+ *                  returned in data->rmsg
  * @return          APR_SUCCESS or error
  */
 apr_status_t ajp_read_header(apr_socket_t *sock,
                              request_rec  *r,
                              apr_size_t buffsize,
-                             ajp_msg_t **msg);
+                             ajp_conn_data_t *data);
 
 /**
- * Allocate a msg to send data
- * @param pool      pool to allocate from
+ * Prepare a msg to send data
+ * @param msg       AJP message
  * @param ptr       data buffer
- * @param len       the length of allocated data buffer
- * @param msg       returned AJP message
+ * @param len       the length of the AJP packet, returned as the length
+ *                  of the data buffer
  * @return          APR_SUCCESS or error
  */
-apr_status_t  ajp_alloc_data_msg(apr_pool_t *pool, char **ptr,
-                                 apr_size_t *len, ajp_msg_t **msg);
+apr_status_t  ajp_init_data_msg(ajp_msg_t *msg, char **ptr,
+                                apr_size_t *len);
 
 /**
  * Send the data message
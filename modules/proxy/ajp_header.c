@@ -667,16 +667,15 @@ static apr_status_t ajp_unmarshal_response(ajp_msg_t *msg,
  */
 apr_status_t ajp_send_header(apr_socket_t *sock,
                              request_rec *r,
-                             apr_size_t buffsize,
+                             ajp_msg_t *msg,
                              apr_uri_t *uri)
 {
-    ajp_msg_t *msg;
     apr_status_t rc;
 
-    rc = ajp_msg_create(r->pool, buffsize, &msg);
+    rc = ajp_msg_reuse(msg);
     if (rc != APR_SUCCESS) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(00987)
-               "ajp_send_header: ajp_msg_create failed");
+               "ajp_send_header: ajp_msg_reuse failed");
         return rc;
     }
 
@@ -704,36 +703,20 @@ apr_status_t ajp_send_header(apr_socket_t *sock,
 apr_status_t ajp_read_header(apr_socket_t *sock,
                              request_rec  *r,
                              apr_size_t buffsize,
-                             ajp_msg_t **msg)
+                             ajp_conn_data_t *data)
 {
+    ajp_msg_t *msg = data->rmsg;
     apr_byte_t result;
     apr_status_t rc;
 
-    if (*msg) {
-        rc = ajp_msg_reuse(*msg);
-        if (rc != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(00990)
-                   "ajp_read_header: ajp_msg_reuse failed");
-            return rc;
-        }
-    }
-    else {
-        rc = ajp_msg_create(r->pool, buffsize, msg);
-        if (rc != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(00991)
-                   "ajp_read_header: ajp_msg_create failed");
-            return rc;
-        }
-    }
-    ajp_msg_reset(*msg);
-    rc = ajp_ilink_receive(sock, *msg);
+    rc = ajp_ilink_receive_ahead(sock, data, buffsize);
     if (rc != APR_SUCCESS) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(00992)
                "ajp_read_header: ajp_ilink_receive failed");
         return rc;
     }
-    ajp_msg_log(r, *msg, "ajp_read_header: ajp_ilink_receive packet dump");
-    rc = ajp_msg_peek_uint8(*msg, &result);
+    ajp_msg_log(r, msg, "ajp_read_header: ajp_ilink_receive packet dump");
+    rc = ajp_msg_peek_uint8(msg, &result);
     if (rc != APR_SUCCESS) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(00993)
                       "ajp_read_header: ajp_msg_peek_uint8 failed");
@@ -849,17 +832,15 @@ apr_status_t ajp_parse_reuse(request_rec *r, ajp_msg_t *msg,
 }
 
 /*
- * Allocate a msg to send data
+ * Prepare a msg to send data
  */
-apr_status_t  ajp_alloc_data_msg(apr_pool_t *pool, char **ptr, apr_size_t *len,
-                                 ajp_msg_t **msg)
+apr_status_t  ajp_init_data_msg(ajp_msg_t *msg, char **ptr, apr_size_t *len)
 {
     apr_status_t rc;
 
-    if ((rc = ajp_msg_create(pool, *len, msg)) != APR_SUCCESS)
+    if ((rc = ajp_msg_reuse(msg)) != APR_SUCCESS)
         return rc;
-    ajp_msg_reset(*msg);
-    *ptr = (char *)&((*msg)->buf[6]);
+    *ptr = (char *)&(msg->buf[6]);
     *len =  *len - 6;
 
     return APR_SUCCESS;
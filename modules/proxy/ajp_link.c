@@ -113,3 +113,128 @@ apr_status_t ajp_ilink_receive(apr_socket_t *sock, ajp_msg_t *msg)
     return APR_SUCCESS;
 }
 
+
+static apr_status_t ilink_data_cleanup(void *conn)
+{
+    ((proxy_conn_rec *)conn)->data = NULL;
+    return APR_SUCCESS;
+}
+
+apr_status_t ajp_ilink_data_get(proxy_conn_rec *conn, apr_size_t buffsize,
+                                ajp_conn_data_t **rdata)
+{
+    ajp_conn_data_t *data = conn->data;
+    apr_status_t status;
+
+    if (!data) {
+        data = apr_pcalloc(conn->scpool, sizeof(ajp_conn_data_t));
+        data->rmsg = apr_pcalloc(conn->scpool, sizeof(ajp_msg_t));
+        data->rbuf_size = AJP_READ_BUFFER_SZ;
+        data->rbuf = apr_palloc(conn->scpool, data->rbuf_size);
+        conn->data = data;
+        apr_pool_cleanup_register(conn->scpool, conn, ilink_data_cleanup,
+                                  apr_pool_cleanup_null);
+    }
+
+    /* The buffer size may differ for the vhosts sharing the connection */
+    if (data->smsg_size < buffsize) {
+        status = ajp_msg_create(conn->scpool, buffsize, &data->smsg);
+        if (status != APR_SUCCESS) {
+            return status;
+        }
+        data->smsg_size = buffsize;
+    }
+    data->smsg->max_size = buffsize;
+
+    *rdata = data;
+    return APR_SUCCESS;
+}
+
+apr_status_t ajp_ilink_receive_ahead(apr_socket_t *sock,
+                                     ajp_conn_data_t *data,
+                                     apr_size_t buffsize)
+{
+    ajp_msg_t *msg = data->rmsg;
+    apr_status_t status;
+    apr_size_t   hlen = AJP_HEADER_LEN;
+    apr_size_t   blen = 0;
+    apr_size_t   avail, length;
+
+    for (;;) {
+        avail = data->rbuf_len - data->rbuf_pos;
+
+        if (avail >= hlen) {
+            msg->buf = data->rbuf + data->rbuf_pos;
+            msg->header_len = hlen;
+            msg->max_size = buffsize;
+            msg->server_side = 0;
+
+            status = ajp_msg_check_header(msg, &blen);
+
+            if (status != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL, APLOGNO(02947)
+                             "ajp_ilink_receive() received bad header");
+                return AJP_EBAD_HEADER;
+            }
+            if (avail >= hlen + blen) {
+                data->rbuf_pos += hlen + blen;
+                break;
+            }
+        }
+
+        /* Move what we have of the message to the start of the buffer,
+         * and read as much as available behind it.
+         */
+        if (data->rbuf_pos) {
+            memmove(data->rbuf, data->rbuf + data->rbuf_pos, avail);
+            data->rbuf_pos = 0;
+            data->rbuf_len = avail;
+        }
+        length = data->rbuf_size - data->rbuf_len;
+
+        status = apr_socket_recv(sock, (char *)(data->rbuf + data->rbuf_len),
+                                 &length);
+
+        if (APR_STATUS_IS_EAGAIN(status)) {
+            continue;
+        }
+        if (status != APR_SUCCESS) {
+            if (avail < hlen) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, status, NULL, APLOGNO(02948)
+                             "ajp_ilink_receive() can't receive header");
+                return (APR_STATUS_IS_TIMEUP(status) ? APR_TIMEUP
+                                                     : AJP_ENO_HEADER);
+            }
+            ap_log_error(APLOG_MARK, APLOG_ERR, status, NULL, APLOGNO(02949)
+                         "ajp_ilink_receive() error while receiving message "
+                         "body of length %" APR_SIZE_T_FMT,
+                         blen);
+            return AJP_EBAD_MESSAGE;
+        }
+        data->rbuf_len += length;
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, NULL, APLOGNO(02950)
+                 "ajp_ilink_receive() received packet len=%" APR_SIZE_T_FMT
+                 "type=%d",
+                  blen, (int)msg->buf[hlen]);
+
+    return APR_SUCCESS;
+}
+
+int ajp_ilink_pending(ajp_conn_data_t *data, apr_byte_t *type)
+{
+    apr_byte_t   *head = data->rbuf + data->rbuf_pos;
+    apr_size_t   avail = data->rbuf_len - data->rbuf_pos;
+    apr_size_t   blen;
+
+    if (avail <= AJP_HEADER_LEN) {
+        return 0;
+    }
+    blen = ((head[2] & 0xff) << 8) + (head[3] & 0xff);
+    if (blen == 0 || avail < AJP_HEADER_LEN + blen) {
+        return 0;
+    }
+    *type = head[AJP_HEADER_LEN];
+    return 1;
+}
@@ -0,0 +1,463 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mod_proxy.h"
+#include "scoreboard.h"
+#include "ap_mpm.h"
+#include "apr_version.h"
+#include "ap_hooks.h"
+#include "ap_expr.h"
+
+module AP_MODULE_DECLARE_DATA lbmethod_byhash_module;
+
+static int (*ap_proxy_retry_worker_fn)(const char *proxy_function,
+        proxy_worker *worker, server_rec *s) = NULL;
+
+/*
+ * The idea behind the find_best_byhash scheduler is the following:
+ *
+ * A key is computed for each request from the BalancerHashKey expression
+ * (the request URI by default) and mapped onto a consistent hash ring on
+ * which every worker owns BYHASH_VNODES * lbfactor virtual nodes, placed by
+ * hashing the worker's name.  The request goes to the owner of the first
+ * virtual node found clockwise from the key's hash, so a given key always
+ * lands on the same backend (and its cache) as long as that backend is
+ * usable.  When a member is added, disabled or fails, only the keys it owns
+ * (about 1/N of them) move, the others keep their backend.
+ *
+ * To prevent a hot key from overloading its owner, the load of each worker
+ * is bounded ("consistent hashing with bounded loads"): a worker already
+ * serving more than BalancerHashBound percent of the average number of
+ * in-flight requests is skipped and the walk continues clockwise to the
+ * next virtual node.
+ *
+ * Like the other lbmethods, only the workers of the lowest lbset having
+ * usable members are considered, and hot standbys only if none of them is.
+ *
+ * The ring is built per child process and per balancer, and rebuilt when
+ * the balancer's members or their lbfactor change.  It is attached to the
+ * balancer at post_config (whatever its lbmethod, which the balancer-manager
+ * can change), and goes away with the configuration.
+ */
+
+#define BYHASH_VNODES 160
+
+#define BYHASH_DEFAULT_BOUND 125
+
+typedef struct {
+    ap_expr_info_t *key;    /* expression giving the request's key */
+    int bound;              /* max load, in percent of the average */
+    unsigned int bound_set:1;
+} byhash_dir_conf;
+
+typedef struct {
+    apr_uint32_t hash;
+    proxy_worker *worker;
+} byhash_vnode;
+
+typedef struct {
+    byhash_vnode *vnodes;
+    int nvnodes;
+    int nalloc;
+    int nworkers;           /* members the ring was built for */
+    int factors;            /* sum of their lbfactors */
+    apr_time_t wupdated;
+} byhash_ring;
+
+/* FNV-1a, followed by a final avalanche so that close names/seeds spread */
+static apr_uint32_t byhash_hash(const char *str, apr_uint32_t seed)
+{
+    apr_uint32_t hash = 2166136261U ^ seed;
+
+    for (; *str; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 16777619U;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+static int vnode_cmp(const void *a, const void *b)
+{
+    apr_uint32_t ha = ((const byhash_vnode *)a)->hash;
+    apr_uint32_t hb = ((const byhash_vnode *)b)->hash;
+
+    return (ha > hb) - (ha < hb);
+}
+
+/* assumed to be mutex protected by caller */
+static byhash_ring *get_ring(proxy_balancer *balancer)
+{
+    int i, j, n, factors = 0;
+    proxy_worker **workers = (proxy_worker **)balancer->workers->elts;
+    byhash_ring *ring = balancer->context;
+
+    if (!ring) {
+        return NULL;
+    }
+
+    for (i = 0; i < balancer->workers->nelts; i++) {
+        factors += workers[i]->s->lbfactor > 0 ? workers[i]->s->lbfactor : 1;
+    }
+
+    if (ring->vnodes
+        && ring->nworkers == balancer->workers->nelts
+             && ring->factors == factors
+             && ring->wupdated == balancer->wupdated) {
+        return ring;
+    }
+
+    if (factors * BYHASH_VNODES > ring->nalloc) {
+        ring->nalloc = factors * BYHASH_VNODES;
+        ring->vnodes = ap_realloc(ring->vnodes,
+                                  ring->nalloc * sizeof(byhash_vnode));
+    }
+
+    for (n = 0, i = 0; i < balancer->workers->nelts; i++) {
+        int count = BYHASH_VNODES * (workers[i]->s->lbfactor > 0
+                                     ? workers[i]->s->lbfactor : 1);
+        for (j = 0; j < count; j++, n++) {
+            ring->vnodes[n].hash = byhash_hash(workers[i]->s->name, j);
+            ring->vnodes[n].worker = workers[i];
+        }
+    }
+    qsort(ring->vnodes, n, sizeof(byhash_vnode), vnode_cmp);
+
+    ring->nvnodes = n;
+    ring->nworkers = balancer->workers->nelts;
+    ring->factors = factors;
+    ring->wupdated = balancer->wupdated;
+
+    return ring;
+}
+
+static int is_candidate(proxy_worker *worker, int lbset, int standby,
+                        const char *retried)
+{
+    return worker->s->lbset == lbset
+           && (standby ? PROXY_WORKER_IS_STANDBY(worker)
+                       : !PROXY_WORKER_IS_STANDBY(worker))
+           && !PROXY_WORKER_IS_DRAINING(worker)
+           && !PROXY_WORKER_IS_RETRIED(worker, retried)
+           && PROXY_WORKER_IS_USABLE(worker);
+}
+
+static proxy_worker *find_best_byhash(proxy_balancer *balancer,
+                                      request_rec *r)
+{
+    int i, lo, hi;
+    proxy_worker **worker;
+    proxy_worker *mycandidate = NULL;
+    proxy_worker *fallback = NULL;
+    byhash_dir_conf *conf;
+    byhash_ring *ring;
+    const char *key;
+    apr_uint32_t hash;
+    apr_size_t total_busy = 0;
+    apr_size_t bound = 0;
+    int nusable = 0;
+    int cur_lbset = 0;
+    int max_lbset = 0;
+    int checking_standby;
+    int checked_standby;
+    const char *retried = apr_table_get(r->notes, PROXY_RETRY_NOTE);
+
+    if (!ap_proxy_retry_worker_fn) {
+        ap_proxy_retry_worker_fn =
+                APR_RETRIEVE_OPTIONAL_FN(ap_proxy_retry_worker);
+        if (!ap_proxy_retry_worker_fn) {
+            /* can only happen if mod_proxy isn't loaded */
+            return NULL;
+        }
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, APLOGNO(02843)
+                 "proxy: Entering byhash for BALANCER (%s)",
+                 balancer->s->name);
+
+    /* Find the tier (lbset, then its standbys) we will balance on */
+    do {
+        checking_standby = checked_standby = 0;
+        while (!nusable && !checked_standby) {
+            worker = (proxy_worker **)balancer->workers->elts;
+            for (i = 0; i < balancer->workers->nelts; i++, worker++) {
+                if (!checking_standby) {    /* first time through */
+                    if ((*worker)->s->lbset > max_lbset)
+                        max_lbset = (*worker)->s->lbset;
+                }
+                if (((*worker)->s->lbset != cur_lbset) ||
+                    (checking_standby ? !PROXY_WORKER_IS_STANDBY(*worker) : PROXY_WORKER_IS_STANDBY(*worker)) ||
+                    (PROXY_WORKER_IS_DRAINING(*worker)) ||
+                    (PROXY_WORKER_IS_RETRIED(*worker, retried))) {
+                    continue;
+                }
+
+                /* If the worker is in error state run
+                 * retry on that worker. It will be marked as
+                 * operational if the retry timeout is elapsed.
+                 * The worker might still be unusable, but we try
+                 * anyway.
+                 */
+                if (!PROXY_WORKER_IS_USABLE(*worker)) {
+                    ap_proxy_retry_worker_fn("BALANCER", *worker, r->server);
+                }
+                if (PROXY_WORKER_IS_USABLE(*worker)) {
+                    total_busy += (*worker)->s->busy;
+                    nusable++;
+                }
+            }
+            checked_standby = checking_standby++;
+        }
+        cur_lbset++;
+    } while (cur_lbset <= max_lbset && !nusable);
+
+    if (!nusable) {
+        return NULL;
+    }
+    cur_lbset--;
+    checking_standby--;
+
+    conf = ap_get_module_config(r->per_dir_config, &lbmethod_byhash_module);
+    if (conf->key) {
+        const char *err = NULL;
+        key = ap_expr_str_exec(r, conf->key, &err);
+        if (err) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02844)
+                          "%s: Can't evaluate BalancerHashKey: %s",
+                          balancer->s->name, err);
+            key = r->uri;
+        }
+    }
+    else {
+        key = r->uri;
+    }
+
+    /* ceil((total_busy + 1) * bound / 100 / nusable), counting this request */
+    if (conf->bound > 0) {
+        bound = ((total_busy + 1) * conf->bound + 100 * nusable - 1)
+                / (100 * nusable);
+    }
+
+    ring = get_ring(balancer);
+    if (!ring) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, r->server, APLOGNO(02959)
+                     "proxy: byhash has no hash ring for BALANCER (%s)",
+                     balancer->s->name);
+        return NULL;
+    }
+    hash = byhash_hash(key ? key : "", 0);
+
+    /* First virtual node whose hash is >= the key's, wrapping around */
+    lo = 0;
+    hi = ring->nvnodes;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ring->vnodes[mid].hash < hash) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    for (i = 0; i < ring->nvnodes; i++) {
+        proxy_worker *w = ring->vnodes[(lo + i) % ring->nvnodes].worker;
+        if (!is_candidate(w, cur_lbset, checking_standby, retried)) {
+            continue;
+        }
+        if (!fallback) {
+            fallback = w;
+        }
+        if (!bound || w->s->busy < bound) {
+            mycandidate = w;
+            break;
+        }
+    }
+    if (!mycandidate) {
+        /* everybody is above the bound (can't happen with bound >= 100) */
+        mycandidate = fallback;
+    }
+
+    if (mycandidate) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, APLOGNO(02845)
+                     "proxy: byhash selected worker \"%s\" for key \"%s\" : "
+                     "busy %" APR_SIZE_T_FMT " : bound %" APR_SIZE_T_FMT,
+                     mycandidate->s->name, key, mycandidate->s->busy, bound);
+    }
+
+    return mycandidate;
+}
+
+/* assumed to be mutex protected by caller */
+static apr_status_t reset(proxy_balancer *balancer, server_rec *s)
+{
+    int i;
+    proxy_worker **worker;
+    worker = (proxy_worker **)balancer->workers->elts;
+    for (i = 0; i < balancer->workers->nelts; i++, worker++) {
+        (*worker)->s->lbstatus = 0;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t age(proxy_balancer *balancer, server_rec *s)
+{
+    return APR_SUCCESS;
+}
+
+static const proxy_balancer_method byhash =
+{
+    "byhash",
+    &find_best_byhash,
+    NULL,
+    &reset,
+    &age
+};
+
+static void *create_byhash_dir_config(apr_pool_t *p, char *dummy)
+{
+    byhash_dir_conf *conf = apr_pcalloc(p, sizeof(byhash_dir_conf));
+
+    conf->bound = BYHASH_DEFAULT_BOUND;
+
+    return conf;
+}
+
+static void *merge_byhash_dir_config(apr_pool_t *p, void *basev, void *addv)
+{
+    byhash_dir_conf *new = apr_pcalloc(p, sizeof(byhash_dir_conf));
+    byhash_dir_conf *add = addv;
+    byhash_dir_conf *base = basev;
+
+    new->key = add->key ? add->key : base->key;
+    new->bound = add->bound_set ? add->bound : base->bound;
+    new->bound_set = add->bound_set || base->bound_set;
+
+    return new;
+}
+
+static const char *set_hash_key(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    byhash_dir_conf *conf = dconf;
+    const char *expr_err = NULL;
+
+    conf->key = ap_expr_parse_cmd(cmd, arg, AP_EXPR_FLAG_STRING_RESULT,
+                                  &expr_err, NULL);
+    if (expr_err) {
+        return apr_pstrcat(cmd->temp_pool,
+                           "Cannot parse expression '", arg,
+                           "' in BalancerHashKey: ", expr_err, NULL);
+    }
+
+    return NULL;
+}
+
+static const char *set_hash_bound(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    byhash_dir_conf *conf = dconf;
+    int bound = atoi(arg);
+
+    if (!strcasecmp(arg, "off")) {
+        bound = 0;
+    }
+    else if (bound < 100) {
+        return "BalancerHashBound must be 'off' or a percentage of the "
+               "average load greater than or equal to 100";
+    }
+    conf->bound = bound;
+    conf->bound_set = 1;
+
+    return NULL;
+}
+
+static const command_rec cmds[] = {
+    AP_INIT_TAKE1("BalancerHashKey", set_hash_key, NULL, RSRC_CONF|ACCESS_CONF,
+                  "Expression giving the key hashed by the byhash lbmethod "
+                  "(defaults to the request URI)"),
+    AP_INIT_TAKE1("BalancerHashBound", set_hash_bound, NULL, RSRC_CONF|ACCESS_CONF,
+                  "Maximum load of a byhash member, in percent of the average "
+                  "load, before its keys overflow to the next member, or 'off'"),
+    {NULL}
+};
+
+static apr_status_t ring_cleanup(void *data)
+{
+    byhash_ring *ring = data;
+
+    free(ring->vnodes);
+    ring->vnodes = NULL;
+    ring->nalloc = 0;
+
+    return APR_SUCCESS;
+}
+
+/* Give every balancer its ring, allocated from (and freed with) pconf */
+static int byhash_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                              apr_pool_t *ptemp, server_rec *s)
+{
+    /* not linked with mod_proxy, like the other lbmethods */
+    module *proxy = ap_find_linked_module("mod_proxy.c");
+
+    if (!proxy) {
+        return OK;
+    }
+    for (; s; s = s->next) {
+        proxy_server_conf *conf = ap_get_module_config(s->module_config,
+                                                       proxy);
+        proxy_balancer *balancer;
+        int i;
+
+        if (!conf) {
+            continue;
+        }
+        balancer = (proxy_balancer *)conf->balancers->elts;
+        for (i = 0; i < conf->balancers->nelts; i++, balancer++) {
+            byhash_ring *ring;
+
+            if (balancer->context) {
+                continue;
+            }
+            ring = apr_pcalloc(pconf, sizeof(*ring));
+            apr_pool_cleanup_register(pconf, ring, ring_cleanup,
+                                      apr_pool_cleanup_null);
+            balancer->context = ring;
+        }
+    }
+
+    return OK;
+}
+
+static void register_hook(apr_pool_t *p)
+{
+    ap_register_provider(p, PROXY_LBMETHOD, "byhash", "0", &byhash);
+    ap_hook_post_config(byhash_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+}
+
+AP_DECLARE_MODULE(lbmethod_byhash) = {
+    STANDARD20_MODULE_STUFF,
+    create_byhash_dir_config,   /* create per-directory config structure */
+    merge_byhash_dir_config,    /* merge per-directory config structures */
+    NULL,                       /* create per-server config structure */
+    NULL,                       /* merge per-server config structures */
+    cmds,                       /* command apr_table_t */
+    register_hook               /* register hooks */
+};
@@ -0,0 +1,253 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mod_proxy.h"
+#include "proxy_latency.h"
+#include "scoreboard.h"
+#include "ap_mpm.h"
+#include "apr_version.h"
+#include "ap_hooks.h"
+
+module AP_MODULE_DECLARE_DATA lbmethod_bylatency_module;
+
+static int (*ap_proxy_retry_worker_fn)(const char *proxy_function,
+        proxy_worker *worker, server_rec *s) = NULL;
+
+/*
+ * The idea behind the find_best_bylatency scheduler is the following:
+ *
+ * mod_proxy_balancer keeps, for each worker, an exponentially weighted
+ * moving average of the backend response time (latency) along with the
+ * number of requests currently in flight (busy).  The expected cost of
+ * sending one more request to a worker is then
+ *
+ *     (latency + 1) * (busy + 1) / lbfactor
+ *
+ * Instead of computing this for every member of the balancer, the cheapest
+ * of two candidates is elected ("power of two choices"): the worker elected
+ * last (by this child) and one drawn at random, or two random ones when
+ * there is no such worker.  This makes the selection O(1) while still
+ * steering traffic away from slow or overloaded backends.  Remembering
+ * the last choice lets the fastest workers take more than the 2/n share
+ * of the requests that random pairs would give them at most.
+ *
+ * A worker that stops being elected because it was slow would never get a
+ * chance to prove it recovered, so its latency is halved for each
+ * PROXY_LATENCY_DECAY period elapsed since its last sample.
+ *
+ * The random draws only consider the usable, non standby workers of the
+ * first lbset.  If they do not yield two candidates (small or mostly
+ * failed balancers, lbsets, hot standbys), we fall back to a linear scan
+ * honoring the same lbset/standby order as the other lbmethods and do the
+ * two choices amongst the eligible workers found.
+ */
+
+/* Number of random draws per candidate before falling back to a scan */
+#define BYLATENCY_PROBES 4
+
+static int is_candidate(proxy_worker *worker, int lbset, int standby,
+                        const char *retried, request_rec *r)
+{
+    if (worker->s->lbset != lbset
+        || (standby ? !PROXY_WORKER_IS_STANDBY(worker)
+                    : PROXY_WORKER_IS_STANDBY(worker))
+        || PROXY_WORKER_IS_DRAINING(worker)
+        || PROXY_WORKER_IS_RETRIED(worker, retried)) {
+        return 0;
+    }
+
+    /* If the worker is in error state run
+     * retry on that worker. It will be marked as
+     * operational if the retry timeout is elapsed.
+     * The worker might still be unusable, but we try
+     * anyway.
+     */
+    if (!PROXY_WORKER_IS_USABLE(worker)) {
+        ap_proxy_retry_worker_fn("BALANCER", worker, r->server);
+    }
+
+    return PROXY_WORKER_IS_USABLE(worker);
+}
+
+/* Returns the cheapest of two candidates, see the cost above. */
+static proxy_worker *choose(proxy_worker *a, proxy_worker *b, apr_time_t now)
+{
+    if (b && proxy_latency_cheaper(b->s, a->s, now)) {
+        return b;
+    }
+    return a;
+}
+
+static proxy_worker *probe_candidate(proxy_balancer *balancer,
+                                     proxy_worker *exclude,
+                                     const char *retried,
+                                     request_rec *r)
+{
+    int i;
+    proxy_worker **workers = (proxy_worker **)balancer->workers->elts;
+    apr_uint32_t max = balancer->workers->nelts - 1;
+
+    for (i = 0; i < BYLATENCY_PROBES; i++) {
+        proxy_worker *worker = workers[ap_random_pick(0, max)];
+        if (worker != exclude && is_candidate(worker, 0, 0, retried, r)) {
+            return worker;
+        }
+    }
+    return NULL;
+}
+
+static proxy_worker *find_best_bylatency(proxy_balancer *balancer,
+                                         request_rec *r)
+{
+    int i;
+    proxy_worker **worker;
+    proxy_worker **eligible;
+    proxy_worker *first = NULL, *second = NULL;
+    proxy_worker *mycandidate = NULL;
+    int cur_lbset = 0;
+    int max_lbset = 0;
+    int checking_standby;
+    int checked_standby;
+    int neligible = 0;
+    const char *retried = apr_table_get(r->notes, PROXY_RETRY_NOTE);
+    apr_time_t now;
+
+    if (!ap_proxy_retry_worker_fn) {
+        ap_proxy_retry_worker_fn =
+                APR_RETRIEVE_OPTIONAL_FN(ap_proxy_retry_worker);
+        if (!ap_proxy_retry_worker_fn) {
+            /* can only happen if mod_proxy isn't loaded */
+            return NULL;
+        }
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, APLOGNO(02841)
+                 "proxy: Entering bylatency for BALANCER (%s)",
+                 balancer->s->name);
+
+    if (!balancer->workers->nelts) {
+        return NULL;
+    }
+
+    now = apr_time_now();
+
+    /* Fast path: the last elected worker, or a random one, against a
+     * random one */
+    if (balancer->workers->nelts > 1) {
+        first = balancer->lbmethod_last;
+        if (first && !is_candidate(first, 0, 0, retried, r)) {
+            first = NULL;
+        }
+        if (!first) {
+            first = probe_candidate(balancer, NULL, retried, r);
+        }
+        if (first
+            && (second = probe_candidate(balancer, first, retried, r))) {
+            mycandidate = choose(first, second, now);
+        }
+    }
+
+    /* Slow path: scan each lbset, then its standbys */
+    if (!mycandidate) {
+        eligible = apr_palloc(r->pool, balancer->workers->nelts
+                                       * sizeof(proxy_worker *));
+        do {
+            checking_standby = checked_standby = 0;
+            while (!neligible && !checked_standby) {
+                worker = (proxy_worker **)balancer->workers->elts;
+                for (i = 0; i < balancer->workers->nelts; i++, worker++) {
+                    if (!checking_standby) {    /* first time through */
+                        if ((*worker)->s->lbset > max_lbset)
+                            max_lbset = (*worker)->s->lbset;
+                    }
+                    if (is_candidate(*worker, cur_lbset, checking_standby,
+                                     retried, r)) {
+                        eligible[neligible++] = *worker;
+                    }
+                }
+                checked_standby = checking_standby++;
+            }
+            cur_lbset++;
+        } while (cur_lbset <= max_lbset && !neligible);
+
+        if (neligible == 1) {
+            mycandidate = eligible[0];
+        }
+        else if (neligible > 1) {
+            apr_uint32_t a = ap_random_pick(0, neligible - 1);
+            apr_uint32_t b = ap_random_pick(0, neligible - 2);
+            if (b >= a) {
+                b++;
+            }
+            mycandidate = choose(eligible[a], eligible[b], now);
+        }
+    }
+
+    balancer->lbmethod_last = mycandidate;
+    if (mycandidate) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, APLOGNO(02842)
+                     "proxy: bylatency selected worker \"%s\" : busy %"
+                     APR_SIZE_T_FMT " : latency %" APR_TIME_T_FMT,
+                     mycandidate->s->name, mycandidate->s->busy,
+                     mycandidate->s->latency);
+    }
+
+    return mycandidate;
+}
+
+/* assumed to be mutex protected by caller */
+static apr_status_t reset(proxy_balancer *balancer, server_rec *s)
+{
+    int i;
+    proxy_worker **worker;
+    worker = (proxy_worker **)balancer->workers->elts;
+    for (i = 0; i < balancer->workers->nelts; i++, worker++) {
+        (*worker)->s->lbstatus = 0;
+        (*worker)->s->latency = 0;
+        (*worker)->s->latency_updated = 0;
+    }
+    balancer->lbmethod_last = NULL;
+    return APR_SUCCESS;
+}
+
+static apr_status_t age(proxy_balancer *balancer, server_rec *s)
+{
+    return APR_SUCCESS;
+}
+
+static const proxy_balancer_method bylatency =
+{
+    "bylatency",
+    &find_best_bylatency,
+    NULL,
+    &reset,
+    &age
+};
+
+static void register_hook(apr_pool_t *p)
+{
+    ap_register_provider(p, PROXY_LBMETHOD, "bylatency", "0", &bylatency);
+}
+
+AP_DECLARE_MODULE(lbmethod_bylatency) = {
+    STANDARD20_MODULE_STUFF,
+    NULL,       /* create per-directory config structure */
+    NULL,       /* merge per-directory config structures */
+    NULL,       /* create per-server config structure */
+    NULL,       /* merge per-server config structures */
+    NULL,       /* command apr_table_t */
+    register_hook /* register hooks */
+};
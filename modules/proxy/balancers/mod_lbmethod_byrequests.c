@@ -82,6 +82,7 @@ static proxy_worker *find_best_byrequests(proxy_balancer *balancer,
     int max_lbset = 0;
     int checking_standby;
     int checked_standby;
+    const char *retried = apr_table_get(r->notes, PROXY_RETRY_NOTE);
 
     if (!ap_proxy_retry_worker_fn) {
         ap_proxy_retry_worker_fn =
@@ -109,7 +110,8 @@ static proxy_worker *find_best_byrequests(proxy_balancer *balancer,
                 if (
                     ((*worker)->s->lbset != cur_lbset) ||
                     (checking_standby ? !PROXY_WORKER_IS_STANDBY(*worker) : PROXY_WORKER_IS_STANDBY(*worker)) ||
-                    (PROXY_WORKER_IS_DRAINING(*worker))
+                    (PROXY_WORKER_IS_DRAINING(*worker)) ||
+                    (PROXY_WORKER_IS_RETRIED(*worker, retried))
                     ) {
                     continue;
                 }
@@ -268,6 +268,7 @@ static proxy_worker *find_best_hb(proxy_balancer *balancer,
     proxy_worker *mycandidate = NULL;
     apr_pool_t *tpool;
     apr_hash_t *servers;
+    const char *retried = apr_table_get(r->notes, PROXY_RETRY_NOTE);
 
     lb_hb_ctx_t *ctx =
         ap_get_module_config(r->server->module_config,
@@ -300,6 +301,9 @@ static proxy_worker *find_best_hb(proxy_balancer *balancer,
 
     for (i = 0; i < balancer->workers->nelts; i++) {
         worker = &APR_ARRAY_IDX(balancer->workers, i, proxy_worker *);
+        if (PROXY_WORKER_IS_RETRIED(*worker, retried)) {
+            continue;
+        }
         server = apr_hash_get(servers, (*worker)->s->hostname, APR_HASH_KEY_STRING);
 
         if (!server) {
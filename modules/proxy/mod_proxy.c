@@ -39,6 +39,8 @@ APR_DECLARE_OPTIONAL_FN(char *, ssl_var_lookup,
 static const char * const proxy_id = "proxy";
 apr_global_mutex_t *proxy_mutex = NULL;
 
+static APR_OPTIONAL_FN_TYPE(set_worker_hc_param) *set_worker_hc_param_f = NULL;
+
 /*
  * A Web proxy module. Stages:
  *
@@ -272,6 +274,9 @@ static const char *set_worker_param(apr_pool_t *p,
                     (int)sizeof(worker->s->flusher));
         PROXY_STRNCPY(worker->s->flusher, val);
     }
+    else if (set_worker_hc_param_f && !strncasecmp(key, "hc", 2)) {
+        return set_worker_hc_param_f(p, worker, key, val);
+    }
     else {
         return "unknown Worker parameter";
     }
@@ -940,7 +945,7 @@ static int proxy_handler(request_rec *r)
     apr_int64_t maxfwd;
     proxy_balancer *balancer = NULL;
     proxy_worker *worker = NULL;
-    int attempts = 0, max_attempts = 0;
+    int attempts = 0, max_attempts = 0, retry;
     struct dirconn_entry *list = (struct dirconn_entry *)conf->dirconn->elts;
     int saved_status;
 
@@ -1072,8 +1077,10 @@ static int proxy_handler(request_rec *r)
 
     do {
         char *url = uri;
+        retry = 0;
         /* Try to obtain the most suitable worker */
         access_status = ap_proxy_pre_request(&worker, &balancer, r, conf, &url);
+        apr_table_unset(r->notes, PROXY_RETRY_NOTE);
         if (access_status != OK) {
             /*
              * Only return if access_status is not HTTP_SERVICE_UNAVAILABLE
@@ -1186,9 +1193,15 @@ static int proxy_handler(request_rec *r)
         else if (access_status == HTTP_SERVICE_UNAVAILABLE) {
             /* Recoverable server error.
              * We can failover to another worker
-             * Mark the worker as unusable if member of load balancer
+             * Mark the worker as unusable if member of load balancer,
+             * unless the scheme handler only asks for the request to be
+             * sent again (the PROXY_RETRY_NOTE note, naming the worker), the
+             * worker not being at fault.
              */
-            if (balancer
+            if (balancer && apr_table_get(r->notes, PROXY_RETRY_NOTE)) {
+                retry = 1;
+            }
+            else if (balancer
                 && !(worker->s->status & PROXY_WORKER_IGNORE_ERRORS)) {
                 worker->s->status |= PROXY_WORKER_IN_ERROR;
                 worker->s->error_time = apr_time_now();
@@ -1201,9 +1214,9 @@ static int proxy_handler(request_rec *r)
             break;
         }
         /* Try again if the worker is unusable and the service is
-         * unavailable.
+         * unavailable, or if asked to.
          */
-    } while (!PROXY_WORKER_IS_USABLE(worker) &&
+    } while ((retry || !PROXY_WORKER_IS_USABLE(worker)) &&
              max_attempts > attempts++);
 
     if (DECLINED == access_status) {
@@ -1508,6 +1521,11 @@ static void *merge_proxy_dir_config(apr_pool_t *p, void *basev, void *addv)
     new->alias = (add->alias_set == 0) ? base->alias : add->alias;
     new->alias_set = add->alias_set || base->alias_set;
     new->add_forwarded_headers = add->add_forwarded_headers;
+    new->retry_body_limit = (add->retry_body_limit_set == 0)
+                            ? base->retry_body_limit
+                            : add->retry_body_limit;
+    new->retry_body_limit_set = add->retry_body_limit_set
+                                || base->retry_body_limit_set;
     return new;
 }
 
@@ -2012,6 +2030,24 @@ static const char *
    conf->add_forwarded_headers = flag;
    return NULL;
 }
+static const char *
+    set_retry_body_limit(cmd_parms *parms, void *dconf, const char *arg)
+{
+    proxy_dir_conf *conf = dconf;
+    char *errp;
+
+    if (!strcasecmp(arg, "off")) {
+        conf->retry_body_limit = 0;
+    }
+    else if (APR_SUCCESS != apr_strtoff(&conf->retry_body_limit, arg,
+                                        &errp, 10)
+             || *errp || conf->retry_body_limit < 0) {
+        return "ProxyRetryBodyLimit must be a non-negative integer or off";
+    }
+    conf->retry_body_limit_set = 1;
+    return NULL;
+}
+
 static const char *
     set_preserve_host(cmd_parms *parms, void *dconf, int flag)
 {
@@ -2599,6 +2635,11 @@ static const command_rec proxy_cmds[] =
      "Configure local source IP used for request forward"),
     AP_INIT_FLAG("ProxyAddHeaders", add_proxy_http_headers, NULL, RSRC_CONF|ACCESS_CONF,
      "on if X-Forwarded-* headers should be added or completed"),
+    AP_INIT_TAKE1("ProxyRetryBodyLimit", set_retry_body_limit, NULL,
+     RSRC_CONF|ACCESS_CONF,
+     "Maximum request body size (in bytes) spooled so that the request can "
+     "be retried on another balancer member, or 0/off (the default) to "
+     "disable"),
     {NULL}
 };
 
@@ -2869,6 +2910,8 @@ static int proxy_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
 
     APR_OPTIONAL_HOOK(ap, status_hook, proxy_status_hook, NULL, NULL,
                       APR_HOOK_MIDDLE);
+    /* Worker parameters handled by mod_proxy_hcheck, if loaded */
+    set_worker_hc_param_f = APR_RETRIEVE_OPTIONAL_FN(set_worker_hc_param);
     /* Reset workers count on gracefull restart */
     proxy_lb_workers = 0;
     return OK;
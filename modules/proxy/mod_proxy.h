@@ -223,6 +223,9 @@ typedef struct {
     /** Named back references */
     apr_array_header_t *refs;
 
+    /** Largest request body kept to replay the request on another worker */
+    apr_off_t retry_body_limit;
+    unsigned int retry_body_limit_set:1;
 } proxy_dir_conf;
 
 /* if we interpolate env vars per-request, we'll need a per-request
@@ -282,6 +285,7 @@ struct proxy_conn_pool {
 #define PROXY_WORKER_IN_ERROR       0x0080
 #define PROXY_WORKER_HOT_STANDBY    0x0100
 #define PROXY_WORKER_FREE           0x0200
+#define PROXY_WORKER_HC_FAIL        0x0400
 
 /* worker status flags */
 #define PROXY_WORKER_INITIALIZED_FLAG    'O'
@@ -294,9 +298,11 @@ struct proxy_conn_pool {
 #define PROXY_WORKER_IN_ERROR_FLAG       'E'
 #define PROXY_WORKER_HOT_STANDBY_FLAG    'H'
 #define PROXY_WORKER_FREE_FLAG           'F'
+#define PROXY_WORKER_HC_FAIL_FLAG        'C'
 
 #define PROXY_WORKER_NOT_USABLE_BITMAP ( PROXY_WORKER_IN_SHUTDOWN | \
-PROXY_WORKER_DISABLED | PROXY_WORKER_STOPPED | PROXY_WORKER_IN_ERROR )
+PROXY_WORKER_DISABLED | PROXY_WORKER_STOPPED | PROXY_WORKER_IN_ERROR | \
+PROXY_WORKER_HC_FAIL )
 
 /* NOTE: these check the shared status */
 #define PROXY_WORKER_IS_INITIALIZED(f)  ( (f)->s->status &  PROXY_WORKER_INITIALIZED )
@@ -310,6 +316,18 @@ PROXY_WORKER_DISABLED | PROXY_WORKER_STOPPED | PROXY_WORKER_IN_ERROR )
 
 #define PROXY_WORKER_IS_GENERIC(f)   ( (f)->s->status &  PROXY_WORKER_GENERIC )
 
+#define PROXY_WORKER_IS_HCFAILED(f)   ( (f)->s->status &  PROXY_WORKER_HC_FAIL )
+
+/* Note naming the balancer member a request could not be sent to, set by
+ * the scheme handler returning HTTP_SERVICE_UNAVAILABLE for the request to
+ * be sent again to another member. The lbmethods must not elect that
+ * member again: n being the note's value (or NULL), they skip the workers
+ * for which PROXY_WORKER_IS_RETRIED(f, n) is true.
+ */
+#define PROXY_RETRY_NOTE "proxy-retry"
+
+#define PROXY_WORKER_IS_RETRIED(f, n)   ( (n) && !strcmp((f)->s->name, (n)) )
+
 /* default worker retry timeout in seconds */
 #define PROXY_WORKER_DEFAULT_RETRY    60
 
@@ -343,6 +361,30 @@ typedef struct {
     unsigned int fnv;
 } proxy_hashes ;
 
+/* Health check methods, see mod_proxy_hcheck */
+typedef enum {
+    PROXY_HC_NONE,
+    PROXY_HC_TCP,
+    PROXY_HC_OPTIONS,
+    PROXY_HC_HEAD,
+    PROXY_HC_GET,
+    PROXY_HC_CPING,
+    PROXY_HC_FCGI
+} proxy_hcmethod_t;
+
+/* Runtime health check settings and state of a worker. Shared in scoreboard */
+typedef struct {
+    proxy_hcmethod_t method;   /* how to check */
+    int             passes;    /* consecutive successes needed to be up */
+    int             fails;     /* consecutive failures needed to be down */
+    int             pcount;    /* current number of consecutive successes */
+    int             fcount;    /* current number of consecutive failures */
+    apr_interval_time_t interval; /* time between two checks */
+    apr_time_t      checked;   /* timestamp of last check */
+    char            uri[PROXY_WORKER_MAX_ROUTE_SIZE];   /* path for HTTP checks */
+    char            expr[PROXY_WORKER_MAX_SCHEME_SIZE]; /* ProxyHCExpr name */
+} proxy_hcheck_t;
+
 /* Runtime worker status informations. Shared in scoreboard */
 typedef struct {
     char      name[PROXY_WORKER_MAX_NAME_SIZE];
@@ -399,6 +441,9 @@ typedef struct {
     unsigned int     disablereuse_set:1;
     unsigned int     was_malloced:1;
     unsigned int     is_name_matchable:1;
+    apr_interval_time_t latency; /* smoothed (EWMA) backend response time */
+    apr_time_t      latency_updated; /* timestamp of last latency sample */
+    proxy_hcheck_t  hc;         /* active health check */
 } proxy_worker_shared;
 
 #define ALIGNED_PROXY_WORKER_SHARED_SIZE (APR_ALIGN_DEFAULT(sizeof(proxy_worker_shared)))
@@ -471,6 +516,7 @@ struct proxy_balancer {
     unsigned int failontimeout_set:1;
     unsigned int growth_set:1;
     unsigned int lbmethod_set:1;
+    proxy_worker *lbmethod_last; /* last elected by the lbmethod (bylatency) */
 };
 
 struct proxy_balancer_method {
@@ -861,6 +907,20 @@ PROXY_DECLARE(int) ap_proxy_determine_connection(apr_pool_t *p, request_rec *r,
 APR_DECLARE_OPTIONAL_FN(int, ap_proxy_retry_worker,
         (const char *proxy_function, proxy_worker *worker, server_rec *s));
 
+/**
+ * Set a health check parameter of a worker (hcmethod, hcinterval, ...).
+ * Provided by mod_proxy_hcheck, and used when parsing worker parameters
+ * unknown to mod_proxy.
+ * @param p        memory pool used for error messages
+ * @param worker   worker to configure
+ * @param key      parameter name
+ * @param val      parameter value
+ * @return         NULL on success, an error message otherwise
+ */
+APR_DECLARE_OPTIONAL_FN(const char *, set_worker_hc_param,
+        (apr_pool_t *p, proxy_worker *worker, const char *key,
+         const char *val));
+
 /**
  * Acquire a connection from worker connection pool
  * @param proxy_function calling proxy scheme (http, ajp, ...)
@@ -1086,6 +1146,40 @@ PROXY_DECLARE(apr_port_t) ap_proxy_port_of_scheme(const char *scheme);
  */
 PROXY_DECLARE(const char *) ap_proxy_de_socketfy(apr_pool_t *p, const char *url);
 
+/**
+ * Opaque state of a zero-copy (splice) transfer in one direction
+ */
+typedef struct proxy_splice_t proxy_splice_t;
+
+/**
+ * Setup a zero-copy transfer from c_i's socket to c_o's socket, for
+ * tunnels which can bypass the filter stacks.
+ * @param r             request
+ * @param c_i           connection to read from
+ * @param c_o           connection to write to
+ * @return              the splice state, or NULL if splicing is not
+ *                      available (platform) or possible (c_i/c_o have
+ *                      filters other than the core ones, eg. SSL)
+ * @note The caller must have drained anything buffered by the core
+ *       filters of c_i and c_o before using the splice.
+ */
+PROXY_DECLARE(proxy_splice_t *) ap_proxy_splice_create(request_rec *r,
+                                                       conn_rec *c_i,
+                                                       conn_rec *c_o);
+
+/**
+ * Move what is readable from the input socket to the output socket,
+ * without copying the data to userspace.
+ * @param ps            splice state from ap_proxy_splice_create()
+ * @param transferred   number of bytes transferred
+ * @return              APR_SUCCESS, APR_EOF if the input side is closed,
+ *                      or an error
+ * @note This should be called once the input socket has been polled
+ *       readable, it may block writing to the output socket.
+ */
+PROXY_DECLARE(apr_status_t) ap_proxy_splice_transfer(proxy_splice_t *ps,
+                                                     apr_off_t *transferred);
+
 extern module PROXY_DECLARE_DATA proxy_module;
 
 #endif /*MOD_PROXY_H*/
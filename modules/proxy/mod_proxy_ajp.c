@@ -154,6 +154,35 @@ static apr_off_t get_content_length(request_rec * r)
  * http://issues.apache.org/bugzilla/show_bug.cgi?id=37100
  */
 
+/*
+ * Replace the body chunks gathered in bb, pointing to the read ahead
+ * buffer, by a single heap bucket.
+ */
+static void coalesce_body(apr_bucket_brigade *bb, apr_bucket_alloc_t *ba)
+{
+    apr_off_t len;
+    apr_size_t size;
+    char *buf;
+    apr_bucket *e;
+
+    if (APR_BRIGADE_EMPTY(bb)
+        || APR_BRIGADE_FIRST(bb) == APR_BRIGADE_LAST(bb)) {
+        return;
+    }
+    if (apr_brigade_length(bb, 0, &len) != APR_SUCCESS || len <= 0) {
+        return;
+    }
+    size = (apr_size_t)len;
+    buf = apr_bucket_alloc(size, ba);
+    if (apr_brigade_flatten(bb, buf, &size) != APR_SUCCESS) {
+        apr_bucket_free(buf);
+        return;
+    }
+    apr_brigade_cleanup(bb);
+    e = apr_bucket_heap_create(buf, size, apr_bucket_free, ba);
+    APR_BRIGADE_INSERT_TAIL(bb, e);
+}
+
 /*
  * process the request and write the response.
  */
@@ -169,6 +198,7 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
     apr_bucket *e;
     apr_bucket_brigade *input_brigade;
     apr_bucket_brigade *output_brigade;
+    ajp_conn_data_t *data;
     ajp_msg_t *msg;
     apr_size_t bufsiz = 0;
     char *buff;
@@ -179,7 +209,6 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
     int havebody = 1;
     int output_failed = 0;
     int backend_failed = 0;
-    apr_off_t bb_len;
     int data_sent = 0;
     int request_ended = 0;
     int headers_sent = 0;
@@ -202,12 +231,22 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
        maxsize = AJP_MSG_BUFFER_SZ;
     maxsize = APR_ALIGN(maxsize, 1024);
 
+    /* get the message buffers of the connection */
+    status = ajp_ilink_data_get(conn, maxsize, &data);
+    if (status != APR_SUCCESS) {
+        conn->close = 1;
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(02868)
+                      "ajp_ilink_data_get failed");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    msg = data->smsg;
+
     /*
      * Send the AJP request to the remote server
      */
 
     /* send request headers */
-    status = ajp_send_header(conn->sock, r, maxsize, uri);
+    status = ajp_send_header(conn->sock, r, msg, uri);
     if (status != APR_SUCCESS) {
         conn->close = 1;
         ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(00868)
@@ -229,14 +268,14 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
         }
     }
 
-    /* allocate an AJP message to store the data of the buckets */
+    /* reuse the AJP message to store the data of the buckets */
     bufsiz = maxsize;
-    status = ajp_alloc_data_msg(r->pool, &buff, &bufsiz, &msg);
+    status = ajp_init_data_msg(msg, &buff, &bufsiz);
     if (status != APR_SUCCESS) {
         /* We had a failure: Close connection to backend */
         conn->close = 1;
         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(00869)
-                      "ajp_alloc_data_msg failed");
+                      "ajp_init_data_msg failed");
         return HTTP_INTERNAL_SERVER_ERROR;
     }
 
@@ -325,9 +364,7 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
     }
 
     /* read the response */
-    conn->data = NULL;
-    status = ajp_read_header(conn->sock, r, maxsize,
-                             (ajp_msg_t **)&(conn->data));
+    status = ajp_read_header(conn->sock, r, maxsize, data);
     if (status != APR_SUCCESS) {
         /* We had a failure: Close connection to backend */
         conn->close = 1;
@@ -359,7 +396,7 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
         return HTTP_INTERNAL_SERVER_ERROR;
     }
     /* parse the reponse */
-    result = ajp_parse_type(r, conn->data);
+    result = ajp_parse_type(r, data->rmsg);
     output_brigade = apr_brigade_create(p, r->connection->bucket_alloc);
 
     /*
@@ -445,7 +482,7 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
                     break;
                 }
                 /* AJP13_SEND_HEADERS: process them */
-                status = ajp_parse_header(r, conf, conn->data);
+                status = ajp_parse_header(r, conf, data->rmsg);
                 if (status != APR_SUCCESS) {
                     backend_failed = 1;
                 }
@@ -464,7 +501,7 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
                 break;
             case CMD_AJP13_SEND_BODY_CHUNK:
                 /* AJP13_SEND_BODY_CHUNK: piece of data */
-                status = ajp_parse_data(r, conn->data, &size, &send_body_chunk_buff);
+                status = ajp_parse_data(r, data->rmsg, &size, &send_body_chunk_buff);
                 if (status == APR_SUCCESS) {
                     /* If we are overriding the errors, we can't put the content
                      * of the page into the brigade.
@@ -486,6 +523,7 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
                         }
                         else {
                             apr_status_t rv;
+                            apr_byte_t next;
 
                             /* Handle the case where the error document is itself reverse
                              * proxied and was successful. We must maintain any previous
@@ -501,6 +539,19 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
                             e = apr_bucket_transient_create(send_body_chunk_buff, size,
                                                         r->connection->bucket_alloc);
                             APR_BRIGADE_INSERT_TAIL(output_brigade, e);
+                            conn->worker->s->read += size;
+
+                            /* If more of the body is read ahead already,
+                             * gather it before passing anything: it stays
+                             * in place until we read from the backend.
+                             */
+                            if (ajp_ilink_pending(data, &next)
+                                && (next == CMD_AJP13_SEND_BODY_CHUNK
+                                    || next == CMD_AJP13_END_RESPONSE)) {
+                                break;
+                            }
+                            coalesce_body(output_brigade,
+                                          r->connection->bucket_alloc);
 
                             if ((conn->worker->s->flush_packets == flush_on) ||
                                 ((conn->worker->s->flush_packets == flush_auto) &&
@@ -511,9 +562,6 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
                                 e = apr_bucket_flush_create(r->connection->bucket_alloc);
                                 APR_BRIGADE_INSERT_TAIL(output_brigade, e);
                             }
-                            apr_brigade_length(output_brigade, 0, &bb_len);
-                            if (bb_len != -1)
-                                conn->worker->s->read += bb_len;
                         }
                         if (headers_sent) {
                             if (ap_pass_brigade(r->output_filters,
@@ -538,7 +586,7 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
                  * the client, especially as the brigade already contains headers.
                  * So do nothing here, and it will be cleaned up below.
                  */
-                status = ajp_parse_reuse(r, conn->data, &conn_reuse);
+                status = ajp_parse_reuse(r, data->rmsg, &conn_reuse);
                 if (status != APR_SUCCESS) {
                     backend_failed = 1;
                 }
@@ -587,15 +635,14 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
             break;
 
         /* read the response */
-        status = ajp_read_header(conn->sock, r, maxsize,
-                                 (ajp_msg_t **)&(conn->data));
+        status = ajp_read_header(conn->sock, r, maxsize, data);
         if (status != APR_SUCCESS) {
             backend_failed = 1;
             ap_log_rerror(APLOG_MARK, APLOG_DEBUG, status, r, APLOGNO(00889)
                           "ajp_read_header failed");
             break;
         }
-        result = ajp_parse_type(r, conn->data);
+        result = ajp_parse_type(r, data->rmsg);
     }
     apr_brigade_destroy(input_brigade);
 
@@ -719,6 +766,11 @@ static int ap_proxy_ajp_request(apr_pool_t *p, request_rec *r,
         conn->close = 1;
     }
 
+    /* Don't let the next request see anything read ahead after the end */
+    if (data->rbuf_pos != data->rbuf_len) {
+        conn->close = 1;
+    }
+
     return rv;
 }
 
@@ -17,6 +17,7 @@
 /* Load balancer module for Apache proxy */
 
 #include "mod_proxy.h"
+#include "proxy_latency.h"
 #include "scoreboard.h"
 #include "ap_mpm.h"
 #include "apr_version.h"
@@ -31,6 +32,17 @@ module AP_MODULE_DECLARE_DATA proxy_balancer_module;
 static int (*ap_proxy_retry_worker_fn)(const char *proxy_function,
         proxy_worker *worker, server_rec *s) = NULL;
 
+static ap_filter_rec_t *latency_filter_handle;
+
+/*
+ * The latency sample of a request, from the election of its worker to the
+ * start of the response (see update_latency()).
+ */
+typedef struct {
+    apr_time_t elected;
+    apr_time_t responded;       /* 0 until the response starts */
+} balancer_latency_t;
+
 /*
  * Register our mutex type before the config is read so we
  * can adjust the mutex settings using the Mutex directive.
@@ -335,6 +347,7 @@ static proxy_worker *find_best_worker(proxy_balancer *balancer,
         return NULL;
     }
 
+    /* The finder skips the member named by PROXY_RETRY_NOTE, if any */
     candidate = (*balancer->lbmethod->finder)(balancer, r);
 
     if (candidate)
@@ -487,8 +500,12 @@ static int proxy_balancer_pre_request(proxy_worker **worker,
     /* TODO: Implement as provider! */
     ap_proxy_sync_balancer(*balancer, r->server, conf);
 
-    /* Step 4: find the session route */
+    /* Step 4: find the session route, unless the request failed on it */
     runtime = find_session_route(*balancer, r, &route, &sticky, url);
+    if (runtime && PROXY_WORKER_IS_RETRIED(runtime,
+                        apr_table_get(r->notes, PROXY_RETRY_NOTE))) {
+        runtime = NULL;
+    }
     if (runtime) {
         if ((*balancer)->lbmethod && (*balancer)->lbmethod->updatelbstatus) {
             /* Call the LB implementation */
@@ -586,6 +603,25 @@ static int proxy_balancer_pre_request(proxy_worker **worker,
     apr_pool_cleanup_register(r->pool, *worker, decrement_busy_count,
                               apr_pool_cleanup_null);
 
+    /* Remember when the backend was elected so that post_request can
+     * account the response time to the worker (see update_latency()).
+     */
+    {
+        balancer_latency_t *latency;
+
+        latency = ap_get_module_config(r->request_config,
+                                       &proxy_balancer_module);
+        if (!latency) {
+            latency = apr_palloc(r->pool, sizeof(*latency));
+            ap_set_module_config(r->request_config, &proxy_balancer_module,
+                                 latency);
+            ap_add_output_filter_handle(latency_filter_handle, latency, r,
+                                        r->connection);
+        }
+        latency->elected = apr_time_now();
+        latency->responded = 0;
+    }
+
     /* Add balancer/worker info to env. */
     apr_table_setn(r->subprocess_env,
                    "BALANCER_NAME", (*balancer)->s->name);
@@ -618,6 +654,43 @@ static int proxy_balancer_pre_request(proxy_worker **worker,
     return access_status;
 }
 
+/*
+ * Note when the response of the elected worker starts, the end of its
+ * latency sample: the time it takes to stream the body depends on its
+ * size and on the client, not on the backend.
+ */
+static apr_status_t balancer_latency_filter(ap_filter_t *f,
+                                            apr_bucket_brigade *bb)
+{
+    balancer_latency_t *latency = f->ctx;
+
+    if (latency->elected && !latency->responded) {
+        latency->responded = apr_time_now();
+    }
+    ap_remove_output_filter(f);
+    return ap_pass_brigade(f->next, bb);
+}
+
+/* assumed to be mutex protected by caller */
+static void update_latency(proxy_worker *worker, request_rec *r)
+{
+    balancer_latency_t *latency = ap_get_module_config(r->request_config,
+                                                       &proxy_balancer_module);
+    apr_time_t now;
+
+    if (!latency || !latency->elected) {
+        return;
+    }
+    /* the response did not start if the backend failed */
+    now = apr_time_now();
+    proxy_latency_update(worker->s, (latency->responded ? latency->responded
+                                                        : now)
+                                    - latency->elected, now);
+
+    /* Don't account the same election twice (e.g. on failover) */
+    latency->elected = 0;
+}
+
 static int proxy_balancer_post_request(proxy_worker *worker,
                                        proxy_balancer *balancer,
                                        request_rec *r,
@@ -664,6 +737,8 @@ static int proxy_balancer_post_request(proxy_worker *worker,
 
     }
 
+    update_latency(worker, r);
+
     if ((rv = PROXY_THREAD_UNLOCK(balancer)) != APR_SUCCESS) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01175)
                       "%s: Unlock failed for post_request", balancer->s->name);
@@ -1377,6 +1452,9 @@ static int balancer_handler(request_rec *r)
                 ap_rprintf(r,
                            "          <httpd:busy>%" APR_SIZE_T_FMT "</httpd:busy>\n",
                            worker->s->busy);
+                ap_rprintf(r,
+                           "          <httpd:latency>%" APR_TIME_T_FMT "</httpd:latency>\n",
+                           worker->s->latency);
                 ap_rprintf(r, "          <httpd:lbset>%d</httpd:lbset>\n",
                            worker->s->lbset);
                 /* End proxy_worker_stat */
@@ -1522,7 +1600,8 @@ static int balancer_handler(request_rec *r)
                 "<th>Worker URL</th>"
                 "<th>Route</th><th>RouteRedir</th>"
                 "<th>Factor</th><th>Set</th><th>Status</th>"
-                "<th>Elected</th><th>Busy</th><th>Load</th><th>To</th><th>From</th>"
+                "<th>Elected</th><th>Busy</th><th>Load</th><th>Latency</th>"
+                "<th>To</th><th>From</th>"
                 "</tr>\n", r);
 
             workers = (proxy_worker **)balancer->workers->elts;
@@ -1547,7 +1626,9 @@ static int balancer_handler(request_rec *r)
                 ap_rputs("</td>", r);
                 ap_rprintf(r, "<td>%" APR_SIZE_T_FMT "</td>", worker->s->elected);
                 ap_rprintf(r, "<td>%" APR_SIZE_T_FMT "</td>", worker->s->busy);
-                ap_rprintf(r, "<td>%d</td><td>", worker->s->lbstatus);
+                ap_rprintf(r, "<td>%d</td>", worker->s->lbstatus);
+                ap_rprintf(r, "<td>%" APR_TIME_T_FMT "ms</td><td>",
+                           apr_time_as_msec(worker->s->latency));
                 ap_rputs(apr_strfsize(worker->s->transferred, fbuf), r);
                 ap_rputs("</td><td>", r);
                 ap_rputs(apr_strfsize(worker->s->read, fbuf), r);
@@ -1706,6 +1787,10 @@ static void ap_proxy_balancer_register_hook(apr_pool_t *p)
     ap_hook_child_init(balancer_child_init, aszPred, NULL, APR_HOOK_MIDDLE);
     proxy_hook_pre_request(proxy_balancer_pre_request, NULL, NULL, APR_HOOK_FIRST);
     proxy_hook_post_request(proxy_balancer_post_request, NULL, NULL, APR_HOOK_FIRST);
+    latency_filter_handle =
+        ap_register_output_filter("PROXY_BALANCER_LATENCY",
+                                  balancer_latency_filter, NULL,
+                                  AP_FTYPE_CONTENT_SET);
     proxy_hook_canon_handler(proxy_balancer_canon, NULL, NULL, APR_HOOK_FIRST);
 }
 
@@ -143,15 +143,30 @@ static int proxy_connect_canon(request_rec *r, char *url)
     return OK;
 }
 
-/* read available data (in blocks of CONN_BLKSZ) from c_i and copy to c_o */
+/* read available data (in blocks of CONN_BLKSZ) from c_i and copy to c_o,
+ * once the filters have been drained switch to zero-copy if possible.
+ */
 static int proxy_connect_transfer(request_rec *r, conn_rec *c_i, conn_rec *c_o,
-                                  apr_bucket_brigade *bb, char *name)
+                                  apr_bucket_brigade *bb, char *name,
+                                  proxy_splice_t **ps, int *try_splice)
 {
     int rv;
 #ifdef DEBUGGING
     apr_off_t len;
 #endif
 
+    if (*ps) {
+        apr_off_t spliced;
+
+        rv = ap_proxy_splice_transfer(*ps, &spliced);
+        if (rv != APR_SUCCESS && !APR_STATUS_IS_EOF(rv)) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, APLOGNO(02857)
+                          "error on %s - ap_proxy_splice_transfer",
+                          name);
+        }
+        return rv;
+    }
+
     do {
         apr_brigade_cleanup(bb);
         rv = ap_get_brigade(c_i->input_filters, bb, AP_MODE_READBYTES,
@@ -186,6 +201,10 @@ static int proxy_connect_transfer(request_rec *r, conn_rec *c_i, conn_rec *c_o,
 
     if (APR_STATUS_IS_EAGAIN(rv)) {
         rv = APR_SUCCESS;
+        if (*try_splice) {
+            *ps = ap_proxy_splice_create(r, c_i, c_o);
+            *try_splice = 0;
+        }
     }
     return rv;
 }
@@ -217,6 +236,8 @@ static int proxy_connect_handler(request_rec *r, proxy_worker *worker,
     apr_int32_t pollcnt, pi;
     apr_int16_t pollevent;
     apr_sockaddr_t *nexthop;
+    proxy_splice_t *splice_in = NULL, *splice_out = NULL;
+    int try_splice_in = 1, try_splice_out = 1;
 
     apr_uri_t uri;
     const char *connectname;
@@ -414,6 +435,11 @@ static int proxy_connect_handler(request_rec *r, proxy_worker *worker,
     r->proto_input_filters = c->input_filters;
 /*    r->sent_bodyct = 1;*/
 
+    /* The request has been read, mod_reqtimeout has nothing left to
+     * time out (and would prevent splicing the client side).
+     */
+    ap_remove_input_filter_byhandle(c->input_filters, "reqtimeout");
+
     do { /* Loop until done (one side closes the connection, or an error) */
         rv = apr_pollset_poll(pollset, -1, &pollcnt, &signalled);
         if (rv != APR_SUCCESS) {
@@ -440,7 +466,9 @@ static int proxy_connect_handler(request_rec *r, proxy_worker *worker,
                                   "sock was readable");
 #endif
                     done |= proxy_connect_transfer(r, backconn, c, bb,
-                                                   "sock") != APR_SUCCESS;
+                                                   "sock", &splice_out,
+                                                   &try_splice_out)
+                            != APR_SUCCESS;
                 }
                 else if (pollevent & APR_POLLERR) {
                     ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, APLOGNO(01026)
@@ -457,7 +485,9 @@ static int proxy_connect_handler(request_rec *r, proxy_worker *worker,
                                   "client was readable");
 #endif
                     done |= proxy_connect_transfer(r, c, backconn, bb,
-                                                   "client") != APR_SUCCESS;
+                                                   "client", &splice_in,
+                                                   &try_splice_in)
+                            != APR_SUCCESS;
                 }
                 else if (pollevent & APR_POLLERR) {
                     ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, APLOGNO(02827)
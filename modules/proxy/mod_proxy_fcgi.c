@@ -17,13 +17,131 @@
 #include "mod_proxy.h"
 #include "util_fcgi.h"
 #include "util_script.h"
+#include "ap_mpm.h"
+#include "apr_hash.h"
+#if APR_HAS_THREADS
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#endif
 
 module AP_MODULE_DECLARE_DATA proxy_fcgi_module;
 
+#define FCGI_SCHEME "FCGI"
+
 typedef struct {
     int need_dirwalk;
 } fcgi_req_config_t;
 
+/* State of a request sharing a multiplexed backend connection, NULL
+ * when the request has the connection for itself.
+ */
+typedef struct fcgi_mux_req_t fcgi_mux_req_t;
+
+#if APR_HAS_THREADS
+
+/*
+ * FastCGI connection multiplexing
+ *
+ * When the application says (FCGI_GET_VALUES) that it accepts several
+ * requests on the same connection (FCGI_MPXS_CONNS), concurrent requests
+ * of a child to a worker share a backend connection, each using its own
+ * request id, up to FCGI_MAX_REQS (and FCGI_MUX_MAX_REQS) of them.
+ *
+ * There is no dedicated thread: whichever request needs a record while
+ * nobody is reading the socket becomes the reader; it reads one record,
+ * queues it to the request it belongs to and wakes up the waiters (one
+ * of which will become the next reader).  Records are written whole,
+ * under the write_mutex.
+ *
+ * A request leaving before its FCGI_END_REQUEST sends FCGI_ABORT_REQUEST
+ * and its id stays reserved (records for it are dropped) until the
+ * FCGI_END_REQUEST arrives.  The connection goes back to the worker's
+ * pool when its last request leaves, and is closed if some request id
+ * is still pending then, or if an I/O error occurred.
+ *
+ * Since a request sends its whole body before reading any record, only
+ * requests with a small body are multiplexed (FCGI_MUX_MAX_BODY), so that
+ * an application writing output before reading all of its input can't
+ * dead-lock with us.
+ *
+ * The records queued for a request are limited (FCGI_MUX_MAX_QUEUED), and
+ * FastCGI has no flow control per request id, so a slow client must not
+ * stop the socket from being read for the others: a request whose queue
+ * overflows while it shares the connection is aborted alone (its records
+ * are dropped until the FCGI_END_REQUEST).  A request alone on the
+ * connection is only slowed down, the socket is not read until it consumed
+ * its records, and no other request joins the connection meanwhile.
+ * A request waiting for its records longer than the socket timeout gives
+ * up alone, the connection stays usable by the others.
+ *
+ * The application is asked about multiplexing with a short timeout
+ * (FCGI_MUX_PROBE_TIMEOUT), and assumed not to multiplex if it does not
+ * answer in time.
+ */
+#define FCGI_MUX_MAX_REQS 64
+#define FCGI_MUX_MAX_BODY (64 * 1024)
+#define FCGI_MUX_MAX_QUEUED (256 * 1024)
+#define FCGI_MUX_PROBE_TIMEOUT apr_time_from_sec(2)
+
+typedef struct fcgi_mux_rec_t fcgi_mux_rec_t;
+struct fcgi_mux_rec_t {
+    fcgi_mux_rec_t *next;
+    apr_size_t len;             /* header + content + padding */
+    apr_size_t pos;             /* bytes consumed by the request */
+    unsigned char data[1];
+};
+
+typedef struct fcgi_mux_conn_t fcgi_mux_conn_t;
+
+struct fcgi_mux_req_t {
+    fcgi_mux_conn_t *mc;
+    apr_uint16_t request_id;
+    int ended;                  /* FCGI_END_REQUEST received */
+    int overrun;                /* queue overflowed, records dropped */
+    int stalling;               /* queue full, counted in mc->nfull */
+    fcgi_mux_rec_t *cur;        /* record being consumed */
+    fcgi_mux_rec_t *first;      /* queued records */
+    fcgi_mux_rec_t *last;
+    apr_size_t queued;          /* bytes queued */
+};
+
+struct fcgi_mux_conn_t {
+    fcgi_mux_conn_t *next;
+    apr_pool_t *pool;
+    proxy_conn_rec *conn;
+    server_rec *s;
+    apr_thread_mutex_t *mutex;  /* protects the below and the queues */
+    apr_thread_mutex_t *write_mutex;
+    apr_thread_cond_t *cond;
+    fcgi_mux_req_t **reqs;      /* by request id, NULL if unused */
+    int max_reqs;
+    int nreqs;                  /* requests using the connection */
+    int naborted;               /* ids waiting for their END_REQUEST */
+    int nfull;                  /* stalling requests, socket not read */
+    int reading;                /* some request is reading the socket */
+    int broken;
+};
+
+typedef struct {
+    int mpxs;                   /* -1: not asked yet, 0: no, 1: yes */
+    int max_reqs;
+    fcgi_mux_conn_t *conns;
+} fcgi_mux_worker_t;
+
+/* Marks the ids of requests which left before their END_REQUEST */
+static fcgi_mux_req_t mux_aborted;
+
+/* Per child, NULL if multiplexing is not usable (non-threaded MPM) */
+static apr_thread_mutex_t *mux_mutex = NULL;
+static apr_pool_t *mux_pool;
+static apr_hash_t *mux_workers;
+
+#endif /* APR_HAS_THREADS */
+
+static apr_status_t mux_get_data(fcgi_mux_req_t *mux, char *buffer,
+                                 apr_size_t *buflen);
+static void mux_set_broken(fcgi_mux_req_t *mux);
+
 /*
  * Canonicalise http-like URLs.
  * scheme is the scheme for the URL
@@ -133,8 +251,12 @@ static int proxy_fcgi_canon(request_rec *r, char *url)
     return OK;
 }
 
-/* Wrapper for apr_socket_sendv that handles updating the worker stats. */
+/* Wrapper for apr_socket_sendv that handles updating the worker stats.
+ * The vectors must make whole records, so that those of multiplexed
+ * requests don't interleave.
+ */
 static apr_status_t send_data(proxy_conn_rec *conn,
+                              fcgi_mux_req_t *mux,
                               struct iovec *vec,
                               int nvec,
                               apr_size_t *len)
@@ -148,6 +270,12 @@ static apr_status_t send_data(proxy_conn_rec *conn,
         to_write += vec[i].iov_len;
     }
 
+#if APR_HAS_THREADS
+    if (mux) {
+        apr_thread_mutex_lock(mux->mc->write_mutex);
+    }
+#endif
+
     offset = 0;
     while (to_write) {
         apr_size_t n = 0;
@@ -175,16 +303,34 @@ static apr_status_t send_data(proxy_conn_rec *conn,
     conn->worker->s->transferred += written;
     *len = written;
 
+#if APR_HAS_THREADS
+    if (mux) {
+        if (rv != APR_SUCCESS) {
+            /* Don't let anyone write after a partial record */
+            mux_set_broken(mux);
+        }
+        apr_thread_mutex_unlock(mux->mc->write_mutex);
+    }
+#endif
+
     return rv;
 }
 
-/* Wrapper for apr_socket_recv that handles updating the worker stats. */
+/* Wrapper for apr_socket_recv that handles updating the worker stats.
+ * Multiplexed requests read from the records demultiplexed for them.
+ */
 static apr_status_t get_data(proxy_conn_rec *conn,
+                             fcgi_mux_req_t *mux,
                              char *buffer,
                              apr_size_t *buflen)
 {
-    apr_status_t rv = apr_socket_recv(conn->sock, buffer, buflen);
+    apr_status_t rv;
+
+    if (mux) {
+        return mux_get_data(mux, buffer, buflen);
+    }
 
+    rv = apr_socket_recv(conn->sock, buffer, buflen);
     if (rv == APR_SUCCESS) {
         conn->worker->s->read += *buflen;
     }
@@ -193,6 +339,7 @@ static apr_status_t get_data(proxy_conn_rec *conn,
 }
 
 static apr_status_t get_data_full(proxy_conn_rec *conn,
+                                  fcgi_mux_req_t *mux,
                                   char *buffer,
                                   apr_size_t buflen)
 {
@@ -202,7 +349,7 @@ static apr_status_t get_data_full(proxy_conn_rec *conn,
 
     do {
         readlen = buflen - cumulative_len;
-        rv = get_data(conn, buffer + cumulative_len, &readlen);
+        rv = get_data(conn, mux, buffer + cumulative_len, &readlen);
         if (rv != APR_SUCCESS) {
             return rv;
         }
@@ -212,7 +359,624 @@ static apr_status_t get_data_full(proxy_conn_rec *conn,
     return APR_SUCCESS;
 }
 
+#if APR_HAS_THREADS
+
+/* Decode the length of a name or value in a FastCGI name-value pair */
+static int get_nv_len(const unsigned char **p, const unsigned char *end,
+                      apr_size_t *len)
+{
+    const unsigned char *b = *p;
+
+    if (b >= end) {
+        return 0;
+    }
+    if (*b & 0x80) {
+        if (end - b < 4) {
+            return 0;
+        }
+        *len = ((apr_size_t)(b[0] & 0x7f) << 24) | (b[1] << 16)
+               | (b[2] << 8) | b[3];
+        *p += 4;
+    }
+    else {
+        *len = *b;
+        *p += 1;
+    }
+    return 1;
+}
+
+static apr_status_t get_values_probe(proxy_conn_rec *conn, request_rec *r,
+                                     int *mpxs, int *max_reqs)
+{
+    static const char names[] = "\x0f\x00" "FCGI_MPXS_CONNS"
+                                "\x0d\x00" "FCGI_MAX_REQS";
+    struct iovec vec[2];
+    ap_fcgi_header header;
+    unsigned char farray[AP_FCGI_HEADER_LEN];
+    unsigned char *buf;
+    const unsigned char *p, *end;
+    apr_uint16_t clen, rid;
+    unsigned char plen, type, version;
+    apr_size_t len;
+    apr_status_t rv;
+
+    *mpxs = 0;
+    *max_reqs = 1;
+
+    ap_fcgi_fill_in_header(&header, AP_FCGI_GET_VALUES, 0,
+                           sizeof(names) - 1, 0);
+    ap_fcgi_header_to_array(&header, farray);
+    vec[0].iov_base = (void *)farray;
+    vec[0].iov_len = sizeof(farray);
+    vec[1].iov_base = (void *)names;
+    vec[1].iov_len = sizeof(names) - 1;
+    rv = send_data(conn, NULL, vec, 2, &len);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    rv = get_data_full(conn, NULL, (char *)farray, AP_FCGI_HEADER_LEN);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    ap_fcgi_header_fields_from_array(&version, &type, &rid, &clen, &plen,
+                                     farray);
+    if (version != AP_FCGI_VERSION_1 || rid != 0
+        || (type != AP_FCGI_GET_VALUES_RESULT
+            && type != AP_FCGI_UNKNOWN_TYPE)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02864)
+                      "Got bogus record %d (rid %d) for FCGI_GET_VALUES",
+                      type, rid);
+        return APR_EINVAL;
+    }
+
+    buf = apr_palloc(r->pool, clen + plen);
+    rv = get_data_full(conn, NULL, (char *)buf, clen + plen);
+    if (rv != APR_SUCCESS || type != AP_FCGI_GET_VALUES_RESULT) {
+        return rv;
+    }
+
+    p = buf;
+    end = buf + clen;
+    for (;;) {
+        apr_size_t nlen, vlen;
+        char *val;
+
+        if (!get_nv_len(&p, end, &nlen) || !get_nv_len(&p, end, &vlen)
+            || (apr_size_t)(end - p) < nlen + vlen) {
+            break;
+        }
+        val = apr_pstrmemdup(r->pool, (const char *)p + nlen, vlen);
+        if (nlen == 15 && !memcmp(p, "FCGI_MPXS_CONNS", 15)) {
+            *mpxs = (atoi(val) > 0);
+        }
+        else if (nlen == 13 && !memcmp(p, "FCGI_MAX_REQS", 13)) {
+            *max_reqs = atoi(val);
+        }
+        p += nlen + vlen;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02865)
+                  "FCGI_MPXS_CONNS=%d, FCGI_MAX_REQS=%d for %s",
+                  *mpxs, *max_reqs, conn->worker->s->name);
+    return APR_SUCCESS;
+}
+
+/*
+ * Ask the application whether it multiplexes connections, and how many
+ * concurrent requests it accepts.  *mpxs is set to 0 if it does not know
+ * FCGI_GET_VALUES.  The answer is waited for FCGI_MUX_PROBE_TIMEOUT at
+ * most, the connection can't be used anymore if this fails.
+ */
+static apr_status_t get_values(proxy_conn_rec *conn, request_rec *r,
+                               int *mpxs, int *max_reqs)
+{
+    apr_interval_time_t timeout;
+    apr_status_t rv;
+
+    apr_socket_timeout_get(conn->sock, &timeout);
+    if (timeout < 0 || timeout > FCGI_MUX_PROBE_TIMEOUT) {
+        apr_socket_timeout_set(conn->sock, FCGI_MUX_PROBE_TIMEOUT);
+    }
+    rv = get_values_probe(conn, r, mpxs, max_reqs);
+    apr_socket_timeout_set(conn->sock, timeout);
+
+    return rv;
+}
+
+static void mux_child_init(apr_pool_t *p, server_rec *s)
+{
+    int threaded;
+
+    if (ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) != APR_SUCCESS
+        || threaded == AP_MPMQ_NOT_SUPPORTED) {
+        /* One request at a time, nothing to share */
+        return;
+    }
+    if (apr_thread_mutex_create(&mux_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                p) != APR_SUCCESS) {
+        mux_mutex = NULL;
+        return;
+    }
+    apr_pool_create(&mux_pool, p);
+    apr_pool_tag(mux_pool, "proxy_fcgi_mux");
+    mux_workers = apr_hash_make(mux_pool);
+}
+
+/* Must be called with mux_mutex held */
+static fcgi_mux_worker_t *mux_get_worker(proxy_worker *worker)
+{
+    fcgi_mux_worker_t *mw;
+
+    mw = apr_hash_get(mux_workers, &worker, sizeof(worker));
+    if (!mw) {
+        proxy_worker **key = apr_palloc(mux_pool, sizeof(*key));
+        *key = worker;
+        mw = apr_pcalloc(mux_pool, sizeof(*mw));
+        mw->mpxs = -1;
+        apr_hash_set(mux_workers, key, sizeof(*key), mw);
+    }
+    return mw;
+}
+
+/* Must be called with mc->mutex held */
+static fcgi_mux_req_t *mux_new_req(fcgi_mux_conn_t *mc, request_rec *r)
+{
+    fcgi_mux_req_t *mux;
+    int id;
+
+    if (mc->broken || mc->nfull) {
+        return NULL;
+    }
+    for (id = 1; id <= mc->max_reqs; id++) {
+        if (!mc->reqs[id]) {
+            break;
+        }
+    }
+    if (id > mc->max_reqs) {
+        return NULL;
+    }
+
+    mux = apr_pcalloc(r->pool, sizeof(*mux));
+    mux->mc = mc;
+    mux->request_id = (apr_uint16_t)id;
+    mc->reqs[id] = mux;
+    mc->nreqs++;
+    return mux;
+}
+
+/*
+ * Join a multiplexed connection to the worker having a free request id,
+ * or if backend is given, make it a new multiplexed connection.
+ */
+static fcgi_mux_req_t *mux_join(request_rec *r, proxy_worker *worker,
+                                proxy_conn_rec *backend)
+{
+    fcgi_mux_worker_t *mw;
+    fcgi_mux_conn_t *mc;
+    fcgi_mux_req_t *mux = NULL;
+
+    apr_thread_mutex_lock(mux_mutex);
+    mw = mux_get_worker(worker);
+    if (!backend) {
+        for (mc = mw->conns; mc && !mux; mc = mc->next) {
+            apr_thread_mutex_lock(mc->mutex);
+            mux = mux_new_req(mc, r);
+            apr_thread_mutex_unlock(mc->mutex);
+        }
+    }
+    else {
+        apr_pool_t *pool;
+
+        apr_pool_create(&pool, mux_pool);
+        mc = apr_pcalloc(pool, sizeof(*mc));
+        mc->pool = pool;
+        mc->conn = backend;
+        mc->s = r->server;
+        mc->max_reqs = mw->max_reqs;
+        mc->reqs = apr_pcalloc(pool, (mc->max_reqs + 1) * sizeof(*mc->reqs));
+        if (apr_thread_mutex_create(&mc->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                    pool) == APR_SUCCESS
+            && apr_thread_mutex_create(&mc->write_mutex,
+                                       APR_THREAD_MUTEX_DEFAULT,
+                                       pool) == APR_SUCCESS
+            && apr_thread_cond_create(&mc->cond, pool) == APR_SUCCESS) {
+            mux = mux_new_req(mc, r);
+            mc->next = mw->conns;
+            mw->conns = mc;
+        }
+        else {
+            apr_pool_destroy(pool);
+        }
+    }
+    apr_thread_mutex_unlock(mux_mutex);
+
+    if (mux) {
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE2, 0, r,
+                      "multiplexing request id %d on connection to %s",
+                      mux->request_id, worker->s->name);
+    }
+    return mux;
+}
+
+/* Must be called with mc->mutex held */
+static void mux_free_records(fcgi_mux_req_t *mux)
+{
+    fcgi_mux_rec_t *rec;
+
+    if (mux->cur) {
+        free(mux->cur);
+        mux->cur = NULL;
+    }
+    while ((rec = mux->first)) {
+        mux->first = rec->next;
+        free(rec);
+    }
+    mux->last = NULL;
+    if (mux->stalling) {
+        /* The socket can be read again */
+        mux->stalling = 0;
+        mux->mc->nfull--;
+        apr_thread_cond_broadcast(mux->mc->cond);
+    }
+    mux->queued = 0;
+}
+
+/*
+ * Invalidate the connection after an I/O error: no request can join it
+ * anymore, those using it fail their next read or write, and it is closed
+ * when the last of them leaves (mux_leave).  The socket itself can't be
+ * closed before, the reader may be blocked on it; with wakeup it is shut
+ * down so that this reader fails now rather than at the socket timeout.
+ * The caller must be counted in mc->nreqs and hold no mutex.
+ */
+static void mux_invalidate(fcgi_mux_conn_t *mc, int wakeup)
+{
+    fcgi_mux_worker_t *mw;
+    fcgi_mux_conn_t **pmc;
+
+    apr_thread_mutex_lock(mux_mutex);
+    apr_thread_mutex_lock(mc->mutex);
+    if (!mc->broken) {
+        mc->broken = 1;
+        mc->conn->close = 1;
+        mw = mux_get_worker(mc->conn->worker);
+        for (pmc = &mw->conns; *pmc; pmc = &(*pmc)->next) {
+            if (*pmc == mc) {
+                *pmc = mc->next;
+                break;
+            }
+        }
+        if (wakeup && mc->reading) {
+            apr_socket_shutdown(mc->conn->sock, APR_SHUTDOWN_READWRITE);
+        }
+    }
+    apr_thread_cond_broadcast(mc->cond);
+    apr_thread_mutex_unlock(mc->mutex);
+    apr_thread_mutex_unlock(mux_mutex);
+}
+
+static void mux_set_broken(fcgi_mux_req_t *mux)
+{
+    mux_invalidate(mux->mc, 1);
+}
+
+/* Read a whole record from the socket.  APR_TIMEUP is returned only if
+ * nothing was read, otherwise the connection is out of sync on failure.
+ */
+static apr_status_t mux_read_record(fcgi_mux_conn_t *mc,
+                                    fcgi_mux_rec_t **prec)
+{
+    unsigned char farray[AP_FCGI_HEADER_LEN];
+    apr_uint16_t clen, rid;
+    unsigned char plen, type, version;
+    fcgi_mux_rec_t *rec;
+    apr_size_t got = 0, len;
+    apr_status_t rv;
+
+    do {
+        len = AP_FCGI_HEADER_LEN - got;
+        rv = get_data(mc->conn, NULL, (char *)farray + got, &len);
+        if (rv != APR_SUCCESS) {
+            return got && APR_STATUS_IS_TIMEUP(rv) ? APR_ECONNABORTED : rv;
+        }
+        got += len;
+    } while (got < AP_FCGI_HEADER_LEN);
+    ap_fcgi_header_fields_from_array(&version, &type, &rid, &clen, &plen,
+                                     farray);
+
+    rec = ap_malloc(sizeof(*rec) + AP_FCGI_HEADER_LEN + clen + plen);
+    rec->next = NULL;
+    rec->pos = 0;
+    rec->len = AP_FCGI_HEADER_LEN + clen + plen;
+    memcpy(rec->data, farray, AP_FCGI_HEADER_LEN);
+    if (clen + plen) {
+        rv = get_data_full(mc->conn, NULL,
+                           (char *)rec->data + AP_FCGI_HEADER_LEN,
+                           clen + plen);
+        if (rv != APR_SUCCESS) {
+            free(rec);
+            return APR_STATUS_IS_TIMEUP(rv) ? APR_ECONNABORTED : rv;
+        }
+    }
+    *prec = rec;
+    return APR_SUCCESS;
+}
+
+/* Hand a record to its request, must be called with mc->mutex held */
+static void mux_queue_record(fcgi_mux_conn_t *mc, fcgi_mux_rec_t *rec)
+{
+    apr_uint16_t rid = (rec->data[AP_FCGI_HDR_REQUEST_ID_B1_OFFSET] << 8)
+                       | rec->data[AP_FCGI_HDR_REQUEST_ID_B0_OFFSET];
+    unsigned char type = rec->data[AP_FCGI_HDR_TYPE_OFFSET];
+    fcgi_mux_req_t *mux = NULL;
+
+    if (rid >= 1 && rid <= mc->max_reqs) {
+        mux = mc->reqs[rid];
+    }
+    if (!mux || mux == &mux_aborted) {
+        if (mux && type == AP_FCGI_END_REQUEST) {
+            /* The id can be used again */
+            mc->reqs[rid] = NULL;
+            mc->naborted--;
+        }
+        else if (!mux) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, mc->s, APLOGNO(02866)
+                         "dropping FastCGI record %d for unknown "
+                         "request id %d", type, rid);
+        }
+        free(rec);
+        return;
+    }
+
+    if (type == AP_FCGI_END_REQUEST) {
+        mux->ended = 1;
+    }
+    if (mux->overrun) {
+        free(rec);
+        return;
+    }
+    if (mux->last) {
+        mux->last->next = rec;
+    }
+    else {
+        mux->first = rec;
+    }
+    mux->last = rec;
+    mux->queued += rec->len;
+    if (mux->queued >= FCGI_MUX_MAX_QUEUED && !mux->stalling) {
+        if (mc->nreqs > 1) {
+            /* Don't make the others wait for this request's client */
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, mc->s, APLOGNO(02957)
+                         "FastCGI request id %d has more than %d bytes "
+                         "of output pending on a shared connection, "
+                         "aborting it", rid, FCGI_MUX_MAX_QUEUED);
+            mux->overrun = 1;
+        }
+        else {
+            /* Stop reading until the request consumed its records */
+            mux->stalling = 1;
+            mc->nfull++;
+        }
+    }
+}
+
+/* Get the next record of this request, reading the socket if needed,
+ * or waiting for someone else to read it no longer than the socket
+ * timeout.
+ */
+static apr_status_t mux_next_record(fcgi_mux_req_t *mux)
+{
+    fcgi_mux_conn_t *mc = mux->mc;
+    fcgi_mux_rec_t *rec;
+    apr_interval_time_t timeout;
+    apr_time_t deadline;
+    apr_status_t rv = APR_SUCCESS;
+
+    apr_socket_timeout_get(mc->conn->sock, &timeout);
+    deadline = apr_time_now() + timeout;
+
+    apr_thread_mutex_lock(mc->mutex);
+    for (;;) {
+        if (mux->overrun) {
+            /* Its queued records are freed when it leaves */
+            rv = APR_ECONNABORTED;
+            break;
+        }
+        if (mux->first) {
+            mux->cur = mux->first;
+            mux->first = mux->cur->next;
+            if (!mux->first) {
+                mux->last = NULL;
+            }
+            mux->queued -= mux->cur->len;
+            if (mux->stalling && mux->queued < FCGI_MUX_MAX_QUEUED) {
+                /* The socket can be read again */
+                mux->stalling = 0;
+                mc->nfull--;
+                apr_thread_cond_broadcast(mc->cond);
+            }
+            break;
+        }
+        if (mc->broken) {
+            rv = APR_ECONNABORTED;
+            break;
+        }
+        if (mc->reading || mc->nfull) {
+            if (timeout < 0) {
+                apr_thread_cond_wait(mc->cond, mc->mutex);
+            }
+            else {
+                apr_time_t now = apr_time_now();
+                if (now >= deadline) {
+                    /* Only this request gives up */
+                    rv = APR_TIMEUP;
+                    break;
+                }
+                apr_thread_cond_timedwait(mc->cond, mc->mutex,
+                                          deadline - now);
+            }
+            continue;
+        }
+
+        /* Nobody is reading, our turn */
+        mc->reading = 1;
+        apr_thread_mutex_unlock(mc->mutex);
+        rv = mux_read_record(mc, &rec);
+        apr_thread_mutex_lock(mc->mutex);
+        mc->reading = 0;
+        if (APR_STATUS_IS_TIMEUP(rv)) {
+            /* Nothing was lost, let someone else read and give up alone */
+            apr_thread_cond_broadcast(mc->cond);
+            break;
+        }
+        if (rv != APR_SUCCESS) {
+            /* Out of sync, nobody can use the connection anymore */
+            apr_thread_mutex_unlock(mc->mutex);
+            mux_invalidate(mc, 0);
+            return rv;
+        }
+        mux_queue_record(mc, rec);
+        /* Wake up the record's owner, and some next reader */
+        apr_thread_cond_broadcast(mc->cond);
+    }
+    apr_thread_mutex_unlock(mc->mutex);
+
+    return rv;
+}
+
+static apr_status_t mux_get_data(fcgi_mux_req_t *mux, char *buffer,
+                                 apr_size_t *buflen)
+{
+    fcgi_mux_rec_t *rec = mux->cur;
+    apr_size_t avail;
+    apr_status_t rv;
+
+    if (!rec || rec->pos == rec->len) {
+        if (rec) {
+            free(rec);
+            mux->cur = NULL;
+        }
+        rv = mux_next_record(mux);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        rec = mux->cur;
+    }
+
+    avail = rec->len - rec->pos;
+    if (*buflen > avail) {
+        *buflen = avail;
+    }
+    memcpy(buffer, rec->data + rec->pos, *buflen);
+    rec->pos += *buflen;
+
+    return APR_SUCCESS;
+}
+
+/* The request is done with the multiplexed connection */
+static void mux_leave(fcgi_mux_req_t *mux, request_rec *r)
+{
+    fcgi_mux_conn_t *mc = mux->mc;
+    fcgi_mux_worker_t *mw;
+    fcgi_mux_conn_t **pmc;
+    int last, send_abort;
+
+    /* Tell the application to stop working for us, unless the connection
+     * is to be closed anyway.  We are still counted in mc->nreqs, so mc
+     * can't go away meanwhile.
+     */
+    apr_thread_mutex_lock(mc->mutex);
+    send_abort = !mux->ended && !mc->broken && mc->nreqs > 1;
+    apr_thread_mutex_unlock(mc->mutex);
+    if (send_abort) {
+        struct iovec vec[1];
+        ap_fcgi_header header;
+        unsigned char farray[AP_FCGI_HEADER_LEN];
+        apr_size_t len;
+
+        ap_fcgi_fill_in_header(&header, AP_FCGI_ABORT_REQUEST,
+                               mux->request_id, 0, 0);
+        ap_fcgi_header_to_array(&header, farray);
+        vec[0].iov_base = (void *)farray;
+        vec[0].iov_len = sizeof(farray);
+        send_data(mc->conn, mux, vec, 1, &len);
+    }
+
+    apr_thread_mutex_lock(mux_mutex);
+    apr_thread_mutex_lock(mc->mutex);
+    mux_free_records(mux);
+    if (mux->ended) {
+        mc->reqs[mux->request_id] = NULL;
+    }
+    else {
+        mc->reqs[mux->request_id] = &mux_aborted;
+        mc->naborted++;
+    }
+    last = (--mc->nreqs == 0);
+    if (last) {
+        mw = mux_get_worker(mc->conn->worker);
+        for (pmc = &mw->conns; *pmc; pmc = &(*pmc)->next) {
+            if (*pmc == mc) {
+                *pmc = mc->next;
+                break;
+            }
+        }
+    }
+    apr_thread_mutex_unlock(mc->mutex);
+    apr_thread_mutex_unlock(mux_mutex);
+
+    if (!last) {
+        return;
+    }
+
+    /* Nobody else can see mc now, keep the connection alive only if no
+     * record can be pending for a previous request id.
+     */
+    if (mc->broken || mc->naborted) {
+        mc->conn->close = 1;
+    }
+    ap_proxy_release_connection(FCGI_SCHEME, mc->conn, r->server);
+
+    apr_thread_mutex_lock(mux_mutex);
+    apr_pool_destroy(mc->pool);
+    apr_thread_mutex_unlock(mux_mutex);
+}
+
+/*
+ * Whether this request can share a connection: the worker must reuse its
+ * connections (disablereuse=off) and the request body be small enough.
+ */
+static int mux_eligible(request_rec *r, proxy_conn_rec *backend)
+{
+    const char *cl;
+
+    if (!mux_mutex || backend->close) {
+        return 0;
+    }
+    if (apr_table_get(r->headers_in, "Transfer-Encoding")) {
+        return 0;
+    }
+    cl = apr_table_get(r->headers_in, "Content-Length");
+    return !cl || apr_atoi64(cl) <= FCGI_MUX_MAX_BODY;
+}
+
+#else /* APR_HAS_THREADS */
+
+static apr_status_t mux_get_data(fcgi_mux_req_t *mux, char *buffer,
+                                 apr_size_t *buflen)
+{
+    return APR_ENOTIMPL;
+}
+
+static void mux_set_broken(fcgi_mux_req_t *mux)
+{
+}
+
+#endif /* APR_HAS_THREADS */
+
 static apr_status_t send_begin_request(proxy_conn_rec *conn,
+                                       fcgi_mux_req_t *mux,
                                        apr_uint16_t request_id)
 {
     struct iovec vec[2];
@@ -237,24 +1001,121 @@ static apr_status_t send_begin_request(proxy_conn_rec *conn,
     vec[1].iov_base = (void *)abrb;
     vec[1].iov_len = sizeof(abrb);
 
-    return send_data(conn, vec, 2, &len);
+    return send_data(conn, mux, vec, 2, &len);
+}
+
+/* Our limit per FCGI_PARAMS record, which could have been up to
+ * AP_FCGI_MAX_CONTENT_LEN
+ */
+#define FCGI_ENV_RECORD_LEN (16 * 1024)
+
+/*
+ * Variables which ap_add_common_vars()/ap_add_cgi_vars() set from server
+ * data only, overriding any value the request had.  They are encoded once
+ * per vhost at child init, and left out of the encoding of the request's
+ * environment.  So is PATH, from the process environment unless the
+ * request sets it.
+ */
+static const char *const env_static_keys[] = {
+    "GATEWAY_INTERFACE",
+    "SERVER_SOFTWARE",
+    "SERVER_ADMIN"
+};
+#define ENV_NSTATIC ((int)(sizeof(env_static_keys) / sizeof(env_static_keys[0])))
+
+typedef struct {
+    const char *vals[ENV_NSTATIC];
+    char *body;                 /* encoded name-value pairs */
+    apr_size_t len;
+} fcgi_env_static_t;
+
+/* Per child, read only once initialized */
+static apr_hash_t *env_statics;     /* by server_rec */
+static const char *env_path;
+static char *env_path_body;
+static apr_size_t env_path_len;     /* 0 if not encoded */
+
+/* Encode env in a block allocated from p, or return 0 if it's too large */
+static apr_size_t env_static_encode(apr_table_t *env, char **body,
+                                    apr_pool_t *p)
+{
+    apr_size_t len;
+    int elem = 0;
+
+    len = ap_fcgi_encoded_env_len(env, FCGI_ENV_RECORD_LEN / 2, &elem);
+    if (!len || elem != apr_table_elts(env)->nelts) {
+        return 0;
+    }
+    *body = apr_palloc(p, len);
+    elem = 0;
+    if (ap_fcgi_encode_env(NULL, env, *body, len, &elem) != APR_SUCCESS) {
+        return 0;
+    }
+    return len;
 }
 
-static apr_status_t send_environment(proxy_conn_rec *conn, request_rec *r,
+static void env_static_init(apr_pool_t *p, server_rec *main_server)
+{
+    apr_pool_t *ptemp;
+    apr_table_t *env;
+    server_rec *s;
+    int i;
+
+    apr_pool_create(&ptemp, p);
+    env_statics = apr_hash_make(p);
+
+    for (s = main_server; s; s = s->next) {
+        fcgi_env_static_t *st = apr_pcalloc(p, sizeof(*st));
+
+        st->vals[0] = "CGI/1.1";
+        st->vals[1] = ap_get_server_banner();
+        st->vals[2] = s->server_admin;
+        if (!st->vals[2]) {
+            continue;
+        }
+        env = apr_table_make(ptemp, ENV_NSTATIC);
+        for (i = 0; i < ENV_NSTATIC; i++) {
+            apr_table_setn(env, env_static_keys[i], st->vals[i]);
+        }
+        st->len = env_static_encode(env, &st->body, p);
+        if (st->len) {
+            server_rec **key = apr_palloc(p, sizeof(*key));
+            *key = s;
+            apr_hash_set(env_statics, key, sizeof(*key), st);
+        }
+    }
+
+    env_path = getenv("PATH");
+    if (env_path == NULL) {
+        env_path = DEFAULT_PATH;
+    }
+    env_path = apr_pstrdup(p, env_path);
+    env = apr_table_make(ptemp, 1);
+    apr_table_setn(env, "PATH", env_path);
+    env_path_len = env_static_encode(env, &env_path_body, p);
+
+    apr_pool_destroy(ptemp);
+}
+
+static apr_status_t send_environment(proxy_conn_rec *conn,
+                                     fcgi_mux_req_t *mux, request_rec *r,
                                      apr_pool_t *temp_pool,
                                      apr_uint16_t request_id)
 {
     const apr_array_header_t *envarr;
     const apr_table_entry_t *elts;
-    struct iovec vec[2];
+    apr_array_header_t *vecs;
+    struct iovec *vec;
     ap_fcgi_header header;
-    unsigned char farray[AP_FCGI_HEADER_LEN];
+    unsigned char *farray;
     char *body;
     apr_status_t rv;
-    apr_size_t avail_len, len, required_len;
-    int next_elem, starting_elem;
+    apr_size_t avail_len, len, required_len, prefix_len = 0;
+    int next_elem, starting_elem, nelts;
     char *proxyfilename = r->filename;
     fcgi_req_config_t *rconf = ap_get_module_config(r->request_config, &proxy_fcgi_module);
+    fcgi_env_static_t *st;
+    int static_path;
 
     if (rconf) { 
        if (rconf->need_dirwalk) { 
@@ -269,6 +1130,9 @@ static apr_status_t send_environment(proxy_conn_rec *conn, request_rec *r,
         r->filename = newfname;
     }
 
+    /* ap_add_common_vars() keeps the request's PATH, if any */
+    static_path = env_path_len && !apr_table_get(r->subprocess_env, "PATH");
+
     ap_add_common_vars(r);
     ap_add_cgi_vars(r);
  
@@ -295,25 +1159,44 @@ static apr_status_t send_environment(proxy_conn_rec *conn, request_rec *r,
         }
     }
 
-    /* Send envvars over in as many FastCGI records as it takes, */
-    next_elem = 0; /* starting with the first one */
+    /* Send the pre-encoded static variables, and only encode the others
+     * (they are put back in the request's environment once sent).
+     */
+    st = apr_hash_get(env_statics, &r->server, sizeof(r->server));
+    if (st) {
+        int i;
 
-    avail_len = 16 * 1024; /* our limit per record, which could have been up
-                            * to AP_FCGI_MAX_CONTENT_LEN
-                            */
+        for (i = 0; i < ENV_NSTATIC; i++) {
+            apr_table_unset(r->subprocess_env, env_static_keys[i]);
+        }
+        prefix_len += st->len;
+    }
+    if (static_path) {
+        apr_table_unset(r->subprocess_env, "PATH");
+        prefix_len += env_path_len;
+    }
 
-    while (next_elem < envarr->nelts) {
+    /* Build as many FastCGI records as it takes (each having whole
+     * name-value pairs, as some applications require), and send them
+     * all at once.
+     */
+    vecs = apr_array_make(temp_pool, 8, sizeof(struct iovec));
+    nelts = envarr->nelts;
+    next_elem = 0; /* starting with the first one */
+
+    while (prefix_len || next_elem < nelts) {
+        avail_len = FCGI_ENV_RECORD_LEN - prefix_len;
         starting_elem = next_elem;
-        required_len = ap_fcgi_encoded_env_len(r->subprocess_env,
-                                               avail_len,
+        required_len = ap_fcgi_encoded_env_len(r->subprocess_env, avail_len,
                                                &next_elem);
 
-        if (!required_len) {
-            if (next_elem < envarr->nelts) {
+        if (!required_len && !prefix_len) {
+            if (next_elem < nelts) {
                 ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
                               APLOGNO(02536) "couldn't encode envvar '%s' in %"
                               APR_SIZE_T_FMT " bytes",
-                              elts[next_elem].key, avail_len);
+                              elts[next_elem].key,
+                              avail_len);
                 /* skip this envvar and continue */
                 ++next_elem;
                 continue;
@@ -322,39 +1205,66 @@ static apr_status_t send_environment(proxy_conn_rec *conn, request_rec *r,
             break;
         }
 
-        body = apr_palloc(temp_pool, required_len);
-        rv = ap_fcgi_encode_env(r, r->subprocess_env, body, required_len,
-                                &starting_elem);
-        /* we pre-compute, so we can't run out of space */
-        ap_assert(rv == APR_SUCCESS);
-        /* compute and encode must be in sync */
-        ap_assert(starting_elem == next_elem);
-
         ap_fcgi_fill_in_header(&header, AP_FCGI_PARAMS, request_id,
-                               (apr_uint16_t)required_len, 0);
+                               (apr_uint16_t)(prefix_len + required_len), 0);
+        farray = apr_palloc(temp_pool, AP_FCGI_HEADER_LEN);
         ap_fcgi_header_to_array(&header, farray);
+        vec = apr_array_push(vecs);
+        vec->iov_base = (void *)farray;
+        vec->iov_len = AP_FCGI_HEADER_LEN;
+
+        if (prefix_len) {
+            if (st) {
+                vec = apr_array_push(vecs);
+                vec->iov_base = st->body;
+                vec->iov_len = st->len;
+            }
+            if (static_path) {
+                vec = apr_array_push(vecs);
+                vec->iov_base = env_path_body;
+                vec->iov_len = env_path_len;
+            }
+            prefix_len = 0;
+        }
 
-        vec[0].iov_base = (void *)farray;
-        vec[0].iov_len = sizeof(farray);
-        vec[1].iov_base = body;
-        vec[1].iov_len = required_len;
-
-        rv = send_data(conn, vec, 2, &len);
-        apr_pool_clear(temp_pool);
-
-        if (rv) {
-            return rv;
+        if (required_len) {
+            body = apr_palloc(temp_pool, required_len);
+            rv = ap_fcgi_encode_env(r, r->subprocess_env, body, required_len,
+                                    &starting_elem);
+            /* we pre-compute, so we can't run out of space */
+            ap_assert(rv == APR_SUCCESS);
+            /* compute and encode must be in sync */
+            ap_assert(starting_elem == next_elem);
+
+            vec = apr_array_push(vecs);
+            vec->iov_base = body;
+            vec->iov_len = required_len;
         }
     }
 
     /* Envvars sent, so say we're done */
     ap_fcgi_fill_in_header(&header, AP_FCGI_PARAMS, request_id, 0, 0);
+    farray = apr_palloc(temp_pool, AP_FCGI_HEADER_LEN);
     ap_fcgi_header_to_array(&header, farray);
+    vec = apr_array_push(vecs);
+    vec->iov_base = (void *)farray;
+    vec->iov_len = AP_FCGI_HEADER_LEN;
 
-    vec[0].iov_base = (void *)farray;
-    vec[0].iov_len = sizeof(farray);
+    rv = send_data(conn, mux, (struct iovec *)vecs->elts, vecs->nelts, &len);
+    apr_pool_clear(temp_pool);
+
+    if (st) {
+        int i;
 
-    return send_data(conn, vec, 1, &len);
+        for (i = 0; i < ENV_NSTATIC; i++) {
+            apr_table_setn(r->subprocess_env, env_static_keys[i], st->vals[i]);
+        }
+    }
+    if (static_path) {
+        apr_table_setn(r->subprocess_env, "PATH", env_path);
+    }
+
+    return rv;
 }
 
 enum {
@@ -425,7 +1335,8 @@ static int handle_headers(request_rec *r, int *state,
     return 0;
 }
 
-static apr_status_t dispatch(proxy_conn_rec *conn, proxy_dir_conf *conf,
+static apr_status_t dispatch(proxy_conn_rec *conn, fcgi_mux_req_t *mux,
+                             proxy_dir_conf *conf,
                              request_rec *r, apr_pool_t *setaside_pool,
                              apr_uint16_t request_id, const char **err,
                              int *bad_request, int *has_responded)
@@ -463,17 +1374,25 @@ static apr_status_t dispatch(proxy_conn_rec *conn, proxy_dir_conf *conf,
         apr_size_t len;
         int n;
 
-        /* We need SOME kind of timeout here, or virtually anything will
-         * cause timeout errors. */
-        apr_socket_timeout_get(conn->sock, &timeout);
+        if (mux) {
+            /* The socket is shared, send the (small) body and then wait
+             * for our records. */
+            pfd.rtnevents = (pfd.reqevents & APR_POLLOUT) ? APR_POLLOUT
+                                                          : APR_POLLIN;
+        }
+        else {
+            /* We need SOME kind of timeout here, or virtually anything
+             * will cause timeout errors. */
+            apr_socket_timeout_get(conn->sock, &timeout);
 
-        rv = apr_poll(&pfd, 1, &n, timeout);
-        if (rv != APR_SUCCESS) {
-            if (APR_STATUS_IS_EINTR(rv)) {
-                continue;
+            rv = apr_poll(&pfd, 1, &n, timeout);
+            if (rv != APR_SUCCESS) {
+                if (APR_STATUS_IS_EINTR(rv)) {
+                    continue;
+                }
+                *err = "polling";
+                break;
             }
-            *err = "polling";
-            break;
         }
 
         if (pfd.rtnevents & APR_POLLOUT) {
@@ -527,7 +1446,7 @@ static apr_status_t dispatch(proxy_conn_rec *conn, proxy_dir_conf *conf,
                     ++nvec;
                 }
 
-                rv = send_data(conn, vec, nvec, &len);
+                rv = send_data(conn, mux, vec, nvec, &len);
                 if (rv != APR_SUCCESS) {
                     *err = "sending stdin";
                     break;
@@ -551,7 +1470,7 @@ static apr_status_t dispatch(proxy_conn_rec *conn, proxy_dir_conf *conf,
                 vec[0].iov_base = (void *)farray;
                 vec[0].iov_len = sizeof(farray);
 
-                rv = send_data(conn, vec, 1, &len);
+                rv = send_data(conn, mux, vec, 1, &len);
                 if (rv != APR_SUCCESS) {
                     *err = "sending empty stdin";
                     break;
@@ -567,7 +1486,7 @@ static apr_status_t dispatch(proxy_conn_rec *conn, proxy_dir_conf *conf,
             unsigned char type, version;
 
             /* First, we grab the header... */
-            rv = get_data_full(conn, (char *) farray, AP_FCGI_HEADER_LEN);
+            rv = get_data_full(conn, mux, (char *) farray, AP_FCGI_HEADER_LEN);
             if (rv != APR_SUCCESS) {
                 ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01067)
                               "Failed to read FastCGI header");
@@ -606,7 +1525,7 @@ recv_again:
              * recv call, this will eventually change when we move to real
              * nonblocking recv calls. */
             if (readbuflen != 0) {
-                rv = get_data(conn, iobuf, &readbuflen);
+                rv = get_data(conn, mux, iobuf, &readbuflen);
                 if (rv != APR_SUCCESS) {
                     *err = "reading response body";
                     break;
@@ -766,7 +1685,7 @@ recv_again:
             }
 
             if (plen) {
-                rv = get_data_full(conn, iobuf, plen);
+                rv = get_data_full(conn, mux, iobuf, plen);
                 if (rv != APR_SUCCESS) {
                     ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(02537)
                                   "Error occurred reading padding");
@@ -792,16 +1711,16 @@ recv_again:
  */
 static int fcgi_do_request(apr_pool_t *p, request_rec *r,
                            proxy_conn_rec *conn,
+                           fcgi_mux_req_t *mux,
                            conn_rec *origin,
                            proxy_dir_conf *conf,
                            apr_uri_t *uri,
                            char *url, char *server_portstr)
 {
     /* Request IDs are arbitrary numbers that we assign to a
-     * single request. This would allow multiplex/pipelining of
-     * multiple requests to the same FastCGI connection, but
-     * we don't support that, and always use a value of '1' to
-     * keep things simple. */
+     * single request. Multiplexed requests get the id reserved
+     * for them on the shared connection, otherwise we always use
+     * a value of '1' to keep things simple. */
     apr_uint16_t request_id = 1;
     apr_status_t rv;
     apr_pool_t *temp_pool;
@@ -809,8 +1728,14 @@ static int fcgi_do_request(apr_pool_t *p, request_rec *r,
     int bad_request = 0,
         has_responded = 0;
 
+#if APR_HAS_THREADS
+    if (mux) {
+        request_id = mux->request_id;
+    }
+#endif
+
     /* Step 1: Send AP_FCGI_BEGIN_REQUEST */
-    rv = send_begin_request(conn, request_id);
+    rv = send_begin_request(conn, mux, request_id);
     if (rv != APR_SUCCESS) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01073)
                       "Failed Writing Request to %s:", server_portstr);
@@ -821,7 +1746,7 @@ static int fcgi_do_request(apr_pool_t *p, request_rec *r,
     apr_pool_create(&temp_pool, r->pool);
 
     /* Step 2: Send Environment via FCGI_PARAMS */
-    rv = send_environment(conn, r, temp_pool, request_id);
+    rv = send_environment(conn, mux, r, temp_pool, request_id);
     if (rv != APR_SUCCESS) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01074)
                       "Failed writing Environment to %s:", server_portstr);
@@ -830,7 +1755,7 @@ static int fcgi_do_request(apr_pool_t *p, request_rec *r,
     }
 
     /* Step 3: Read records from the back end server and handle them. */
-    rv = dispatch(conn, conf, r, temp_pool, request_id,
+    rv = dispatch(conn, mux, conf, r, temp_pool, request_id,
                   &err, &bad_request, &has_responded);
     if (rv != APR_SUCCESS) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(01075)
@@ -839,7 +1764,10 @@ static int fcgi_do_request(apr_pool_t *p, request_rec *r,
                       err ? "(" : "",
                       err ? err : "",
                       err ? ")" : "");
-        conn->close = 1;
+        if (!mux) {
+            /* Multiplexed requests leave gracefully (mux_leave) */
+            conn->close = 1;
+        }
         if (has_responded) {
             return AP_FILTER_ERROR;
         }
@@ -852,8 +1780,6 @@ static int fcgi_do_request(apr_pool_t *p, request_rec *r,
     return OK;
 }
 
-#define FCGI_SCHEME "FCGI"
-
 /*
  * This handles fcgi:(dest) URLs
  */
@@ -866,6 +1792,10 @@ static int proxy_fcgi_handler(request_rec *r, proxy_worker *worker,
     char server_portstr[32];
     conn_rec *origin = NULL;
     proxy_conn_rec *backend = NULL;
+    fcgi_mux_req_t *mux = NULL;
+#if APR_HAS_THREADS
+    char *orig_url = url;
+#endif
 
     proxy_dir_conf *dconf = ap_get_module_config(r->per_dir_config,
                                                  &proxy_module);
@@ -885,6 +1815,9 @@ static int proxy_fcgi_handler(request_rec *r, proxy_worker *worker,
 
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(01078) "serving URL %s", url);
 
+#if APR_HAS_THREADS
+acquire:
+#endif
     /* Create space for state information */
     status = ap_proxy_acquire_connection(FCGI_SCHEME, &backend, worker,
                                          r->server);
@@ -917,6 +1850,22 @@ static int proxy_fcgi_handler(request_rec *r, proxy_worker *worker,
         backend->close = 0;
     }
 
+#if APR_HAS_THREADS
+    /* If the application multiplexes, share an existing connection */
+    if (mux_eligible(r, backend)) {
+        int mpxs;
+
+        apr_thread_mutex_lock(mux_mutex);
+        mpxs = mux_get_worker(worker)->mpxs;
+        apr_thread_mutex_unlock(mux_mutex);
+        if (mpxs == 1 && (mux = mux_join(r, worker, NULL))) {
+            ap_proxy_release_connection(FCGI_SCHEME, backend, r->server);
+            backend = NULL;
+            goto process;
+        }
+    }
+#endif
+
     /* Step Two: Make the Connection */
     if (ap_proxy_connect_backend(FCGI_SCHEME, backend, worker, r->server)) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01079)
@@ -926,19 +1875,85 @@ static int proxy_fcgi_handler(request_rec *r, proxy_worker *worker,
         goto cleanup;
     }
 
+#if APR_HAS_THREADS
+    if (mux_eligible(r, backend)) {
+        fcgi_mux_worker_t *mw;
+        int mpxs;
+
+        apr_thread_mutex_lock(mux_mutex);
+        mpxs = mux_get_worker(worker)->mpxs;
+        apr_thread_mutex_unlock(mux_mutex);
+        if (mpxs < 0) {
+            /* First eligible request for this worker in this child */
+            int max_reqs;
+            apr_status_t rv = get_values(backend, r, &mpxs, &max_reqs);
+            if (rv != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(02867)
+                              "Failed querying FCGI_GET_VALUES from %s, "
+                              "not multiplexing", backend->hostname);
+                mpxs = 0;
+                max_reqs = 1;
+            }
+            apr_thread_mutex_lock(mux_mutex);
+            mw = mux_get_worker(worker);
+            mw->mpxs = mpxs;
+            mw->max_reqs = max_reqs < 1 ? 1 : (max_reqs > FCGI_MUX_MAX_REQS
+                                               ? FCGI_MUX_MAX_REQS
+                                               : max_reqs);
+            apr_thread_mutex_unlock(mux_mutex);
+            if (rv != APR_SUCCESS) {
+                /* A late answer could still come on this connection, close
+                 * it and start over with a new one (not probing again).
+                 */
+                backend->close = 1;
+                ap_proxy_release_connection(FCGI_SCHEME, backend, r->server);
+                backend = NULL;
+                url = orig_url;
+                goto acquire;
+            }
+        }
+        if (mpxs == 1) {
+            mux = mux_join(r, worker, backend);
+        }
+    }
+
+process:
+#endif
+
     /* Step Three: Process the Request */
-    status = fcgi_do_request(p, r, backend, origin, dconf, uri, url,
+#if APR_HAS_THREADS
+    status = fcgi_do_request(p, r, mux ? mux->mc->conn : backend, mux,
+                             origin, dconf, uri, url, server_portstr);
+#else
+    status = fcgi_do_request(p, r, backend, mux, origin, dconf, uri, url,
                              server_portstr);
+#endif
 
 cleanup:
+#if APR_HAS_THREADS
+    if (mux) {
+        /* The connection is released by the last request leaving */
+        mux_leave(mux, r);
+        return status;
+    }
+#endif
     ap_proxy_release_connection(FCGI_SCHEME, backend, r->server);
     return status;
 }
 
+static void proxy_fcgi_child_init(apr_pool_t *p, server_rec *s)
+{
+    env_static_init(p, s);
+#if APR_HAS_THREADS
+    mux_child_init(p, s);
+#endif
+}
+
 static void register_hooks(apr_pool_t *p)
 {
     proxy_hook_scheme_handler(proxy_fcgi_handler, NULL, NULL, APR_HOOK_FIRST);
     proxy_hook_canon_handler(proxy_fcgi_canon, NULL, NULL, APR_HOOK_FIRST);
+    ap_hook_child_init(proxy_fcgi_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 AP_DECLARE_MODULE(proxy_fcgi) = {
@@ -0,0 +1,868 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Active health checking of proxy workers.
+ *
+ * Workers are configured with the hcmethod, hcinterval, hcpasses, hcfails,
+ * hcuri and hcexpr parameters (ProxyPass, BalancerMember, ProxySet).  A
+ * singleton watchdog callback then probes each of them every hcinterval,
+ * and sets or clears the PROXY_WORKER_HC_FAIL status flag after hcfails
+ * consecutive failures or hcpasses consecutive successes.
+ *
+ * Probes never block the watchdog thread: sockets are non-blocking and
+ * all the probes in flight are driven by a single pollset, each one being
+ * a small state machine (connect, send the request, read the response).
+ * Only the first name resolution of a worker's address may block.
+ */
+
+#include "mod_proxy.h"
+#include "mod_watchdog.h"
+#include "ap_expr.h"
+#include "apr_poll.h"
+
+module AP_MODULE_DECLARE_DATA proxy_hcheck_module;
+
+#define HC_WATCHDOG_NAME        "_proxy_hcheck_"
+
+/* Defaults for the worker parameters left unset */
+#define HC_DEFAULT_INTERVAL     apr_time_from_sec(30)
+#define HC_DEFAULT_PASSES       1
+#define HC_DEFAULT_FAILS        1
+
+/* Max time spent polling per watchdog tick */
+#define HC_POLL_SLICE           AP_WD_TM_SLICE
+
+/* Max size of the response (status line and headers) we look at */
+#define HC_MAX_RESPONSE         8192
+
+static const char *hc_method_names[] = {
+    "NONE", "TCP", "OPTIONS", "HEAD", "GET", "CPING", "FCGI", NULL
+};
+
+typedef struct {
+    apr_hash_t *exprs;      /* ProxyHCExpr name -> ap_expr_info_t */
+} hc_server_conf;
+
+typedef enum {
+    HC_CONNECTING,
+    HC_WRITING,
+    HC_READING
+} hc_state_t;
+
+typedef struct hc_worker_t hc_worker_t;
+
+typedef struct {
+    hc_worker_t *hw;
+    apr_pool_t *p;          /* probe's lifetime */
+    apr_socket_t *sock;
+    apr_pollfd_t pfd;
+    hc_state_t state;
+    apr_time_t deadline;
+    const char *req;        /* request to send, if any */
+    apr_size_t reqlen;
+    apr_size_t sent;
+    char *buf;              /* response read so far */
+    apr_size_t len;
+} hc_probe_t;
+
+struct hc_worker_t {
+    proxy_worker *worker;
+    server_rec *s;
+    apr_pool_t *p;          /* address cache */
+    apr_sockaddr_t *addr;
+    hc_probe_t *probe;      /* probe in flight, if any */
+    proxy_hcmethod_t method;
+};
+
+typedef struct {
+    server_rec *s;
+    apr_pool_t *p;
+    apr_array_header_t *workers;    /* hc_worker_t */
+    apr_pollset_t *pollset;
+    ap_watchdog_t *watchdog;
+    int started;
+} hc_ctx_t;
+
+static hc_ctx_t *hctx = NULL;
+
+static const char *set_worker_hc_param(apr_pool_t *p, proxy_worker *worker,
+                                       const char *key, const char *val)
+{
+    int ival;
+
+    if (!strcasecmp(key, "hcmethod")) {
+        int i;
+        for (i = 0; hc_method_names[i]; i++) {
+            if (!strcasecmp(val, hc_method_names[i])) {
+                worker->s->hc.method = (proxy_hcmethod_t)i;
+                return NULL;
+            }
+        }
+        return "hcmethod must be one of None, TCP, OPTIONS, HEAD, GET, "
+               "CPING or FCGI";
+    }
+    else if (!strcasecmp(key, "hcinterval")) {
+        ival = atoi(val);
+        if (ival < 1)
+            return "hcinterval must be a positive number of seconds";
+        worker->s->hc.interval = apr_time_from_sec(ival);
+    }
+    else if (!strcasecmp(key, "hcpasses")) {
+        ival = atoi(val);
+        if (ival < 1)
+            return "hcpasses must be a positive number";
+        worker->s->hc.passes = ival;
+    }
+    else if (!strcasecmp(key, "hcfails")) {
+        ival = atoi(val);
+        if (ival < 1)
+            return "hcfails must be a positive number";
+        worker->s->hc.fails = ival;
+    }
+    else if (!strcasecmp(key, "hcuri")) {
+        if (strlen(val) >= sizeof(worker->s->hc.uri))
+            return apr_psprintf(p, "hcuri length must be < %d characters",
+                    (int)sizeof(worker->s->hc.uri));
+        PROXY_STRNCPY(worker->s->hc.uri, val);
+    }
+    else if (!strcasecmp(key, "hcexpr")) {
+        if (strlen(val) >= sizeof(worker->s->hc.expr))
+            return apr_psprintf(p, "hcexpr name length must be < %d characters",
+                    (int)sizeof(worker->s->hc.expr));
+        PROXY_STRNCPY(worker->s->hc.expr, val);
+    }
+    else {
+        return "unknown Worker hcheck parameter";
+    }
+    return NULL;
+}
+
+/*
+ * Update the worker's counters and status after a probe.
+ * Only called from the watchdog thread.
+ */
+static void hc_result(hc_worker_t *hw, int ok, apr_status_t rv,
+                      const char *why)
+{
+    proxy_worker *worker = hw->worker;
+    proxy_hcheck_t *hc = &worker->s->hc;
+    int passes = hc->passes > 0 ? hc->passes : HC_DEFAULT_PASSES;
+    int fails = hc->fails > 0 ? hc->fails : HC_DEFAULT_FAILS;
+
+    ap_log_error(APLOG_MARK, APLOG_TRACE2, rv, hw->s,
+                 "%s health check of %s: %s",
+                 hc_method_names[hw->method], worker->s->name,
+                 ok ? "passed" : why);
+
+    if (ok) {
+        hc->fcount = 0;
+        if (PROXY_WORKER_IS_HCFAILED(worker)) {
+            if (++hc->pcount >= passes) {
+                hc->pcount = 0;
+                ap_proxy_set_wstatus(PROXY_WORKER_HC_FAIL_FLAG, 0, worker);
+                /* The backend is known to be back, don't wait for retry */
+                ap_proxy_set_wstatus(PROXY_WORKER_IN_ERROR_FLAG, 0, worker);
+                ap_log_error(APLOG_MARK, APLOG_INFO, 0, hw->s, APLOGNO(02846)
+                             "%s: health check passed %d time(s), "
+                             "worker is back in service",
+                             worker->s->name, passes);
+            }
+        }
+    }
+    else {
+        hc->pcount = 0;
+        if (!PROXY_WORKER_IS_HCFAILED(worker)) {
+            if (++hc->fcount >= fails) {
+                hc->fcount = 0;
+                ap_proxy_set_wstatus(PROXY_WORKER_HC_FAIL_FLAG, 1, worker);
+                ap_log_error(APLOG_MARK, APLOG_WARNING, rv, hw->s, APLOGNO(02847)
+                             "%s: health check failed %d time(s) (%s), "
+                             "worker is out of service",
+                             worker->s->name, fails, why);
+            }
+        }
+    }
+}
+
+static void hc_probe_done(hc_probe_t *probe, int ok, apr_status_t rv,
+                          const char *why)
+{
+    hc_worker_t *hw = probe->hw;
+
+    apr_pollset_remove(hctx->pollset, &probe->pfd);
+    apr_socket_close(probe->sock);
+    if (!ok) {
+        /* re-resolve on next check, the backend may have moved */
+        hw->addr = NULL;
+    }
+    hc_result(hw, ok, rv, why);
+    hw->probe = NULL;
+    apr_pool_destroy(probe->p);
+}
+
+static apr_status_t hc_probe_wait(hc_probe_t *probe, apr_int16_t events)
+{
+    if (probe->pfd.reqevents) {
+        apr_pollset_remove(hctx->pollset, &probe->pfd);
+    }
+    probe->pfd.reqevents = events;
+    return apr_pollset_add(hctx->pollset, &probe->pfd);
+}
+
+static const char *hc_build_request(hc_probe_t *probe)
+{
+    proxy_worker *worker = probe->hw->worker;
+    const char *method = hc_method_names[probe->hw->method];
+    const char *path = worker->s->hc.uri;
+    apr_uri_t uri;
+
+    switch (probe->hw->method) {
+    case PROXY_HC_CPING:
+        /* AJP13 CPING: magic 0x1234, length 1, CMD_AJP13_CPING */
+        probe->reqlen = 5;
+        return "\x12\x34\x00\x01\x0a";
+
+    case PROXY_HC_FCGI:
+        /* FCGI_GET_VALUES record (version 1, type 9, request id 0)
+         * asking for FCGI_MPXS_CONNS (name length 15, value length 0)
+         */
+        probe->reqlen = 8 + 17;
+        return "\x01\x09\x00\x00\x00\x11\x00\x00"
+               "\x0f\x00" "FCGI_MPXS_CONNS";
+
+    default:
+        break;
+    }
+
+    if (!*path) {
+        if (apr_uri_parse(probe->p, worker->s->name, &uri) == APR_SUCCESS
+            && uri.path && *uri.path) {
+            path = uri.path;
+        }
+        else {
+            path = "/";
+        }
+    }
+    else if (*path != '/') {
+        if (apr_uri_parse(probe->p, worker->s->name, &uri) == APR_SUCCESS
+            && uri.path && *uri.path) {
+            path = apr_pstrcat(probe->p, uri.path,
+                               uri.path[strlen(uri.path) - 1] == '/' ? "" : "/",
+                               path, NULL);
+        }
+        else {
+            path = apr_pstrcat(probe->p, "/", path, NULL);
+        }
+    }
+
+    probe->req = apr_pstrcat(probe->p, method, " ", path, " HTTP/1.0" CRLF
+                             "Host: ", worker->s->hostname, ":",
+                             apr_itoa(probe->p, worker->s->port), CRLF
+                             "User-Agent: ", ap_get_server_banner(), CRLF
+                             "Connection: close" CRLF CRLF, NULL);
+    probe->reqlen = strlen(probe->req);
+    return probe->req;
+}
+
+static request_rec *hc_fake_request(hc_probe_t *probe, int status,
+                                    apr_table_t *headers)
+{
+    request_rec *r = apr_pcalloc(probe->p, sizeof(request_rec));
+    conn_rec *c = apr_pcalloc(probe->p, sizeof(conn_rec));
+    server_rec *s = probe->hw->s;
+
+    c->pool = probe->p;
+    c->base_server = s;
+    c->client_ip = "0.0.0.0";
+    c->local_ip = "0.0.0.0";
+    c->notes = apr_table_make(probe->p, 1);
+    c->conn_config = ap_create_conn_config(probe->p);
+
+    r->pool = probe->p;
+    r->connection = c;
+    r->server = s;
+    r->status = status;
+    r->method = hc_method_names[probe->hw->method];
+    r->protocol = "HTTP/1.0";
+    r->proto_num = HTTP_VERSION(1, 0);
+    r->uri = r->unparsed_uri = (char *)probe->hw->worker->s->hc.uri;
+    r->hostname = probe->hw->worker->s->hostname;
+    r->headers_in = apr_table_make(probe->p, 1);
+    r->headers_out = headers;
+    r->err_headers_out = apr_table_make(probe->p, 1);
+    r->subprocess_env = apr_table_make(probe->p, 1);
+    r->notes = apr_table_make(probe->p, 1);
+    r->request_config = ap_create_request_config(probe->p);
+    r->per_dir_config = s->lookup_defaults;
+    r->request_time = apr_time_now();
+
+    return r;
+}
+
+/* Checks the response of an HTTP probe, once its header is complete */
+static void hc_check_http(hc_probe_t *probe)
+{
+    hc_worker_t *hw = probe->hw;
+    apr_table_t *headers = apr_table_make(probe->p, 8);
+    char *line, *last;
+    int status = 0;
+
+    line = apr_strtok(probe->buf, "\r\n", &last);
+    if (!line || strncmp(line, "HTTP/", 5) || !(line = strchr(line, ' '))) {
+        hc_probe_done(probe, 0, APR_SUCCESS, "invalid status line");
+        return;
+    }
+    status = atoi(line + 1);
+    while ((line = apr_strtok(NULL, "\r\n", &last))) {
+        char *val = strchr(line, ':');
+        if (val) {
+            *val++ = '\0';
+            while (apr_isspace(*val)) {
+                val++;
+            }
+            apr_table_add(headers, line, val);
+        }
+    }
+
+    if (*hw->worker->s->hc.expr) {
+        hc_server_conf *conf = ap_get_module_config(hw->s->module_config,
+                                                    &proxy_hcheck_module);
+        ap_expr_info_t *expr = apr_hash_get(conf->exprs,
+                                            hw->worker->s->hc.expr,
+                                            APR_HASH_KEY_STRING);
+        const char *err = NULL;
+        int ok;
+
+        if (!expr) {
+            hc_probe_done(probe, 0, APR_SUCCESS, "unknown hcexpr");
+            return;
+        }
+        ok = ap_expr_exec(hc_fake_request(probe, status, headers),
+                          expr, &err);
+        if (ok < 0) {
+            hc_probe_done(probe, 0, APR_SUCCESS,
+                          apr_pstrcat(probe->p, "hcexpr error: ", err, NULL));
+            return;
+        }
+        hc_probe_done(probe, ok, APR_SUCCESS, "hcexpr not matched");
+        return;
+    }
+
+    hc_probe_done(probe, status >= 200 && status < 400, APR_SUCCESS,
+                  apr_psprintf(probe->p, "status %d", status));
+}
+
+/* Called when some response data has been read, returns non-zero once
+ * the probe is done.
+ */
+static int hc_check_response(hc_probe_t *probe, int eof)
+{
+    const unsigned char *buf = (const unsigned char *)probe->buf;
+
+    switch (probe->hw->method) {
+    case PROXY_HC_CPING:
+        if (probe->len < 5 && !eof) {
+            return 0;
+        }
+        /* AJP13 CPONG: magic 'AB', length 1, CMD_AJP13_CPONG */
+        hc_probe_done(probe, probe->len >= 5 && buf[0] == 'A' && buf[1] == 'B'
+                             && buf[4] == 0x09, APR_SUCCESS, "no CPONG reply");
+        return 1;
+
+    case PROXY_HC_FCGI:
+        if (probe->len < 8 && !eof) {
+            return 0;
+        }
+        /* Any FCGI_GET_VALUES_RESULT record will do */
+        hc_probe_done(probe, probe->len >= 8 && buf[0] == 1 && buf[1] == 10,
+                      APR_SUCCESS, "no FCGI_GET_VALUES_RESULT reply");
+        return 1;
+
+    default:
+        probe->buf[probe->len] = '\0';
+        if (!strstr(probe->buf, CRLF CRLF)
+            && probe->len < HC_MAX_RESPONSE && !eof) {
+            return 0;
+        }
+        hc_check_http(probe);
+        return 1;
+    }
+}
+
+static void hc_probe_connected(hc_probe_t *probe)
+{
+    apr_status_t rv;
+
+    if (probe->hw->method == PROXY_HC_TCP) {
+        hc_probe_done(probe, 1, APR_SUCCESS, NULL);
+        return;
+    }
+
+    probe->req = hc_build_request(probe);
+    probe->state = HC_WRITING;
+    if ((rv = hc_probe_wait(probe, APR_POLLOUT)) != APR_SUCCESS) {
+        hc_probe_done(probe, 0, rv, "pollset error");
+    }
+}
+
+static void hc_probe_event(hc_probe_t *probe, apr_int16_t rtnevents)
+{
+    apr_status_t rv;
+    apr_size_t len;
+
+    switch (probe->state) {
+    case HC_CONNECTING:
+        rv = apr_socket_connect(probe->sock, probe->hw->addr);
+        if (rv == APR_SUCCESS) {
+            hc_probe_connected(probe);
+        }
+        else if (!APR_STATUS_IS_EINPROGRESS(rv)) {
+            hc_probe_done(probe, 0, rv, "connect failed");
+        }
+        break;
+
+    case HC_WRITING:
+        len = probe->reqlen - probe->sent;
+        rv = apr_socket_send(probe->sock, probe->req + probe->sent, &len);
+        probe->sent += len;
+        if (rv != APR_SUCCESS && !APR_STATUS_IS_EAGAIN(rv)) {
+            hc_probe_done(probe, 0, rv, "send failed");
+        }
+        else if (probe->sent == probe->reqlen) {
+            probe->state = HC_READING;
+            probe->buf = apr_palloc(probe->p, HC_MAX_RESPONSE + 1);
+            if ((rv = hc_probe_wait(probe, APR_POLLIN)) != APR_SUCCESS) {
+                hc_probe_done(probe, 0, rv, "pollset error");
+            }
+        }
+        break;
+
+    case HC_READING:
+        len = HC_MAX_RESPONSE - probe->len;
+        rv = apr_socket_recv(probe->sock, probe->buf + probe->len, &len);
+        probe->len += len;
+        if (APR_STATUS_IS_EOF(rv) || (rv == APR_SUCCESS && !len)) {
+            hc_check_response(probe, 1);
+        }
+        else if (rv != APR_SUCCESS && !APR_STATUS_IS_EAGAIN(rv)) {
+            hc_probe_done(probe, 0, rv, "recv failed");
+        }
+        else {
+            hc_check_response(probe, 0);
+        }
+        break;
+    }
+}
+
+static void hc_probe_start(hc_worker_t *hw, apr_time_t now)
+{
+    proxy_worker *worker = hw->worker;
+    hc_probe_t *probe;
+    apr_pool_t *p;
+    apr_interval_time_t timeout;
+    apr_status_t rv;
+
+    worker->s->hc.checked = now;
+
+    if (!hw->addr) {
+        apr_pool_clear(hw->p);
+        rv = apr_sockaddr_info_get(&hw->addr, worker->s->hostname,
+                                   APR_UNSPEC, worker->s->port, 0, hw->p);
+        if (rv != APR_SUCCESS) {
+            hw->addr = NULL;
+            hc_result(hw, 0, rv, "DNS lookup failure");
+            return;
+        }
+    }
+
+    apr_pool_create(&p, hctx->p);
+    apr_pool_tag(p, "proxy_hcheck_probe");
+    probe = apr_pcalloc(p, sizeof(hc_probe_t));
+    probe->p = p;
+    probe->hw = hw;
+
+    /* connectiontimeout, else timeout, else the check interval */
+    if (worker->s->conn_timeout_set) {
+        timeout = worker->s->conn_timeout;
+    }
+    else if (worker->s->timeout_set) {
+        timeout = worker->s->timeout;
+    }
+    else {
+        timeout = worker->s->hc.interval > 0 ? worker->s->hc.interval
+                                             : HC_DEFAULT_INTERVAL;
+    }
+    probe->deadline = now + timeout;
+
+    rv = apr_socket_create(&probe->sock, hw->addr->family, SOCK_STREAM,
+                           APR_PROTO_TCP, p);
+    if (rv != APR_SUCCESS) {
+        apr_pool_destroy(p);
+        hc_result(hw, 0, rv, "can't create socket");
+        return;
+    }
+    apr_socket_timeout_set(probe->sock, 0);
+
+    probe->pfd.p = p;
+    probe->pfd.desc_type = APR_POLL_SOCKET;
+    probe->pfd.desc.s = probe->sock;
+    probe->pfd.client_data = probe;
+    hw->probe = probe;
+
+    rv = apr_socket_connect(probe->sock, hw->addr);
+    if (rv == APR_SUCCESS) {
+        hc_probe_connected(probe);
+    }
+    else if (APR_STATUS_IS_EINPROGRESS(rv)) {
+        probe->state = HC_CONNECTING;
+        if ((rv = hc_probe_wait(probe, APR_POLLOUT)) != APR_SUCCESS) {
+            hc_probe_done(probe, 0, rv, "pollset error");
+        }
+    }
+    else {
+        hc_probe_done(probe, 0, rv, "connect failed");
+    }
+}
+
+static void hc_add_worker(apr_hash_t *seen, server_rec *s,
+                          proxy_worker *worker)
+{
+    hc_worker_t *hw;
+
+    if (worker->s->hc.method == PROXY_HC_NONE
+        || apr_hash_get(seen, &worker->s, sizeof(worker->s))) {
+        return;
+    }
+    apr_hash_set(seen, &worker->s, sizeof(worker->s), worker);
+
+    if (*worker->s->uds_path) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, APLOGNO(02848)
+                     "%s: health checks of Unix domain socket workers "
+                     "are not supported", worker->s->name);
+        return;
+    }
+
+    hw = apr_array_push(hctx->workers);
+    hw->worker = worker;
+    hw->s = s;
+    hw->addr = NULL;
+    hw->probe = NULL;
+    hw->method = worker->s->hc.method;
+    apr_pool_create(&hw->p, hctx->p);
+    apr_pool_tag(hw->p, "proxy_hcheck_addr");
+
+    /* We don't speak TLS, checking the port is the best we can do */
+    if ((hw->method == PROXY_HC_OPTIONS || hw->method == PROXY_HC_HEAD
+         || hw->method == PROXY_HC_GET)
+        && (!strcasecmp(worker->s->scheme, "https")
+            || !strcasecmp(worker->s->scheme, "wss"))) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, APLOGNO(02849)
+                     "%s: using TCP health check rather than %s over TLS",
+                     worker->s->name, hc_method_names[hw->method]);
+        hw->method = PROXY_HC_TCP;
+    }
+}
+
+/*
+ * Collect the workers to check, in the watchdog's child.
+ *
+ * Only balancer members are checked: their proxy_worker_shared lives in
+ * the balancer's slotmem, so the PROXY_WORKER_HC_FAIL status set here is
+ * seen by the children serving the requests. The other workers' shared
+ * state is allocated by each process.
+ */
+static apr_status_t hc_init_workers(void)
+{
+    server_rec *s;
+    apr_hash_t *seen = apr_hash_make(hctx->p);
+    apr_status_t rv;
+
+    hctx->workers = apr_array_make(hctx->p, 16, sizeof(hc_worker_t));
+
+    for (s = hctx->s; s; s = s->next) {
+        proxy_server_conf *conf = ap_get_module_config(s->module_config,
+                                                       &proxy_module);
+        proxy_balancer *balancer = (proxy_balancer *)conf->balancers->elts;
+        int i, j;
+
+        for (i = 0; i < conf->balancers->nelts; i++, balancer++) {
+            proxy_worker **workers = (proxy_worker **)balancer->workers->elts;
+            for (j = 0; j < balancer->workers->nelts; j++) {
+                hc_add_worker(seen, s, workers[j]);
+            }
+        }
+    }
+
+    if (!hctx->workers->nelts) {
+        return APR_SUCCESS;
+    }
+    rv = apr_pollset_create(&hctx->pollset, hctx->workers->nelts, hctx->p, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, hctx->s, APLOGNO(02850)
+                     "can't create the health checks pollset");
+        return rv;
+    }
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, hctx->s, APLOGNO(02851)
+                 "health checking %d worker(s)", hctx->workers->nelts);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t hc_watchdog_callback(int state, void *data,
+                                         apr_pool_t *pool)
+{
+    hc_worker_t *hw;
+    const apr_pollfd_t *pfds;
+    apr_int32_t n;
+    apr_time_t now;
+    int i;
+
+    switch (state) {
+    case AP_WATCHDOG_STATE_STARTING:
+        break;
+
+    case AP_WATCHDOG_STATE_RUNNING:
+        /* Done on the first run, once the workers have been attached to
+         * their shared memory by child_init.
+         */
+        if (!hctx->started) {
+            hctx->started = 1;
+            if (hc_init_workers() != APR_SUCCESS) {
+                hctx->workers->nelts = 0;
+            }
+        }
+        if (!hctx->workers->nelts) {
+            break;
+        }
+
+        now = apr_time_now();
+        hw = (hc_worker_t *)hctx->workers->elts;
+        for (i = 0; i < hctx->workers->nelts; i++, hw++) {
+            apr_interval_time_t interval = hw->worker->s->hc.interval;
+            if (interval <= 0) {
+                interval = HC_DEFAULT_INTERVAL;
+            }
+            if (!hw->probe && now - hw->worker->s->hc.checked >= interval
+                && !(hw->worker->s->status & (PROXY_WORKER_DISABLED
+                                              | PROXY_WORKER_STOPPED))) {
+                hc_probe_start(hw, now);
+            }
+        }
+
+        if (apr_pollset_poll(hctx->pollset, HC_POLL_SLICE, &n,
+                             &pfds) == APR_SUCCESS) {
+            for (i = 0; i < n; i++) {
+                hc_probe_event(pfds[i].client_data, pfds[i].rtnevents);
+            }
+        }
+
+        now = apr_time_now();
+        hw = (hc_worker_t *)hctx->workers->elts;
+        for (i = 0; i < hctx->workers->nelts; i++, hw++) {
+            if (hw->probe && now > hw->probe->deadline) {
+                hc_probe_done(hw->probe, 0, APR_TIMEUP, "timed out");
+            }
+        }
+        break;
+
+    case AP_WATCHDOG_STATE_STOPPING:
+        if (hctx->workers) {
+            hw = (hc_worker_t *)hctx->workers->elts;
+            for (i = 0; i < hctx->workers->nelts; i++, hw++) {
+                if (hw->probe) {
+                    apr_pollset_remove(hctx->pollset, &hw->probe->pfd);
+                    apr_socket_close(hw->probe->sock);
+                    apr_pool_destroy(hw->probe->p);
+                    hw->probe = NULL;
+                }
+            }
+        }
+        break;
+    }
+
+    return APR_SUCCESS;
+}
+
+static int hc_post_config(apr_pool_t *p, apr_pool_t *plog,
+                          apr_pool_t *ptemp, server_rec *main_s)
+{
+    apr_status_t rv;
+    server_rec *s;
+    int needed = 0;
+    apr_hash_t *warned = apr_hash_make(ptemp);
+    APR_OPTIONAL_FN_TYPE(ap_watchdog_get_instance) *hc_watchdog_get_instance;
+    APR_OPTIONAL_FN_TYPE(ap_watchdog_register_callback) *hc_watchdog_register_callback;
+
+    hctx = NULL;
+
+    /* Anything to check? Also verify the hcexpr references */
+    for (s = main_s; s; s = s->next) {
+        proxy_server_conf *conf = ap_get_module_config(s->module_config,
+                                                       &proxy_module);
+        hc_server_conf *hconf = ap_get_module_config(s->module_config,
+                                                     &proxy_hcheck_module);
+        proxy_balancer *balancer = (proxy_balancer *)conf->balancers->elts;
+        proxy_worker *worker = (proxy_worker *)conf->workers->elts;
+        int i, j;
+
+        /* vhosts inherit the main server's workers, warn once */
+        for (i = 0; i < conf->workers->nelts; i++) {
+            if (worker[i].s->hc.method != PROXY_HC_NONE
+                && !apr_hash_get(warned, &worker[i].s, sizeof(worker[i].s))) {
+                apr_hash_set(warned, &worker[i].s, sizeof(worker[i].s), "");
+                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(02951)
+                             "%s: health checks only apply to balancer "
+                             "members, ignoring them", worker[i].s->name);
+            }
+        }
+
+        for (i = 0; i < conf->balancers->nelts; i++) {
+            proxy_worker **workers = (proxy_worker **)balancer[i].workers->elts;
+            for (j = 0; j < balancer[i].workers->nelts; j++) {
+                proxy_worker *w = workers[j];
+                if (w->s->hc.method == PROXY_HC_NONE) {
+                    continue;
+                }
+                needed = 1;
+                if (*w->s->hc.expr
+                    && !apr_hash_get(hconf->exprs, w->s->hc.expr,
+                                     APR_HASH_KEY_STRING)) {
+                    ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s, APLOGNO(02852)
+                                 "%s: hcexpr '%s' is not defined by "
+                                 "ProxyHCExpr", w->s->name, w->s->hc.expr);
+                    return !OK;
+                }
+            }
+        }
+    }
+    if (!needed) {
+        return OK;
+    }
+
+    hc_watchdog_get_instance = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_get_instance);
+    hc_watchdog_register_callback = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_register_callback);
+    if (!hc_watchdog_get_instance || !hc_watchdog_register_callback) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, main_s, APLOGNO(02853)
+                     "mod_watchdog is required for health checks");
+        return !OK;
+    }
+
+    hctx = apr_pcalloc(p, sizeof(hc_ctx_t));
+    hctx->s = main_s;
+
+    rv = hc_watchdog_get_instance(&hctx->watchdog, HC_WATCHDOG_NAME,
+                                  0, 1, p);
+    if (rv) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, main_s, APLOGNO(02854)
+                     "Failed to create watchdog instance (%s)",
+                     HC_WATCHDOG_NAME);
+        return !OK;
+    }
+    /* Register a callback with zero interval, called each timer slice */
+    rv = hc_watchdog_register_callback(hctx->watchdog, 0, hctx,
+                                       hc_watchdog_callback);
+    if (rv) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, main_s, APLOGNO(02855)
+                     "Failed to register watchdog callback (%s)",
+                     HC_WATCHDOG_NAME);
+        return !OK;
+    }
+
+    return OK;
+}
+
+static void hc_child_init(apr_pool_t *p, server_rec *s)
+{
+    if (hctx) {
+        apr_pool_create(&hctx->p, p);
+        apr_pool_tag(hctx->p, "proxy_hcheck");
+        hctx->workers = apr_array_make(hctx->p, 1, sizeof(hc_worker_t));
+        hctx->started = 0;
+    }
+}
+
+static void *hc_create_config(apr_pool_t *p, server_rec *s)
+{
+    hc_server_conf *conf = apr_pcalloc(p, sizeof(hc_server_conf));
+
+    conf->exprs = apr_hash_make(p);
+
+    return conf;
+}
+
+static void *hc_merge_config(apr_pool_t *p, void *basev, void *overridesv)
+{
+    hc_server_conf *conf = apr_pcalloc(p, sizeof(hc_server_conf));
+    hc_server_conf *base = basev;
+    hc_server_conf *overrides = overridesv;
+
+    conf->exprs = apr_hash_overlay(p, overrides->exprs, base->exprs);
+
+    return conf;
+}
+
+static const char *set_hc_expr(cmd_parms *cmd, void *dummy,
+                               const char *name, const char *arg)
+{
+    hc_server_conf *conf = ap_get_module_config(cmd->server->module_config,
+                                                &proxy_hcheck_module);
+    ap_expr_info_t *expr;
+    const char *expr_err = NULL;
+
+    if (strlen(name) >= PROXY_WORKER_MAX_SCHEME_SIZE) {
+        return apr_psprintf(cmd->pool,
+                            "ProxyHCExpr name length must be < %d characters",
+                            PROXY_WORKER_MAX_SCHEME_SIZE);
+    }
+    expr = ap_expr_parse_cmd(cmd, arg, 0, &expr_err, NULL);
+    if (expr_err) {
+        return apr_pstrcat(cmd->temp_pool,
+                           "Cannot parse expression '", arg,
+                           "' in ProxyHCExpr: ", expr_err, NULL);
+    }
+    apr_hash_set(conf->exprs, name, APR_HASH_KEY_STRING, expr);
+
+    return NULL;
+}
+
+static const command_rec hc_cmds[] = {
+    AP_INIT_TAKE2("ProxyHCExpr", set_hc_expr, NULL, RSRC_CONF,
+                  "Name and expression evaluated against the response of an "
+                  "HTTP health check (e.g. %{REQUEST_STATUS}, resp('...'))"),
+    {NULL}
+};
+
+static void hc_register_hooks(apr_pool_t *p)
+{
+    static const char *const aszPre[] = { "mod_proxy_balancer.c",
+                                          "mod_watchdog.c", NULL};
+
+    APR_REGISTER_OPTIONAL_FN(set_worker_hc_param);
+    ap_hook_post_config(hc_post_config, aszPre, NULL, APR_HOOK_LAST);
+    ap_hook_child_init(hc_child_init, aszPre, NULL, APR_HOOK_LAST);
+}
+
+AP_DECLARE_MODULE(proxy_hcheck) =
+{
+    STANDARD20_MODULE_STUFF,
+    NULL,                       /* create per-directory config structure */
+    NULL,                       /* merge per-directory config structures */
+    hc_create_config,           /* create per-server config structure */
+    hc_merge_config,            /* merge per-server config structures */
+    hc_cmds,                    /* command table */
+    hc_register_hooks           /* register hooks */
+};
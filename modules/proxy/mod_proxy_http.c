@@ -19,6 +19,13 @@
 #include "mod_proxy.h"
 #include "ap_regex.h"
 
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>       /* for memfd_create() */
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#endif
+
 module AP_MODULE_DECLARE_DATA proxy_http_module;
 
 static int (*ap_proxy_clear_connection_fn)(request_rec *r, apr_table_t *headers) =
@@ -229,6 +236,118 @@ static void terminate_headers(apr_bucket_alloc_t *bucket_alloc,
 
 #define MAX_MEM_SPOOL 16384
 
+/*
+ * Request body kept by the first attempt so that the request can be sent
+ * again to another balancer member without reading from the client, see
+ * ProxyRetryBodyLimit.
+ */
+typedef struct {
+    apr_bucket_brigade *bb;     /* complete body (memory and spool file) */
+    apr_off_t length;
+    int sent;                   /* some attempt passed it to a backend */
+} proxy_http_body_t;
+
+static int is_idempotent(request_rec *r)
+{
+    switch (r->method_number) {
+    case M_GET:     /* and HEAD */
+    case M_PUT:
+    case M_DELETE:
+    case M_OPTIONS:
+    case M_TRACE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static apr_status_t spool_file_cleanup(void *data)
+{
+    return apr_file_close(data);
+}
+
+/*
+ * Create the temporary file used to spool the request body.  When the
+ * amount to spool is bounded, prefer an anonymous memory file (memfd)
+ * which never hits the disk and which APR's file buckets will mmap()
+ * or sendfile() from; otherwise use a file in the temporary directory.
+ */
+static int create_spool_file(apr_pool_t *p, request_rec *r, int bounded,
+                             apr_file_t **tmpfile)
+{
+    const char *temp_dir;
+    char *template;
+    apr_status_t status;
+
+#ifdef HAVE_MEMFD_CREATE
+    if (bounded) {
+        apr_os_file_t fd = memfd_create("modproxy.spool", MFD_CLOEXEC);
+        if (fd >= 0) {
+            status = apr_os_file_put(tmpfile, &fd,
+                                     APR_FOPEN_READ | APR_FOPEN_WRITE, p);
+            if (status == APR_SUCCESS) {
+                apr_pool_cleanup_register(p, *tmpfile, spool_file_cleanup,
+                                          apr_pool_cleanup_null);
+                return OK;
+            }
+            close(fd);
+        }
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, errno, r, APLOGNO(02859)
+                      "memfd_create() failed, spooling to temporary "
+                      "directory");
+    }
+#endif
+
+    status = apr_temp_dir_get(&temp_dir, p);
+    if (status != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01089)
+                      "search for temporary directory failed");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    apr_filepath_merge(&template, temp_dir,
+                       "modproxy.tmp.XXXXXX",
+                       APR_FILEPATH_NATIVE, p);
+    status = apr_file_mktemp(tmpfile, template, 0, p);
+    if (status != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01090)
+                      "creation of temporary file in directory "
+                      "%s failed", temp_dir);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    return OK;
+}
+
+static int write_spool_file(request_rec *r, apr_file_t *tmpfile,
+                            apr_bucket_brigade *bb, apr_off_t *fsize)
+{
+    apr_bucket *e;
+    apr_status_t status;
+
+    for (e = APR_BRIGADE_FIRST(bb);
+         e != APR_BRIGADE_SENTINEL(bb);
+         e = APR_BUCKET_NEXT(e)) {
+        const char *data;
+        apr_size_t bytes_read, bytes_written;
+
+        apr_bucket_read(e, &data, &bytes_read, APR_BLOCK_READ);
+        status = apr_file_write_full(tmpfile, data, bytes_read, &bytes_written);
+        if (status != APR_SUCCESS) {
+            const char *tmpfile_name;
+
+            if (apr_file_name_get(&tmpfile_name, tmpfile) != APR_SUCCESS) {
+                tmpfile_name = "(unknown)";
+            }
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01091)
+                          "write to temporary file %s failed",
+                          tmpfile_name);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        AP_DEBUG_ASSERT(bytes_read == bytes_written);
+        *fsize += bytes_written;
+    }
+    return OK;
+}
+
 static int stream_reqbody_chunked(apr_pool_t *p,
                                            request_rec *r,
                                            proxy_conn_rec *p_conn,
@@ -530,7 +649,7 @@ static int spool_reqbody_cl(apr_pool_t *p,
                                      apr_bucket_brigade *input_brigade,
                                      int force_cl)
 {
-    int seen_eos = 0;
+    int seen_eos = 0, rv;
     apr_status_t status = APR_SUCCESS;
     apr_bucket_alloc_t *bucket_alloc = r->connection->bucket_alloc;
     apr_bucket_brigade *body_brigade;
@@ -576,47 +695,14 @@ static int spool_reqbody_cl(apr_pool_t *p,
             }
             /* can't spool any more in memory; write latest brigade to disk */
             if (tmpfile == NULL) {
-                const char *temp_dir;
-                char *template;
-
-                status = apr_temp_dir_get(&temp_dir, p);
-                if (status != APR_SUCCESS) {
-                    ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01089)
-                                  "search for temporary directory failed");
-                    return HTTP_INTERNAL_SERVER_ERROR;
-                }
-                apr_filepath_merge(&template, temp_dir,
-                                   "modproxy.tmp.XXXXXX",
-                                   APR_FILEPATH_NATIVE, p);
-                status = apr_file_mktemp(&tmpfile, template, 0, p);
-                if (status != APR_SUCCESS) {
-                    ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01090)
-                                  "creation of temporary file in directory "
-                                  "%s failed", temp_dir);
-                    return HTTP_INTERNAL_SERVER_ERROR;
+                rv = create_spool_file(p, r, 0, &tmpfile);
+                if (rv != OK) {
+                    return rv;
                 }
             }
-            for (e = APR_BRIGADE_FIRST(input_brigade);
-                 e != APR_BRIGADE_SENTINEL(input_brigade);
-                 e = APR_BUCKET_NEXT(e)) {
-                const char *data;
-                apr_size_t bytes_read, bytes_written;
-
-                apr_bucket_read(e, &data, &bytes_read, APR_BLOCK_READ);
-                status = apr_file_write_full(tmpfile, data, bytes_read, &bytes_written);
-                if (status != APR_SUCCESS) {
-                    const char *tmpfile_name;
-
-                    if (apr_file_name_get(&tmpfile_name, tmpfile) != APR_SUCCESS) {
-                        tmpfile_name = "(unknown)";
-                    }
-                    ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01091)
-                                  "write to temporary file %s failed",
-                                  tmpfile_name);
-                    return HTTP_INTERNAL_SERVER_ERROR;
-                }
-                AP_DEBUG_ASSERT(bytes_read == bytes_written);
-                fsize += bytes_written;
+            rv = write_spool_file(r, tmpfile, input_brigade, &fsize);
+            if (rv != OK) {
+                return rv;
             }
             apr_brigade_cleanup(input_brigade);
         }
@@ -671,6 +757,122 @@ static int spool_reqbody_cl(apr_pool_t *p,
     return OK;
 }
 
+/*
+ * Continue the prefetch up to limit bytes, so that the whole body can be
+ * kept for a retry.  What does not fit in memory goes to a (bounded)
+ * spool file appended to input_brigade, which the stream_reqbody_*()
+ * functions will then forward whether or not EOS could be reached.
+ */
+static int spool_reqbody_retry(apr_pool_t *p, request_rec *r,
+                               apr_bucket_brigade *input_brigade,
+                               apr_off_t limit, apr_off_t *bytes_read)
+{
+    apr_bucket_alloc_t *bucket_alloc = r->connection->bucket_alloc;
+    apr_bucket_brigade *bb = apr_brigade_create(p, bucket_alloc);
+    apr_file_t *tmpfile = NULL;
+    apr_off_t bytes, fsize = 0;
+    apr_status_t status;
+    int seen_eos = 0, rv;
+
+    while (!seen_eos && *bytes_read <= limit) {
+        status = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES,
+                                APR_BLOCK_READ, HUGE_STRING_LEN);
+        if (status != APR_SUCCESS) {
+            conn_rec *c = r->connection;
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(02860)
+                          "read request body failed from %s (%s)",
+                          c->client_ip, c->remote_host ? c->remote_host: "");
+            return ap_map_http_request_error(status, HTTP_BAD_REQUEST);
+        }
+        if (!APR_BRIGADE_EMPTY(bb)
+            && APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(bb))) {
+            seen_eos = 1;
+            apr_bucket_delete(APR_BRIGADE_LAST(bb));
+        }
+        apr_brigade_length(bb, 1, &bytes);
+        if (bytes) {
+            if (tmpfile == NULL) {
+                rv = create_spool_file(p, r, 1, &tmpfile);
+                if (rv != OK) {
+                    return rv;
+                }
+            }
+            rv = write_spool_file(r, tmpfile, bb, &fsize);
+            if (rv != OK) {
+                return rv;
+            }
+            *bytes_read += bytes;
+        }
+        apr_brigade_cleanup(bb);
+    }
+
+    if (tmpfile) {
+        apr_brigade_insert_file(input_brigade, tmpfile, 0, fsize, p);
+    }
+    if (seen_eos) {
+        APR_BRIGADE_INSERT_TAIL(input_brigade,
+                                apr_bucket_eos_create(bucket_alloc));
+    }
+    return OK;
+}
+
+/*
+ * Keep a reference to the complete body prefetched in input_brigade,
+ * for ap_proxy_http_prefetch() to replay it should mod_proxy fail over to
+ * another worker.
+ */
+static void keep_reqbody(request_rec *r, apr_bucket_brigade *input_brigade,
+                         apr_off_t length)
+{
+    proxy_http_body_t *body;
+    apr_bucket *e, *copy;
+
+    body = apr_pcalloc(r->pool, sizeof(*body));
+    body->bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    body->length = length;
+    for (e = APR_BRIGADE_FIRST(input_brigade);
+         e != APR_BRIGADE_SENTINEL(input_brigade);
+         e = APR_BUCKET_NEXT(e)) {
+        if (APR_BUCKET_IS_METADATA(e)) {
+            continue;
+        }
+        if (apr_bucket_copy(e, &copy) != APR_SUCCESS) {
+            /* Not replayable */
+            apr_brigade_destroy(body->bb);
+            return;
+        }
+        APR_BRIGADE_INSERT_TAIL(body->bb, copy);
+    }
+    ap_set_module_config(r->request_config, &proxy_http_module, body);
+}
+
+static int replay_reqbody(request_rec *r, proxy_http_body_t *body,
+                          apr_bucket_brigade *input_brigade)
+{
+    apr_bucket *e, *copy;
+
+    if (body->sent && !is_idempotent(r)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02861)
+                      "not retrying non-idempotent %s request whose body "
+                      "was already sent", r->method);
+        return HTTP_BAD_GATEWAY;
+    }
+
+    for (e = APR_BRIGADE_FIRST(body->bb);
+         e != APR_BRIGADE_SENTINEL(body->bb);
+         e = APR_BUCKET_NEXT(e)) {
+        apr_bucket_copy(e, &copy);
+        APR_BRIGADE_INSERT_TAIL(input_brigade, copy);
+    }
+    APR_BRIGADE_INSERT_TAIL(input_brigade,
+                            apr_bucket_eos_create(input_brigade->bucket_alloc));
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02862)
+                  "replaying %" APR_OFF_T_FMT " bytes of spooled request body",
+                  body->length);
+    return OK;
+}
+
 /*
  * Transform buckets from one bucket allocator to another one by creating a
  * transient bucket for each data bucket and let it use the data read from
@@ -748,6 +950,10 @@ static int ap_proxy_http_prefetch(apr_pool_t *p, request_rec *r,
     int force10, rv;
     apr_read_type_e block;
     conn_rec *origin = p_conn->connection;
+    proxy_dir_conf *dconf = ap_get_module_config(r->per_dir_config,
+                                                 &proxy_module);
+    proxy_http_body_t *body = ap_get_module_config(r->request_config,
+                                                   &proxy_http_module);
 
     if (apr_table_get(r->subprocess_env, "force-proxy-request-1.0")) {
         if (r->expecting_100) {
@@ -809,67 +1015,98 @@ static int ap_proxy_http_prefetch(apr_pool_t *p, request_rec *r,
         p_conn->close = 1;
     }
 
-    /* Prefetch MAX_MEM_SPOOL bytes
-     *
-     * This helps us avoid any election of C-L v.s. T-E
-     * request bodies, since we are willing to keep in
-     * memory this much data, in any case.  This gives
-     * us an instant C-L election if the body is of some
-     * reasonable size.
-     */
-    temp_brigade = apr_brigade_create(p, bucket_alloc);
-    block = (flushall) ? APR_NONBLOCK_READ : APR_BLOCK_READ;
-    do {
-        status = ap_get_brigade(r->input_filters, temp_brigade,
-                                AP_MODE_READBYTES, block,
-                                MAX_MEM_SPOOL - bytes_read);
-        /* ap_get_brigade may return success with an empty brigade
-         * for a non-blocking read which would block
-         */
-        if (block == APR_NONBLOCK_READ
-            && ((status == APR_SUCCESS && APR_BRIGADE_EMPTY(temp_brigade))
-                || APR_STATUS_IS_EAGAIN(status))) {
-            break;
-        }
-        if (status != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01095)
-                          "prefetch request body failed to %pI (%s)"
-                          " from %s (%s)",
-                          p_conn->addr, p_conn->hostname ? p_conn->hostname: "",
-                          c->client_ip, c->remote_host ? c->remote_host: "");
-            return ap_map_http_request_error(status, HTTP_BAD_REQUEST);
+    if (body) {
+        /* This is a retry, the whole body was spooled by the first attempt */
+        rv = replay_reqbody(r, body, input_brigade);
+        if (rv != OK) {
+            return rv;
         }
+        bytes_read = body->length;
+    }
+    else {
+        /* Prefetch MAX_MEM_SPOOL bytes
+         *
+         * This helps us avoid any election of C-L v.s. T-E
+         * request bodies, since we are willing to keep in
+         * memory this much data, in any case.  This gives
+         * us an instant C-L election if the body is of some
+         * reasonable size.
+         */
+        temp_brigade = apr_brigade_create(p, bucket_alloc);
+        block = (flushall) ? APR_NONBLOCK_READ : APR_BLOCK_READ;
+        do {
+            status = ap_get_brigade(r->input_filters, temp_brigade,
+                                    AP_MODE_READBYTES, block,
+                                    MAX_MEM_SPOOL - bytes_read);
+            /* ap_get_brigade may return success with an empty brigade
+             * for a non-blocking read which would block
+             */
+            if (block == APR_NONBLOCK_READ
+                && ((status == APR_SUCCESS && APR_BRIGADE_EMPTY(temp_brigade))
+                    || APR_STATUS_IS_EAGAIN(status))) {
+                break;
+            }
+            if (status != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01095)
+                              "prefetch request body failed to %pI (%s)"
+                              " from %s (%s)",
+                              p_conn->addr, p_conn->hostname ? p_conn->hostname: "",
+                              c->client_ip, c->remote_host ? c->remote_host: "");
+                return ap_map_http_request_error(status, HTTP_BAD_REQUEST);
+            }
 
-        apr_brigade_length(temp_brigade, 1, &bytes);
-        bytes_read += bytes;
+            apr_brigade_length(temp_brigade, 1, &bytes);
+            bytes_read += bytes;
 
-        /*
-         * Save temp_brigade in input_brigade. (At least) in the SSL case
-         * temp_brigade contains transient buckets whose data would get
-         * overwritten during the next call of ap_get_brigade in the loop.
-         * ap_save_brigade ensures these buckets to be set aside.
-         * Calling ap_save_brigade with NULL as filter is OK, because
-         * input_brigade already has been created and does not need to get
-         * created by ap_save_brigade.
+            /*
+             * Save temp_brigade in input_brigade. (At least) in the SSL case
+             * temp_brigade contains transient buckets whose data would get
+             * overwritten during the next call of ap_get_brigade in the loop.
+             * ap_save_brigade ensures these buckets to be set aside.
+             * Calling ap_save_brigade with NULL as filter is OK, because
+             * input_brigade already has been created and does not need to get
+             * created by ap_save_brigade.
+             */
+            status = ap_save_brigade(NULL, &input_brigade, &temp_brigade, p);
+            if (status != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01096)
+                              "processing prefetched request body failed"
+                              " to %pI (%s) from %s (%s)",
+                              p_conn->addr, p_conn->hostname ? p_conn->hostname: "",
+                              c->client_ip, c->remote_host ? c->remote_host: "");
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+        /* Ensure we don't hit a wall where we have a buffer too small
+         * for ap_get_brigade's filters to fetch us another bucket,
+         * surrender once we hit 80 bytes less than MAX_MEM_SPOOL
+         * (an arbitrary value.)
          */
-        status = ap_save_brigade(NULL, &input_brigade, &temp_brigade, p);
-        if (status != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r, APLOGNO(01096)
-                          "processing prefetched request body failed"
-                          " to %pI (%s) from %s (%s)",
-                          p_conn->addr, p_conn->hostname ? p_conn->hostname: "",
-                          c->client_ip, c->remote_host ? c->remote_host: "");
-            return HTTP_INTERNAL_SERVER_ERROR;
+        } while ((bytes_read < MAX_MEM_SPOOL - 80)
+                  && !APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(input_brigade))
+                  && block == APR_BLOCK_READ);
+
+        /* If the body is allowed to be retried, read (up to) the rest now */
+        if (dconf->retry_body_limit > 0 && !flushall
+            && bytes_read <= dconf->retry_body_limit
+            && (APR_BRIGADE_EMPTY(input_brigade)
+                || !APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(input_brigade)))
+            && !(*old_cl_val && !*old_te_val
+                 && apr_atoi64(*old_cl_val) > dconf->retry_body_limit)) {
+            rv = spool_reqbody_retry(p, r, input_brigade,
+                                     dconf->retry_body_limit, &bytes_read);
+            if (rv != OK) {
+                return rv;
+            }
         }
 
-    /* Ensure we don't hit a wall where we have a buffer too small
-     * for ap_get_brigade's filters to fetch us another bucket,
-     * surrender once we hit 80 bytes less than MAX_MEM_SPOOL
-     * (an arbitrary value.)
-     */
-    } while ((bytes_read < MAX_MEM_SPOOL - 80)
-              && !APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(input_brigade))
-              && block == APR_BLOCK_READ);
+        if (dconf->retry_body_limit > 0
+            && bytes_read <= dconf->retry_body_limit
+            && !APR_BRIGADE_EMPTY(input_brigade)
+            && APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(input_brigade))) {
+            keep_reqbody(r, input_brigade, bytes_read);
+        }
+    }
 
     /* Use chunked request body encoding or send a content-length body?
      *
@@ -1989,6 +2226,7 @@ static int proxy_http_handler(request_rec *r, proxy_worker *worker,
     apr_bucket_brigade *header_brigade;
     apr_bucket_brigade *input_brigade;
     proxy_conn_rec *backend = NULL;
+    proxy_http_body_t *body;
     int is_ssl = 0;
     conn_rec *c = r->connection;
     int retry = 0;
@@ -2175,6 +2413,10 @@ static int proxy_http_handler(request_rec *r, proxy_worker *worker,
          * On the off-chance that we forced a 100-Continue as a
          * kinda HTTP ping test, allow for retries
          */
+        body = ap_get_module_config(r->request_config, &proxy_http_module);
+        if (body) {
+            body->sent = 1;
+        }
         if ((status = ap_proxy_http_request(p, r, backend,
                                             header_brigade, input_brigade,
                                             old_cl_val, old_te_val, rb_method,
@@ -2189,9 +2431,21 @@ static int proxy_http_handler(request_rec *r, proxy_worker *worker,
                               worker->cp->addr, worker->s->hostname);
                 retry++;
                 continue;
-            } else {
-                break;
             }
+            /* The body is spooled, so let mod_proxy fail over to another
+             * balancer member if the request can safely be sent again,
+             * without putting this worker in error for a single failure.
+             */
+            if (body && is_idempotent(r)
+                && apr_table_get(r->subprocess_env, "BALANCER_NAME")) {
+                ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(02863)
+                              "HTTP: sending request to %pI (%s) failed, "
+                              "will retry on another member",
+                              worker->cp->addr, worker->s->hostname);
+                apr_table_setn(r->notes, PROXY_RETRY_NOTE, worker->s->name);
+                status = HTTP_SERVICE_UNAVAILABLE;
+            }
+            break;
         }
 
         /* Step Five: Receive the Response... Fall thru to cleanup */
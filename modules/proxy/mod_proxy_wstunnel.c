@@ -34,12 +34,18 @@ typedef struct ws_baton_t {
     apr_bucket_brigade *bb;
     apr_pool_t *subpool;        /* cleared before each suspend, destroyed when request ends */
     char *scheme;               /* required to release the proxy connection */
+    proxy_splice_t *splice_in;  /* zero-copy client to backend, if possible */
+    proxy_splice_t *splice_out; /* zero-copy backend to client, if possible */
+    int try_splice_in;
+    int try_splice_out;
 } ws_baton_t;
 
 static apr_status_t proxy_wstunnel_transfer(request_rec *r,
                                             conn_rec *c_i, conn_rec *c_o,
                                             apr_bucket_brigade *bb,
-                                            const char *name, int *sent);
+                                            const char *name, int *sent,
+                                            proxy_splice_t **ps,
+                                            int *try_splice);
 static void proxy_wstunnel_callback(void *b);
 
 static int proxy_wstunnel_pump(ws_baton_t *baton, apr_time_t timeout, int try_async) {
@@ -90,7 +96,9 @@ static int proxy_wstunnel_pump(ws_baton_t *baton, apr_time_t timeout, int try_as
                     ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, APLOGNO(02446)
                             "sock was readable");
                     done |= proxy_wstunnel_transfer(r, backconn, c, bb, "sock",
-                                                    NULL) != APR_SUCCESS;
+                                                    NULL, &baton->splice_out,
+                                                    &baton->try_splice_out)
+                            != APR_SUCCESS;
                 }
                 else if (pollevent & APR_POLLERR) {
                     ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, APLOGNO(02447)
@@ -110,7 +118,9 @@ static int proxy_wstunnel_pump(ws_baton_t *baton, apr_time_t timeout, int try_as
                     ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, APLOGNO(02448)
                             "client was readable");
                     done |= proxy_wstunnel_transfer(r, c, backconn, bb, "client",
-                                                    &replied) != APR_SUCCESS;
+                                                    &replied, &baton->splice_in,
+                                                    &baton->try_splice_in)
+                            != APR_SUCCESS;
                 }
                 else if (pollevent & APR_POLLERR) {
                     ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, APLOGNO(02607)
@@ -271,13 +281,34 @@ static int proxy_wstunnel_canon(request_rec *r, char *url)
 static apr_status_t proxy_wstunnel_transfer(request_rec *r,
                                             conn_rec *c_i, conn_rec *c_o,
                                             apr_bucket_brigade *bb,
-                                            const char *name, int *sent)
+                                            const char *name, int *sent,
+                                            proxy_splice_t **ps,
+                                            int *try_splice)
 {
     apr_status_t rv;
 #ifdef DEBUGGING
     apr_off_t len;
 #endif
 
+    /* Once the filters are drained, relay with splice() if possible */
+    if (*ps) {
+        apr_off_t spliced;
+
+        rv = ap_proxy_splice_transfer(*ps, &spliced);
+        if (spliced && sent) {
+            *sent = 1;
+        }
+        if (rv != APR_SUCCESS && !APR_STATUS_IS_EOF(rv)) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, APLOGNO(02858)
+                          "error on %s - ap_proxy_splice_transfer",
+                          name);
+        }
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE2, rv, r,
+                      "wstunnel_transfer spliced %" APR_OFF_T_FMT " bytes",
+                      spliced);
+        return rv;
+    }
+
     do {
         apr_brigade_cleanup(bb);
         rv = ap_get_brigade(c_i->input_filters, bb, AP_MODE_READBYTES,
@@ -319,6 +350,10 @@ static apr_status_t proxy_wstunnel_transfer(request_rec *r,
 
     if (APR_STATUS_IS_EAGAIN(rv)) {
         rv = APR_SUCCESS;
+        if (*try_splice) {
+            *ps = ap_proxy_splice_create(r, c_i, c_o);
+            *try_splice = 0;
+        }
     }
 
     return rv;
@@ -415,6 +450,7 @@ static int proxy_wstunnel_request(apr_pool_t *p, request_rec *r,
     baton->proxy_connrec = conn;
     baton->bb = bb;
     baton->scheme = scheme;
+    baton->try_splice_in = baton->try_splice_out = 1;
     apr_pool_create(&baton->subpool, r->pool);
 
     if (!dconf->is_async) { 
@@ -0,0 +1,114 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PROXY_LATENCY_H_
+#define PROXY_LATENCY_H_
+
+/**
+ * @file  proxy_latency.h
+ * @brief Backend latency estimate, sampled by mod_proxy_balancer and
+ *        balanced on by mod_lbmethod_bylatency.
+ *
+ * Only the latency, latency_updated, busy and lbfactor fields of
+ * proxy_worker_shared are used, so that test/test_lbmethod_sim.c can
+ * compile this file against its synthetic backends.
+ *
+ * @defgroup MOD_PROXY_LATENCY Latency
+ * @ingroup MOD_PROXY
+ * @{
+ */
+
+/**
+ * Weight given to the last response time sample when updating a worker's
+ * smoothed latency: new = old + (sample - old) / PROXY_LATENCY_WEIGHT.
+ * This is the same 1/8 gain TCP uses for its smoothed RTT estimator.
+ */
+#define PROXY_LATENCY_WEIGHT 8
+
+/**
+ * Idle period after which a worker's latency is halved, so that a worker
+ * avoided for being slow gets a chance to prove it recovered.
+ */
+#define PROXY_LATENCY_DECAY apr_time_from_sec(10)
+
+/**
+ * Account a response time sample to a worker.
+ * @param ws     the worker's shared data
+ * @param sample the time from the election to the start of the response
+ * @param now    the time of the sample
+ */
+static APR_INLINE void proxy_latency_update(proxy_worker_shared *ws,
+                                            apr_interval_time_t sample,
+                                            apr_time_t now)
+{
+    if (sample < 0) {
+        sample = 0;
+    }
+    ws->latency_updated = now;
+    if (!ws->latency) {
+        ws->latency = sample;
+    }
+    else {
+        ws->latency += (sample - ws->latency) / PROXY_LATENCY_WEIGHT;
+    }
+}
+
+/**
+ * The worker's latency, halved for each PROXY_LATENCY_DECAY elapsed since
+ * its last sample.
+ */
+static APR_INLINE apr_uint64_t proxy_latency_decayed(
+                                    const proxy_worker_shared *ws,
+                                    apr_time_t now)
+{
+    apr_interval_time_t latency = ws->latency;
+    apr_interval_time_t idle = now - ws->latency_updated;
+
+    if (latency <= 0) {
+        return 0;
+    }
+    if (idle > PROXY_LATENCY_DECAY) {
+        apr_interval_time_t halvings = idle / PROXY_LATENCY_DECAY;
+        if (halvings >= 32) {
+            return 0;
+        }
+        latency >>= halvings;
+    }
+    return (apr_uint64_t)latency;
+}
+
+/**
+ * Whether worker b is expected to serve one more request sooner than
+ * worker a, i.e. has a lower (latency + 1) * (busy + 1) / lbfactor.
+ */
+static APR_INLINE int proxy_latency_cheaper(const proxy_worker_shared *b,
+                                            const proxy_worker_shared *a,
+                                            apr_time_t now)
+{
+    apr_uint64_t cost_a, cost_b;
+
+    /* Cross multiply by the other's lbfactor rather than dividing */
+    cost_a = (proxy_latency_decayed(a, now) + 1) * (a->busy + 1)
+             * (apr_uint64_t)(b->lbfactor > 0 ? b->lbfactor : 1);
+    cost_b = (proxy_latency_decayed(b, now) + 1) * (b->busy + 1)
+             * (apr_uint64_t)(a->lbfactor > 0 ? a->lbfactor : 1);
+
+    return cost_b < cost_a;
+}
+
+/** @} */
+
+#endif /* PROXY_LATENCY_H_ */
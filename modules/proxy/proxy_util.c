@@ -36,6 +36,9 @@
 #if APR_HAVE_SYS_UN_H
 #include <sys/un.h>
 #endif
+#ifdef HAVE_SPLICE
+#include <fcntl.h>          /* for splice() */
+#endif
 #if (APR_MAJOR_VERSION < 2)
 #include "apr_support.h"        /* for apr_wait_for_io_or_timeout() */
 #endif
@@ -69,6 +72,7 @@ static struct wstat {
     {PROXY_WORKER_IN_ERROR,      PROXY_WORKER_IN_ERROR_FLAG,      "Err "},
     {PROXY_WORKER_HOT_STANDBY,   PROXY_WORKER_HOT_STANDBY_FLAG,   "Stby "},
     {PROXY_WORKER_FREE,          PROXY_WORKER_FREE_FLAG,          "Free "},
+    {PROXY_WORKER_HC_FAIL,       PROXY_WORKER_HC_FAIL_FLAG,       "HcFl "},
     {0x0, '\0', NULL}
 };
 
@@ -3650,6 +3654,174 @@ PROXY_DECLARE(int) ap_proxy_pass_brigade(apr_bucket_alloc_t *bucket_alloc,
     return OK;
 }
 
+#ifdef HAVE_SPLICE
+
+/* Largest amount of data moved through the pipe at once, this is the
+ * default pipe capacity on Linux.
+ */
+#define PROXY_SPLICE_BLKSZ (64 * 1024)
+
+struct proxy_splice_t {
+    conn_rec *c_i;
+    conn_rec *c_o;
+    apr_socket_t *sock_o;
+    int fd_i;
+    int fd_o;
+    int pipefd[2];
+    apr_size_t pending;
+    int logio_in;
+    APR_OPTIONAL_FN_TYPE(ap_logio_add_bytes_in) *add_bytes_in;
+    APR_OPTIONAL_FN_TYPE(ap_logio_add_bytes_out) *add_bytes_out;
+};
+
+static apr_status_t proxy_splice_cleanup(void *data)
+{
+    proxy_splice_t *ps = data;
+
+    close(ps->pipefd[0]);
+    close(ps->pipefd[1]);
+    return APR_SUCCESS;
+}
+
+/*
+ * Splicing is only possible if nothing but the core filters (and mod_logio
+ * accounting) would see the data, ie. no SSL, no timeout or any other
+ * connection filter, otherwise we must go through the filter stacks.
+ */
+static int proxy_splice_eligible(conn_rec *c_i, conn_rec *c_o, int *logio)
+{
+    ap_filter_t *f;
+
+    *logio = 0;
+    for (f = c_i->input_filters; f; f = f->next) {
+        if (f->frec == ap_core_input_filter_handle) {
+            continue;
+        }
+        if (strcasecmp(f->frec->name, "LOG_INPUT_OUTPUT") == 0) {
+            *logio = 1;
+            continue;
+        }
+        return 0;
+    }
+    for (f = c_o->output_filters; f; f = f->next) {
+        if (f->frec != ap_core_output_filter_handle) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#endif /* HAVE_SPLICE */
+
+PROXY_DECLARE(proxy_splice_t *) ap_proxy_splice_create(request_rec *r,
+                                                       conn_rec *c_i,
+                                                       conn_rec *c_o)
+{
+#ifdef HAVE_SPLICE
+    proxy_splice_t *ps;
+    apr_socket_t *sock_i, *sock_o;
+    apr_os_sock_t fd_i, fd_o;
+    int logio;
+
+    if (!proxy_splice_eligible(c_i, c_o, &logio)) {
+        return NULL;
+    }
+    sock_i = ap_get_conn_socket(c_i);
+    sock_o = ap_get_conn_socket(c_o);
+    if (!sock_i || !sock_o
+            || apr_os_sock_get(&fd_i, sock_i) != APR_SUCCESS
+            || apr_os_sock_get(&fd_o, sock_o) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    ps = apr_pcalloc(r->pool, sizeof(*ps));
+    if (pipe(ps->pipefd) != 0) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, errno, r, APLOGNO(02856)
+                      "splice: pipe() failed, using regular transfer");
+        return NULL;
+    }
+    apr_pool_cleanup_register(r->pool, ps, proxy_splice_cleanup,
+                              apr_pool_cleanup_null);
+
+    ps->c_i = c_i;
+    ps->c_o = c_o;
+    ps->sock_o = sock_o;
+    ps->fd_i = fd_i;
+    ps->fd_o = fd_o;
+    ps->logio_in = logio;
+    ps->add_bytes_in = APR_RETRIEVE_OPTIONAL_FN(ap_logio_add_bytes_in);
+    ps->add_bytes_out = APR_RETRIEVE_OPTIONAL_FN(ap_logio_add_bytes_out);
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE2, 0, r,
+                  "splice: zero-copy transfer enabled from %pI to %pI",
+                  c_i->client_addr, c_o->client_addr);
+    return ps;
+#else
+    return NULL;
+#endif
+}
+
+PROXY_DECLARE(apr_status_t) ap_proxy_splice_transfer(proxy_splice_t *ps,
+                                                     apr_off_t *transferred)
+{
+#ifdef HAVE_SPLICE
+    apr_status_t rv;
+    ssize_t n;
+
+    *transferred = 0;
+
+    /* Pull what is available from the input socket into the pipe, the
+     * caller polled it so this should not block.
+     */
+    if (!ps->pending) {
+        do {
+            n = splice(ps->fd_i, NULL, ps->pipefd[1], NULL,
+                       PROXY_SPLICE_BLKSZ, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while (n < 0 && errno == EINTR);
+        if (n == 0) {
+            return APR_EOF;
+        }
+        if (n < 0) {
+            rv = APR_FROM_OS_ERROR(errno);
+            return APR_STATUS_IS_EAGAIN(rv) ? APR_SUCCESS : rv;
+        }
+        ps->pending = n;
+        if (ps->logio_in && ps->add_bytes_in) {
+            ps->add_bytes_in(ps->c_i, n);
+        }
+    }
+
+    /* Then push it all to the output socket */
+    while (ps->pending) {
+        n = splice(ps->pipefd[0], NULL, ps->fd_o, NULL,
+                   ps->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            rv = APR_FROM_OS_ERROR(errno);
+            if (APR_STATUS_IS_EINTR(rv)) {
+                continue;
+            }
+            if (APR_STATUS_IS_EAGAIN(rv)) {
+                rv = apr_wait_for_io_or_timeout(NULL, ps->sock_o, 0);
+                if (rv == APR_SUCCESS) {
+                    continue;
+                }
+            }
+            ps->c_o->aborted = 1;
+            return rv;
+        }
+        ps->pending -= n;
+        *transferred += n;
+        if (ps->add_bytes_out) {
+            ps->add_bytes_out(ps->c_o, n);
+        }
+    }
+
+    return APR_SUCCESS;
+#else
+    return APR_ENOTIMPL;
+#endif
+}
+
 /* Fill in unknown schemes from apr_uri_port_of_scheme() */
 
 typedef struct proxy_schemes_t {
@@ -105,6 +105,9 @@ static const command_rec ssl_config_cmds[] = {
     SSL_CMD_SRV(SessionTicketKeyFile, TAKE1,
                 "TLS session ticket encryption/decryption key file (RFC 5077) "
                 "('/path/to/file' - file with 48 bytes of random data)")
+    SSL_CMD_SRV(SessionTicketKeyRotation, TAKE1,
+                "Interval in seconds for rotating the session ticket keys "
+                "shared by all children ('0' to not share them)")
 #endif
     SSL_CMD_ALL(CACertificatePath, TAKE1,
                 "SSL CA Certificate path "
@@ -151,6 +154,19 @@ static const command_rec ssl_config_cmds[] = {
     SSL_CMD_SRV(SessionTickets, FLAG,
                 "Enable or disable TLS session tickets"
                 "(`on', `off')")
+    SSL_CMD_SRV(AsyncHandshake, FLAG,
+                "Let crypto engines perform handshake operations "
+                "asynchronously (`on', `off')")
+    SSL_CMD_SRV(SharedContext, FLAG,
+                "Share the SSL_CTX of identically configured virtual hosts "
+                "(`on', `off')")
+    SSL_CMD_SRV(EarlyData, FLAG,
+                "Accept TLS 1.3 early data (0-RTT) on resumed sessions "
+                "(`on', `off')")
+    SSL_CMD_SRV(DynamicRecordSizing, TAKE12,
+                "Bytes sent in small TLS records at the start of a "
+                "connection and after idling, before switching to full "
+                "size records ('off' or bytes [idle-seconds])")
     SSL_CMD_SRV(InsecureRenegotiation, FLAG,
                 "Enable support for insecure renegotiation")
     SSL_CMD_ALL(UserName, TAKE1,
@@ -248,6 +264,9 @@ static const command_rec ssl_config_cmds[] = {
                 "OCSP responder query timeout")
     SSL_CMD_SRV(OCSPUseRequestNonce, FLAG,
                 "Whether OCSP queries use a nonce or not ('on', 'off')")
+    SSL_CMD_SRV(OCSPCacheTimeout, TAKE1,
+                "Seconds to remember the OCSP status of client certificates "
+                "in the session cache (0 to disable)")
 
 #ifdef HAVE_OCSP_STAPLING
     /*
@@ -276,6 +295,9 @@ static const command_rec ssl_config_cmds[] = {
                 "SSL stapling option for OCSP Response Error Cache Lifetime")
     SSL_CMD_SRV(StaplingForceURL, TAKE1,
                 "SSL stapling option to Force the OCSP Stapling URL")
+    SSL_CMD_SRV(StaplingBackgroundRefresh, FLAG,
+                "SSL stapling switch to renew OCSP responses from a watchdog "
+                "rather than during the handshakes (`on', `off')")
 #endif
 
 #ifdef HAVE_SSL_CONF_CMD
@@ -382,6 +404,10 @@ static int ssl_hook_pre_config(apr_pool_t *pconf,
 #ifdef HAVE_OCSP_STAPLING
     ap_mutex_register(pconf, SSL_STAPLING_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
 #endif
+#ifdef HAVE_TLS_EARLY_DATA
+    ap_mutex_register(pconf, SSL_EARLY_DATA_MUTEX_TYPE, NULL,
+                      APR_LOCK_DEFAULT, 0);
+#endif
 
     return OK;
 }
@@ -549,6 +575,19 @@ int ssl_init_ssl_connection(conn_rec *c, request_rec *r)
         return DECLINED; /* XXX */
     }
 
+#ifdef HAVE_TLS_EARLY_DATA
+    /*
+     * Accept a record's worth of early data (0-RTT) on resumed sessions,
+     * each of them only once, if the virtual host finally selected (SNI)
+     * enables it, see ssl_callback_AllowEarlyData().  Set on the SSL since
+     * SSL_set_SSL_CTX() does not carry them over from the SNI vhost's ctx.
+     */
+    if (!sslconn->is_proxy && myModConfig(server)->early_data == TRUE) {
+        SSL_set_max_early_data(ssl, SSL3_RT_MAX_PLAIN_LENGTH);
+        SSL_set_allow_early_data_cb(ssl, ssl_callback_AllowEarlyData, NULL);
+    }
+#endif
+
     rc = ssl_run_pre_handshake(c, ssl, sslconn->is_proxy ? 1 : 0);
     if (rc != OK && rc != DECLINED) {
         return rc;
@@ -22,8 +22,6 @@
  *     first time the data is received; but it could fail once due to invalid
  *     timestamp, and not be rechecked later after (potentially) time elapses
  *     and the timestamp is now in a valid range
- *   . server: shouldn't have to read file of server SCTs on every handshake
- *     (shared memory or cached file?)
  *   . split mod_ssl_ct.c into more pieces
  *   . research: Is it possible to send an SCT that is outside of the known
  *     valid interval for the log?
@@ -46,8 +44,10 @@
 #error mod_ssl_ct requires APR 1.5.0 or later! (for apr_escape.h)
 #endif
 
+#include "apr_atomic.h"
 #include "apr_escape.h"
 #include "apr_global_mutex.h"
+#include "apr_shm.h"
 #include "apr_signal.h"
 #include "apr_strings.h"
 #include "apr_thread_rwlock.h"
@@ -72,6 +72,7 @@
 #include "mod_proxy.h"
 #include "mod_ssl.h"
 #include "mod_ssl_openssl.h"
+#include "mod_watchdog.h"
 
 #include "ssl_ct_util.h"
 #include "ssl_ct_sct.h"
@@ -109,6 +110,12 @@
  */
 #define MAX_LOGLIST_SIZE 1000
 
+/** How often the watchdog looks for SCTs collated by the daemon
+ */
+#define SCT_LOAD_INTERVAL apr_time_from_sec(30)
+
+#define SCT_WATCHDOG_NAME "_ssl_ct_scts_"
+
 typedef struct ct_server_config {
     apr_array_header_t *db_log_config;
     apr_pool_t *db_log_config_pool;
@@ -149,8 +156,27 @@ typedef struct ct_conn_config {
 typedef struct ct_server_cert_info {
     const char *fingerprint;
     const char *sct_dir;
+    X509 *cert;
 } ct_server_cert_info;
 
+/** The SCT list of a server certificate, in shared memory and ready to be
+ * sent as the extension's data.  The watchdog loads a new list into the
+ * inactive buffer, then switches to it by incrementing the generation; a
+ * handshake copies the active buffer and retries if it was switched
+ * meanwhile.
+ */
+typedef struct ct_sct_slot {
+    apr_time_t mtime;                   /* of the collated file loaded */
+    volatile apr_uint32_t generation;   /* active buffer: generation & 1 */
+    apr_uint16_t len[2];                /* 0: no SCTs */
+    unsigned char scts[2][MAX_SCTS_SIZE];
+} ct_sct_slot;
+
+typedef struct ct_sct_slot_info {
+    ct_sct_slot *slot;
+    const char *sct_dir;
+} ct_sct_slot_info;
+
 typedef struct ct_sct_data {
     const void *data;
     apr_uint16_t len;
@@ -185,6 +211,10 @@ static apr_thread_t *service_thread;
 
 static apr_hash_t *cached_server_data;
 
+static apr_array_header_t *sct_slots; /* ct_sct_slot_info */
+static apr_hash_t *sct_slot_by_cert;  /* X509 * -> ct_sct_slot */
+static ap_watchdog_t *sct_watchdog;
+
 static const char *audit_fn_perm, *audit_fn_active;
 static apr_file_t *audit_file;
 static int audit_file_nonempty;
@@ -1214,6 +1244,204 @@ static int num_server_certs(server_rec *s_main)
     return num;
 }
 
+/* Load the SCTs last collated by the daemon into the inactive buffer of
+ * the slot and switch to them, unless they were loaded already.
+ */
+static void sct_slot_load(server_rec *s, apr_pool_t *p,
+                          ct_sct_slot_info *info)
+{
+    ct_sct_slot *slot = info->slot;
+    apr_finfo_t finfo;
+    apr_status_t rv, tmprv;
+    apr_size_t scts_len = 0;
+    char *sct_fn, *scts = NULL;
+    int next;
+
+    rv = ctutil_path_join(&sct_fn, info->sct_dir, COLLATED_SCTS_BASENAME, p, s);
+    if (rv != APR_SUCCESS) {
+        return;
+    }
+
+    if (apr_stat(&finfo, sct_fn, APR_FINFO_MTIME, p) != APR_SUCCESS) {
+        finfo.mtime = 0; /* no SCTs (anymore) */
+    }
+    if (finfo.mtime == slot->mtime) {
+        return;
+    }
+
+    if (finfo.mtime) {
+        if ((rv = apr_global_mutex_lock(ssl_ct_sct_update)) != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                         APLOGNO(02935) "global mutex lock failed");
+            return;
+        }
+
+        rv = ctutil_read_file(p, s, sct_fn, MAX_SCTS_SIZE, &scts, &scts_len);
+
+        if ((tmprv = apr_global_mutex_unlock(ssl_ct_sct_update)) != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, tmprv, s,
+                         APLOGNO(02936) "global mutex unlock failed");
+        }
+
+        if (rv != APR_SUCCESS) {
+            return;
+        }
+    }
+
+    next = (slot->generation + 1) & 1;
+    if (scts_len) {
+        memcpy(slot->scts[next], scts, scts_len);
+    }
+    slot->len[next] = (apr_uint16_t)scts_len;
+    slot->mtime = finfo.mtime;
+    apr_atomic_inc32(&slot->generation);
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 APLOGNO(02937) "loaded %" APR_SIZE_T_FMT " bytes of SCTs "
+                 "from %s", scts_len, sct_fn);
+}
+
+/* Copy the SCTs of a slot for the handshake; APR_NOTFOUND if none.
+ */
+static apr_status_t sct_slot_get(apr_pool_t *p, ct_sct_slot *slot,
+                                 const unsigned char **scts,
+                                 apr_size_t *scts_len)
+{
+    apr_uint32_t generation;
+    unsigned char *buf;
+    apr_size_t len;
+
+    do {
+        generation = apr_atomic_read32(&slot->generation);
+        len = slot->len[generation & 1];
+        if (!len) {
+            return APR_NOTFOUND;
+        }
+        buf = apr_palloc(p, len);
+        memcpy(buf, slot->scts[generation & 1], len);
+    } while (apr_atomic_read32(&slot->generation) != generation);
+
+    *scts = buf;
+    *scts_len = len;
+    return APR_SUCCESS;
+}
+
+static apr_status_t sct_watchdog_callback(int state, void *data,
+                                          apr_pool_t *pool)
+{
+    server_rec *s = data;
+    ct_sct_slot_info *info;
+    int i;
+
+    if (state != AP_WATCHDOG_STATE_RUNNING) {
+        return APR_SUCCESS;
+    }
+
+    info = (ct_sct_slot_info *)sct_slots->elts;
+    for (i = 0; i < sct_slots->nelts; i++) {
+        sct_slot_load(s, pool, &info[i]);
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Give each server certificate a slot in shared memory, load its SCTs
+ * and have the watchdog load them again whenever the daemon collated
+ * new ones.
+ */
+static int sct_slots_init(server_rec *s_main, apr_pool_t *pconf)
+{
+    APR_OPTIONAL_FN_TYPE(ap_watchdog_get_instance) *wd_get_instance;
+    APR_OPTIONAL_FN_TYPE(ap_watchdog_register_callback) *wd_register_callback;
+    apr_hash_t *by_fingerprint;
+    apr_size_t size;
+    apr_shm_t *shm;
+    apr_status_t rv;
+    ct_sct_slot *slots;
+    ct_sct_slot_info *info;
+    server_rec *s;
+    int i, used = 0;
+
+    sct_watchdog = NULL;
+
+    size = num_server_certs(s_main) * sizeof(ct_sct_slot);
+    rv = apr_shm_create(&shm, size, NULL, pconf);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        /* The slots reloaded by the watchdog are read by all the children,
+         * which a name-based segment provides too. */
+        const char *fname = ap_runtime_dir_relative(pconf, "ssl_ct_scts");
+        if (fname) {
+            apr_shm_remove(fname, pconf);
+            rv = apr_shm_create(&shm, size, fname, pconf);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s_main,
+                     APLOGNO(02938) "could not allocate shared memory for "
+                     "SCTs");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    slots = apr_shm_baseaddr_get(shm);
+    memset(slots, 0, size);
+
+    sct_slots = apr_array_make(pconf, 2, sizeof(ct_sct_slot_info));
+    sct_slot_by_cert = apr_hash_make(pconf);
+    by_fingerprint = apr_hash_make(pconf);
+
+    for (s = s_main; s; s = s->next) {
+        ct_server_config *sconf = ap_get_module_config(s->module_config,
+                                                       &ssl_ct_module);
+        ct_server_cert_info *cert_info;
+
+        if (!sconf || !sconf->server_cert_info) {
+            continue;
+        }
+        cert_info = (ct_server_cert_info *)sconf->server_cert_info->elts;
+        for (i = 0; i < sconf->server_cert_info->nelts; i++) {
+            ct_sct_slot *slot = apr_hash_get(by_fingerprint,
+                                             cert_info[i].fingerprint,
+                                             APR_HASH_KEY_STRING);
+
+            if (!slot) {
+                slot = &slots[used++];
+                apr_hash_set(by_fingerprint, cert_info[i].fingerprint,
+                             APR_HASH_KEY_STRING, slot);
+                info = (ct_sct_slot_info *)apr_array_push(sct_slots);
+                info->slot = slot;
+                info->sct_dir = cert_info[i].sct_dir;
+                sct_slot_load(s_main, pconf, info);
+            }
+            apr_hash_set(sct_slot_by_cert, &cert_info[i].cert,
+                         sizeof(cert_info[i].cert), slot);
+        }
+    }
+
+    wd_get_instance = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_get_instance);
+    wd_register_callback = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_register_callback);
+    if (!wd_get_instance || !wd_register_callback) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s_main,
+                     APLOGNO(02939) "mod_watchdog is not loaded, SCTs "
+                     "refreshed by the " DAEMON_NAME " will be sent only "
+                     "after a restart, those missing at startup are read "
+                     "from disk at each handshake");
+        return OK;
+    }
+
+    rv = wd_get_instance(&sct_watchdog, SCT_WATCHDOG_NAME, 0, 1, pconf);
+    if (rv == APR_SUCCESS) {
+        rv = wd_register_callback(sct_watchdog, SCT_LOAD_INTERVAL, s_main,
+                                  sct_watchdog_callback);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s_main,
+                     APLOGNO(02940) "could not set up the watchdog (%s) "
+                     "loading SCTs", SCT_WATCHDOG_NAME);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return OK;
+}
+
 static int ssl_ct_post_config(apr_pool_t *pconf, apr_pool_t *plog,
                               apr_pool_t *ptemp, server_rec *s_main)
 {
@@ -1332,6 +1560,13 @@ static int ssl_ct_post_config(apr_pool_t *pconf, apr_pool_t *plog,
     }
 #endif
 
+    {
+        int ret = sct_slots_init(s_main, pconf);
+        if (ret != OK) {
+            return ret;
+        }
+    }
+
 #ifdef HAVE_SCT_DAEMON_CHILD
     if (ap_state_query(AP_SQ_MAIN_STATE) != AP_SQ_MS_CREATE_PRE_CONFIG) {
         int ret = daemon_start(pconf, s_main, procnew);
@@ -1506,6 +1741,7 @@ static void look_for_server_certs(server_rec *s, SSL_CTX *ctx, const char *sct_d
             cert_info = (ct_server_cert_info *)apr_array_push(sconf->server_cert_info);
             cert_info->sct_dir = cert_sct_dir;
             cert_info->fingerprint = fingerprint;
+            cert_info->cert = x;
         }
         else {
             ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
@@ -2289,6 +2525,7 @@ static int server_extension_add_callback(SSL *ssl, unsigned ext_type,
     const unsigned char *scts;
     apr_size_t scts_len;
     apr_status_t rv;
+    ct_sct_slot *slot;
 
     if (!is_client_ct_aware(c)) {
         /* Hmmm...  Is this actually called if the client doesn't include
@@ -2303,16 +2540,25 @@ static int server_extension_add_callback(SSL *ssl, unsigned ext_type,
     /* need to reply with SCT */
 
     server_cert = SSL_get_certificate(ssl); /* no need to free! */
-    fingerprint = get_cert_fingerprint(c->pool, server_cert);
 
     ap_log_cerror(APLOG_MARK, APLOG_TRACE2, 0, c,
                   "server_extension_add_callback called, "
                   "ext %hu will be in ServerHello",
                   ext_type);
 
-    rv = read_scts(c->pool, fingerprint,
-                   sconf->sct_storage,
-                   c->base_server, (char **)&scts, &scts_len);
+    slot = apr_hash_get(sct_slot_by_cert, &server_cert, sizeof(server_cert));
+    rv = APR_NOTFOUND;
+    if (slot) {
+        rv = sct_slot_get(c->pool, slot, &scts, &scts_len);
+    }
+    /* not a certificate seen at startup, or nothing collated for it
+     * then and no watchdog to load it later */
+    if (!slot || (rv == APR_NOTFOUND && !sct_watchdog)) {
+        fingerprint = get_cert_fingerprint(c->pool, server_cert);
+        rv = read_scts(c->pool, fingerprint,
+                       sconf->sct_storage,
+                       c->base_server, (char **)&scts, &scts_len);
+    }
     if (rv == APR_SUCCESS) {
         *out = scts;
         ap_assert(scts_len <= USHRT_MAX);
@@ -42,6 +42,13 @@
 /**
  * init_server hook -- allow SSL_CTX-specific initialization to be performed by
  * a module for each SSL-enabled server (one at a time)
+ *
+ * When some module implements this hook, each server has its own SSL_CTX
+ * unless "SSLSharedContext on" is configured.  Identically configured
+ * servers then share a single SSL_CTX and the hook is only run once for
+ * it, with the first server using it, so a module supporting this must
+ * look its per-server state up from the connection at handshake time.
+ *
  * @param s SSL-enabled [virtual] server
  * @param p pconf pool
  * @param is_proxy 1 if this server supports backend connections
@@ -62,10 +62,15 @@ SSLModConfigRec *ssl_config_global_create(server_rec *s)
     mc->sesscache_mode         = SSL_SESS_CACHE_OFF;
     mc->sesscache              = NULL;
     mc->pMutex                 = NULL;
+#ifdef HAVE_TLS_EARLY_DATA
+    mc->early_data_mutex       = NULL;
+    mc->early_data             = FALSE;
+#endif
     mc->aRandSeed              = apr_array_make(pool, 4,
                                                 sizeof(ssl_randseed_t));
     mc->tVHostKeys             = apr_hash_make(pool);
     mc->tPrivateKey            = apr_hash_make(pool);
+    mc->tParsedFiles           = apr_hash_make(pool);
 #if defined(HAVE_OPENSSL_ENGINE_H) && defined(HAVE_ENGINE_INIT)
     mc->szCryptoDevice         = NULL;
 #endif
@@ -73,6 +78,12 @@ SSLModConfigRec *ssl_config_global_create(server_rec *s)
     mc->stapling_cache         = NULL;
     mc->stapling_mutex         = NULL;
 #endif
+#ifdef HAVE_TLSEXT
+    mc->sni_index              = NULL;
+#endif
+#ifdef HAVE_TLS_SESSION_TICKETS
+    mc->ticket_keys            = NULL;
+#endif
 
     apr_pool_userdata_set(mc, SSL_MOD_CONFIG_KEY,
                           apr_pool_cleanup_null,
@@ -102,6 +113,7 @@ static void modssl_ctx_init(modssl_ctx_t *mctx, apr_pool_t *p)
     mctx->sc                  = NULL; /* set during module init */
 
     mctx->ssl_ctx             = NULL; /* set during module init */
+    mctx->ssl_ctx_shared      = FALSE;
 
     mctx->pks                 = NULL;
     mctx->pkp                 = NULL;
@@ -135,6 +147,7 @@ static void modssl_ctx_init(modssl_ctx_t *mctx, apr_pool_t *p)
     mctx->ocsp_resp_maxage    = UNSET;
     mctx->ocsp_responder_timeout = UNSET;
     mctx->ocsp_use_request_nonce = UNSET;
+    mctx->ocsp_cache_timeout  = UNSET;
 
 #ifdef HAVE_OCSP_STAPLING
     mctx->stapling_enabled           = UNSET;
@@ -146,6 +159,7 @@ static void modssl_ctx_init(modssl_ctx_t *mctx, apr_pool_t *p)
     mctx->stapling_errcache_timeout  = UNSET;
     mctx->stapling_responder_timeout = UNSET;
     mctx->stapling_force_url         = NULL;
+    mctx->stapling_background        = UNSET;
 #endif
 
 #ifdef HAVE_SRP
@@ -227,6 +241,17 @@ static SSLSrvConfigRec *ssl_config_server_new(apr_pool_t *p)
     sc->compression            = UNSET;
 #endif
     sc->session_tickets        = UNSET;
+    sc->shared_ctx             = UNSET;
+    sc->async_handshake        = UNSET;
+    sc->early_data             = UNSET;
+#ifdef HAVE_SSL_RECORD_SIZING
+    sc->record_boost           = UNSET;
+    sc->record_idle            = UNSET;
+    sc->record_stats           = NULL;
+#endif
+#ifdef HAVE_TLS_SESSION_TICKETS
+    sc->ticket_key_rotation    = UNSET;
+#endif
 
     modssl_ctx_init_proxy(sc, p);
 
@@ -287,6 +312,7 @@ static void modssl_ctx_cfg_merge(apr_pool_t *p,
     cfgMergeInt(ocsp_resp_maxage);
     cfgMergeInt(ocsp_responder_timeout);
     cfgMergeBool(ocsp_use_request_nonce);
+    cfgMergeInt(ocsp_cache_timeout);
 #ifdef HAVE_OCSP_STAPLING
     cfgMergeBool(stapling_enabled);
     cfgMergeInt(stapling_resptime_skew);
@@ -297,6 +323,7 @@ static void modssl_ctx_cfg_merge(apr_pool_t *p,
     cfgMergeInt(stapling_errcache_timeout);
     cfgMergeInt(stapling_responder_timeout);
     cfgMerge(stapling_force_url, NULL);
+    cfgMergeBool(stapling_background);
 #endif
 
 #ifdef HAVE_SRP
@@ -370,6 +397,16 @@ void *ssl_config_server_merge(apr_pool_t *p, void *basev, void *addv)
     cfgMergeBool(compression);
 #endif
     cfgMergeBool(session_tickets);
+    cfgMergeBool(shared_ctx);
+    cfgMergeBool(async_handshake);
+    cfgMergeBool(early_data);
+#ifdef HAVE_SSL_RECORD_SIZING
+    cfgMerge(record_boost, UNSET);
+    cfgMergeInt(record_idle);
+#endif
+#ifdef HAVE_TLS_SESSION_TICKETS
+    cfgMergeInt(ticket_key_rotation);
+#endif
 
     modssl_ctx_cfg_merge_proxy(p, base->proxy, add->proxy, mrg->proxy);
 
@@ -758,6 +795,71 @@ const char *ssl_cmd_SSLSessionTickets(cmd_parms *cmd, void *dcfg, int flag)
     return NULL;
 }
 
+const char *ssl_cmd_SSLSharedContext(cmd_parms *cmd, void *dcfg, int flag)
+{
+    SSLSrvConfigRec *sc = mySrvConfig(cmd->server);
+
+    sc->shared_ctx = flag ? TRUE : FALSE;
+    return NULL;
+}
+
+const char *ssl_cmd_SSLAsyncHandshake(cmd_parms *cmd, void *dcfg, int flag)
+{
+    SSLSrvConfigRec *sc = mySrvConfig(cmd->server);
+#ifndef HAVE_SSL_ASYNC
+    if (flag) {
+        return "This version of OpenSSL does not support "
+               "asynchronous operations (SSLAsyncHandshake).";
+    }
+#endif
+    sc->async_handshake = flag ? TRUE : FALSE;
+    return NULL;
+}
+
+const char *ssl_cmd_SSLEarlyData(cmd_parms *cmd, void *dcfg, int flag)
+{
+    SSLSrvConfigRec *sc = mySrvConfig(cmd->server);
+#ifndef HAVE_TLS_EARLY_DATA
+    if (flag) {
+        return "This version of OpenSSL does not support "
+               "TLS 1.3 early data (SSLEarlyData).";
+    }
+#endif
+    sc->early_data = flag ? TRUE : FALSE;
+    return NULL;
+}
+
+const char *ssl_cmd_SSLDynamicRecordSizing(cmd_parms *cmd, void *dcfg,
+                                          const char *arg1, const char *arg2)
+{
+#ifdef HAVE_SSL_RECORD_SIZING
+    SSLSrvConfigRec *sc = mySrvConfig(cmd->server);
+    char *end;
+
+    if (!strcEQ(arg1, "off")) {
+        if (apr_strtoff(&sc->record_boost, arg1, &end, 10) != APR_SUCCESS
+            || *end || sc->record_boost < 0) {
+            return "SSLDynamicRecordSizing: Invalid number of bytes";
+        }
+    }
+    else {
+        sc->record_boost = 0;
+    }
+
+    if (arg2) {
+        sc->record_idle = atoi(arg2);
+        if (sc->record_idle < 0) {
+            return "SSLDynamicRecordSizing: Invalid idle timeout";
+        }
+    }
+
+    return NULL;
+#else
+    return "This version of OpenSSL does not support "
+           "SSLDynamicRecordSizing.";
+#endif
+}
+
 const char *ssl_cmd_SSLInsecureRenegotiation(cmd_parms *cmd, void *dcfg, int flag)
 {
 #ifdef SSL_OP_ALLOW_UNSAFE_LEGACY_RENEGOTIATION
@@ -864,6 +966,26 @@ const char *ssl_cmd_SSLSessionTicketKeyFile(cmd_parms *cmd,
 
     return NULL;
 }
+
+const char *ssl_cmd_SSLSessionTicketKeyRotation(cmd_parms *cmd,
+                                                void *dcfg,
+                                                const char *arg)
+{
+    SSLSrvConfigRec *sc = mySrvConfig(cmd->server);
+    const char *err;
+
+    if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY))) {
+        return err;
+    }
+
+    sc->ticket_key_rotation = atoi(arg);
+
+    if (sc->ticket_key_rotation < 0) {
+        return "SSLSessionTicketKeyRotation: Invalid argument";
+    }
+
+    return NULL;
+}
 #endif
 
 #define NO_PER_DIR_SSL_CA \
@@ -1643,6 +1765,16 @@ const char *ssl_cmd_SSLOCSPUseRequestNonce(cmd_parms *cmd, void *dcfg, int flag)
     return NULL;
 }
 
+const char *ssl_cmd_SSLOCSPCacheTimeout(cmd_parms *cmd, void *dcfg, const char *arg)
+{
+    SSLSrvConfigRec *sc = mySrvConfig(cmd->server);
+    sc->server->ocsp_cache_timeout = atoi(arg);
+    if (sc->server->ocsp_cache_timeout < 0) {
+        return "SSLOCSPCacheTimeout: invalid argument";
+    }
+    return NULL;
+}
+
 const char *ssl_cmd_SSLProxyCheckPeerExpire(cmd_parms *cmd, void *dcfg, int flag)
 {
     SSLSrvConfigRec *sc = mySrvConfig(cmd->server);
@@ -1829,6 +1961,14 @@ const char *ssl_cmd_SSLStaplingForceURL(cmd_parms *cmd, void *dcfg,
     return NULL;
 }
 
+const char *ssl_cmd_SSLStaplingBackgroundRefresh(cmd_parms *cmd,
+                                                 void *dcfg, int flag)
+{
+    SSLSrvConfigRec *sc = mySrvConfig(cmd->server);
+    sc->server->stapling_background = flag ? TRUE : FALSE;
+    return NULL;
+}
+
 #endif /* HAVE_OCSP_STAPLING */
 
 #ifdef HAVE_SSL_CONF_CMD
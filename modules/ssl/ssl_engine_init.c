@@ -30,6 +30,7 @@
 #include "mod_ssl.h"
 #include "mod_ssl_openssl.h"
 #include "mpm_common.h"
+#include "apr_shm.h"
 
 APR_IMPLEMENT_OPTIONAL_HOOK_RUN_ALL(ssl, SSL, int, init_server,
                                     (server_rec *s,apr_pool_t *p,int is_proxy,SSL_CTX *ctx),
@@ -41,6 +42,18 @@ APR_IMPLEMENT_OPTIONAL_HOOK_RUN_ALL(ssl, SSL, int, init_server,
 **  _________________________________________________________________
 */
 
+/* fingerprint => SSLSrvConfigRec, while the servers are initialized */
+static apr_hash_t *ssl_ctx_owners = NULL;
+
+/* Some module implements the init_server hook */
+static int ssl_ctx_hooked = 0;
+
+static void ssl_parsed_files_reset(SSLModConfigRec *mc, apr_pool_t *ptemp);
+static void ssl_parsed_files_prune(SSLModConfigRec *mc, apr_pool_t *ptemp);
+#ifdef HAVE_SSL_RECORD_SIZING
+static void ssl_init_record_stats(server_rec *base_server, apr_pool_t *p);
+#endif
+
 #ifdef HAVE_ECC
 #define KEYTYPES "RSA, DSA or ECC"
 #else 
@@ -174,6 +187,9 @@ apr_status_t ssl_init_Module(apr_pool_t *p, apr_pool_t *plog,
      */
     ssl_config_global_create(base_server); /* just to avoid problems */
     ssl_config_global_fix(mc);
+#ifdef HAVE_TLS_EARLY_DATA
+    mc->early_data = FALSE;
+#endif
 
     /*
      *  try to fix the configuration and open the dedicated SSL
@@ -217,6 +233,12 @@ apr_status_t ssl_init_Module(apr_pool_t *p, apr_pool_t *plog,
             sc->session_cache_timeout = SSL_SESSION_CACHE_TIMEOUT;
         }
 
+#ifdef HAVE_SSL_RECORD_SIZING
+        if (sc->record_idle == UNSET) {
+            sc->record_idle = SSL_RECORD_IDLE_TIMEOUT;
+        }
+#endif
+
         if (sc->server && sc->server->pphrase_dialog_type == SSL_PPTYPE_UNSET) {
             sc->server->pphrase_dialog_type = SSL_PPTYPE_BUILTIN;
         }
@@ -226,6 +248,12 @@ apr_status_t ssl_init_Module(apr_pool_t *p, apr_pool_t *plog,
             sc->fips = FALSE;
         }
 #endif
+
+#ifdef HAVE_TLS_EARLY_DATA
+        if (sc->enabled == SSL_ENABLED_TRUE && sc->early_data == TRUE) {
+            mc->early_data = TRUE;
+        }
+#endif
     }
 
 #if APR_HAS_THREADS
@@ -288,8 +316,32 @@ apr_status_t ssl_init_Module(apr_pool_t *p, apr_pool_t *plog,
         return rv;
     }
 
+#ifdef HAVE_TLS_SESSION_TICKETS
+    if ((rv = ssl_ticket_keys_init(base_server, p)) != APR_SUCCESS) {
+        return rv;
+    }
+#endif
+
     pphrases = apr_array_make(ptemp, 2, sizeof(char *));
 
+    ssl_ctx_owners = apr_hash_make(ptemp);
+    ssl_parsed_files_reset(mc, ptemp);
+
+    /* Modules initializing the SSL_CTX of each server (init_server hook)
+     * expect one per server, unless SSLSharedContext is explicitly on.
+     */
+    {
+        apr_array_header_t *hooks = apr_optional_hook_get("init_server");
+
+        ssl_ctx_hooked = hooks && hooks->nelts;
+        if (ssl_ctx_hooked) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server,
+                         APLOGNO(02958) "Init: A module initializes the "
+                         "SSL_CTX of each server, not sharing them unless "
+                         "SSLSharedContext is on");
+        }
+    }
+
     /*
      *  initialize servers
      */
@@ -309,10 +361,18 @@ apr_status_t ssl_init_Module(apr_pool_t *p, apr_pool_t *plog,
          */
         if ((rv = ssl_init_ConfigureServer(s, p, ptemp, sc, pphrases))
             != APR_SUCCESS) {
+            ssl_ctx_owners = NULL;
             return rv;
         }
     }
 
+    ssl_ctx_owners = NULL;
+    ssl_parsed_files_prune(mc, ptemp);
+
+#ifdef HAVE_SSL_RECORD_SIZING
+    ssl_init_record_stats(base_server, p);
+#endif
+
     if (pphrases->nelts > 0) {
         memset(pphrases->elts, 0, pphrases->elt_size * pphrases->nelts);
         pphrases->nelts = 0;
@@ -323,7 +383,7 @@ apr_status_t ssl_init_Module(apr_pool_t *p, apr_pool_t *plog,
     /*
      * Configuration consistency checks
      */
-    if ((rv = ssl_init_CheckServers(base_server, ptemp)) != APR_SUCCESS) {
+    if ((rv = ssl_init_CheckServers(base_server, p, ptemp)) != APR_SUCCESS) {
         return rv;
     }
 
@@ -331,6 +391,11 @@ apr_status_t ssl_init_Module(apr_pool_t *p, apr_pool_t *plog,
         sc = mySrvConfig(s);
 
         if (sc->enabled == SSL_ENABLED_TRUE || sc->enabled == SSL_ENABLED_OPTIONAL) {
+            /* a shared SSL_CTX (SSLSharedContext on) was initialized for
+             * the server owning it */
+            if (sc->server->ssl_ctx_shared) {
+                continue;
+            }
             if ((rv = ssl_run_init_server(s, p, 0, sc->server->ssl_ctx)) != APR_SUCCESS) {
                 return rv;
             }
@@ -355,6 +420,53 @@ apr_status_t ssl_init_Module(apr_pool_t *p, apr_pool_t *plog,
     return OK;
 }
 
+#ifdef HAVE_SSL_RECORD_SIZING
+/*
+ * Allocate the record sizing statistics of the servers using
+ * SSLDynamicRecordSizing, shared by the children if possible.
+ */
+static void ssl_init_record_stats(server_rec *base_server, apr_pool_t *p)
+{
+    SSLSrvConfigRec *sc;
+    server_rec *s;
+    ssl_record_stats_t *stats;
+    apr_shm_t *shm;
+    apr_size_t size;
+    int n = 0;
+
+    for (s = base_server; s; s = s->next) {
+        sc = mySrvConfig(s);
+        if ((sc->enabled == SSL_ENABLED_TRUE
+             || sc->enabled == SSL_ENABLED_OPTIONAL)
+            && sc->record_boost > 0) {
+            n++;
+        }
+    }
+    if (!n) {
+        return;
+    }
+
+    size = n * sizeof(*stats);
+    if (apr_shm_create(&shm, size, NULL, p) == APR_SUCCESS) {
+        stats = apr_shm_baseaddr_get(shm);
+        memset(stats, 0, size);
+    }
+    else {
+        /* counted per process then */
+        stats = apr_pcalloc(p, size);
+    }
+
+    for (s = base_server; s; s = s->next) {
+        sc = mySrvConfig(s);
+        if ((sc->enabled == SSL_ENABLED_TRUE
+             || sc->enabled == SSL_ENABLED_OPTIONAL)
+            && sc->record_boost > 0) {
+            sc->record_stats = stats++;
+        }
+    }
+}
+#endif
+
 /*
  * Support for external a Crypto Device ("engine"), usually
  * a hardware accellerator card for crypto operations.
@@ -590,6 +702,29 @@ static apr_status_t ssl_init_ctx_protocol(server_rec *s,
     }
 #endif
 
+#ifdef HAVE_SSL_ASYNC
+    /*
+     * Let an engine (SSLCryptoDevice) run the handshake's private key
+     * and key exchange operations asynchronously, see
+     * ssl_io_filter_handshake().
+     */
+    if (!mctx->pkp && sc->async_handshake == TRUE) {
+        SSL_CTX_set_mode(ctx, SSL_MODE_ASYNC);
+    }
+#endif
+
+#ifdef HAVE_TLS_EARLY_DATA
+    /*
+     * Early data is enabled per connection, the virtual host selected by
+     * SNI being known only by ssl_callback_AllowEarlyData().
+     */
+    if (!mctx->pkp && sc->early_data == TRUE && !myModConfig(s)->sesscache) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(02928)
+                     "SSLEarlyData needs an SSLSessionCache to detect "
+                     "replays, early data will be refused");
+    }
+#endif
+
     SSL_CTX_set_app_data(ctx, s);
 
     /*
@@ -656,6 +791,244 @@ static void ssl_init_ctx_callbacks(server_rec *s,
 #endif
 }
 
+/* prevent OpenSSL from showing its "Enter PEM pass phrase:" prompt */
+static int ssl_no_passwd_prompt_cb(char *buf, int size, int rwflag,
+                                   void *userdata) {
+   return 0;
+}
+
+/*
+ * Cache of the certificates, keys and CA name lists parsed from PEM
+ * files during startup.  Large configurations tend to reference the
+ * same (wildcard or SAN) certificate from many virtual hosts; with the
+ * cache each file is parsed once, and only again after a restart if
+ * it was modified in between.
+ */
+#define SSL_PARSED_CERT     (1<<0)
+#define SSL_PARSED_KEY      (1<<1)
+#define SSL_PARSED_CA_NAMES (1<<2)
+
+typedef struct {
+    apr_time_t mtime;
+    apr_off_t size;
+    int parsed;                    /* SSL_PARSED_* already attempted */
+    BOOL used;                     /* referenced in this init round */
+    X509 *cert;
+    STACK_OF(X509) *chain;
+    EVP_PKEY *pkey;
+    STACK_OF(X509_NAME) *ca_names;
+} ssl_parsed_file_t;
+
+static void ssl_parsed_file_clear(ssl_parsed_file_t *pf)
+{
+    if (pf->cert) {
+        X509_free(pf->cert);
+        pf->cert = NULL;
+    }
+    if (pf->chain) {
+        sk_X509_pop_free(pf->chain, X509_free);
+        pf->chain = NULL;
+    }
+    if (pf->pkey) {
+        EVP_PKEY_free(pf->pkey);
+        pf->pkey = NULL;
+    }
+    if (pf->ca_names) {
+        sk_X509_NAME_pop_free(pf->ca_names, X509_NAME_free);
+        pf->ca_names = NULL;
+    }
+    pf->parsed = 0;
+}
+
+static ssl_parsed_file_t *ssl_parsed_file_get(server_rec *s,
+                                              apr_pool_t *ptemp,
+                                              const char *file)
+{
+    SSLModConfigRec *mc = myModConfig(s);
+    ssl_parsed_file_t *pf;
+    apr_finfo_t finfo;
+
+    if (apr_stat(&finfo, file, APR_FINFO_MTIME | APR_FINFO_SIZE,
+                 ptemp) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    pf = apr_hash_get(mc->tParsedFiles, file, APR_HASH_KEY_STRING);
+    if (!pf) {
+        pf = apr_pcalloc(mc->pPool, sizeof(*pf));
+        apr_hash_set(mc->tParsedFiles, apr_pstrdup(mc->pPool, file),
+                     APR_HASH_KEY_STRING, pf);
+    }
+    else if (pf->mtime != finfo.mtime || pf->size != finfo.size) {
+        ssl_parsed_file_clear(pf);
+    }
+    pf->mtime = finfo.mtime;
+    pf->size = finfo.size;
+    pf->used = TRUE;
+
+    return pf;
+}
+
+/* mark all entries unused before (virtual) servers are initialized ... */
+static void ssl_parsed_files_reset(SSLModConfigRec *mc, apr_pool_t *ptemp)
+{
+    apr_hash_index_t *hi;
+    void *val;
+
+    for (hi = apr_hash_first(ptemp, mc->tParsedFiles); hi;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &val);
+        ((ssl_parsed_file_t *)val)->used = FALSE;
+    }
+}
+
+/* ... and release the ones no longer referenced afterwards */
+static void ssl_parsed_files_prune(SSLModConfigRec *mc, apr_pool_t *ptemp)
+{
+    apr_hash_index_t *hi;
+    const void *key;
+    void *val;
+    ssl_parsed_file_t *pf;
+
+    for (hi = apr_hash_first(ptemp, mc->tParsedFiles); hi;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &key, NULL, &val);
+        pf = val;
+        if (!pf->used) {
+            ssl_parsed_file_clear(pf);
+            apr_hash_set(mc->tParsedFiles, key, APR_HASH_KEY_STRING, NULL);
+        }
+    }
+}
+
+/*
+ * Configure the certificate (and, unless SSLCertificateChainFile is
+ * used, its chain) from the parse cache.  Returns FALSE if the caller
+ * has to fall back to loading the file itself, which also takes care
+ * of reporting any errors.
+ */
+static BOOL ssl_parsed_file_use_cert(server_rec *s, apr_pool_t *ptemp,
+                                     modssl_ctx_t *mctx, const char *file)
+{
+#ifdef SSL_CTRL_SET_CURRENT_CERT
+    ssl_parsed_file_t *pf;
+    BIO *bio;
+    X509 *x509;
+    unsigned long err;
+    int i;
+
+    if (!(pf = ssl_parsed_file_get(s, ptemp, file))) {
+        return FALSE;
+    }
+
+    if (!(pf->parsed & SSL_PARSED_CERT)) {
+        pf->parsed |= SSL_PARSED_CERT;
+        if ((bio = BIO_new_file(file, "r")) != NULL) {
+            pf->cert = PEM_read_bio_X509_AUX(bio, NULL,
+                                             ssl_no_passwd_prompt_cb, NULL);
+            if (pf->cert) {
+                pf->chain = sk_X509_new_null();
+                while ((x509 = PEM_read_bio_X509(bio, NULL,
+                                                 ssl_no_passwd_prompt_cb,
+                                                 NULL)) != NULL) {
+                    sk_X509_push(pf->chain, x509);
+                }
+                /* running out of certificates is the only expected end */
+                err = ERR_peek_last_error();
+                if (err && !(ERR_GET_LIB(err) == ERR_LIB_PEM
+                             && ERR_GET_REASON(err) == PEM_R_NO_START_LINE)) {
+                    ssl_parsed_file_clear(pf);
+                    pf->parsed |= SSL_PARSED_CERT;
+                }
+            }
+            BIO_free(bio);
+        }
+        ERR_clear_error();
+    }
+    if (!pf->cert) {
+        return FALSE;
+    }
+
+    if (SSL_CTX_use_certificate(mctx->ssl_ctx, pf->cert) < 1) {
+        ERR_clear_error();
+        return FALSE;
+    }
+    if (!mctx->cert_chain) {
+        SSL_CTX_clear_chain_certs(mctx->ssl_ctx);
+        for (i = 0; i < sk_X509_num(pf->chain); i++) {
+            if (!SSL_CTX_add1_chain_cert(mctx->ssl_ctx,
+                                         sk_X509_value(pf->chain, i))) {
+                ERR_clear_error();
+                return FALSE;
+            }
+        }
+    }
+
+    return TRUE;
+#else
+    /* no per certificate chains to configure them from memory */
+    return FALSE;
+#endif
+}
+
+/*
+ * Configure an unencrypted private key from the parse cache, returns
+ * FALSE if it has to be loaded the usual way (encrypted, not PEM, ...).
+ */
+static BOOL ssl_parsed_file_use_key(server_rec *s, apr_pool_t *ptemp,
+                                    modssl_ctx_t *mctx, const char *file)
+{
+    ssl_parsed_file_t *pf;
+    BIO *bio;
+
+    if (!(pf = ssl_parsed_file_get(s, ptemp, file))) {
+        return FALSE;
+    }
+
+    if (!(pf->parsed & SSL_PARSED_KEY)) {
+        pf->parsed |= SSL_PARSED_KEY;
+        if ((bio = BIO_new_file(file, "r")) != NULL) {
+            pf->pkey = PEM_read_bio_PrivateKey(bio, NULL,
+                                               ssl_no_passwd_prompt_cb, NULL);
+            BIO_free(bio);
+        }
+        ERR_clear_error();
+    }
+    if (!pf->pkey) {
+        return FALSE;
+    }
+
+    if (SSL_CTX_use_PrivateKey(mctx->ssl_ctx, pf->pkey) < 1) {
+        ERR_clear_error();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * ssl_init_FindCAList() through the parse cache; only lists read from
+ * a single file are cached, directories would need every file checked.
+ */
+static STACK_OF(X509_NAME) *ssl_parsed_file_ca_list(server_rec *s,
+                                                    apr_pool_t *ptemp,
+                                                    const char *file,
+                                                    const char *path)
+{
+    ssl_parsed_file_t *pf;
+
+    if (!file || path || !(pf = ssl_parsed_file_get(s, ptemp, file))) {
+        return ssl_init_FindCAList(s, ptemp, file, path);
+    }
+
+    if (!(pf->parsed & SSL_PARSED_CA_NAMES)) {
+        pf->parsed |= SSL_PARSED_CA_NAMES;
+        pf->ca_names = ssl_init_FindCAList(s, ptemp, file, NULL);
+    }
+
+    return pf->ca_names ? SSL_dup_CA_list(pf->ca_names) : NULL;
+}
+
 static apr_status_t ssl_init_ctx_verify(server_rec *s,
                                         apr_pool_t *p,
                                         apr_pool_t *ptemp,
@@ -708,13 +1081,13 @@ static apr_status_t ssl_init_ctx_verify(server_rec *s,
         }
 
         if (mctx->pks && (mctx->pks->ca_name_file || mctx->pks->ca_name_path)) {
-            ca_list = ssl_init_FindCAList(s, ptemp,
-                                          mctx->pks->ca_name_file,
-                                          mctx->pks->ca_name_path);
+            ca_list = ssl_parsed_file_ca_list(s, ptemp,
+                                              mctx->pks->ca_name_file,
+                                              mctx->pks->ca_name_path);
         } else
-            ca_list = ssl_init_FindCAList(s, ptemp,
-                                          mctx->auth.ca_cert_file,
-                                          mctx->auth.ca_cert_path);
+            ca_list = ssl_parsed_file_ca_list(s, ptemp,
+                                              mctx->auth.ca_cert_file,
+                                              mctx->auth.ca_cert_path);
         if (sk_X509_NAME_num(ca_list) <= 0) {
             ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s, APLOGNO(01896)
                     "Unable to determine list of acceptable "
@@ -967,12 +1340,6 @@ static void ssl_check_public_cert(server_rec *s,
     }
 }
 
-/* prevent OpenSSL from showing its "Enter PEM pass phrase:" prompt */
-static int ssl_no_passwd_prompt_cb(char *buf, int size, int rwflag,
-                                   void *userdata) {
-   return 0;
-}
-
 static apr_status_t ssl_init_server_certs(server_rec *s,
                                           apr_pool_t *p,
                                           apr_pool_t *ptemp,
@@ -1006,7 +1373,10 @@ static apr_status_t ssl_init_server_certs(server_rec *s,
         ERR_clear_error();
 
         /* first the certificate (public key) */
-        if (mctx->cert_chain) {
+        if (ssl_parsed_file_use_cert(s, ptemp, mctx, certfile)) {
+            /* already parsed for this or another server */
+        }
+        else if (mctx->cert_chain) {
             if ((SSL_CTX_use_certificate_file(mctx->ssl_ctx, certfile,
                                               SSL_FILETYPE_PEM) < 1)) {
                 ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s, APLOGNO(02561)
@@ -1035,7 +1405,8 @@ static apr_status_t ssl_init_server_certs(server_rec *s,
 
         ERR_clear_error();
 
-        if ((SSL_CTX_use_PrivateKey_file(mctx->ssl_ctx, keyfile,
+        if (!ssl_parsed_file_use_key(s, ptemp, mctx, keyfile) &&
+            (SSL_CTX_use_PrivateKey_file(mctx->ssl_ctx, keyfile,
                                          SSL_FILETYPE_PEM) < 1) &&
             (ERR_GET_FUNC(ERR_peek_last_error())
                 != X509_F_X509_CHECK_PRIVATE_KEY)) {
@@ -1180,6 +1551,17 @@ static apr_status_t ssl_init_ticket_key(server_rec *s,
     modssl_ticket_key_t *ticket_key = mctx->ticket_key;
 
     if (!ticket_key->file_path) {
+        /* use the keys shared by all children, if enabled */
+        if (mctx->sc->session_tickets != FALSE
+            && ssl_ticket_keys_get(myModConfig(s), NULL, NULL)
+            && !SSL_CTX_set_tlsext_ticket_key_cb(mctx->ssl_ctx,
+                                                 ssl_callback_SessionTicket)) {
+            ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s, APLOGNO(02926)
+                         "Unable to initialize TLS session ticket key "
+                         "callback (incompatible OpenSSL version?)");
+            ssl_log_ssl_error(SSLLOG_MARK, APLOG_EMERG, s);
+            return ssl_die(s);
+        }
         return APR_SUCCESS;
     }
 
@@ -1386,6 +1768,162 @@ static apr_status_t ssl_init_proxy_ctx(server_rec *s,
     return APR_SUCCESS;
 }
 
+/*
+ * Virtual hosts with identical TLS settings share a single SSL_CTX,
+ * found in ssl_ctx_owners by a fingerprint of their configuration.
+ * Everything which differs between such
+ * hosts (session id context, SNI checks, ticket keys, ALPN
+ * preferences) is looked up from the connection's server at runtime.
+ */
+#define SSL_FP_ADD(parts, p, fmt, val) \
+    APR_ARRAY_PUSH(parts, const char *) = apr_psprintf(p, fmt, val)
+
+static const char *ssl_init_ctx_fingerprint(apr_pool_t *p,
+                                            SSLSrvConfigRec *sc)
+{
+    modssl_ctx_t *mctx = sc->server;
+    apr_array_header_t *parts;
+    int i;
+
+    if (!mctx->pks) {
+        return NULL;
+    }
+#ifdef HAVE_SRP
+    /* the SRP verifier base is per context and freed with it */
+    if (mctx->srp_vfile) {
+        return NULL;
+    }
+#endif
+
+    parts = apr_array_make(p, 48, sizeof(const char *));
+
+    SSL_FP_ADD(parts, p, "%d", sc->session_cache_timeout);
+    SSL_FP_ADD(parts, p, "%d", sc->cipher_server_pref);
+    SSL_FP_ADD(parts, p, "%d", sc->insecure_reneg);
+    SSL_FP_ADD(parts, p, "%d", sc->session_tickets);
+    SSL_FP_ADD(parts, p, "%d", sc->async_handshake);
+    SSL_FP_ADD(parts, p, "%d", sc->early_data);
+#ifndef OPENSSL_NO_COMP
+    SSL_FP_ADD(parts, p, "%d", sc->compression);
+#endif
+
+    SSL_FP_ADD(parts, p, "%d", (int)mctx->protocol);
+    SSL_FP_ADD(parts, p, "%d", (int)mctx->pphrase_dialog_type);
+    SSL_FP_ADD(parts, p, "%s", mctx->pphrase_dialog_path);
+    SSL_FP_ADD(parts, p, "%s", mctx->cert_chain);
+    SSL_FP_ADD(parts, p, "%s", mctx->crl_path);
+    SSL_FP_ADD(parts, p, "%s", mctx->crl_file);
+    SSL_FP_ADD(parts, p, "%d", (int)mctx->crl_check_mode);
+
+#ifdef HAVE_OCSP_STAPLING
+    SSL_FP_ADD(parts, p, "%d", mctx->stapling_enabled);
+    SSL_FP_ADD(parts, p, "%ld", mctx->stapling_resptime_skew);
+    SSL_FP_ADD(parts, p, "%ld", mctx->stapling_resp_maxage);
+    SSL_FP_ADD(parts, p, "%d", mctx->stapling_cache_timeout);
+    SSL_FP_ADD(parts, p, "%d", mctx->stapling_return_errors);
+    SSL_FP_ADD(parts, p, "%d", mctx->stapling_fake_trylater);
+    SSL_FP_ADD(parts, p, "%d", mctx->stapling_errcache_timeout);
+    SSL_FP_ADD(parts, p, "%" APR_TIME_T_FMT,
+               mctx->stapling_responder_timeout);
+    SSL_FP_ADD(parts, p, "%s", mctx->stapling_force_url);
+    SSL_FP_ADD(parts, p, "%d", mctx->stapling_background);
+#endif
+
+    SSL_FP_ADD(parts, p, "%s", mctx->auth.ca_cert_path);
+    SSL_FP_ADD(parts, p, "%s", mctx->auth.ca_cert_file);
+    SSL_FP_ADD(parts, p, "%s", mctx->auth.cipher_suite);
+    SSL_FP_ADD(parts, p, "%d", mctx->auth.verify_depth);
+    SSL_FP_ADD(parts, p, "%d", (int)mctx->auth.verify_mode);
+
+    SSL_FP_ADD(parts, p, "%s", mctx->pks->ca_name_path);
+    SSL_FP_ADD(parts, p, "%s", mctx->pks->ca_name_file);
+    for (i = 0; i < mctx->pks->cert_files->nelts; i++) {
+        SSL_FP_ADD(parts, p, "cert=%s",
+                   APR_ARRAY_IDX(mctx->pks->cert_files, i, const char *));
+    }
+    for (i = 0; i < mctx->pks->key_files->nelts; i++) {
+        SSL_FP_ADD(parts, p, "key=%s",
+                   APR_ARRAY_IDX(mctx->pks->key_files, i, const char *));
+    }
+
+#ifdef HAVE_TLS_SESSION_TICKETS
+    SSL_FP_ADD(parts, p, "%s", mctx->ticket_key->file_path);
+#endif
+
+#ifdef HAVE_SSL_CONF_CMD
+    for (i = 0; i < mctx->ssl_ctx_param->nelts; i++) {
+        ssl_ctx_param_t *param = &APR_ARRAY_IDX(mctx->ssl_ctx_param, i,
+                                                ssl_ctx_param_t);
+        SSL_FP_ADD(parts, p, "%s", apr_pstrcat(p, "conf=", param->name,
+                                               " ", param->value, NULL));
+    }
+#endif
+
+    return apr_array_pstrcat(p, parts, '\n');
+}
+
+/*
+ * Use the SSL_CTX of an identically configured server, taking over
+ * the settings ssl_init_server_ctx() resolved for it.
+ */
+static apr_status_t ssl_init_server_ctx_shared(server_rec *s,
+                                               apr_pool_t *ptemp,
+                                               SSLSrvConfigRec *sc,
+                                               SSLSrvConfigRec *osc)
+{
+    modssl_ctx_t *mctx = sc->server, *owner = osc->server;
+#ifdef SSL_CTRL_SET_CURRENT_CERT
+    X509 *cert;
+    int i = 0, ret;
+#endif
+
+    mctx->ssl_ctx = owner->ssl_ctx;
+    mctx->ssl_ctx_shared = TRUE;
+
+    mctx->auth.verify_mode = owner->auth.verify_mode;
+    mctx->auth.verify_depth = owner->auth.verify_depth;
+
+#ifdef HAVE_OCSP_STAPLING
+    mctx->stapling_resptime_skew = owner->stapling_resptime_skew;
+    mctx->stapling_resp_maxage = owner->stapling_resp_maxage;
+    mctx->stapling_cache_timeout = owner->stapling_cache_timeout;
+    mctx->stapling_return_errors = owner->stapling_return_errors;
+    mctx->stapling_fake_trylater = owner->stapling_fake_trylater;
+    mctx->stapling_errcache_timeout = owner->stapling_errcache_timeout;
+    mctx->stapling_responder_timeout = owner->stapling_responder_timeout;
+    mctx->stapling_background = owner->stapling_background;
+#endif
+
+#ifdef HAVE_TLS_SESSION_TICKETS
+    mctx->ticket_key = owner->ticket_key;
+#endif
+
+#ifdef HAVE_SSL_CONF_CMD
+    SSL_CONF_CTX_free(mctx->ssl_ctx_config);
+    mctx->ssl_ctx_config = NULL;
+#endif
+
+#ifdef SSL_CTRL_SET_CURRENT_CERT
+    /* the certificates still have to match this server's name */
+    ret = SSL_CTX_set_current_cert(mctx->ssl_ctx, SSL_CERT_SET_FIRST);
+    while (ret) {
+        if ((cert = SSL_CTX_get0_certificate(mctx->ssl_ctx)) != NULL) {
+            ssl_check_public_cert(s, ptemp, cert,
+                                  apr_psprintf(ptemp, "%s:%d",
+                                               sc->vhost_id, i));
+        }
+        ret = SSL_CTX_set_current_cert(mctx->ssl_ctx, SSL_CERT_SET_NEXT);
+        i++;
+    }
+#endif
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(02918)
+                 "Init: %s shares the SSL context of %s",
+                 sc->vhost_id, osc->vhost_id);
+
+    return APR_SUCCESS;
+}
+
 static apr_status_t ssl_init_server_ctx(server_rec *s,
                                         apr_pool_t *p,
                                         apr_pool_t *ptemp,
@@ -1393,6 +1931,8 @@ static apr_status_t ssl_init_server_ctx(server_rec *s,
                                         apr_array_header_t *pphrases)
 {
     apr_status_t rv;
+    SSLSrvConfigRec *osc;
+    const char *fingerprint = NULL;
 #ifdef HAVE_SSL_CONF_CMD
     ssl_ctx_param_t *param = (ssl_ctx_param_t *)sc->server->ssl_ctx_param->elts;
     SSL_CONF_CTX *cctx = sc->server->ssl_ctx_config;
@@ -1409,6 +1949,15 @@ static apr_status_t ssl_init_server_ctx(server_rec *s,
         return APR_EGENERAL;
     }
 
+    if (ssl_ctx_owners
+        && (sc->shared_ctx == TRUE
+            || (sc->shared_ctx == UNSET && !ssl_ctx_hooked))
+        && (fingerprint = ssl_init_ctx_fingerprint(ptemp, sc)) != NULL
+        && (osc = apr_hash_get(ssl_ctx_owners, fingerprint,
+                               APR_HASH_KEY_STRING)) != NULL) {
+        return ssl_init_server_ctx_shared(s, ptemp, sc, osc);
+    }
+
     if ((rv = ssl_init_ctx(s, p, ptemp, sc->server)) != APR_SUCCESS) {
         return rv;
     }
@@ -1489,6 +2038,10 @@ static apr_status_t ssl_init_server_ctx(server_rec *s,
                         sc->session_cache_timeout == UNSET ?
                         SSL_SESSION_CACHE_TIMEOUT : sc->session_cache_timeout);
 
+    if (fingerprint) {
+        apr_hash_set(ssl_ctx_owners, fingerprint, APR_HASH_KEY_STRING, sc);
+    }
+
     return APR_SUCCESS;
 }
 
@@ -1523,7 +2076,106 @@ apr_status_t ssl_init_ConfigureServer(server_rec *s,
     return APR_SUCCESS;
 }
 
-apr_status_t ssl_init_CheckServers(server_rec *base_server, apr_pool_t *p)
+#ifdef HAVE_TLSEXT
+static void ssl_init_sni_index_add(apr_pool_t *p, apr_hash_t *table,
+                                   const char *name, server_rec *s)
+{
+    apr_array_header_t *servers;
+    char *key;
+
+    key = apr_pstrdup(p, name);
+    ap_str_tolower(key);
+
+    servers = apr_hash_get(table, key, APR_HASH_KEY_STRING);
+    if (!servers) {
+        servers = apr_array_make(p, 1, sizeof(server_rec *));
+        apr_hash_set(table, key, APR_HASH_KEY_STRING, servers);
+    }
+    APR_ARRAY_PUSH(servers, server_rec *) = s;
+}
+
+/*
+ * Index the names of all the virtual hosts for the SNI callback, which
+ * only has to look at the virtual hosts found here.  Aliases of the form
+ * "*.example.com" are indexed by their suffix, since the '*' matches any
+ * prefix, the other wildcards are still matched one by one.
+ */
+static void ssl_init_sni_index(server_rec *base_server, apr_pool_t *p)
+{
+    SSLModConfigRec *mc = myModConfig(base_server);
+    ssl_sni_index_t *idx;
+    server_rec *s;
+    int i, n;
+
+    idx = apr_palloc(p, sizeof(*idx));
+    idx->names = apr_hash_make(p);
+    idx->wild_suffixes = apr_hash_make(p);
+    idx->wild_names = apr_array_make(p, 1, sizeof(ssl_sni_wild_t));
+    idx->order = apr_hash_make(p);
+    idx->specific_addrs = 0;
+
+    for (s = base_server, n = 0; s; s = s->next, n++) {
+        server_addr_rec *sar;
+        server_rec **key;
+        int *order;
+        char **name;
+
+        key = apr_palloc(p, sizeof(*key));
+        *key = s;
+        order = apr_palloc(p, sizeof(*order));
+        *order = n;
+        apr_hash_set(idx->order, key, sizeof(*key), order);
+        if (s->is_virtual) {
+            for (sar = s->addrs; sar; sar = sar->next) {
+                if (!apr_sockaddr_is_wildcard(sar->host_addr)) {
+                    idx->specific_addrs = 1;
+                }
+            }
+        }
+
+        if (s->server_hostname) {
+            ssl_init_sni_index_add(p, idx->names, s->server_hostname, s);
+        }
+        if (s->names) {
+            name = (char **)s->names->elts;
+            for (i = 0; i < s->names->nelts; ++i) {
+                if (name[i]) {
+                    ssl_init_sni_index_add(p, idx->names, name[i], s);
+                }
+            }
+        }
+        if (s->wild_names) {
+            name = (char **)s->wild_names->elts;
+            for (i = 0; i < s->wild_names->nelts; ++i) {
+                if (!name[i]) {
+                    continue;
+                }
+                if (name[i][0] == '*' && name[i][1] == '.'
+                    && !strpbrk(name[i] + 1, "*?")) {
+                    ssl_init_sni_index_add(p, idx->wild_suffixes,
+                                           name[i] + 1, s);
+                }
+                else {
+                    ssl_sni_wild_t *wild = apr_array_push(idx->wild_names);
+                    wild->name = name[i];
+                    wild->server = s;
+                }
+            }
+        }
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server, APLOGNO(02917)
+                 "Init: Indexed %u server names and %u wildcard suffixes "
+                 "for SNI (%d other wildcard aliases)",
+                 apr_hash_count(idx->names), apr_hash_count(idx->wild_suffixes),
+                 idx->wild_names->nelts);
+
+    mc->sni_index = idx;
+}
+#endif
+
+apr_status_t ssl_init_CheckServers(server_rec *base_server, apr_pool_t *pconf,
+                                   apr_pool_t *p)
 {
     server_rec *s;
     SSLSrvConfigRec *sc;
@@ -1608,6 +2260,8 @@ apr_status_t ssl_init_CheckServers(server_rec *base_server, apr_pool_t *p)
                      "but the currently used library version (%s) is "
                      "lacking this feature", SSLeay_version(SSLEAY_VERSION));
     }
+#else
+    ssl_init_sni_index(base_server, pconf);
 #endif
 
     return APR_SUCCESS;
@@ -1748,6 +2402,11 @@ void ssl_init_Child(apr_pool_t *p, server_rec *s)
 
 static void ssl_init_ctx_cleanup(modssl_ctx_t *mctx)
 {
+    if (mctx->ssl_ctx_shared) {
+        /* freed along with the owning server's */
+        mctx->ssl_ctx = NULL;
+        mctx->ssl_ctx_shared = FALSE;
+    }
     MODSSL_CFG_ITEM_FREE(SSL_CTX_free, mctx->ssl_ctx);
 
 #ifdef HAVE_SRP
@@ -109,6 +109,17 @@ typedef struct {
     ap_filter_t        *pInputFilter;
     ap_filter_t        *pOutputFilter;
     SSLConnRec         *config;
+#ifdef HAVE_TLS_EARLY_DATA
+    enum {
+        SSL_EARLY_DATA_NONE = 0, /* not tried yet */
+        SSL_EARLY_DATA_READING,  /* reading early data, handshake pending */
+        SSL_EARLY_DATA_DONE      /* no (more) early data to read */
+    } early_data;
+    char               *early_buf;  /* early data read but not consumed */
+    apr_size_t          early_size;
+    apr_size_t          early_off;
+    apr_size_t          early_len;
+#endif
 } ssl_filter_ctx_t;
 
 typedef struct {
@@ -587,6 +598,138 @@ static BIO_METHOD bio_filter_in_method = {
     NULL
 };
 
+#ifdef HAVE_TLS_EARLY_DATA
+static apr_status_t ssl_io_filter_handshake(ssl_filter_ctx_t *filter_ctx);
+
+/*
+ * Read (more) TLS 1.3 early data (0-RTT) sent along with the ClientHello,
+ * appending to what is not consumed yet.  Returns 1 when early data was
+ * read, 0 once the client has sent all of it (the handshake is to be
+ * completed then), or -1 on errors to be checked with SSL_get_error().
+ */
+static int ssl_io_early_data_fill(ssl_filter_ctx_t *filter_ctx)
+{
+    conn_rec *c = (conn_rec *)SSL_get_app_data(filter_ctx->pssl);
+    size_t readbytes = 0;
+
+    if (filter_ctx->early_off == filter_ctx->early_len) {
+        filter_ctx->early_off = filter_ctx->early_len = 0;
+    }
+    if (filter_ctx->early_len == filter_ctx->early_size) {
+        apr_size_t size = filter_ctx->early_size ? filter_ctx->early_size * 2
+                                                 : AP_IOBUFSIZE;
+        char *buf = apr_palloc(c->pool, size);
+
+        filter_ctx->early_len -= filter_ctx->early_off;
+        if (filter_ctx->early_len) {
+            memcpy(buf, filter_ctx->early_buf + filter_ctx->early_off,
+                   filter_ctx->early_len);
+        }
+        filter_ctx->early_buf = buf;
+        filter_ctx->early_size = size;
+        filter_ctx->early_off = 0;
+    }
+
+    switch (SSL_read_early_data(filter_ctx->pssl,
+                                filter_ctx->early_buf + filter_ctx->early_len,
+                                filter_ctx->early_size - filter_ctx->early_len,
+                                &readbytes)) {
+    case SSL_READ_EARLY_DATA_SUCCESS:
+        filter_ctx->early_len += readbytes;
+        ap_log_cerror(APLOG_MARK, APLOG_TRACE4, 0, c,
+                      "read %" APR_SIZE_T_FMT " bytes of early data",
+                      (apr_size_t)readbytes);
+        return 1;
+
+    case SSL_READ_EARLY_DATA_FINISH:
+        filter_ctx->early_data = SSL_EARLY_DATA_DONE;
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Serve the early data read ahead of the completed handshake, reading on
+ * while the client sends it.  Nothing is added to *len only when all of
+ * it is consumed and the handshake completed.
+ */
+static apr_status_t ssl_io_early_data_read(bio_filter_in_ctx_t *inctx,
+                                           char *buf, apr_size_t wanted,
+                                           apr_size_t *len)
+{
+    ssl_filter_ctx_t *filter_ctx = inctx->filter_ctx;
+    conn_rec *c = inctx->f->c;
+    apr_size_t n;
+    int rc;
+
+    while (filter_ctx->early_off == filter_ctx->early_len
+           && filter_ctx->early_data == SSL_EARLY_DATA_READING) {
+        rc = ssl_io_early_data_fill(filter_ctx);
+        if (rc == 0) {
+            return ssl_io_filter_handshake(filter_ctx);
+        }
+        if (rc < 0) {
+            if (SSL_get_error(filter_ctx->pssl, -1) != SSL_ERROR_WANT_READ) {
+                ap_log_cerror(APLOG_MARK, APLOG_INFO, inctx->rc, c,
+                              APLOGNO(02929) "SSL library error reading "
+                              "early data");
+                ssl_log_ssl_error(SSLLOG_MARK, APLOG_INFO, mySrvFromConn(c));
+                return inctx->rc != APR_SUCCESS ? inctx->rc : APR_EGENERAL;
+            }
+            if (inctx->block == APR_NONBLOCK_READ) {
+                return APR_EAGAIN;
+            }
+        }
+    }
+
+    n = filter_ctx->early_len - filter_ctx->early_off;
+    if (n == 0) {
+        /* Requests from now on are read after the handshake */
+        filter_ctx->config->early_data = 0;
+        return APR_SUCCESS;
+    }
+    if (n > wanted - *len) {
+        n = wanted - *len;
+    }
+    memcpy(buf + *len, filter_ctx->early_buf + filter_ctx->early_off, n);
+    if (inctx->mode != AP_MODE_SPECULATIVE) {
+        filter_ctx->early_off += n;
+    }
+    filter_ctx->config->early_data = 1;
+    *len += n;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Wait for the client to send all of its early data, which is kept for
+ * the next reads, and complete the handshake (AP_MODE_INIT).
+ */
+static apr_status_t ssl_io_early_data_finish(bio_filter_in_ctx_t *inctx)
+{
+    ssl_filter_ctx_t *filter_ctx = inctx->filter_ctx;
+
+    while (filter_ctx->early_data == SSL_EARLY_DATA_READING) {
+        if (ssl_io_early_data_fill(filter_ctx) < 0) {
+            if (SSL_get_error(filter_ctx->pssl, -1) != SSL_ERROR_WANT_READ) {
+                ap_log_cerror(APLOG_MARK, APLOG_INFO, inctx->rc, inctx->f->c,
+                              APLOGNO(02930) "SSL library error reading "
+                              "early data");
+                ssl_log_ssl_error(SSLLOG_MARK, APLOG_INFO,
+                                  mySrvFromConn(inctx->f->c));
+                return inctx->rc != APR_SUCCESS ? inctx->rc : APR_EGENERAL;
+            }
+            if (inctx->block == APR_NONBLOCK_READ) {
+                return APR_EAGAIN;
+            }
+        }
+    }
+
+    return ssl_io_filter_handshake(filter_ctx);
+}
+#endif
 
 static apr_status_t ssl_io_input_read(bio_filter_in_ctx_t *inctx,
                                       char *buf,
@@ -629,6 +772,22 @@ static apr_status_t ssl_io_input_read(bio_filter_in_ctx_t *inctx,
         }
     }
 
+#ifdef HAVE_TLS_EARLY_DATA
+    if (inctx->filter_ctx->early_buf) {
+        apr_status_t rv = ssl_io_early_data_read(inctx, buf, wanted, len);
+
+        if (rv != APR_SUCCESS) {
+            if (*len > 0 && APR_STATUS_IS_EAGAIN(rv)) {
+                return APR_SUCCESS;
+            }
+            return rv;
+        }
+        if (*len > bytes) {
+            return APR_SUCCESS;
+        }
+    }
+#endif
+
     while (1) {
 
         if (!inctx->filter_ctx->pssl) {
@@ -813,6 +972,15 @@ static apr_status_t ssl_filter_write(ap_filter_t *f,
     }
 
     outctx = (bio_filter_out_ctx_t *)filter_ctx->pbioWrite->ptr;
+#ifdef HAVE_TLS_EARLY_DATA
+    if (filter_ctx->early_data == SSL_EARLY_DATA_READING) {
+        /* Respond to early data before the handshake completes */
+        size_t written = 0;
+        res = SSL_write_early_data(filter_ctx->pssl, data, len, &written)
+              ? (int)written : -1;
+    }
+    else
+#endif
     res = SSL_write(filter_ctx->pssl, (unsigned char *)data, len);
 
     if (res < 0) {
@@ -879,6 +1047,96 @@ static apr_status_t ssl_filter_write(ap_filter_t *f,
     return outctx->rc;
 }
 
+#ifdef HAVE_SSL_RECORD_SIZING
+/*
+ * Dynamic record sizing (SSLDynamicRecordSizing): the first bytes of a
+ * connection, and those after it idled, are sent in records fitting a
+ * single TCP segment, so that the client can start processing them as
+ * soon as they arrive rather than waiting for a whole 16K record to be
+ * received.  Bulk transfers then continue with full size records for
+ * throughput.  Sets the record size for the next write and returns how
+ * many of the len bytes to write with it.
+ */
+static apr_size_t ssl_io_record_size(ssl_filter_ctx_t *filter_ctx,
+                                     apr_size_t len)
+{
+    SSLConnRec *sslconn = filter_ctx->config;
+    SSLSrvConfigRec *sc = mySrvConfig(sslconn->server);
+    ssl_record_stats_t *stats = sc->record_stats;
+    apr_size_t size;
+    apr_time_t now;
+
+    if (sslconn->is_proxy || sc->record_boost <= 0) {
+        return len;
+    }
+
+    now = apr_time_now();
+    if (sslconn->record_size == SSL_RECORD_SIZE_FULL && sc->record_idle > 0
+        && now - sslconn->record_last >= apr_time_from_sec(sc->record_idle)) {
+        sslconn->record_bytes = 0;
+        if (stats) {
+            apr_atomic_inc32(&stats->idle_resets);
+        }
+    }
+    sslconn->record_last = now;
+
+    if (sslconn->record_bytes < sc->record_boost) {
+        size = SSL_RECORD_SIZE_SMALL;
+        /* leave what exceeds the budget for full size records */
+        if ((apr_off_t)len > sc->record_boost - sslconn->record_bytes) {
+            len = (apr_size_t)(sc->record_boost - sslconn->record_bytes);
+        }
+        sslconn->record_bytes += len;
+    }
+    else {
+        size = SSL_RECORD_SIZE_FULL;
+    }
+
+    if (size != sslconn->record_size) {
+        SSL_set_max_send_fragment(filter_ctx->pssl, size);
+        if (size == SSL_RECORD_SIZE_FULL && stats) {
+            apr_atomic_inc32(&stats->boosts);
+        }
+        ap_log_cerror(APLOG_MARK, APLOG_TRACE4, 0,
+                      (conn_rec *)SSL_get_app_data(filter_ctx->pssl),
+                      "record size: %" APR_SIZE_T_FMT " bytes", size);
+        sslconn->record_size = size;
+    }
+
+    if (stats) {
+        apr_atomic_add32(size == SSL_RECORD_SIZE_FULL ? &stats->full_records
+                                                      : &stats->small_records,
+                         (apr_uint32_t)((len + size - 1) / size));
+    }
+
+    return len;
+}
+#endif
+
+/* Write the data, in records sized as configured for the connection */
+static apr_status_t ssl_filter_write_records(ap_filter_t *f,
+                                             const char *data,
+                                             apr_size_t len)
+{
+#ifdef HAVE_SSL_RECORD_SIZING
+    apr_status_t rv;
+    apr_size_t n;
+
+    do {
+        n = ssl_io_record_size(f->ctx, len);
+        if ((rv = ssl_filter_write(f, data, n)) != APR_SUCCESS) {
+            return rv;
+        }
+        data += n;
+        len -= n;
+    } while (len);
+
+    return APR_SUCCESS;
+#else
+    return ssl_filter_write(f, data, len);
+#endif
+}
+
 /* Just use a simple request.  Any request will work for this, because
  * we use a flag in the conn_rec->conn_vector now.  The fake request just
  * gets the request back to the Apache core so that a response can be sent.
@@ -1092,6 +1350,59 @@ static apr_status_t ssl_io_filter_cleanup(void *data)
     return APR_SUCCESS;
 }
 
+#ifdef HAVE_SSL_ASYNC
+/*
+ * SSL_accept() paused for an asynchronous engine operation (SSLAsyncHandshake),
+ * typically a private key signature which the engine computes in its own
+ * threads.  Sleep on the job's wait descriptors instead of computing (or
+ * spinning) in this thread, bounded by the server's Timeout.  Returns
+ * APR_SUCCESS when the handshake is to be resumed.
+ */
+static apr_status_t ssl_io_wait_async(ssl_filter_ctx_t *filter_ctx,
+                                      conn_rec *c, int n)
+{
+    SSLConnRec *sslconn = myConnConfig(c);
+    bio_filter_in_ctx_t *inctx = (bio_filter_in_ctx_t *)
+                                 (filter_ctx->pbioRead->ptr);
+    OSSL_ASYNC_FD *fds;
+    size_t numfds, i;
+    apr_pollfd_t *pfds;
+    apr_int32_t nsds;
+    apr_pool_t *p;
+    apr_status_t rv;
+
+    if (SSL_get_error(filter_ctx->pssl, n) != SSL_ERROR_WANT_ASYNC
+        || !SSL_get_all_async_fds(filter_ctx->pssl, NULL, &numfds)
+        || !numfds) {
+        return APR_EGENERAL;
+    }
+
+    apr_pool_create(&p, c->pool);
+    fds = apr_palloc(p, numfds * sizeof(*fds));
+    pfds = apr_pcalloc(p, numfds * sizeof(*pfds));
+    SSL_get_all_async_fds(filter_ctx->pssl, fds, &numfds);
+    for (i = 0; i < numfds; i++) {
+        apr_os_file_put(&pfds[i].desc.f, &fds[i], APR_READ, p);
+        pfds[i].p = p;
+        pfds[i].desc_type = APR_POLL_FILE;
+        pfds[i].reqevents = APR_POLLIN;
+    }
+
+    rv = apr_poll(pfds, (apr_int32_t)numfds, &nsds,
+                  sslconn->server->timeout);
+    apr_pool_destroy(p);
+
+    if (rv != APR_SUCCESS) {
+        ap_log_cerror(APLOG_MARK, APLOG_INFO, rv, c, APLOGNO(02927)
+                      "SSL handshake: asynchronous operation did not "
+                      "complete");
+        inctx->rc = rv;
+    }
+
+    return rv;
+}
+#endif
+
 /*
  * The hook is NOT registered with ap_hook_process_connection. Instead, it is
  * called manually from the churn () before it tries to read any data.
@@ -1237,7 +1548,35 @@ static apr_status_t ssl_io_filter_handshake(ssl_filter_ctx_t *filter_ctx)
         return APR_SUCCESS;
     }
 
-    if ((n = SSL_accept(filter_ctx->pssl)) <= 0) {
+    n = 0;
+#ifdef HAVE_TLS_EARLY_DATA
+    if (filter_ctx->early_data == SSL_EARLY_DATA_READING) {
+        /* Completed once the early data is read, see ssl_io_input_read() */
+        return APR_SUCCESS;
+    }
+    if (filter_ctx->early_data == SSL_EARLY_DATA_NONE) {
+        /* The vhost is not known yet (SNI), the callback decides */
+        if (myModConfig(server)->early_data == TRUE) {
+            /* The ClientHello may come with early data, read it first */
+            filter_ctx->early_data = SSL_EARLY_DATA_READING;
+            if ((n = ssl_io_early_data_fill(filter_ctx)) > 0) {
+                return APR_SUCCESS;
+            }
+        }
+        else {
+            filter_ctx->early_data = SSL_EARLY_DATA_DONE;
+        }
+    }
+#endif
+    if (n == 0) {
+        n = SSL_accept(filter_ctx->pssl);
+#ifdef HAVE_SSL_ASYNC
+        while (n <= 0 && ssl_io_wait_async(filter_ctx, c, n) == APR_SUCCESS) {
+            n = SSL_accept(filter_ctx->pssl);
+        }
+#endif
+    }
+    if (n <= 0) {
         bio_filter_in_ctx_t *inctx = (bio_filter_in_ctx_t *)
                                      (filter_ctx->pbioRead->ptr);
         bio_filter_out_ctx_t *outctx = (bio_filter_out_ctx_t *)
@@ -1298,6 +1637,11 @@ static apr_status_t ssl_io_filter_handshake(ssl_filter_ctx_t *filter_ctx)
     }
     sc = mySrvConfig(sslconn->server);
 
+#ifdef HAVE_SSL_ASYNC
+    /* later renegotiations are not waited for, let them run inline */
+    SSL_clear_mode(filter_ctx->pssl, SSL_MODE_ASYNC);
+#endif
+
     /*
      * Check for failed client authentication
      */
@@ -1427,6 +1771,12 @@ static apr_status_t ssl_io_filter_input(ap_filter_t *f,
         /* protocol module needs to handshake before sending
          * data to client (e.g. NNTP or FTP)
          */
+#ifdef HAVE_TLS_EARLY_DATA
+        if (inctx->filter_ctx->early_data == SSL_EARLY_DATA_READING
+            && (status = ssl_io_early_data_finish(inctx)) != APR_SUCCESS) {
+            return ssl_io_filter_error(f, bb, status);
+        }
+#endif
         return APR_SUCCESS;
     }
 
@@ -1568,12 +1918,33 @@ struct coalesce_ctx {
     apr_size_t bytes; /* number of bytes of buffer used. */
 };
 
+/* While small records are sent (SSLDynamicRecordSizing), coalesce no
+ * more than fits one of them. */
+static apr_size_t ssl_io_coalesce_limit(conn_rec *c)
+{
+#ifdef HAVE_SSL_RECORD_SIZING
+    SSLConnRec *sslconn = myConnConfig(c);
+
+    if (sslconn && !sslconn->is_proxy) {
+        SSLSrvConfigRec *sc = mySrvConfig(sslconn->server);
+
+        if (sc->record_boost > 0 && sslconn->record_bytes < sc->record_boost) {
+            return SSL_RECORD_SIZE_SMALL < COALESCE_BYTES
+                   ? SSL_RECORD_SIZE_SMALL : COALESCE_BYTES;
+        }
+    }
+#endif
+
+    return COALESCE_BYTES;
+}
+
 static apr_status_t ssl_io_filter_coalesce(ap_filter_t *f,
                                            apr_bucket_brigade *bb)
 {
     apr_bucket *e, *last = NULL;
     apr_size_t bytes = 0;
     struct coalesce_ctx *ctx = f->ctx;
+    apr_size_t limit = ssl_io_coalesce_limit(f->c);
     unsigned count = 0;
 
     /* The brigade consists of zero-or-more small data buckets which
@@ -1593,10 +1964,10 @@ static apr_status_t ssl_io_filter_coalesce(ap_filter_t *f,
          e != APR_BRIGADE_SENTINEL(bb)
              && !APR_BUCKET_IS_METADATA(e)
              && e->length != (apr_size_t)-1
-             && e->length < COALESCE_BYTES
-             && (bytes + e->length) < COALESCE_BYTES
+             && e->length < limit
+             && (bytes + e->length) < limit
              && (ctx == NULL
-                 || bytes + ctx->bytes + e->length < COALESCE_BYTES);
+                 || bytes + ctx->bytes + e->length < limit);
          e = APR_BUCKET_NEXT(e)) {
         last = e;
         if (e->length) count++; /* don't count zero-length buckets */
@@ -1788,7 +2159,7 @@ static apr_status_t ssl_io_filter_output(ap_filter_t *f,
                 break;
             }
 
-            status = ssl_filter_write(f, data, len);
+            status = ssl_filter_write_records(f, data, len);
             apr_bucket_delete(bucket);
 
             if (status != APR_SUCCESS) {
@@ -2040,6 +2411,13 @@ void ssl_io_filter_init(conn_rec *c, request_rec *r, SSL *ssl)
     filter_ctx = apr_palloc(c->pool, sizeof(ssl_filter_ctx_t));
 
     filter_ctx->config          = myConnConfig(c);
+#ifdef HAVE_TLS_EARLY_DATA
+    filter_ctx->early_data      = SSL_EARLY_DATA_NONE;
+    filter_ctx->early_buf       = NULL;
+    filter_ctx->early_size      = 0;
+    filter_ctx->early_off       = 0;
+    filter_ctx->early_len       = 0;
+#endif
 
     ap_add_output_filter(ssl_io_coalesce, NULL, r, c);
 
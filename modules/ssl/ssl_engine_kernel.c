@@ -35,6 +35,13 @@
 static void ssl_configure_env(request_rec *r, SSLConnRec *sslconn);
 #ifdef HAVE_TLSEXT
 static int ssl_find_vhost(void *servername, conn_rec *c, server_rec *s);
+static int ssl_find_vhost_indexed(void *candidates, conn_rec *c,
+                                  server_rec *s);
+static int ssl_set_vhost(conn_rec *c, server_rec *s);
+static apr_array_header_t *ssl_sni_candidates(conn_rec *c,
+                                              const char *servername);
+static server_rec *ssl_sni_resolve(conn_rec *c,
+                                   apr_array_header_t *candidates);
 #endif
 
 #define SWITCH_STATUS_LINE "HTTP/1.1 101 Switching Protocols"
@@ -252,6 +259,35 @@ int ssl_hook_ReadReq(request_rec *r)
         ssl_configure_env(r, sslconn);
     }
 
+#ifdef HAVE_TLS_EARLY_DATA
+    /*
+     * Early data may be replayed (RFC 8470): let safe requests be handled
+     * right away but tell the backends (Early-Data header), and delay the
+     * others until the handshake completes.
+     */
+    if (sslconn->early_data && r->proxyreq != PROXYREQ_PROXY
+        && ap_is_initial_req(r)) {
+        if (r->method_number == M_GET || r->method_number == M_OPTIONS) {
+            apr_table_setn(r->headers_in, "Early-Data", "1");
+            apr_table_setn(r->notes, "ssl-early-data", "1");
+        }
+        else {
+            apr_bucket_brigade *bb;
+            apr_status_t rv;
+
+            bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+            rv = ap_get_brigade(r->connection->input_filters, bb,
+                                AP_MODE_INIT, APR_BLOCK_READ, 0);
+            apr_brigade_destroy(bb);
+            if (rv != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_INFO, rv, r, APLOGNO(02932)
+                              "SSL handshake failed after early data");
+                return HTTP_BAD_REQUEST;
+            }
+        }
+    }
+#endif
+
     return DECLINED;
 }
 
@@ -292,6 +328,16 @@ static void ssl_configure_env(request_rec *r, SSLConnRec *sslconn)
     }
 }
 
+/*
+ * Forget the SSL_* variables cached for the connection (sslconn->env_*),
+ * before the handshake or the client verification they come from is redone.
+ */
+static void ssl_env_cache_clear(SSLConnRec *sslconn)
+{
+    sslconn->env_std = NULL;
+    sslconn->env_certs = NULL;
+}
+
 /*
  *  Access Handler
  */
@@ -574,6 +620,7 @@ int ssl_hook_Access(request_rec *r)
 
         SSL_set_verify(ssl, verify, ssl_callback_SSLVerify);
         SSL_set_verify_result(ssl, X509_V_OK);
+        ssl_env_cache_clear(sslconn);
 
         /* determine whether we've to force a renegotiation */
         if (!renegotiate && verify != verify_old) {
@@ -640,6 +687,7 @@ int ssl_hook_Access(request_rec *r)
                      * will indicate partial success only, later on.
                      */
                     sslconn->verify_info = "GENEROUS";
+                    ssl_env_cache_clear(sslconn);
             }
         }
     }
@@ -688,6 +736,8 @@ int ssl_hook_Access(request_rec *r)
      * now do the renegotiation if anything was actually reconfigured
      */
     if (renegotiate) {
+        ssl_env_cache_clear(sslconn);
+
         /*
          * Now we force the SSL renegotiation by sending the Hello Request
          * message to the client. Here we have to do a workaround: Actually
@@ -744,25 +794,41 @@ int ssl_hook_Access(request_rec *r)
                 cert = sk_X509_value(cert_stack, 0);
             }
 
-            X509_STORE_CTX_init(&cert_store_ctx, cert_store, cert, cert_stack);
             depth = SSL_get_verify_depth(ssl);
 
-            if (depth >= 0) {
-                X509_STORE_CTX_set_depth(&cert_store_ctx, depth);
+            if (sslconn->reverify_store == cert_store
+                && sslconn->reverify_depth == depth) {
+                /* the peer was re-verified so already on this connection */
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02934)
+                              "Reusing the peer's re-verification result "
+                              "(%ld)", sslconn->reverify_result);
+                SSL_set_verify_result(ssl, sslconn->reverify_result);
             }
+            else {
+                X509_STORE_CTX_init(&cert_store_ctx, cert_store, cert,
+                                    cert_stack);
 
-            X509_STORE_CTX_set_ex_data(&cert_store_ctx,
-                                       SSL_get_ex_data_X509_STORE_CTX_idx(),
-                                       (char *)ssl);
+                if (depth >= 0) {
+                    X509_STORE_CTX_set_depth(&cert_store_ctx, depth);
+                }
 
-            if (!X509_verify_cert(&cert_store_ctx)) {
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02224)
-                              "Re-negotiation verification step failed");
-                ssl_log_ssl_error(SSLLOG_MARK, APLOG_ERR, r->server);
-            }
+                X509_STORE_CTX_set_ex_data(&cert_store_ctx,
+                                           SSL_get_ex_data_X509_STORE_CTX_idx(),
+                                           (char *)ssl);
+
+                if (!X509_verify_cert(&cert_store_ctx)) {
+                    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02224)
+                                  "Re-negotiation verification step failed");
+                    ssl_log_ssl_error(SSLLOG_MARK, APLOG_ERR, r->server);
+                }
 
-            SSL_set_verify_result(ssl, cert_store_ctx.error);
-            X509_STORE_CTX_cleanup(&cert_store_ctx);
+                SSL_set_verify_result(ssl, cert_store_ctx.error);
+                X509_STORE_CTX_cleanup(&cert_store_ctx);
+
+                sslconn->reverify_store = cert_store;
+                sslconn->reverify_depth = depth;
+                sslconn->reverify_result = cert_store_ctx.error;
+            }
 
             if (cert_stack != SSL_get_peer_cert_chain(ssl)) {
                 /* we created this ourselves, so free it */
@@ -838,6 +904,9 @@ int ssl_hook_Access(request_rec *r)
 
             sslconn->reneg_state = RENEG_REJECT;
 
+            /* the peer may have sent another certificate */
+            sslconn->reverify_store = NULL;
+
             if (SSL_get_state(ssl) != SSL_ST_OK) {
                 ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02261)
                               "Re-negotiation handshake failed");
@@ -1154,11 +1223,27 @@ static const char *ssl_hook_Fixup_vars[] = {
     NULL
 };
 
+/*
+ * Forget the variables cached for the connection (sslconn->env_*) when
+ * they are formatted differently (SSLOptions +LegacyDNStringFormat).
+ * ssl_hook_Access() drops them itself when it renegotiates or re-verifies
+ * the client.
+ */
+static void ssl_env_cache_check(SSLConnRec *sslconn, int options)
+{
+    options &= SSL_OPT_LEGACYDNFORMAT;
+    if (sslconn->env_options != options) {
+        ssl_env_cache_clear(sslconn);
+        sslconn->env_options = options;
+    }
+}
+
 int ssl_hook_Fixup(request_rec *r)
 {
     SSLConnRec *sslconn = myConnConfig(r->connection);
     SSLSrvConfigRec *sc = mySrvConfig(r->server);
     SSLDirConfigRec *dc = myDirConfig(r);
+    conn_rec *c = r->connection;
     apr_table_t *env = r->subprocess_env;
     char *var, *val = "";
 #ifdef HAVE_TLSEXT
@@ -1197,44 +1282,57 @@ int ssl_hook_Fixup(request_rec *r)
     }
 #endif
 
+    if (dc->nOptions & (SSL_OPT_STDENVVARS | SSL_OPT_EXPORTCERTDATA)) {
+        ssl_env_cache_check(sslconn, dc->nOptions);
+    }
+
     /* standard SSL environment variables */
     if (dc->nOptions & SSL_OPT_STDENVVARS) {
-        modssl_var_extract_dns(env, sslconn->ssl, r->pool);
-        modssl_var_extract_san_entries(env, sslconn->ssl, r->pool);
-
-        for (i = 0; ssl_hook_Fixup_vars[i]; i++) {
-            var = (char *)ssl_hook_Fixup_vars[i];
-            val = ssl_var_lookup(r->pool, r->server, r->connection, r, var);
-            if (!strIsEmpty(val)) {
-                apr_table_setn(env, var, val);
+        if (!sslconn->env_std) {
+            apr_table_t *vars = apr_table_make(c->pool, 48);
+
+            modssl_var_extract_dns(vars, sslconn->ssl, c->pool);
+            modssl_var_extract_san_entries(vars, sslconn->ssl, c->pool);
+
+            for (i = 0; ssl_hook_Fixup_vars[i]; i++) {
+                var = (char *)ssl_hook_Fixup_vars[i];
+                val = ssl_var_lookup(c->pool, r->server, c, r, var);
+                if (!strIsEmpty(val)) {
+                    apr_table_setn(vars, var, val);
+                }
             }
+            sslconn->env_std = vars;
         }
+        apr_table_overlap(env, sslconn->env_std, APR_OVERLAP_TABLES_SET);
     }
 
     /*
      * On-demand bloat up the SSI/CGI environment with certificate data
      */
     if (dc->nOptions & SSL_OPT_EXPORTCERTDATA) {
-        val = ssl_var_lookup(r->pool, r->server, r->connection,
-                             r, "SSL_SERVER_CERT");
+        if (!sslconn->env_certs) {
+            apr_table_t *vars = apr_table_make(c->pool, 4);
+
+            val = ssl_var_lookup(c->pool, r->server, c, r, "SSL_SERVER_CERT");
 
-        apr_table_setn(env, "SSL_SERVER_CERT", val);
+            apr_table_setn(vars, "SSL_SERVER_CERT", val);
 
-        val = ssl_var_lookup(r->pool, r->server, r->connection,
-                             r, "SSL_CLIENT_CERT");
+            val = ssl_var_lookup(c->pool, r->server, c, r, "SSL_CLIENT_CERT");
 
-        apr_table_setn(env, "SSL_CLIENT_CERT", val);
+            apr_table_setn(vars, "SSL_CLIENT_CERT", val);
 
-        if ((peer_certs = (STACK_OF(X509) *)SSL_get_peer_cert_chain(ssl))) {
-            for (i = 0; i < sk_X509_num(peer_certs); i++) {
-                var = apr_psprintf(r->pool, "SSL_CLIENT_CERT_CHAIN_%d", i);
-                val = ssl_var_lookup(r->pool, r->server, r->connection,
-                                     r, var);
-                if (val) {
-                    apr_table_setn(env, var, val);
+            if ((peer_certs = (STACK_OF(X509) *)SSL_get_peer_cert_chain(ssl))) {
+                for (i = 0; i < sk_X509_num(peer_certs); i++) {
+                    var = apr_psprintf(c->pool, "SSL_CLIENT_CERT_CHAIN_%d", i);
+                    val = ssl_var_lookup(c->pool, r->server, c, r, var);
+                    if (val) {
+                        apr_table_setn(vars, var, val);
+                    }
                 }
             }
+            sslconn->env_certs = vars;
         }
+        apr_table_overlap(env, sslconn->env_certs, APR_OVERLAP_TABLES_SET);
     }
 
 
@@ -1927,8 +2025,29 @@ int ssl_callback_ServerNameIndication(SSL *ssl, int *al, modssl_ctx_t *mctx)
 
     if (c) {
         if (servername) {
-            if (ap_vhost_iterate_given_conn(c, ssl_find_vhost,
-                                            (void *)servername)) {
+            apr_array_header_t *candidates = ssl_sni_candidates(c, servername);
+            int found;
+
+            if (candidates) {
+                server_rec *s = ssl_sni_resolve(c, candidates);
+
+                if (s) {
+                    found = ssl_set_vhost(c, s);
+                }
+                else {
+                    /* only the virtual hosts bearing the name are compared,
+                     * in the order of the address' virtual hosts */
+                    found = candidates->nelts
+                            && ap_vhost_iterate_given_conn(c,
+                                                   ssl_find_vhost_indexed,
+                                                   candidates);
+                }
+            }
+            else {
+                found = ap_vhost_iterate_given_conn(c, ssl_find_vhost,
+                                                    (void *)servername);
+            }
+            if (found) {
                 ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, c, APLOGNO(02043)
                               "SSL virtual host for servername %s found",
                               servername);
@@ -1966,6 +2085,110 @@ int ssl_callback_ServerNameIndication(SSL *ssl, int *al, modssl_ctx_t *mctx)
     return SSL_TLSEXT_ERR_NOACK;
 }
 
+/*
+ * Look up the virtual hosts which have the supplied name as ServerName
+ * or ServerAlias in the index built by ssl_init_CheckServers().  Returns
+ * NULL when there is no index.
+ */
+static apr_array_header_t *ssl_sni_candidates(conn_rec *c,
+                                              const char *servername)
+{
+    SSLModConfigRec *mc = myModConfigFromConn(c);
+    ssl_sni_index_t *idx = mc->sni_index;
+    apr_array_header_t *candidates, *servers;
+    ssl_sni_wild_t *wild;
+    char *name, *dot;
+    int i;
+
+    if (!idx) {
+        return NULL;
+    }
+
+    name = apr_pstrdup(c->pool, servername);
+    ap_str_tolower(name);
+
+    candidates = apr_array_make(c->pool, 2, sizeof(server_rec *));
+
+    servers = apr_hash_get(idx->names, name, APR_HASH_KEY_STRING);
+    if (servers) {
+        apr_array_cat(candidates, servers);
+    }
+
+    /* "*.example.com" matches whatever precedes any ".example.com" */
+    for (dot = strchr(name, '.'); dot; dot = strchr(dot + 1, '.')) {
+        servers = apr_hash_get(idx->wild_suffixes, dot, APR_HASH_KEY_STRING);
+        if (servers) {
+            apr_array_cat(candidates, servers);
+        }
+    }
+
+    wild = (ssl_sni_wild_t *)idx->wild_names->elts;
+    for (i = 0; i < idx->wild_names->nelts; i++) {
+        if (!ap_strcasecmp_match(servername, wild[i].name)) {
+            APR_ARRAY_PUSH(candidates, server_rec *) = wild[i].server;
+        }
+    }
+
+    return candidates;
+}
+
+/*
+ * Pick among the candidates the virtual host the connection's address would
+ * be matched against first, like ap_vhost_iterate_given_conn() would: the
+ * first one in configuration order which is on the local address and port,
+ * or on a wildcard address and the local port when no virtual host is on a
+ * specific address.  Returns NULL when that can't be told without the vhost
+ * lookup (port wildcards, mixed specific and wildcard addresses), or when
+ * no candidate is on the address.
+ */
+static server_rec *ssl_sni_resolve(conn_rec *c,
+                                   apr_array_header_t *candidates)
+{
+    SSLModConfigRec *mc = myModConfigFromConn(c);
+    ssl_sni_index_t *idx = mc->sni_index;
+    apr_sockaddr_t *local = c->local_addr;
+    server_rec *found = NULL;
+    int found_order = 0;
+    int i;
+
+    for (i = 0; i < candidates->nelts; i++) {
+        server_rec *s = APR_ARRAY_IDX(candidates, i, server_rec *);
+        server_addr_rec *sar;
+        int *order;
+
+        if (!s->is_virtual) {
+            continue;
+        }
+        order = apr_hash_get(idx->order, &s, sizeof(s));
+        if (!order || (found && *order >= found_order)) {
+            continue;
+        }
+        for (sar = s->addrs; sar; sar = sar->next) {
+            if (sar->host_port == 0) {
+                return NULL;
+            }
+            if (sar->host_port != local->port) {
+                continue;
+            }
+            if (apr_sockaddr_is_wildcard(sar->host_addr)) {
+                if (idx->specific_addrs) {
+                    return NULL;
+                }
+                break;
+            }
+            if (apr_sockaddr_equal(sar->host_addr, local)) {
+                break;
+            }
+        }
+        if (sar) {
+            found = s;
+            found_order = *order;
+        }
+    }
+
+    return found;
+}
+
 /*
  * Find a (name-based) SSL virtual host where either the ServerName
  * or one of the ServerAliases matches the supplied name (to be used
@@ -1973,12 +2196,9 @@ int ssl_callback_ServerNameIndication(SSL *ssl, int *al, modssl_ctx_t *mctx)
  */
 static int ssl_find_vhost(void *servername, conn_rec *c, server_rec *s)
 {
-    SSLSrvConfigRec *sc;
-    SSL *ssl;
     BOOL found = FALSE;
     apr_array_header_t *names;
     int i;
-    SSLConnRec *sslcon;
 
     /* check ServerName */
     if (!strcasecmp(servername, s->server_hostname)) {
@@ -2021,8 +2241,43 @@ static int ssl_find_vhost(void *servername, conn_rec *c, server_rec *s)
     }
 
     /* set SSL_CTX (if matched) */
+    if (found) {
+        return ssl_set_vhost(c, s);
+    }
+
+    return 0;
+}
+
+/*
+ * Same as ssl_find_vhost() for the virtual hosts returned by
+ * ssl_sni_candidates(), which are known to match the name.
+ */
+static int ssl_find_vhost_indexed(void *candidates, conn_rec *c,
+                                  server_rec *s)
+{
+    apr_array_header_t *servers = candidates;
+    int i;
+
+    for (i = 0; i < servers->nelts; i++) {
+        if (APR_ARRAY_IDX(servers, i, server_rec *) == s) {
+            return ssl_set_vhost(c, s);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Switch the connection to the SSL virtual host found for the SNI.
+ */
+static int ssl_set_vhost(conn_rec *c, server_rec *s)
+{
+    SSLSrvConfigRec *sc;
+    SSL *ssl;
+    SSLConnRec *sslcon;
+
     sslcon = myConnConfig(c);
-    if (found && (ssl = sslcon->ssl) &&
+    if ((ssl = sslcon->ssl) &&
         (sc = mySrvConfig(s))) {
         SSL_CTX *ctx = SSL_set_SSL_CTX(ssl, sc->server->ssl_ctx);
         /*
@@ -2031,6 +2286,16 @@ static int ssl_find_vhost(void *servername, conn_rec *c, server_rec *s)
          * from the ctx by hand
          */
         SSL_set_options(ssl, SSL_CTX_get_options(ctx));
+#ifdef HAVE_SSL_ASYNC
+        /*
+         * Only ever set: this runs from the SNI callback, possibly within
+         * the async job of the handshake, which SSL_accept() would not
+         * resume anymore were the mode cleared.
+         */
+        if (SSL_CTX_get_mode(ctx) & SSL_MODE_ASYNC) {
+            SSL_set_mode(ssl, SSL_MODE_ASYNC);
+        }
+#endif
         if ((SSL_get_verify_mode(ssl) == SSL_VERIFY_NONE) ||
             (SSL_num_renegotiations(ssl) == 0)) {
            /*
@@ -2096,7 +2361,8 @@ static int ssl_find_vhost(void *servername, conn_rec *c, server_rec *s)
 /*
  * This callback function is executed when OpenSSL needs a key for encrypting/
  * decrypting a TLS session ticket (RFC 5077) and a ticket key file has been
- * configured through SSLSessionTicketKeyFile.
+ * configured through SSLSessionTicketKeyFile, or else the keys shared by
+ * all children are used (SSLSessionTicketKeyRotation).
  */
 int ssl_callback_SessionTicket(SSL *ssl,
                                unsigned char *keyname,
@@ -2111,6 +2377,13 @@ int ssl_callback_SessionTicket(SSL *ssl,
     SSLConnRec *sslconn = myConnConfig(c);
     modssl_ctx_t *mctx = myCtxConfig(sslconn, sc);
     modssl_ticket_key_t *ticket_key = mctx->ticket_key;
+    SSLModConfigRec *mc = myModConfig(s);
+    ssl_ticket_keys_t *keys = mc->ticket_keys;
+    BOOL renew = FALSE;
+
+    if (ticket_key && !ticket_key->file_path) {
+        ticket_key = NULL;
+    }
 
     if (mode == 1) {
         /* 
@@ -2118,6 +2391,9 @@ int ssl_callback_SessionTicket(SSL *ssl,
          * see s3_srvr.c:ssl3_send_newsession_ticket()
          */
 
+        if (ticket_key == NULL) {
+            ticket_key = ssl_ticket_keys_get(mc, NULL, NULL);
+        }
         if (ticket_key == NULL) {
             /* should never happen, but better safe than sorry */
             return -1;
@@ -2129,6 +2405,10 @@ int ssl_callback_SessionTicket(SSL *ssl,
                            ticket_key->aes_key, iv);
         HMAC_Init_ex(hctx, ticket_key->hmac_secret, 16, tlsext_tick_md(), NULL);
 
+        if (keys) {
+            apr_atomic_inc32(&keys->issued);
+        }
+
         ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, c, APLOGNO(02289)
                       "TLS session ticket key for %s successfully set, "
                       "creating new session ticket", sc->vhost_id);
@@ -2142,7 +2422,16 @@ int ssl_callback_SessionTicket(SSL *ssl,
          */
 
         /* check key name */
-        if (ticket_key == NULL || memcmp(keyname, ticket_key->key_name, 16)) {
+        if (ticket_key == NULL) {
+            ticket_key = ssl_ticket_keys_get(mc, keyname, &renew);
+        }
+        else if (memcmp(keyname, ticket_key->key_name, 16)) {
+            ticket_key = NULL;
+        }
+        if (ticket_key == NULL) {
+            if (keys) {
+                apr_atomic_inc32(&keys->unknown);
+            }
             return 0;
         }
 
@@ -2154,7 +2443,12 @@ int ssl_callback_SessionTicket(SSL *ssl,
                       "TLS session ticket key for %s successfully set, "
                       "decrypting existing session ticket", sc->vhost_id);
 
-        return 1;
+        if (keys) {
+            apr_atomic_inc32(renew ? &keys->renewed : &keys->resumed);
+        }
+
+        /* tickets of an older key get replaced by one of the current */
+        return renew ? 2 : 1;
     }
 
     /* OpenSSL is not expected to call us with modes other than 1 or 0 */
@@ -2162,6 +2456,49 @@ int ssl_callback_SessionTicket(SSL *ssl,
 }
 #endif /* HAVE_TLS_SESSION_TICKETS */
 
+#ifdef HAVE_TLS_EARLY_DATA
+/*
+ * This callback function is executed when a client resumes a session with
+ * early data (0-RTT), after the SNI callback switched to the requested
+ * virtual host, whose SSLEarlyData decides.  The early data of a session
+ * is accepted only once, which the session cache remembers (for all
+ * children) until the session expires; a replayed ClientHello falls back
+ * to a full handshake.
+ */
+int ssl_callback_AllowEarlyData(SSL *ssl, void *arg)
+{
+    conn_rec *c = (conn_rec *)SSL_get_app_data(ssl);
+    server_rec *s = mySrvFromConn(c);
+    SSLModConfigRec *mc = myModConfig(s);
+    SSL_SESSION *session = SSL_get_session(ssl);
+    unsigned char secret[SSL_MAX_MASTER_KEY_LENGTH];
+    unsigned char id[EVP_MAX_MD_SIZE];
+    unsigned int idlen;
+    size_t len;
+    BOOL replayed;
+
+    if (mySrvConfig(s)->early_data != TRUE || !mc->sesscache || !session
+        || !(len = SSL_SESSION_get_master_key(session, secret,
+                                              sizeof(secret)))) {
+        return 0;
+    }
+
+    /* Identify the early data by the session's (unique) secret */
+    replayed = !EVP_Digest(secret, len, id, &idlen, EVP_sha256(), NULL)
+               || ssl_scache_early_data_replayed(s, id, idlen,
+                      apr_time_from_sec(SSL_SESSION_get_time(session)
+                                        + SSL_SESSION_get_timeout(session)),
+                      c->pool);
+    OPENSSL_cleanse(secret, sizeof(secret));
+
+    ap_log_cerror(APLOG_MARK, replayed ? APLOG_INFO : APLOG_DEBUG, 0, c,
+                  APLOGNO(02931) "%s TLS early data",
+                  replayed ? "Refusing replayed" : "Accepting");
+
+    return replayed ? 0 : 1;
+}
+#endif /* HAVE_TLS_EARLY_DATA */
+
 #ifdef HAVE_TLS_ALPN
 static int ssl_array_index(apr_array_header_t *array,
                            const char *s)
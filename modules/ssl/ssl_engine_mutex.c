@@ -30,11 +30,105 @@
 
 #include "ssl_private.h"
 
+#ifdef HAVE_TLS_EARLY_DATA
+static int ssl_early_data_mutex_init(server_rec *s, apr_pool_t *p)
+{
+    SSLModConfigRec *mc = myModConfig(s);
+    server_rec *ps;
+
+    /* The replay check looks up and then records the early data in the
+     * session cache, which must be atomic whatever the provider is, so
+     * it always needs its own mutex when early data is enabled. */
+    if (!mc->sesscache || mc->early_data_mutex) {
+        return TRUE;
+    }
+    for (ps = s; ps; ps = ps->next) {
+        SSLSrvConfigRec *sc = mySrvConfig(ps);
+        if ((sc->enabled == SSL_ENABLED_TRUE
+             || sc->enabled == SSL_ENABLED_OPTIONAL)
+            && sc->early_data == TRUE) {
+            break;
+        }
+    }
+    if (!ps) {
+        return TRUE;
+    }
+
+    if (ap_global_mutex_create(&mc->early_data_mutex, NULL,
+                               SSL_EARLY_DATA_MUTEX_TYPE, NULL, s,
+                               s->process->pool, 0) != APR_SUCCESS) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static int ssl_early_data_mutex_reinit(server_rec *s, apr_pool_t *p)
+{
+    SSLModConfigRec *mc = myModConfig(s);
+    apr_status_t rv;
+    const char *lockfile;
+
+    if (mc->early_data_mutex == NULL) {
+        return TRUE;
+    }
+
+    lockfile = apr_global_mutex_lockfile(mc->early_data_mutex);
+    if ((rv = apr_global_mutex_child_init(&mc->early_data_mutex,
+                                          lockfile, p)) != APR_SUCCESS) {
+        if (lockfile)
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02941)
+                         "Cannot reinit %s mutex with file `%s'",
+                         SSL_EARLY_DATA_MUTEX_TYPE, lockfile);
+        else
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(02942)
+                         "Cannot reinit %s mutex", SSL_EARLY_DATA_MUTEX_TYPE);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int ssl_early_data_mutex_on(server_rec *s)
+{
+    SSLModConfigRec *mc = myModConfig(s);
+    apr_status_t rv;
+
+    if (mc->early_data_mutex == NULL) {
+        return FALSE;
+    }
+    if ((rv = apr_global_mutex_lock(mc->early_data_mutex)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(02943)
+                     "Failed to acquire SSL early data lock");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int ssl_early_data_mutex_off(server_rec *s)
+{
+    SSLModConfigRec *mc = myModConfig(s);
+    apr_status_t rv;
+
+    if ((rv = apr_global_mutex_unlock(mc->early_data_mutex)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(02944)
+                     "Failed to release SSL early data lock");
+        return FALSE;
+    }
+    return TRUE;
+}
+#endif
+
 int ssl_mutex_init(server_rec *s, apr_pool_t *p)
 {
     SSLModConfigRec *mc = myModConfig(s);
     apr_status_t rv;
 
+#ifdef HAVE_TLS_EARLY_DATA
+    if (!ssl_early_data_mutex_init(s, p)) {
+        return FALSE;
+    }
+#endif
+
     /* A mutex is only needed if a session cache is configured, and
      * the provider used is not internally multi-process/thread
      * safe. */
@@ -62,6 +156,12 @@ int ssl_mutex_reinit(server_rec *s, apr_pool_t *p)
     apr_status_t rv;
     const char *lockfile;
 
+#ifdef HAVE_TLS_EARLY_DATA
+    if (!ssl_early_data_mutex_reinit(s, p)) {
+        return FALSE;
+    }
+#endif
+
     if (mc->pMutex == NULL || !mc->sesscache
         || (mc->sesscache->flags & AP_SOCACHE_FLAG_NOTMPSAFE) == 0) {
         return TRUE;
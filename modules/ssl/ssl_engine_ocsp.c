@@ -128,7 +128,7 @@ static OCSP_REQUEST *create_request(X509_STORE_CTX *ctx, X509 *cert,
  * V_OCSP_CERTSTATUS_* result code. */
 static int verify_ocsp_status(X509 *cert, X509_STORE_CTX *ctx, conn_rec *c,
                               SSLSrvConfigRec *sc, server_rec *s,
-                              apr_pool_t *pool)
+                              apr_pool_t *pool, apr_time_t *next_update)
 {
     int rc = V_OCSP_CERTSTATUS_GOOD;
     OCSP_RESPONSE *response = NULL;
@@ -224,6 +224,17 @@ static int verify_ocsp_status(X509 *cert, X509_STORE_CTX *ctx, conn_rec *c,
                 ssl_log_ssl_error(SSLLOG_MARK, APLOG_ERR, s);
                 rc = V_OCSP_CERTSTATUS_UNKNOWN;
             }
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+            else if (nextup) {
+                int days, secs;
+
+                if (ASN1_TIME_diff(&days, &secs, NULL, nextup)) {
+                    *next_update = apr_time_now()
+                                   + apr_time_from_sec((apr_time_t)days
+                                                       * 86400 + secs);
+                }
+            }
+#endif
         }
 
         {
@@ -252,6 +263,10 @@ int modssl_verify_ocsp(X509_STORE_CTX *ctx, SSLSrvConfigRec *sc,
                        server_rec *s, conn_rec *c, apr_pool_t *pool)
 {
     X509 *cert = X509_STORE_CTX_get_current_cert(ctx);
+    SSLModConfigRec *mc = myModConfig(s);
+    unsigned char id[5 + EVP_MAX_MD_SIZE], md[EVP_MAX_MD_SIZE];
+    unsigned int idlen = 0, mdlen;
+    apr_time_t now, expiry, next_update = 0;
     apr_pool_t *vpool;
     int rv;
 
@@ -270,13 +285,51 @@ int modssl_verify_ocsp(X509_STORE_CTX *ctx, SSLSrvConfigRec *sc,
         return 1;
     }
 
-    /* Create a temporary pool to constrain memory use (the passed-in
-     * pool may be e.g. a connection pool). */
-    apr_pool_create(&vpool, pool);
+    /* The status of a client certificate may be known already from a
+     * previous connection, identified by the certificate's fingerprint
+     * and the server (whose OCSP configuration produced the status). */
+    rv = -1;
+    if (sc->server->ocsp_cache_timeout > 0 && mc->sesscache
+        && X509_digest(cert, EVP_sha256(), md, &mdlen)) {
+        apr_size_t buflen = sc->vhost_id_len + mdlen;
+        unsigned char *buf = apr_palloc(pool, buflen);
+
+        memcpy(buf, sc->vhost_id, sc->vhost_id_len);
+        memcpy(buf + sc->vhost_id_len, md, mdlen);
+        if (EVP_Digest(buf, buflen, id + 5, &idlen, EVP_sha256(), NULL)) {
+            memcpy(id, "ocsp:", 5);
+            idlen += 5;
+        }
+        else {
+            idlen = 0;
+        }
+    }
+    if (idlen) {
+        if ((rv = ssl_scache_ocsp_retrieve(s, id, idlen, pool)) != -1) {
+            ssl_log_cxerror(SSLLOG_MARK, APLOG_DEBUG, 0, c, cert,
+                            APLOGNO(02933) "Using cached OCSP status %d", rv);
+        }
+    }
+
+    if (rv == -1) {
+        /* Create a temporary pool to constrain memory use (the passed-in
+         * pool may be e.g. a connection pool). */
+        apr_pool_create(&vpool, pool);
+
+        rv = verify_ocsp_status(cert, ctx, c, sc, s, vpool, &next_update);
 
-    rv = verify_ocsp_status(cert, ctx, c, sc, s, vpool);
+        apr_pool_destroy(vpool);
 
-    apr_pool_destroy(vpool);
+        /* Remember definite answers, no longer than the responder says */
+        if (idlen && rv != V_OCSP_CERTSTATUS_UNKNOWN) {
+            now = apr_time_now();
+            expiry = now + apr_time_from_sec(sc->server->ocsp_cache_timeout);
+            if (next_update > now && next_update < expiry) {
+                expiry = next_update;
+            }
+            ssl_scache_ocsp_store(s, id, idlen, expiry, rv, pool);
+        }
+    }
 
     /* Propagate the verification status back to the passed-in
      * context. */
@@ -50,6 +50,7 @@
 #include "apr_fnmatch.h"
 #include "apr_strings.h"
 #include "apr_global_mutex.h"
+#include "apr_atomic.h"
 #include "apr_optional.h"
 #include "ap_socache.h"
 #include "mod_auth.h"
@@ -191,6 +192,21 @@
 #define HAVE_TLS_NPN
 #endif
 
+/* Asynchronous crypto operations (OpenSSL 1.1.0 and later) */
+#if defined(SSL_MODE_ASYNC) && !defined(WIN32)
+#define HAVE_SSL_ASYNC
+#endif
+
+/* Dynamic TLS record sizing */
+#ifdef SSL_set_max_send_fragment
+#define HAVE_SSL_RECORD_SIZING
+#endif
+
+/* TLS 1.3 early data (0-RTT) */
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+#define HAVE_TLS_EARLY_DATA
+#endif
+
 /* Secure Remote Password */
 #if !defined(OPENSSL_NO_SRP) && defined(SSL_CTRL_SET_TLS_EXT_SRP_USERNAME_CB)
 #define HAVE_SRP
@@ -265,6 +281,24 @@ ap_set_module_config(c->conn_config, &ssl_module, val)
 #define SSL_SESSION_CACHE_TIMEOUT  300
 #endif
 
+/* Record payload sizes for dynamic record sizing: small records fit a
+ * single TCP segment (1460 bytes MSS less TCP options and the TLS
+ * record overhead), full records are the largest TLS allows. */
+#ifndef SSL_RECORD_SIZE_SMALL
+#define SSL_RECORD_SIZE_SMALL      1369
+#endif
+#define SSL_RECORD_SIZE_FULL       SSL3_RT_MAX_PLAIN_LENGTH
+
+/* Default idle time after which records are small again */
+#ifndef SSL_RECORD_IDLE_TIMEOUT
+#define SSL_RECORD_IDLE_TIMEOUT    1
+#endif
+
+/* Default interval for rotating the shared session ticket keys */
+#ifndef SSL_TICKET_KEY_ROTATION
+#define SSL_TICKET_KEY_ROTATION    3600
+#endif
+
 /* Default setting for per-dir reneg buffer. */
 #ifndef DEFAULT_RENEG_BUFFER_SIZE
 #define DEFAULT_RENEG_BUFFER_SIZE (128 * 1024)
@@ -461,8 +495,61 @@ typedef struct {
 #endif
 
     server_rec *server;
+
+#ifdef HAVE_SSL_RECORD_SIZING
+    /* Dynamic record sizing state (SSLDynamicRecordSizing) */
+    apr_size_t record_size;   /* payload size of the records written, 0
+                               * before the first write */
+    apr_off_t record_bytes;   /* bytes written in small records */
+    apr_time_t record_last;   /* time of the last write */
+#endif
+
+    /* Outcome of the last manual re-verification of the peer certificate
+     * (quick renegotiation), reused while done with the same store and
+     * depth. */
+    X509_STORE *reverify_store;
+    int reverify_depth;
+    long reverify_result;
+
+    /* SSL_* variables exported by ssl_hook_Fixup(), computed once for the
+     * requests of the connection, until ssl_hook_Access() renegotiates or
+     * re-verifies the client (see ssl_env_cache_clear()). */
+    apr_table_t *env_std;     /* SSLOptions +StdEnvVars */
+    apr_table_t *env_certs;   /* SSLOptions +ExportCertData */
+    int env_options;
+
+#ifdef HAVE_TLS_EARLY_DATA
+    int early_data;           /* request data is read from early data
+                               * (0-RTT), i.e. may be a replay */
+#endif
 } SSLConnRec;
 
+#ifdef HAVE_TLSEXT
+/** Index of the ServerName and ServerAlias of all the virtual hosts, used
+ * to pick the candidates for a name sent by SNI without matching it
+ * against every virtual host of the address.  The values are arrays of
+ * server_rec pointers.
+ */
+typedef struct {
+    /** lowercased names and non wildcard aliases */
+    apr_hash_t *names;
+    /** lowercased ".example.com" for the "*.example.com" aliases */
+    apr_hash_t *wild_suffixes;
+    /** any other wildcard alias, as ssl_sni_wild_t */
+    apr_array_header_t *wild_names;
+    /** position of the virtual hosts in the configuration, as int *,
+     *  by server_rec pointer */
+    apr_hash_t *order;
+    /** some virtual host is on a specific (non wildcard) address */
+    int specific_addrs;
+} ssl_sni_index_t;
+
+typedef struct {
+    const char *name;
+    server_rec *server;
+} ssl_sni_wild_t;
+#endif
+
 /* BIG FAT WARNING: SSLModConfigRec has unusual memory lifetime: it is
  * allocated out of the "process" pool and only a single such
  * structure is created and used for the lifetime of the process.
@@ -491,6 +578,10 @@ typedef struct {
  * the random seed), and have that structure be strictly ABI-versioned
  * for safety.
  */
+#ifdef HAVE_TLS_SESSION_TICKETS
+typedef struct ssl_ticket_keys_t ssl_ticket_keys_t;
+#endif
+
 typedef struct {
     pid_t           pid;
     apr_pool_t     *pPool;
@@ -505,6 +596,12 @@ typedef struct {
     ap_socache_instance_t *sesscache_context;
 
     apr_global_mutex_t   *pMutex;
+#ifdef HAVE_TLS_EARLY_DATA
+    /* serializes the early data replay check in the session cache */
+    apr_global_mutex_t   *early_data_mutex;
+    /* some virtual host accepts early data (SSLEarlyData) */
+    BOOL                  early_data;
+#endif
     apr_array_header_t   *aRandSeed;
     apr_hash_t     *tVHostKeys;
 
@@ -514,6 +611,17 @@ typedef struct {
      * index), for example the string "vhost.example.com:443:0". */
     apr_hash_t     *tPrivateKey;
 
+    /* Certificates, keys and CA name lists parsed at startup, indexed
+     * by file name and kept across restarts as long as the file's
+     * modification time and size do not change. */
+    apr_hash_t     *tParsedFiles;
+
+#ifdef HAVE_TLS_SESSION_TICKETS
+    /* session ticket keys shared by all children, in shared memory
+     * allocated once for the lifetime of the server */
+    ssl_ticket_keys_t *ticket_keys;
+#endif
+
 #if defined(HAVE_OPENSSL_ENGINE_H) && defined(HAVE_ENGINE_INIT)
     const char     *szCryptoDevice;
 #endif
@@ -523,6 +631,11 @@ typedef struct {
     ap_socache_instance_t *stapling_cache_context;
     apr_global_mutex_t   *stapling_mutex;
 #endif
+#ifdef HAVE_TLSEXT
+    /* Index of the server names for the SNI lookup, rebuilt by
+     * ssl_init_CheckServers() on each (re)start */
+    ssl_sni_index_t *sni_index;
+#endif
 } SSLModConfigRec;
 
 /** Structure representing configured filenames for certs and keys for
@@ -569,6 +682,27 @@ typedef struct {
     unsigned char hmac_secret[16];
     unsigned char aes_key[16];
 } modssl_ticket_key_t;
+
+/**
+ * Ring of session ticket keys shared by all children: new tickets are
+ * encrypted with the current key, the previous and next keys are still
+ * accepted.  The fourth slot is the one a rotation writes to, before
+ * it advances current.
+ */
+#define SSL_TICKET_KEYS 4
+
+struct ssl_ticket_keys_t {
+    apr_uint32_t current;          /* key in use is current % SSL_TICKET_KEYS */
+    apr_interval_time_t interval;  /* rotation interval, 0 when disabled */
+    apr_time_t rotated;            /* time of the last rotation */
+    modssl_ticket_key_t keys[SSL_TICKET_KEYS];
+
+    /* statistics for mod_status */
+    apr_uint32_t issued;           /* new tickets */
+    apr_uint32_t resumed;          /* tickets decrypted with the current key */
+    apr_uint32_t renewed;          /* tickets accepted with an older key */
+    apr_uint32_t unknown;          /* tickets with an unknown key name */
+};
 #endif
 
 #ifdef HAVE_SSL_CONF_CMD
@@ -580,9 +714,20 @@ typedef struct {
 
 typedef struct SSLSrvConfigRec SSLSrvConfigRec;
 
+#ifdef HAVE_SSL_RECORD_SIZING
+/** Per server record sizing statistics, in shared memory */
+typedef struct {
+    apr_uint32_t small_records;   /* records written in small size */
+    apr_uint32_t full_records;    /* records written in full size */
+    apr_uint32_t boosts;          /* switches to full size records */
+    apr_uint32_t idle_resets;     /* returns to small size after idling */
+} ssl_record_stats_t;
+#endif
+
 typedef struct {
     SSLSrvConfigRec *sc; /** pointer back to server config */
     SSL_CTX *ssl_ctx;
+    BOOL ssl_ctx_shared; /** ssl_ctx is owned by another server */
 
     /** we are one or the other */
     modssl_pk_server_t *pks;
@@ -617,6 +762,7 @@ typedef struct {
     int         stapling_errcache_timeout;
     apr_interval_time_t stapling_responder_timeout;
     const char *stapling_force_url;
+    BOOL        stapling_background;
 #endif
 
 #ifdef HAVE_SRP
@@ -635,6 +781,8 @@ typedef struct {
     long ocsp_resp_maxage;
     apr_interval_time_t ocsp_responder_timeout;
     BOOL ocsp_use_request_nonce;
+    int ocsp_cache_timeout; /* seconds client certificates' OCSP status
+                             * is remembered in the session cache, 0: off */
 
 #ifdef HAVE_SSL_CONF_CMD
     SSL_CONF_CTX *ssl_ctx_config; /* Configuration context */
@@ -670,6 +818,18 @@ struct SSLSrvConfigRec {
     BOOL             compression;
 #endif
     BOOL             session_tickets;
+    BOOL             shared_ctx;
+    BOOL             async_handshake;
+    BOOL             early_data;
+#ifdef HAVE_SSL_RECORD_SIZING
+    apr_off_t        record_boost;   /* bytes in small records, 0: off */
+    int              record_idle;    /* idle seconds to restart with small
+                                      * records, 0: never */
+    ssl_record_stats_t *record_stats;
+#endif
+#ifdef HAVE_TLS_SESSION_TICKETS
+    int              ticket_key_rotation;
+#endif
 };
 
 /**
@@ -725,6 +885,10 @@ const char  *ssl_cmd_SSLCARevocationCheck(cmd_parms *, void *, const char *);
 const char  *ssl_cmd_SSLHonorCipherOrder(cmd_parms *cmd, void *dcfg, int flag);
 const char  *ssl_cmd_SSLCompression(cmd_parms *, void *, int flag);
 const char  *ssl_cmd_SSLSessionTickets(cmd_parms *, void *, int flag);
+const char  *ssl_cmd_SSLSharedContext(cmd_parms *, void *, int flag);
+const char  *ssl_cmd_SSLAsyncHandshake(cmd_parms *, void *, int flag);
+const char  *ssl_cmd_SSLEarlyData(cmd_parms *, void *, int flag);
+const char  *ssl_cmd_SSLDynamicRecordSizing(cmd_parms *, void *, const char *, const char *);
 const char  *ssl_cmd_SSLVerifyClient(cmd_parms *, void *, const char *);
 const char  *ssl_cmd_SSLVerifyDepth(cmd_parms *, void *, const char *);
 const char  *ssl_cmd_SSLSessionCache(cmd_parms *, void *, const char *);
@@ -753,6 +917,7 @@ const char  *ssl_cmd_SSLProxyMachineCertificateFile(cmd_parms *, void *, const c
 const char  *ssl_cmd_SSLProxyMachineCertificateChainFile(cmd_parms *, void *, const char *);
 #ifdef HAVE_TLS_SESSION_TICKETS
 const char *ssl_cmd_SSLSessionTicketKeyFile(cmd_parms *cmd, void *dcfg, const char *arg);
+const char *ssl_cmd_SSLSessionTicketKeyRotation(cmd_parms *cmd, void *dcfg, const char *arg);
 #endif
 const char  *ssl_cmd_SSLProxyCheckPeerExpire(cmd_parms *cmd, void *dcfg, int flag);
 const char  *ssl_cmd_SSLProxyCheckPeerCN(cmd_parms *cmd, void *dcfg, int flag);
@@ -764,6 +929,7 @@ const char *ssl_cmd_SSLOCSPResponseTimeSkew(cmd_parms *cmd, void *dcfg, const ch
 const char *ssl_cmd_SSLOCSPResponseMaxAge(cmd_parms *cmd, void *dcfg, const char *arg);
 const char *ssl_cmd_SSLOCSPResponderTimeout(cmd_parms *cmd, void *dcfg, const char *arg);
 const char *ssl_cmd_SSLOCSPUseRequestNonce(cmd_parms *cmd, void *dcfg, int flag);
+const char *ssl_cmd_SSLOCSPCacheTimeout(cmd_parms *cmd, void *dcfg, const char *arg);
 const char *ssl_cmd_SSLOCSPEnable(cmd_parms *cmd, void *dcfg, int flag);
 
 #ifdef HAVE_SSL_CONF_CMD
@@ -786,7 +952,7 @@ apr_status_t ssl_init_Module(apr_pool_t *, apr_pool_t *, apr_pool_t *, server_re
 apr_status_t ssl_init_Engine(server_rec *, apr_pool_t *);
 apr_status_t ssl_init_ConfigureServer(server_rec *, apr_pool_t *, apr_pool_t *, SSLSrvConfigRec *,
                                       apr_array_header_t *);
-apr_status_t ssl_init_CheckServers(server_rec *, apr_pool_t *);
+apr_status_t ssl_init_CheckServers(server_rec *, apr_pool_t *, apr_pool_t *);
 STACK_OF(X509_NAME)
             *ssl_init_FindCAList(server_rec *, apr_pool_t *, const char *, const char *);
 void         ssl_init_Child(apr_pool_t *, server_rec *);
@@ -822,6 +988,10 @@ int         ssl_callback_SessionTicket(SSL *, unsigned char *, unsigned char *,
                                        EVP_CIPHER_CTX *, HMAC_CTX *, int);
 #endif
 
+#ifdef HAVE_TLS_EARLY_DATA
+int          ssl_callback_AllowEarlyData(SSL *, void *);
+#endif
+
 #ifdef HAVE_TLS_ALPN
 int ssl_callback_alpn_select(SSL *ssl, const unsigned char **out,
                              unsigned char *outlen, const unsigned char *in,
@@ -840,6 +1010,21 @@ BOOL         ssl_scache_store(server_rec *, UCHAR *, int,
 SSL_SESSION *ssl_scache_retrieve(server_rec *, UCHAR *, int, apr_pool_t *);
 void         ssl_scache_remove(server_rec *, UCHAR *, int,
                                apr_pool_t *);
+#ifndef OPENSSL_NO_OCSP
+BOOL         ssl_scache_ocsp_store(server_rec *, UCHAR *, int,
+                                   apr_time_t, int, apr_pool_t *);
+int          ssl_scache_ocsp_retrieve(server_rec *, UCHAR *, int,
+                                      apr_pool_t *);
+#endif
+#ifdef HAVE_TLS_EARLY_DATA
+BOOL         ssl_scache_early_data_replayed(server_rec *, UCHAR *, int,
+                                            apr_time_t, apr_pool_t *);
+#endif
+#ifdef HAVE_TLS_SESSION_TICKETS
+apr_status_t ssl_ticket_keys_init(server_rec *, apr_pool_t *);
+modssl_ticket_key_t *ssl_ticket_keys_get(SSLModConfigRec *,
+                                         const unsigned char *, BOOL *);
+#endif
 
 /** OCSP Stapling Support */
 #ifdef HAVE_OCSP_STAPLING
@@ -853,6 +1038,7 @@ const char *ssl_cmd_SSLStaplingReturnResponderErrors(cmd_parms *, void *, int);
 const char *ssl_cmd_SSLStaplingFakeTryLater(cmd_parms *, void *, int);
 const char *ssl_cmd_SSLStaplingResponderTimeout(cmd_parms *, void *, const char *);
 const char *ssl_cmd_SSLStaplingForceURL(cmd_parms *, void *, const char *);
+const char *ssl_cmd_SSLStaplingBackgroundRefresh(cmd_parms *, void *, int);
 apr_status_t modssl_init_stapling(server_rec *, apr_pool_t *, apr_pool_t *, modssl_ctx_t *);
 void         ssl_stapling_certinfo_hash_init(apr_pool_t *);
 int          ssl_stapling_init_cert(server_rec *, apr_pool_t *, apr_pool_t *,
@@ -910,12 +1096,17 @@ int          ssl_mutex_init(server_rec *, apr_pool_t *);
 int          ssl_mutex_reinit(server_rec *, apr_pool_t *);
 int          ssl_mutex_on(server_rec *);
 int          ssl_mutex_off(server_rec *);
+#ifdef HAVE_TLS_EARLY_DATA
+int          ssl_early_data_mutex_on(server_rec *);
+int          ssl_early_data_mutex_off(server_rec *);
+#endif
 
 int          ssl_stapling_mutex_reinit(server_rec *, apr_pool_t *);
 
 /* mutex type names for Mutex directive */
 #define SSL_CACHE_MUTEX_TYPE    "ssl-cache"
 #define SSL_STAPLING_MUTEX_TYPE "ssl-stapling"
+#define SSL_EARLY_DATA_MUTEX_TYPE "ssl-early-data"
 
 apr_status_t ssl_die(server_rec *);
 
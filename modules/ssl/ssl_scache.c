@@ -30,6 +30,8 @@
                                                  -- Unknown         */
 #include "ssl_private.h"
 #include "mod_status.h"
+#include "mod_watchdog.h"
+#include "apr_shm.h"
 
 /*  _________________________________________________________________
 **
@@ -189,16 +191,410 @@ void ssl_scache_remove(server_rec *s, UCHAR *id, int idlen,
     }
 }
 
+#ifndef OPENSSL_NO_OCSP
+/*
+ * Remember the OCSP status of a client certificate, identified by id
+ * (its fingerprint), until expiry.
+ */
+BOOL ssl_scache_ocsp_store(server_rec *s, UCHAR *id, int idlen,
+                           apr_time_t expiry, int status, apr_pool_t *p)
+{
+    SSLModConfigRec *mc = myModConfig(s);
+    unsigned char data = (unsigned char)status;
+    apr_status_t rv;
+
+    if (mc->sesscache->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        ssl_mutex_on(s);
+    }
+
+    rv = mc->sesscache->store(mc->sesscache_context, s, id, idlen,
+                              expiry, &data, 1, p);
+
+    if (mc->sesscache->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        ssl_mutex_off(s);
+    }
+
+    return rv == APR_SUCCESS ? TRUE : FALSE;
+}
+
+/*
+ * Returns the OCSP status remembered for the client certificate
+ * identified by id, or -1 if none.
+ */
+int ssl_scache_ocsp_retrieve(server_rec *s, UCHAR *id, int idlen,
+                             apr_pool_t *p)
+{
+    SSLModConfigRec *mc = myModConfig(s);
+    unsigned char data;
+    unsigned int datalen = 1;
+    apr_status_t rv;
+
+    if (mc->sesscache->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        ssl_mutex_on(s);
+    }
+
+    rv = mc->sesscache->retrieve(mc->sesscache_context, s, id, idlen,
+                                 &data, &datalen, p);
+
+    if (mc->sesscache->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        ssl_mutex_off(s);
+    }
+
+    return rv == APR_SUCCESS && datalen == 1 ? (int)data : -1;
+}
+#endif
+
+#ifdef HAVE_TLS_EARLY_DATA
+/*
+ * Remember the early data (0-RTT) identified by id until expiry, and
+ * tell whether it was seen before, i.e. is a replay.  The lookup and
+ * the store are serialized by the early data mutex, any failure counts
+ * as a replay so that the early data is refused.
+ */
+BOOL ssl_scache_early_data_replayed(server_rec *s, UCHAR *id, int idlen,
+                                    apr_time_t expiry, apr_pool_t *p)
+{
+    SSLModConfigRec *mc = myModConfig(s);
+    unsigned char dest[1];
+    unsigned int destlen = sizeof dest;
+    apr_status_t rv;
+
+    if (!ssl_early_data_mutex_on(s)) {
+        return TRUE;
+    }
+    if (mc->sesscache->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        ssl_mutex_on(s);
+    }
+
+    rv = mc->sesscache->retrieve(mc->sesscache_context, s, id, idlen,
+                                 dest, &destlen, p);
+    if (rv != APR_SUCCESS) {
+        rv = mc->sesscache->store(mc->sesscache_context, s, id, idlen,
+                                  expiry, (unsigned char *)"1", 1, p);
+        /* refuse what could not be recorded */
+        rv = rv == APR_SUCCESS ? APR_NOTFOUND : rv;
+    }
+
+    if (mc->sesscache->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        ssl_mutex_off(s);
+    }
+    ssl_early_data_mutex_off(s);
+
+    return rv == APR_NOTFOUND ? FALSE : TRUE;
+}
+#endif
+
+#ifdef HAVE_TLS_SESSION_TICKETS
+/*  _________________________________________________________________
+**
+**  Session Tickets: Shared Key Ring
+**  _________________________________________________________________
+*/
+
+#define TICKET_KEYS_WATCHDOG_NAME "_ssl_ticket_keys_"
+#define TICKET_KEYS_CHECK_INTERVAL apr_time_from_sec(10)
+
+static ap_watchdog_t *ticket_keys_watchdog;
+
+static BOOL ssl_ticket_key_generate(modssl_ticket_key_t *key)
+{
+    return RAND_bytes(key->key_name, sizeof(key->key_name)) > 0
+           && RAND_bytes(key->hmac_secret, sizeof(key->hmac_secret)) > 0
+           && RAND_bytes(key->aes_key, sizeof(key->aes_key)) > 0;
+}
+
+/*
+ * Only the watchdog rotates the keys.  The slot written to held the key
+ * before the previous one, which no handshake accepts any more, so the
+ * children never see a partially written key.
+ */
+static BOOL ssl_ticket_keys_rotate(ssl_ticket_keys_t *keys)
+{
+    apr_uint32_t current = apr_atomic_read32(&keys->current);
+
+    if (!ssl_ticket_key_generate(&keys->keys[(current + 2)
+                                             % SSL_TICKET_KEYS])) {
+        return FALSE;
+    }
+    apr_atomic_cas32(&keys->current, current + 1, current);
+    keys->rotated = apr_time_now();
+
+    return TRUE;
+}
+
+static apr_status_t ssl_ticket_keys_watchdog_callback(int state, void *data,
+                                                      apr_pool_t *pool)
+{
+    server_rec *s = data;
+    ssl_ticket_keys_t *keys = myModConfig(s)->ticket_keys;
+
+    if (state != AP_WATCHDOG_STATE_RUNNING || !keys || !keys->interval) {
+        return APR_SUCCESS;
+    }
+
+    if (apr_time_now() - keys->rotated >= keys->interval) {
+        if (ssl_ticket_keys_rotate(keys)) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(02919)
+                         "TLS session ticket keys rotated");
+        }
+        else {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(02920)
+                         "Failed to generate a new TLS session ticket key");
+            ssl_log_ssl_error(SSLLOG_MARK, APLOG_ERR, s);
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+apr_status_t ssl_ticket_keys_init(server_rec *s, apr_pool_t *p)
+{
+    SSLModConfigRec *mc = myModConfig(s);
+    SSLSrvConfigRec *sc = mySrvConfig(s);
+    APR_OPTIONAL_FN_TYPE(ap_watchdog_get_instance) *wd_get_instance;
+    APR_OPTIONAL_FN_TYPE(ap_watchdog_register_callback) *wd_register_callback;
+    ssl_ticket_keys_t *keys;
+    apr_shm_t *shm;
+    apr_status_t rv;
+    int i;
+
+    ticket_keys_watchdog = NULL;
+
+    if (sc->ticket_key_rotation == UNSET) {
+        sc->ticket_key_rotation = SSL_TICKET_KEY_ROTATION;
+    }
+
+    if (!mc->ticket_keys) {
+        /* Allocated from the process pool, so that the keys and thus the
+         * tickets issued remain valid across restarts. */
+        rv = apr_shm_create(&shm, sizeof(*keys), NULL, mc->pPool);
+        if (APR_STATUS_IS_ENOTIMPL(rv)) {
+            /* The children must see the keys rotated by the watchdog, use
+             * a name-based segment where anonymous ones are not supported,
+             * removing any left by an unclean shutdown first. */
+            const char *fname = ap_runtime_dir_relative(mc->pPool,
+                                                        "ssl_ticket_keys");
+            if (fname) {
+                apr_shm_remove(fname, mc->pPool);
+                rv = apr_shm_create(&shm, sizeof(*keys), fname, mc->pPool);
+            }
+        }
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, APLOGNO(02921)
+                         "Cannot allocate shared memory for the TLS session "
+                         "ticket keys");
+            return ssl_die(s);
+        }
+        keys = apr_shm_baseaddr_get(shm);
+
+        memset(keys, 0, sizeof(*keys));
+        for (i = 0; i < SSL_TICKET_KEYS - 1; i++) {
+            if (!ssl_ticket_key_generate(&keys->keys[i])) {
+                ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s, APLOGNO(02922)
+                             "Failed to generate the TLS session ticket "
+                             "keys");
+                ssl_log_ssl_error(SSLLOG_MARK, APLOG_EMERG, s);
+                return ssl_die(s);
+            }
+        }
+        keys->current = 1;
+        keys->rotated = apr_time_now();
+        mc->ticket_keys = keys;
+    }
+
+    mc->ticket_keys->interval = apr_time_from_sec(sc->ticket_key_rotation);
+    if (!mc->ticket_keys->interval) {
+        return APR_SUCCESS;
+    }
+
+    wd_get_instance = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_get_instance);
+    wd_register_callback = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_register_callback);
+    if (!wd_get_instance || !wd_register_callback) {
+        /* Never rotated keys would outlive restarts, rather let OpenSSL
+         * use its own keys per SSL_CTX, renewed with each (re)start. */
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, APLOGNO(02923)
+                     "mod_watchdog is not loaded, the TLS session ticket "
+                     "keys can't be rotated and are not shared");
+        mc->ticket_keys->interval = 0;
+        return APR_SUCCESS;
+    }
+
+    rv = wd_get_instance(&ticket_keys_watchdog, TICKET_KEYS_WATCHDOG_NAME,
+                         0, 1, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02924)
+                     "Failed to create watchdog instance (%s)",
+                     TICKET_KEYS_WATCHDOG_NAME);
+        return rv;
+    }
+    rv = wd_register_callback(ticket_keys_watchdog, TICKET_KEYS_CHECK_INTERVAL,
+                              s, ssl_ticket_keys_watchdog_callback);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02925)
+                     "Failed to register watchdog callback (%s)",
+                     TICKET_KEYS_WATCHDOG_NAME);
+        return rv;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Returns the key to encrypt a new ticket with when keyname is NULL,
+ * else the key named keyname if it is still accepted, setting *renew
+ * unless it is the current one.  NULL when the keys are not shared.
+ */
+modssl_ticket_key_t *ssl_ticket_keys_get(SSLModConfigRec *mc,
+                                         const unsigned char *keyname,
+                                         BOOL *renew)
+{
+    /* current first, then previous and next */
+    static const int accepted[] = { 0, SSL_TICKET_KEYS - 1, 1 };
+    ssl_ticket_keys_t *keys = mc->ticket_keys;
+    modssl_ticket_key_t *key;
+    apr_uint32_t current;
+    int i;
+
+    if (!keys || !keys->interval) {
+        return NULL;
+    }
+
+    current = apr_atomic_read32(&keys->current);
+    if (!keyname) {
+        return &keys->keys[current % SSL_TICKET_KEYS];
+    }
+
+    for (i = 0; i < (int)(sizeof(accepted) / sizeof(accepted[0])); i++) {
+        key = &keys->keys[(current + accepted[i]) % SSL_TICKET_KEYS];
+        if (!memcmp(keyname, key->key_name, sizeof(key->key_name))) {
+            *renew = (i != 0);
+            return key;
+        }
+    }
+
+    return NULL;
+}
+#endif /* HAVE_TLS_SESSION_TICKETS */
+
 /*  _________________________________________________________________
 **
 **  SSL Extension to mod_status
 **  _________________________________________________________________
 */
+#ifdef HAVE_TLS_SESSION_TICKETS
+static void ssl_ticket_keys_status(request_rec *r, int flags,
+                                   ssl_ticket_keys_t *keys)
+{
+    apr_uint32_t issued = apr_atomic_read32(&keys->issued);
+    apr_uint32_t resumed = apr_atomic_read32(&keys->resumed);
+    apr_uint32_t renewed = apr_atomic_read32(&keys->renewed);
+    apr_uint32_t unknown = apr_atomic_read32(&keys->unknown);
+    apr_uint64_t presented = (apr_uint64_t)resumed + renewed + unknown;
+    int hit_pct = presented ? (int)(((apr_uint64_t)resumed + renewed) * 100
+                                    / presented) : 0;
+
+    if (!(flags & AP_STATUS_SHORT)) {
+        ap_rputs("<hr>\n", r);
+        ap_rputs("<table cellspacing=0 cellpadding=0>\n", r);
+        ap_rputs("<tr><td bgcolor=\"#000000\">\n", r);
+        ap_rputs("<b><font color=\"#ffffff\" face=\"Arial,Helvetica\">SSL/TLS Session Ticket Status:</font></b>\r", r);
+        ap_rputs("</td></tr>\n", r);
+        ap_rputs("<tr><td bgcolor=\"#ffffff\">\n", r);
+        if (keys->interval) {
+            ap_rprintf(r, "shared keys rotated every <b>%d</b> seconds<br>",
+                       (int)apr_time_sec(keys->interval));
+        }
+        else {
+            ap_rputs("shared keys: <b>disabled</b><br>", r);
+        }
+        ap_rprintf(r, "tickets issued since starting: <b>%u</b><br>", issued);
+        ap_rprintf(r, "tickets presented since starting: <b>%u</b> resumed, "
+                   "<b>%u</b> renewed, <b>%u</b> unknown key<br>",
+                   resumed, renewed, unknown);
+        ap_rprintf(r, "resumption hit rate: <b>%d%%</b><br>", hit_pct);
+        ap_rputs("</td></tr>\n", r);
+        ap_rputs("</table>\n", r);
+    }
+    else {
+        ap_rprintf(r, "TLSTicketKeyRotation: %d\n",
+                   (int)apr_time_sec(keys->interval));
+        ap_rprintf(r, "TLSTicketIssueCount: %u\n", issued);
+        ap_rprintf(r, "TLSTicketResumeCount: %u\n", resumed);
+        ap_rprintf(r, "TLSTicketRenewCount: %u\n", renewed);
+        ap_rprintf(r, "TLSTicketUnknownKeyCount: %u\n", unknown);
+        ap_rprintf(r, "TLSTicketResumeRate: %d%%\n", hit_pct);
+    }
+}
+#endif
+
+#ifdef HAVE_SSL_RECORD_SIZING
+static void ssl_record_stats_status(request_rec *r, int flags)
+{
+    SSLSrvConfigRec *sc;
+    ssl_record_stats_t *stats;
+    server_rec *s;
+    int header = 0;
+
+    for (s = ap_server_conf; s; s = s->next) {
+        sc = mySrvConfig(s);
+        if (!(stats = sc->record_stats)) {
+            continue;
+        }
+
+        if (!(flags & AP_STATUS_SHORT)) {
+            if (!header) {
+                ap_rputs("<hr>\n", r);
+                ap_rputs("<table cellspacing=0 cellpadding=0>\n", r);
+                ap_rputs("<tr><td bgcolor=\"#000000\">\n", r);
+                ap_rputs("<b><font color=\"#ffffff\" face=\"Arial,Helvetica\">SSL/TLS Dynamic Record Sizing:</font></b>\r", r);
+                ap_rputs("</td></tr>\n", r);
+                ap_rputs("<tr><td bgcolor=\"#ffffff\">\n", r);
+                header = 1;
+            }
+            ap_rprintf(r, "<b>%s</b>: first <b>%" APR_OFF_T_FMT "</b> bytes "
+                       "in small records, <b>%u</b> small and <b>%u</b> full "
+                       "size records, <b>%u</b> switches to full size, "
+                       "<b>%u</b> restarts after idling<br>",
+                       ap_escape_html(r->pool, sc->vhost_id), sc->record_boost,
+                       apr_atomic_read32(&stats->small_records),
+                       apr_atomic_read32(&stats->full_records),
+                       apr_atomic_read32(&stats->boosts),
+                       apr_atomic_read32(&stats->idle_resets));
+        }
+        else {
+            ap_rprintf(r, "TLSRecordSizing: %s %" APR_OFF_T_FMT " %u %u %u %u\n",
+                       sc->vhost_id, sc->record_boost,
+                       apr_atomic_read32(&stats->small_records),
+                       apr_atomic_read32(&stats->full_records),
+                       apr_atomic_read32(&stats->boosts),
+                       apr_atomic_read32(&stats->idle_resets));
+        }
+    }
+
+    if (header) {
+        ap_rputs("</td></tr>\n", r);
+        ap_rputs("</table>\n", r);
+    }
+}
+#endif
+
 static int ssl_ext_status_hook(request_rec *r, int flags)
 {
     SSLModConfigRec *mc = myModConfig(r->server);
 
-    if (mc == NULL || mc->sesscache == NULL)
+    if (mc == NULL)
+        return OK;
+
+#ifdef HAVE_TLS_SESSION_TICKETS
+    if (mc->ticket_keys)
+        ssl_ticket_keys_status(r, flags, mc->ticket_keys);
+#endif
+
+#ifdef HAVE_SSL_RECORD_SIZING
+    ssl_record_stats_status(r, flags);
+#endif
+
+    if (mc->sesscache == NULL)
         return OK;
 
     if (!(flags & AP_STATUS_SHORT)) {
@@ -31,6 +31,7 @@
 #include "ssl_private.h"
 #include "ap_mpm.h"
 #include "apr_thread_mutex.h"
+#include "mod_watchdog.h"
 
 #ifdef HAVE_OCSP_STAPLING
 
@@ -43,6 +44,12 @@
 
 #define MAX_STAPLING_DER 10240
 
+/* Watchdog running the background refresh, and how often it looks at
+ * the certificates.
+ */
+#define STAPLING_WATCHDOG_NAME "_ssl_stapling_"
+#define STAPLING_REFRESH_INTERVAL apr_time_from_sec(10)
+
 /* Cached info stored in the global stapling_certinfo hash. */
 typedef struct {
     /* Index in session cache (SHA-1 digest of DER encoded certificate) */
@@ -51,6 +58,12 @@ typedef struct {
     OCSP_CERTID *cid;
     /* URI of the OCSP responder */
     char *uri;
+    /* Server whose configuration drives the background refresh, NULL
+     * if the response is renewed during the handshakes */
+    server_rec *s;
+    modssl_ctx_t *mctx;
+    /* When the watchdog renews the response next (watchdog child only) */
+    apr_time_t refresh;
 } certinfo;
 
 static apr_status_t ssl_stapling_certid_free(void *data)
@@ -65,10 +78,12 @@ static apr_status_t ssl_stapling_certid_free(void *data)
 }
 
 static apr_hash_t *stapling_certinfo;
+static ap_watchdog_t *stapling_watchdog;
 
 void ssl_stapling_certinfo_hash_init(apr_pool_t *p)
 {
     stapling_certinfo = apr_hash_make(p);
+    stapling_watchdog = NULL;
 }
 
 static X509 *stapling_get_issuer(modssl_ctx_t *mctx, X509 *x)
@@ -128,6 +143,10 @@ int ssl_stapling_init_cert(server_rec *s, apr_pool_t *p, apr_pool_t *ptemp,
                            "configured for server %s", mctx->sc->vhost_id);
             return 0;
         }
+        if (mctx->stapling_background == TRUE && !cinf->mctx) {
+            cinf->s = s;
+            cinf->mctx = mctx;
+        }
         return 1;
     }
 
@@ -168,6 +187,10 @@ int ssl_stapling_init_cert(server_rec *s, apr_pool_t *p, apr_pool_t *ptemp,
        cinf->uri = apr_pstrdup(p, sk_OPENSSL_STRING_value(aia, 0));
        X509_email_free(aia);
     }
+    if (mctx->stapling_background == TRUE) {
+        cinf->s = s;
+        cinf->mctx = mctx;
+    }
 
     ssl_log_xerror(SSLLOG_MARK, APLOG_TRACE1, 0, ptemp, s, x,
                    "ssl_stapling_init_cert: storing certinfo for server %s",
@@ -385,11 +408,16 @@ static int stapling_check_response(server_rec *s, modssl_ctx_t *mctx,
     return SSL_TLSEXT_ERR_OK;
 }
 
+/*
+ * Query the responder for a new response.  The response is returned in
+ * *prsp, and *pok tells whether it is acceptable, for the caller to cache
+ * it.  ssl is NULL for the background refresh, which has no client
+ * supplied extensions to forward.
+ */
 static BOOL stapling_renew_response(server_rec *s, modssl_ctx_t *mctx, SSL *ssl,
-                                    certinfo *cinf, OCSP_RESPONSE **prsp,
-                                    apr_pool_t *pool)
+                                    conn_rec *conn, certinfo *cinf,
+                                    OCSP_RESPONSE **prsp, BOOL *pok)
 {
-    conn_rec *conn      = (conn_rec *)SSL_get_app_data(ssl);
     apr_pool_t *vpool;
     OCSP_REQUEST *req = NULL;
     OCSP_CERTID *id = NULL;
@@ -401,6 +429,7 @@ static BOOL stapling_renew_response(server_rec *s, modssl_ctx_t *mctx, SSL *ssl,
     apr_uri_t uri;
 
     *prsp = NULL;
+    *pok = FALSE;
     /* Build up OCSP query from server certificate info */
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(01938)
                  "stapling_renew_response: querying responder");
@@ -415,11 +444,13 @@ static BOOL stapling_renew_response(server_rec *s, modssl_ctx_t *mctx, SSL *ssl,
         goto err;
     id = NULL;
     /* Add any extensions to the request */
-    SSL_get_tlsext_status_exts(ssl, &exts);
-    for (i = 0; i < sk_X509_EXTENSION_num(exts); i++) {
-        X509_EXTENSION *ext = sk_X509_EXTENSION_value(exts, i);
-        if (!OCSP_REQUEST_add_ext(req, ext, -1))
-            goto err;
+    if (ssl) {
+        SSL_get_tlsext_status_exts(ssl, &exts);
+        for (i = 0; i < sk_X509_EXTENSION_num(exts); i++) {
+            X509_EXTENSION *ext = sk_X509_EXTENSION_value(exts, i);
+            if (!OCSP_REQUEST_add_ext(req, ext, -1))
+                goto err;
+        }
     }
 
     if (mctx->stapling_force_url)
@@ -489,10 +520,7 @@ static BOOL stapling_renew_response(server_rec *s, modssl_ctx_t *mctx, SSL *ssl,
                          OCSP_response_status_str(response_status));
         }
     }
-    if (stapling_cache_response(s, mctx, *prsp, cinf, ok, pool) == FALSE) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(01945)
-                     "stapling_renew_response: error caching response!");
-    }
+    *pok = ok;
 
 done:
     if (id)
@@ -656,10 +684,20 @@ static int stapling_cb(SSL *ssl, void *arg)
         }
     }
 
+    if (rsp == NULL && cinf->mctx) {
+        /* never query the responder from the handshake when the watchdog
+         * keeps the response fresh, it will be there in a moment */
+        stapling_mutex_off(s);
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(02916)
+                     "stapling_cb: no cached response, left to the "
+                     "background refresh");
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
     if (rsp == NULL) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(01954)
                      "stapling_cb: renewing cached response");
-        rv = stapling_renew_response(s, mctx, ssl, cinf, &rsp, conn->pool);
+        rv = stapling_renew_response(s, mctx, ssl, conn, cinf, &rsp, &ok);
 
         if (rv == FALSE) {
             stapling_mutex_off(s);
@@ -667,6 +705,11 @@ static int stapling_cb(SSL *ssl, void *arg)
                          "stapling_cb: fatal error");
             return SSL_TLSEXT_ERR_ALERT_FATAL;
         }
+        if (rsp && stapling_cache_response(s, mctx, rsp, cinf, ok,
+                                           conn->pool) == FALSE) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(01945)
+                         "stapling_cb: error caching response!");
+        }
     }
     stapling_mutex_off(s);
 
@@ -684,6 +727,160 @@ static int stapling_cb(SSL *ssl, void *arg)
 
 }
 
+/*
+ * Background refresh.  A singleton watchdog renews the responses of the
+ * certificates configured with SSLStaplingBackgroundRefresh well before
+ * they expire from the stapling cache, so that the handshakes only ever
+ * read from the cache.  The responder is queried without holding the
+ * stapling mutex, which only protects the cache accesses.
+ */
+
+/* Just enough of a connection for the OCSP client to log and to read
+ * the response */
+static conn_rec *stapling_fake_conn(server_rec *s, apr_pool_t *p)
+{
+    conn_rec *c = apr_pcalloc(p, sizeof(conn_rec));
+    SSLConnRec *sslconn = apr_pcalloc(p, sizeof(SSLConnRec));
+
+    c->pool = p;
+    c->base_server = s;
+    c->client_ip = "0.0.0.0";
+    c->local_ip = "0.0.0.0";
+    c->notes = apr_table_make(p, 1);
+    c->conn_config = ap_create_conn_config(p);
+    c->bucket_alloc = apr_bucket_alloc_create(p);
+
+    sslconn->server = s;
+    myConnConfigSet(c, sslconn);
+
+    return c;
+}
+
+static void stapling_refresh(certinfo *cinf, apr_time_t now, apr_pool_t *p)
+{
+    server_rec *s = cinf->s;
+    modssl_ctx_t *mctx = cinf->mctx;
+    OCSP_RESPONSE *rsp = NULL;
+    BOOL ok = FALSE;
+    int rv;
+
+    if (!stapling_mutex_on(s)) {
+        return;
+    }
+    stapling_get_cached_response(s, &rsp, &ok, cinf, p);
+    stapling_mutex_off(s);
+
+    if (rsp) {
+        /* A response cached before this process took over the watchdog
+         * is assumed to be fresh, it is renewed at the latest when it
+         * expires from the cache.
+         */
+        if (!cinf->refresh) {
+            cinf->refresh = now
+                + apr_time_from_sec(mctx->stapling_cache_timeout) / 2;
+        }
+        rv = ok ? stapling_check_response(s, mctx, cinf, rsp, NULL)
+                : SSL_TLSEXT_ERR_OK;
+        OCSP_RESPONSE_free(rsp);
+        rsp = NULL;
+        if (rv == SSL_TLSEXT_ERR_OK && now < cinf->refresh) {
+            return;
+        }
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(02914)
+                 "stapling_refresh: renewing response for server %s",
+                 mctx->sc->vhost_id);
+
+    if (stapling_renew_response(s, mctx, NULL, stapling_fake_conn(s, p),
+                                cinf, &rsp, &ok) == FALSE || !rsp) {
+        /* try again on the next run */
+        return;
+    }
+
+    if (stapling_mutex_on(s)) {
+        if (stapling_cache_response(s, mctx, rsp, cinf, ok, p) == FALSE) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(02915)
+                         "stapling_refresh: error caching response!");
+        }
+        stapling_mutex_off(s);
+    }
+    OCSP_RESPONSE_free(rsp);
+
+    /* renew good responses halfway through their cache lifetime, and
+     * retry failed ones as soon as their error is forgotten */
+    if (ok) {
+        cinf->refresh = now
+            + apr_time_from_sec(mctx->stapling_cache_timeout) / 2;
+    }
+    else {
+        cinf->refresh = now
+            + apr_time_from_sec(mctx->stapling_errcache_timeout);
+    }
+}
+
+static apr_status_t stapling_watchdog_callback(int state, void *data,
+                                               apr_pool_t *pool)
+{
+    apr_hash_index_t *hi;
+    apr_pool_t *p;
+
+    if (state != AP_WATCHDOG_STATE_RUNNING) {
+        return APR_SUCCESS;
+    }
+
+    apr_pool_create(&p, pool);
+    for (hi = apr_hash_first(pool, stapling_certinfo); hi;
+         hi = apr_hash_next(hi)) {
+        void *val;
+        certinfo *cinf;
+
+        apr_hash_this(hi, NULL, NULL, &val);
+        cinf = val;
+        if (cinf->mctx && cinf->cid) {
+            stapling_refresh(cinf, apr_time_now(), p);
+            apr_pool_clear(p);
+        }
+    }
+    apr_pool_destroy(p);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t stapling_watchdog_init(server_rec *s, apr_pool_t *p)
+{
+    APR_OPTIONAL_FN_TYPE(ap_watchdog_get_instance) *wd_get_instance;
+    APR_OPTIONAL_FN_TYPE(ap_watchdog_register_callback) *wd_register_callback;
+    apr_status_t rv;
+
+    wd_get_instance = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_get_instance);
+    wd_register_callback = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_register_callback);
+    if (!wd_get_instance || !wd_register_callback) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, APLOGNO(02911)
+                     "mod_watchdog is required for "
+                     "SSLStaplingBackgroundRefresh");
+        return APR_EGENERAL;
+    }
+
+    rv = wd_get_instance(&stapling_watchdog, STAPLING_WATCHDOG_NAME, 0, 1, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02912)
+                     "Failed to create watchdog instance (%s)",
+                     STAPLING_WATCHDOG_NAME);
+        return rv;
+    }
+    rv = wd_register_callback(stapling_watchdog, STAPLING_REFRESH_INTERVAL,
+                              NULL, stapling_watchdog_callback);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02913)
+                     "Failed to register watchdog callback (%s)",
+                     STAPLING_WATCHDOG_NAME);
+        return rv;
+    }
+
+    return APR_SUCCESS;
+}
+
 apr_status_t modssl_init_stapling(server_rec *s, apr_pool_t *p,
                                   apr_pool_t *ptemp, modssl_ctx_t *mctx)
 {
@@ -719,6 +916,14 @@ apr_status_t modssl_init_stapling(server_rec *s, apr_pool_t *p,
     if (mctx->stapling_responder_timeout == UNSET) {
         mctx->stapling_responder_timeout = 10 * APR_USEC_PER_SEC;
     }
+    if (mctx->stapling_background == UNSET) {
+        mctx->stapling_background = FALSE;
+    }
+    if (mctx->stapling_background == TRUE && !stapling_watchdog) {
+        if (stapling_watchdog_init(s, p) != APR_SUCCESS) {
+            return ssl_die(s);
+        }
+    }
     SSL_CTX_set_tlsext_status_cb(ctx, stapling_cb);
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(01960) "OCSP stapling initialized");
 
@@ -414,6 +414,8 @@ static int list_urls(char *path, apr_pool_t *pool, apr_off_t round)
     char *url;
     apr_uint32_t format;
     disk_cache_info_t disk_info;
+    disk_cache_entity_info_t entity_info;
+    int has_data;
 
     apr_pool_create(&p, pool);
 
@@ -446,15 +448,29 @@ static int list_urls(char *path, apr_pool_t *pool, apr_off_t round)
                     len = sizeof(format);
                     if (apr_file_read_full(fd, &format, len, &len)
                             == APR_SUCCESS) {
-                        if (format == DISK_FORMAT_VERSION) {
+                        if (format == DISK_FORMAT_VERSION
+                            || format == ENTITY_FORMAT_VERSION) {
                             apr_off_t offset = 0;
+                            apr_status_t rv;
 
                             apr_file_seek(fd, APR_SET, &offset);
 
-                            len = sizeof(disk_cache_info_t);
+                            /* a single file entity has the body itself */
+                            if (format == ENTITY_FORMAT_VERSION) {
+                                len = sizeof(disk_cache_entity_info_t);
+                                rv = apr_file_read_full(fd, &entity_info,
+                                                        len, &len);
+                                disk_info = entity_info.info;
+                                has_data = 0;
+                            }
+                            else {
+                                len = sizeof(disk_cache_info_t);
+                                rv = apr_file_read_full(fd, &disk_info,
+                                                        len, &len);
+                                has_data = disk_info.has_body;
+                            }
 
-                            if (apr_file_read_full(fd, &disk_info, len, &len)
-                                    == APR_SUCCESS) {
+                            if (rv == APR_SUCCESS) {
                                 len = disk_info.name_len;
                                 url = apr_palloc(p, len + 1);
                                 url[len] = 0;
@@ -470,7 +486,7 @@ static int list_urls(char *path, apr_pool_t *pool, apr_off_t round)
                                                 &hinfo, APR_FINFO_SIZE, fd)) {
                                             /* ignore the file */
                                         }
-                                        else if (disk_info.has_body && APR_SUCCESS
+                                        else if (has_data && APR_SUCCESS
                                                 != apr_stat(
                                                         &dinfo,
                                                         apr_pstrcat(
@@ -489,7 +505,7 @@ static int list_urls(char *path, apr_pool_t *pool, apr_off_t round)
                                                         p)) {
                                             /* ignore the file */
                                         }
-                                        else if (disk_info.has_body && (dinfo.device
+                                        else if (has_data && (dinfo.device
                                                 != disk_info.device
                                                 || dinfo.inode
                                                         != disk_info.inode)) {
@@ -508,9 +524,13 @@ static int list_urls(char *path, apr_pool_t *pool, apr_off_t round)
                                                     " %" APR_TIME_T_FMT
                                                     " %d %d\n",
                                                     url,
-                                                    round_up((apr_size_t)hinfo.size, round),
+                                                    round_up(format == ENTITY_FORMAT_VERSION
+                                                            ? (apr_size_t)entity_info.body_offset
+                                                            : (apr_size_t)hinfo.size, round),
                                                     round_up(
-                                                            disk_info.has_body ? (apr_size_t)dinfo.size
+                                                            format == ENTITY_FORMAT_VERSION
+                                                            ? (apr_size_t)entity_info.body_len
+                                                            : has_data ? (apr_size_t)dinfo.size
                                                                     : 0, round),
                                                     disk_info.status,
                                                     disk_info.entity_version,
@@ -526,7 +546,7 @@ static int list_urls(char *path, apr_pool_t *pool, apr_off_t round)
                                         apr_finfo_t dinfo;
 
                                         /* stat the data file */
-                                        if (disk_info.has_body && APR_SUCCESS
+                                        if (has_data && APR_SUCCESS
                                                 != apr_stat(
                                                         &dinfo,
                                                         apr_pstrcat(
@@ -545,7 +565,7 @@ static int list_urls(char *path, apr_pool_t *pool, apr_off_t round)
                                                         p)) {
                                             /* ignore the file */
                                         }
-                                        else if (disk_info.has_body && (dinfo.device
+                                        else if (has_data && (dinfo.device
                                                 != disk_info.device
                                                 || dinfo.inode
                                                         != disk_info.inode)) {
@@ -763,7 +783,8 @@ static int process_dir(char *path, apr_pool_t *pool, apr_off_t *nodes)
                 len = sizeof(format);
                 if (apr_file_read_full(fd, &format, len,
                                        &len) == APR_SUCCESS) {
-                    if (format == DISK_FORMAT_VERSION) {
+                    if (format == DISK_FORMAT_VERSION
+                        || format == ENTITY_FORMAT_VERSION) {
                         apr_off_t offset = 0;
 
                         apr_file_seek(fd, APR_SET, &offset);
@@ -782,7 +803,15 @@ static int process_dir(char *path, apr_pool_t *pool, apr_off_t *nodes)
                             e->hsize = d->hsize;
                             e->dsize = d->dsize;
                             e->basename = apr_pstrdup(pool, d->basename);
-                            if (!disk_info.has_body) {
+                            /* a single file entity has its body with the
+                             * headers, the .data file is a leftover of
+                             * the two file layout
+                             */
+                            if (format == ENTITY_FORMAT_VERSION) {
+                                e->dsize = 0;
+                            }
+                            if (!disk_info.has_body
+                                || format == ENTITY_FORMAT_VERSION) {
                                 delete_file(path, apr_pstrcat(p, path, "/",
                                         d->basename, CACHE_DATA_SUFFIX, NULL),
                                         nodes, p);
@@ -879,7 +908,8 @@ static int process_dir(char *path, apr_pool_t *pool, apr_off_t *nodes)
                             break;
                         }
                     }
-                    else if (format == DISK_FORMAT_VERSION) {
+                    else if (format == DISK_FORMAT_VERSION
+                             || format == ENTITY_FORMAT_VERSION) {
                         apr_off_t offset = 0;
 
                         apr_file_seek(fd, APR_SET, &offset);
@@ -0,0 +1,323 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* This program simulates mod_proxy_balancer electing workers among
+ * synthetic backends of varying latency, to compare the bylatency
+ * lbmethod (EWMA latency, power of two choices) with round robin (what
+ * byrequests does for equal lbfactors) and bybusyness.
+ *
+ *   gcc -g -O2 -Wall -Wextra -o test_lbmethod_sim test_lbmethod_sim.c -lm
+ *   test_lbmethod_sim [requests [load% [seed]]]
+ *
+ * Requests arrive at random (Poisson) at load% of the total capacity of
+ * the backends.  Each backend serves a number of requests in parallel,
+ * with exponentially distributed service times, queueing the others.
+ * Halfway through, the first backend becomes ten times slower.
+ *
+ * The latency estimate (moving average, decay) and the cost bylatency
+ * elects with are those of modules/proxy/proxy_latency.h, compiled here
+ * against the synthetic backends; the sample is taken when the response
+ * starts, as mod_proxy_balancer does.  The draws mirror
+ * mod_lbmethod_bylatency.c.
+ *
+ * Exits with 1 unless bylatency yields a lower mean and 99th percentile
+ * response time than bybusyness, which does better than round robin.
+ * This is not checked above MAX_CHECKED_LOAD, where the backends can't
+ * keep up anymore once the first one slowed down.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+/* What proxy_latency.h needs from APR and mod_proxy.h */
+typedef int64_t apr_time_t;
+typedef int64_t apr_interval_time_t;
+typedef uint64_t apr_uint64_t;
+typedef size_t apr_size_t;
+#define APR_INLINE inline
+#define apr_time_from_sec(sec) ((apr_time_t)(sec) * 1000000)
+
+typedef struct {
+    int lbfactor;
+    apr_size_t busy;
+    apr_interval_time_t latency;
+    apr_time_t latency_updated;
+} proxy_worker_shared;
+
+#include "../modules/proxy/proxy_latency.h"
+
+#define MAX_SLOTS 16
+
+/* % of the capacity still available once "fast1" slowed down */
+#define MAX_CHECKED_LOAD 80
+
+typedef apr_time_t sim_time_t;          /* usecs */
+
+typedef struct {
+    const char *name;
+    sim_time_t mean;                    /* mean service time */
+    int slots;                          /* requests served in parallel */
+    proxy_worker_shared s;              /* lbfactor, then state */
+    sim_time_t slot_free[MAX_SLOTS];
+    long served;
+} backend_t;
+
+static backend_t backends[] = {
+    { "fast1",   10000, 8, { 1, 0, 0, 0 }, { 0 }, 0 },
+    { "fast2",   10000, 8, { 1, 0, 0, 0 }, { 0 }, 0 },
+    { "fast3",   10000, 8, { 1, 0, 0, 0 }, { 0 }, 0 },
+    { "fast4",   10000, 8, { 1, 0, 0, 0 }, { 0 }, 0 },
+    { "medium1", 30000, 8, { 1, 0, 0, 0 }, { 0 }, 0 },
+    { "medium2", 30000, 8, { 1, 0, 0, 0 }, { 0 }, 0 },
+    { "slow",   100000, 8, { 1, 0, 0, 0 }, { 0 }, 0 },
+};
+#define NBACKENDS ((int)(sizeof(backends) / sizeof(backends[0])))
+
+typedef struct {
+    sim_time_t done;
+    sim_time_t elected;
+    int backend;
+} completion_t;
+
+/* min-heap of the requests in flight, by completion time */
+static completion_t *heap;
+static int nheap;
+
+static void heap_push(completion_t c)
+{
+    int i = nheap++;
+
+    while (i > 0 && heap[(i - 1) / 2].done > c.done) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = c;
+}
+
+static completion_t heap_pop(void)
+{
+    completion_t top = heap[0], last = heap[--nheap];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < nheap) {
+        if (child + 1 < nheap && heap[child + 1].done < heap[child].done) {
+            child++;
+        }
+        if (last.done <= heap[child].done) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static double uniform(void)
+{
+    return (rand() + 1.0) / (RAND_MAX + 2.0);
+}
+
+static sim_time_t exponential(sim_time_t mean)
+{
+    return (sim_time_t)(-log(uniform()) * mean);
+}
+
+typedef int (*lbmethod_t)(sim_time_t now);
+
+static int rr_next;
+
+static int find_roundrobin(sim_time_t now)
+{
+    (void)now;
+    return rr_next++ % NBACKENDS;
+}
+
+static int find_bybusyness(sim_time_t now)
+{
+    int i, best = 0;
+
+    (void)now;
+    for (i = 1; i < NBACKENDS; i++) {
+        if (backends[i].s.busy * backends[best].s.lbfactor
+            < backends[best].s.busy * backends[i].s.lbfactor) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+/* lbmethod_last of the balancer */
+static int bylatency_last;
+
+/* The last elected backend (or a random one) against a random one */
+static int find_bylatency(sim_time_t now)
+{
+    int a = bylatency_last, b;
+
+    if (a < 0) {
+        a = rand() % NBACKENDS;
+    }
+    do {
+        b = rand() % NBACKENDS;
+    } while (b == a);
+
+    bylatency_last = proxy_latency_cheaper(&backends[b].s, &backends[a].s,
+                                           now) ? b : a;
+    return bylatency_last;
+}
+
+static int compare_times(const void *a, const void *b)
+{
+    sim_time_t ta = *(const sim_time_t *)a, tb = *(const sim_time_t *)b;
+
+    return ta < tb ? -1 : ta > tb;
+}
+
+static void complete(completion_t c, sim_time_t *times, long *ntimes)
+{
+    backend_t *b = &backends[c.backend];
+    sim_time_t sample = c.done - c.elected;
+
+    b->s.busy--;
+    b->served++;
+    proxy_latency_update(&b->s, sample, c.done);
+    times[(*ntimes)++] = sample;
+}
+
+typedef struct {
+    double mean;
+    sim_time_t p99;
+} result_t;
+
+static result_t simulate(const char *name, lbmethod_t find, long requests,
+                         int load, unsigned int seed)
+{
+    result_t res;
+    sim_time_t now = 0, interarrival, *times;
+    double capacity = 0, sum = 0;
+    long i, ntimes = 0;
+    int j;
+
+    srand(seed);
+    rr_next = 0;
+    bylatency_last = -1;
+    for (j = 0; j < NBACKENDS; j++) {
+        backend_t *b = &backends[j];
+        memset(b->slot_free, 0, sizeof(b->slot_free));
+        b->s.busy = 0;
+        b->s.latency = 0;
+        b->s.latency_updated = 0;
+        b->served = 0;
+        capacity += (double)b->slots * 1000000 / b->mean;
+    }
+    interarrival = (sim_time_t)(1000000 / (capacity * load / 100));
+
+    heap = malloc(requests * sizeof(*heap));
+    times = malloc(requests * sizeof(*times));
+    nheap = 0;
+
+    for (i = 0; i < requests; i++) {
+        completion_t c;
+        backend_t *b;
+        sim_time_t start, service;
+        int slot = 0;
+
+        now += exponential(interarrival);
+        while (nheap && heap[0].done <= now) {
+            complete(heap_pop(), times, &ntimes);
+        }
+
+        c.backend = find(now);
+        b = &backends[c.backend];
+        b->s.busy++;
+
+        service = b->mean;
+        if (c.backend == 0 && i >= requests / 2) {
+            service *= 10;
+        }
+        for (j = 1; j < b->slots; j++) {
+            if (b->slot_free[j] < b->slot_free[slot]) {
+                slot = j;
+            }
+        }
+        start = b->slot_free[slot] > now ? b->slot_free[slot] : now;
+        b->slot_free[slot] = start + exponential(service);
+
+        c.elected = now;
+        c.done = b->slot_free[slot];
+        heap_push(c);
+    }
+    while (nheap) {
+        complete(heap_pop(), times, &ntimes);
+    }
+
+    qsort(times, ntimes, sizeof(*times), compare_times);
+    for (i = 0; i < ntimes; i++) {
+        sum += times[i];
+    }
+    printf("%-12s mean %8.1fms  p50 %8.1fms  p99 %8.1fms  max %9.1fms\n",
+           name, sum / ntimes / 1000, times[ntimes / 2] / 1000.0,
+           times[ntimes * 99 / 100] / 1000.0, times[ntimes - 1] / 1000.0);
+    printf("%-12s", "");
+    for (j = 0; j < NBACKENDS; j++) {
+        printf(" %s:%ld", backends[j].name, backends[j].served);
+    }
+    printf("\n");
+
+    res.mean = sum / ntimes;
+    res.p99 = times[ntimes * 99 / 100];
+
+    free(heap);
+    free(times);
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    long requests = argc > 1 ? atol(argv[1]) : 200000;
+    int load = argc > 2 ? atoi(argv[2]) : 70;
+    unsigned int seed = argc > 3 ? (unsigned int)atoi(argv[3]) : 1;
+    result_t rr, busy, lat;
+
+    if (requests < 2 || load <= 0 || load >= 100) {
+        fprintf(stderr, "usage: %s [requests [load%% (1-99) [seed]]]\n",
+                argv[0]);
+        exit(1);
+    }
+
+    printf("%ld requests at %d%% of the backends' capacity, "
+           "\"%s\" ten times slower after %ld\n\n",
+           requests, load, backends[0].name, requests / 2);
+    rr = simulate("roundrobin", find_roundrobin, requests, load, seed);
+    busy = simulate("bybusyness", find_bybusyness, requests, load, seed);
+    lat = simulate("bylatency", find_bylatency, requests, load, seed);
+
+    if (load > MAX_CHECKED_LOAD) {
+        printf("\nnot checked, the backends are overloaded\n");
+        exit(0);
+    }
+    if (!(lat.mean < busy.mean && busy.mean < rr.mean)
+        || !(lat.p99 < busy.p99 && busy.p99 < rr.p99)) {
+        printf("\nFAILED: expected bylatency < bybusyness < roundrobin\n");
+        exit(1);
+    }
+    printf("\nok: bylatency < bybusyness < roundrobin\n");
+    exit(0);
+}